@@ -0,0 +1,562 @@
+#include <string.h>
+#include <inttypes.h>
+#include <esp_log.h>
+#include "sdkconfig.h"
+#include "mqtt_outbox.h"
+#include "mist_outbox.h"
+
+static const char *TAG = "mist_outbox";
+
+#define MAX_ITEMS CONFIG_MIST_OUTBOX_MAX_ITEMS
+
+static const uint32_t BUDGET[MIST_OUTBOX_CLASS_MAX] = {
+    [MIST_OUTBOX_CONTROL] = CONFIG_MIST_OUTBOX_CONTROL_BYTES,
+    [MIST_OUTBOX_TELEMETRY] = CONFIG_MIST_OUTBOX_TELEMETRY_BYTES,
+    [MIST_OUTBOX_BACKLOG] = CONFIG_MIST_OUTBOX_BACKLOG_BYTES,
+};
+
+#define ARENA_SIZE (CONFIG_MIST_OUTBOX_CONTROL_BYTES + CONFIG_MIST_OUTBOX_TELEMETRY_BYTES + CONFIG_MIST_OUTBOX_BACKLOG_BYTES)
+
+// MQTT control packet type and the MQTT 5 publish properties
+#define PACKET_PUBLISH 3
+#define PROPERTY_PAYLOAD_FORMAT 0x01
+#define PROPERTY_MESSAGE_EXPIRY 0x02
+#define PROPERTY_CONTENT_TYPE 0x03
+#define PROPERTY_RESPONSE_TOPIC 0x08
+#define PROPERTY_CORRELATION_DATA 0x09
+#define PROPERTY_TOPIC_ALIAS 0x23
+#define PROPERTY_USER_PROPERTY 0x26
+
+// Aliases tracked on a connection, 1 to 31
+#define MAX_ALIAS 31
+
+typedef struct outbox_item {
+    uint32_t offset;            // Into the class arena
+    uint32_t len;
+    int msg_id;
+    int msg_type;
+    int qos;
+    pending_state_t pending;
+    outbox_tick_t tick;
+    uint32_t skip;              // Bytes before the packet once its topic was left out
+    uint16_t alias;             // Topic alias added to the packet, 0 if none
+} outbox_item_t;
+
+// Messages are packed into the arena in enqueue order and items[0] is the
+// oldest. Deleting one moves the newer ones down, which is cheap at the size
+// of an arena and keeps eviction a matter of dropping items[0].
+typedef struct {
+    uint8_t *arena;
+    uint32_t used;
+    uint32_t count;
+    outbox_item_t items[MAX_ITEMS];
+    mist_outbox_stats_t stats;
+} class_t;
+
+struct outbox_t {
+    class_t classes[MIST_OUTBOX_CLASS_MAX];
+};
+
+// The client calls the outbox with its lock held, so none of this needs its own.
+// Item handles stay valid until the next enqueue or delete, which is as long as
+// the client holds on to them.
+static struct outbox_t s_outbox;
+static uint8_t s_arena[ARENA_SIZE];
+
+// Per task, set and read by the task enqueueing
+static __thread const mist_outbox_publish_t *s_next;
+
+// Last item enqueued or handed out by outbox_dequeue(). QoS 0 messages all have msg_id 0, so
+// lookups by msg_id right after either have to find that very item.
+static outbox_item_t *s_last;
+
+static bool s_mqtt5;
+static uint16_t s_alias_max;
+// Bit per topic alias the broker learned on the current connection
+static uint32_t s_aliases;
+
+// Where the properties start in a PUBLISH, which the client encodes in the
+// first part of the message
+typedef struct {
+    uint32_t remaining;         // Remaining length
+    uint32_t remaining_start;   // Offset of the topic length
+    uint32_t props_start;       // Offset of the property length
+    uint32_t props_len;
+    uint32_t props_len_bytes;
+} publish_layout_t;
+
+void mist_outbox_set_next_publish(const mist_outbox_publish_t *publish) {
+    s_next = publish;
+}
+
+void mist_outbox_set_protocol(bool mqtt5) {
+    s_mqtt5 = mqtt5;
+}
+
+void mist_outbox_get_stats(mist_outbox_class_t cls, mist_outbox_stats_t *stats) {
+    *stats = s_outbox.classes[cls].stats;
+}
+
+static void remove_at(class_t *c, uint32_t index) {
+    outbox_item_t *item = &c->items[index];
+    uint32_t end = item->offset + item->len;
+    memmove(c->arena + item->offset, c->arena + end, c->used - end);
+    c->used -= item->len;
+
+    for (uint32_t i = index + 1; i < c->count; i++) {
+        c->items[i].offset -= item->len;
+    }
+    memmove(item, item + 1, (c->count - index - 1) * sizeof(*item));
+    c->count--;
+
+    c->stats.bytes = c->used;
+    c->stats.items = c->count;
+    s_last = NULL;
+}
+
+void mist_outbox_new_connection(uint16_t alias_max) {
+    s_alias_max = alias_max;
+    s_aliases = 0;
+    // Messages that lost their topic were handed out on the previous connection
+    // and may never have gone out. They are QoS 0, so drop them, as well as
+    // those carrying an alias this broker does not accept.
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &s_outbox.classes[i];
+        for (uint32_t j = c->count; j-- > 0;) {
+            if (c->items[j].skip != 0 || c->items[j].alias > alias_max) {
+                remove_at(c, j);
+                c->stats.evicted++;
+            }
+        }
+    }
+}
+
+void mist_outbox_drop_unsent(void) {
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &s_outbox.classes[i];
+        for (uint32_t j = c->count; j-- > 0;) {
+            if (c->items[j].pending == QUEUED) {
+                remove_at(c, j);
+                c->stats.evicted++;
+            }
+        }
+    }
+}
+
+// Reads an MQTT variable byte integer, returns its length or 0 if malformed
+static uint32_t read_varint(const uint8_t *p, uint32_t len, uint32_t *value) {
+    *value = 0;
+    for (uint32_t i = 0; i < len && i < 4; i++) {
+        *value |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if ((p[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t varint_len(uint32_t value) {
+    return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+}
+
+static void write_varint(uint8_t *p, uint32_t value) {
+    do {
+        *p = value & 0x7f;
+        value >>= 7;
+        if (value > 0) {
+            *p |= 0x80;
+        }
+        p++;
+    } while (value > 0);
+}
+
+static uint32_t read_u16(const uint8_t *p) {
+    return (uint32_t)p[0] << 8 | p[1];
+}
+
+static void write_u16(uint8_t *p, uint32_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static bool parse_publish(const uint8_t *p, uint32_t len, int qos, publish_layout_t *layout) {
+    if (len < 2 || (p[0] >> 4) != PACKET_PUBLISH) {
+        return false;
+    }
+    uint32_t n = read_varint(p + 1, len - 1, &layout->remaining);
+    uint32_t pos = 1 + n;
+    if (n == 0 || pos + 2 > len) {
+        return false;
+    }
+    layout->remaining_start = pos;
+    pos += 2 + read_u16(p + pos) + (qos > 0 ? 2 : 0);
+    layout->props_start = pos;
+    layout->props_len_bytes = pos < len ? read_varint(p + pos, len - pos, &layout->props_len) : 0;
+    return layout->props_len_bytes != 0 && pos + layout->props_len_bytes + layout->props_len <= len;
+}
+
+// Length of the properties publish adds, with the alias it adds in *alias
+static uint32_t added_properties_len(const mist_outbox_publish_t *publish, int qos, uint16_t *alias) {
+    *alias = qos == 0 && publish->topic_alias <= s_alias_max && publish->topic_alias <= MAX_ALIAS ? publish->topic_alias : 0;
+    uint32_t len = *alias != 0 ? 3 : 0;
+    if (publish->content_type != NULL) {
+        len += 3 + strlen(publish->content_type);
+    }
+    return len;
+}
+
+// Remaining length of the PUBLISH once added bytes of properties are appended
+static uint32_t remaining_with_properties(const publish_layout_t *layout, uint32_t added) {
+    return layout->remaining + added + varint_len(layout->props_len + added) - layout->props_len_bytes;
+}
+
+// Copies the PUBLISH in message to dst with added bytes of properties appended
+// to its own, see added_properties_len()
+static void copy_with_properties(uint8_t *dst, outbox_message_handle_t message, const publish_layout_t *layout,
+                                 const mist_outbox_publish_t *publish, uint16_t alias, uint32_t added) {
+    const uint8_t *src = message->data;
+    uint32_t props_len = layout->props_len + added;
+    uint32_t remaining = remaining_with_properties(layout, added);
+
+    uint8_t *out = dst;
+    *out++ = src[0];
+    write_varint(out, remaining);
+    out += varint_len(remaining);
+    // Topic and packet identifier
+    memcpy(out, src + layout->remaining_start, layout->props_start - layout->remaining_start);
+    out += layout->props_start - layout->remaining_start;
+    write_varint(out, props_len);
+    out += varint_len(props_len);
+    memcpy(out, src + layout->props_start + layout->props_len_bytes, layout->props_len);
+    out += layout->props_len;
+
+    if (publish->content_type != NULL) {
+        uint32_t len = strlen(publish->content_type);
+        *out++ = PROPERTY_CONTENT_TYPE;
+        write_u16(out, len);
+        memcpy(out + 2, publish->content_type, len);
+        out += 2 + len;
+    }
+    if (alias != 0) {
+        *out++ = PROPERTY_TOPIC_ALIAS;
+        write_u16(out, alias);
+        out += 2;
+    }
+
+    // The payload
+    uint32_t end = layout->props_start + layout->props_len_bytes + layout->props_len;
+    memcpy(out, src + end, message->len - end);
+    out += message->len - end;
+    if (message->remaining_len > 0) {
+        memcpy(out, message->remaining_data, message->remaining_len);
+    }
+}
+
+// Topic alias among the publish properties, 0 if there is none
+static uint16_t find_alias(const uint8_t *p, uint32_t len) {
+    uint32_t pos = 0;
+    while (pos < len) {
+        uint8_t id = p[pos++];
+        uint32_t size;
+        switch (id) {
+        case PROPERTY_TOPIC_ALIAS:
+            return pos + 2 <= len ? read_u16(p + pos) : 0;
+        case PROPERTY_PAYLOAD_FORMAT:
+            size = 1;
+            break;
+        case PROPERTY_MESSAGE_EXPIRY:
+            size = 4;
+            break;
+        case PROPERTY_CONTENT_TYPE:
+        case PROPERTY_RESPONSE_TOPIC:
+        case PROPERTY_CORRELATION_DATA:
+            if (pos + 2 > len) return 0;
+            size = 2 + read_u16(p + pos);
+            break;
+        case PROPERTY_USER_PROPERTY:
+            // Key and value strings
+            if (pos + 2 > len) return 0;
+            size = 2 + read_u16(p + pos);
+            if (pos + size + 2 > len) return 0;
+            size += 2 + read_u16(p + pos + size);
+            break;
+        default:
+            return 0;
+        }
+        pos += size;
+    }
+    return 0;
+}
+
+// Called on a QoS 0 publish about to be sent. The first one carrying a topic
+// alias on a connection teaches the broker the alias, later ones have their
+// topic left out. The packet is rewritten in place to end where it did, with
+// a shorter header starting skip bytes in.
+static void apply_alias(class_t *c, outbox_item_t *item) {
+    if (!s_mqtt5 || item->qos != 0 || item->skip != 0) {
+        return;
+    }
+    uint8_t *p = c->arena + item->offset;
+    uint32_t len = item->len;
+    if (len < 2 || (p[0] >> 4) != PACKET_PUBLISH) {
+        return;
+    }
+
+    uint32_t remaining;
+    uint32_t n = read_varint(p + 1, len - 1, &remaining);
+    uint32_t pos = 1 + n;
+    if (n == 0 || pos + 2 > len) {
+        return;
+    }
+    uint32_t topic_len = read_u16(p + pos);
+    uint32_t topic_end = pos + 2 + topic_len;   // QoS 0 has no packet identifier
+    uint32_t props_len;
+    uint32_t m = topic_end < len ? read_varint(p + topic_end, len - topic_end, &props_len) : 0;
+    if (topic_len == 0 || m == 0 || topic_end + m + props_len > len) {
+        return;
+    }
+
+    uint16_t alias = find_alias(p + topic_end + m, props_len);
+    if (alias == 0 || alias > MAX_ALIAS) {
+        return;
+    }
+    if ((s_aliases & (1u << alias)) == 0) {
+        s_aliases |= 1u << alias;
+        return;
+    }
+
+    uint8_t type = p[0];
+    uint32_t header = 1 + varint_len(remaining - topic_len) + 2;
+    uint8_t *out = p + topic_end - header;
+    out[0] = type;
+    write_varint(out + 1, remaining - topic_len);
+    out[header - 2] = 0;
+    out[header - 1] = 0;
+    item->skip = topic_end - header;
+}
+
+static bool locate(outbox_handle_t outbox, outbox_item_handle_t item, class_t **out_class, uint32_t *out_index) {
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &outbox->classes[i];
+        if (item >= c->items && item < c->items + c->count) {
+            *out_class = c;
+            *out_index = item - c->items;
+            return true;
+        }
+    }
+    return false;
+}
+
+static outbox_item_t *find(outbox_handle_t outbox, int msg_id, int msg_type) {
+    if (s_last != NULL && s_last->msg_id == msg_id && (msg_type < 0 || s_last->msg_type == msg_type)) {
+        return s_last;
+    }
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &outbox->classes[i];
+        for (uint32_t j = 0; j < c->count; j++) {
+            if (c->items[j].msg_id == msg_id && (msg_type < 0 || c->items[j].msg_type == msg_type)) {
+                return &c->items[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+outbox_handle_t outbox_init(void) {
+    uint8_t *arena = s_arena;
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &s_outbox.classes[i];
+        mist_outbox_stats_t stats = c->stats;
+        memset(c, 0, sizeof(*c));
+        // Counters survive the client being recreated
+        c->stats = (mist_outbox_stats_t){ .high_water = stats.high_water, .evicted = stats.evicted, .rejected = stats.rejected };
+        c->arena = arena;
+        arena += BUDGET[i];
+    }
+    s_last = NULL;
+    return &s_outbox;
+}
+
+outbox_item_handle_t outbox_enqueue(outbox_handle_t outbox, outbox_message_handle_t message, outbox_tick_t tick) {
+    const mist_outbox_publish_t *publish = NULL;
+    if (message->msg_type == PACKET_PUBLISH) {
+        publish = s_next;
+        s_next = NULL;
+    }
+    mist_outbox_class_t cls = publish != NULL ? publish->cls : MIST_OUTBOX_CONTROL;
+    class_t *c = &outbox->classes[cls];
+    uint32_t len = message->len + message->remaining_len;
+
+    publish_layout_t layout;
+    uint16_t alias = 0;
+    uint32_t added = 0;
+    if (publish != NULL && s_mqtt5) {
+        if (parse_publish(message->data, message->len, message->msg_qos, &layout)) {
+            added = added_properties_len(publish, message->msg_qos, &alias);
+            uint32_t remaining = remaining_with_properties(&layout, added);
+            len = 1 + varint_len(remaining) + remaining;
+        } else {
+            ESP_LOGW(TAG, "Unexpected PUBLISH, sending msg_id %d without properties", message->msg_id);
+        }
+    }
+
+    if (len > BUDGET[cls]) {
+        c->stats.rejected++;
+        ESP_LOGW(TAG, "Message of %" PRIu32 " bytes exceeds the budget of class %d", len, cls);
+        return NULL;
+    }
+
+    while (c->count == MAX_ITEMS || c->used + len > BUDGET[cls]) {
+        ESP_LOGD(TAG, "Evicting msg_id %d from class %d", c->items[0].msg_id, cls);
+        remove_at(c, 0);
+        c->stats.evicted++;
+    }
+
+    outbox_item_t *item = &c->items[c->count++];
+    *item = (outbox_item_t){
+        .offset = c->used,
+        .len = len,
+        .msg_id = message->msg_id,
+        .msg_type = message->msg_type,
+        .qos = message->msg_qos,
+        .pending = QUEUED,
+        .tick = tick,
+        .alias = alias,
+    };
+    if (added > 0) {
+        copy_with_properties(c->arena + c->used, message, &layout, publish, alias, added);
+    } else {
+        memcpy(c->arena + c->used, message->data, message->len);
+        if (message->remaining_len > 0) {
+            memcpy(c->arena + c->used + message->len, message->remaining_data, message->remaining_len);
+        }
+    }
+    c->used += len;
+
+    c->stats.bytes = c->used;
+    c->stats.items = c->count;
+    if (c->used > c->stats.high_water) {
+        c->stats.high_water = c->used;
+    }
+    s_last = item;
+    return item;
+}
+
+// Oldest message in the given state, from the highest class that has one
+outbox_item_handle_t outbox_dequeue(outbox_handle_t outbox, pending_state_t pending, outbox_tick_t *tick) {
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &outbox->classes[i];
+        for (uint32_t j = 0; j < c->count; j++) {
+            if (c->items[j].pending == pending) {
+                if (pending == QUEUED) {
+                    apply_alias(c, &c->items[j]);
+                }
+                if (tick != NULL) {
+                    *tick = c->items[j].tick;
+                }
+                s_last = &c->items[j];
+                return s_last;
+            }
+        }
+    }
+    return NULL;
+}
+
+outbox_item_handle_t outbox_get(outbox_handle_t outbox, int msg_id) {
+    return find(outbox, msg_id, -1);
+}
+
+uint8_t *outbox_item_get_data(outbox_item_handle_t item, size_t *len, uint16_t *msg_id, int *msg_type, int *qos) {
+    class_t *c;
+    uint32_t index;
+    if (item == NULL || !locate(&s_outbox, item, &c, &index)) {
+        return NULL;
+    }
+    *len = item->len - item->skip;
+    *msg_id = item->msg_id;
+    *msg_type = item->msg_type;
+    *qos = item->qos;
+    return c->arena + item->offset + item->skip;
+}
+
+esp_err_t outbox_delete_item(outbox_handle_t outbox, outbox_item_handle_t item) {
+    class_t *c;
+    uint32_t index;
+    if (!locate(outbox, item, &c, &index)) {
+        return ESP_FAIL;
+    }
+    remove_at(c, index);
+    return ESP_OK;
+}
+
+esp_err_t outbox_delete(outbox_handle_t outbox, int msg_id, int msg_type) {
+    outbox_item_t *item = find(outbox, msg_id, msg_type);
+    return item != NULL ? outbox_delete_item(outbox, item) : ESP_FAIL;
+}
+
+esp_err_t outbox_set_pending(outbox_handle_t outbox, int msg_id, pending_state_t pending) {
+    outbox_item_t *item = find(outbox, msg_id, -1);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->pending = pending;
+    return ESP_OK;
+}
+
+pending_state_t outbox_item_get_pending(outbox_item_handle_t item) {
+    return item != NULL ? item->pending : QUEUED;
+}
+
+esp_err_t outbox_set_tick(outbox_handle_t outbox, int msg_id, outbox_tick_t tick) {
+    outbox_item_t *item = find(outbox, msg_id, -1);
+    if (item == NULL) {
+        return ESP_FAIL;
+    }
+    item->tick = tick;
+    return ESP_OK;
+}
+
+int outbox_delete_single_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout) {
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &outbox->classes[i];
+        for (uint32_t j = 0; j < c->count; j++) {
+            if (current_tick - c->items[j].tick > timeout) {
+                int msg_id = c->items[j].msg_id;
+                remove_at(c, j);
+                return msg_id;
+            }
+        }
+    }
+    return -1;
+}
+
+int outbox_delete_expired(outbox_handle_t outbox, outbox_tick_t current_tick, outbox_tick_t timeout) {
+    int deleted = 0;
+    while (outbox_delete_single_expired(outbox, current_tick, timeout) >= 0) {
+        deleted++;
+    }
+    return deleted;
+}
+
+uint64_t outbox_get_size(outbox_handle_t outbox) {
+    uint64_t size = 0;
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        size += outbox->classes[i].used;
+    }
+    return size;
+}
+
+void outbox_delete_all_items(outbox_handle_t outbox) {
+    for (int i = 0; i < MIST_OUTBOX_CLASS_MAX; i++) {
+        class_t *c = &outbox->classes[i];
+        c->used = 0;
+        c->count = 0;
+        c->stats.bytes = 0;
+        c->stats.items = 0;
+    }
+    s_last = NULL;
+}
+
+void outbox_destroy(outbox_handle_t outbox) {
+    outbox_delete_all_items(outbox);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Outbox of the esp-mqtt client, replacing its heap allocated one when
+// CONFIG_MIST_MQTT_OUTBOX is enabled. Pending messages are kept in a fixed arena
+// split into one budget per class. The client sends queued messages of a higher
+// class first, and a class that runs out of budget evicts its own oldest
+// messages, so telemetry piling up never delays or pushes out control traffic.
+typedef enum {
+    MIST_OUTBOX_CONTROL,        // Command status and the client's own packets, e.g. SUBSCRIBE
+    MIST_OUTBOX_TELEMETRY,      // Live readings, summaries and metrics
+    MIST_OUTBOX_BACKLOG,        // Messages replayed from the flash backlog
+    MIST_OUTBOX_CLASS_MAX,
+} mist_outbox_class_t;
+
+typedef struct {
+    uint32_t bytes;         // Currently held
+    uint32_t items;
+    uint32_t high_water;    // Most bytes held at once since boot
+    uint32_t evicted;       // Messages dropped to make room for newer ones
+    uint32_t rejected;      // Messages larger than the class budget
+} mist_outbox_stats_t;
+
+// Class and MQTT 5 properties of one publish
+typedef struct {
+    mist_outbox_class_t cls;
+    const char *content_type;   // Content Type property, NULL for none
+    uint16_t topic_alias;       // Topic Alias property for QoS 0, 0 for none
+} mist_outbox_publish_t;
+
+// Describes the next PUBLISH the calling task enqueues. The client calls the
+// outbox with its lock held from the enqueueing task, so the description is
+// applied to that very message whatever other tasks publish meanwhile, and then
+// cleared. publish must stay valid until the enqueue returns, NULL clears it.
+// Messages enqueued without a description, including the client's own, are
+// CONTROL without properties.
+void mist_outbox_set_next_publish(const mist_outbox_publish_t *publish);
+
+// Protocol version the client encodes packets with, properties are only added
+// to MQTT 5 publishes. Called before the client starts, and with the client
+// lock held whenever the version changes.
+void mist_outbox_set_protocol(bool mqtt5);
+
+void mist_outbox_get_stats(mist_outbox_class_t cls, mist_outbox_stats_t *stats);
+
+// Starts tracking topic aliases afresh for a new connection, on which the
+// broker accepts aliases up to alias_max. QoS 0 publishes with a topic alias
+// have their topic left out once an earlier one taught the broker the alias,
+// so callers pass both topic and alias on every publish. Queued messages with
+// an alias the broker no longer accepts are dropped. Called from the client's
+// event handler, with the client lock held.
+void mist_outbox_new_connection(uint16_t alias_max);
+
+// Drops every message not sent yet, e.g. when queued packets no longer match the
+// protocol version of the connection. Called with the client lock held.
+void mist_outbox_drop_unsent(void);
@@ -4,22 +4,10 @@
 
 static const char *TAG = "time_sync";
 
-/* Initialize SNTP client */
-void time_sync(void)
-{
-    ESP_LOGI(TAG, "Initializing SNTP");
-    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    esp_sntp_setservername(0, "pool.ntp.org");
-    esp_sntp_init();
-
-    // Wait for time synchronization
-    int retry = 0;
-    const int retry_count = 15;
-    while (sntp_get_sync_status() == SNTP_SYNC_STATUS_RESET && ++retry < retry_count) {
-        ESP_LOGI(TAG, "Waiting for system time to be set... (%d/%d)", retry, retry_count);
-        vTaskDelay(2000 / portTICK_PERIOD_MS);
-    }
+static time_sync_cb_t s_on_synced;
 
+static void time_sync_notification(struct timeval *tv)
+{
     // Print time information
     // Get current time
     time_t now;
@@ -30,4 +18,21 @@ void time_sync(void)
     ESP_LOGI(TAG, "Unix timestamp: %lld", (long long)now);
     ESP_LOGI(TAG, "UTC time:       %s", asctime(&timeinfo));
     ESP_LOGI(TAG, "Local time:     %s", ctime(&now));
+
+    if (s_on_synced != NULL) {
+        s_on_synced();
+    }
+}
+
+/* Initialize SNTP client. Returns immediately. on_synced is called on every sync
+ * from the lwIP tcpip thread, so it must only hand work off to a task: blocking
+ * there stalls all networking, including the MQTT connection. */
+void time_sync(time_sync_cb_t on_synced)
+{
+    ESP_LOGI(TAG, "Initializing SNTP");
+    s_on_synced = on_synced;
+    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, "pool.ntp.org");
+    sntp_set_time_sync_notification_cb(time_sync_notification);
+    esp_sntp_init();
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
 #pragma once
 
-void time_sync(void);
\ No newline at end of file
+typedef void (*time_sync_cb_t)(void);
+
+void time_sync(time_sync_cb_t on_synced);
\ No newline at end of file
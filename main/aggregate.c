@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "pbw.h"
+#include "mqtt.h"
+#include "peers.h"
+#include "backlog.h"
+#include "aggregate.h"
+
+#if CONFIG_MIST_AGGREGATION
+
+static const char *TAG = "aggregate";
+
+#define CAPACITY CONFIG_MIST_PEER_CAPACITY
+
+// EWMA weight of a new value is 1 / 2^EWMA_SHIFT, kept with EWMA_FRAC fractional bits
+#define EWMA_SHIFT 3
+#define EWMA_FRAC 8
+
+// Earliest plausible wall clock time, the clock is not set before that
+#define VALID_TIME_FLOOR 1700000000
+
+#define METRIC_BIT(metric) (1u << (metric))
+
+#define SUMMARY_BUF_SIZE 1024
+// Upper bound of one encoded SensorSummary including its tag and length
+#define SENSOR_SUMMARY_MAX_SIZE (32 + AGG_METRIC_MAX * 36)
+
+// Values are stored in 1/METRIC_SCALE units of the reading, deadbands in the same units
+static const int32_t METRIC_SCALE[AGG_METRIC_MAX] = {
+    [AGG_METRIC_TEMPERATURE] = 100,
+    [AGG_METRIC_HUMIDITY] = 100,
+    [AGG_METRIC_VOC_INDEX] = 1,
+    [AGG_METRIC_MOISTURE] = 100,
+};
+
+static const int32_t DEADBAND[AGG_METRIC_MAX] = {
+    [AGG_METRIC_TEMPERATURE] = CONFIG_MIST_AGG_DEADBAND_TEMPERATURE,
+    [AGG_METRIC_HUMIDITY] = CONFIG_MIST_AGG_DEADBAND_HUMIDITY,
+    [AGG_METRIC_VOC_INDEX] = CONFIG_MIST_AGG_DEADBAND_VOC_INDEX,
+    [AGG_METRIC_MOISTURE] = CONFIG_MIST_AGG_DEADBAND_MOISTURE,
+};
+
+// One array per statistic and metric, indexed by peers_index(), so a pass over
+// one metric of every sensor touches contiguous memory
+typedef struct {
+    int16_t last_sent[AGG_METRIC_MAX][CAPACITY];
+    int16_t min[AGG_METRIC_MAX][CAPACITY];
+    int16_t max[AGG_METRIC_MAX][CAPACITY];
+    int32_t sum[AGG_METRIC_MAX][CAPACITY];
+    int32_t ewma[AGG_METRIC_MAX][CAPACITY];
+    uint16_t count[AGG_METRIC_MAX][CAPACITY];
+    uint8_t seen[CAPACITY];                 // Bit per metric that has a last_sent and ewma
+    uint8_t sensor_type[CAPACITY];
+    uint8_t mac_addr[CAPACITY][ESP_NOW_ETH_ALEN];   // Sensor the entry belongs to
+} agg_table_t;
+
+static agg_table_t s_table;
+static SemaphoreHandle_t s_lock;
+
+static int64_t s_window_start_us;
+static uint32_t s_forwarded;
+static uint32_t s_suppressed;
+
+// Only touched by the summary task
+static uint8_t s_summary_buf[SUMMARY_BUF_SIZE];
+
+// Fixed for one round of summaries, since every summary is encoded twice
+static int64_t s_summary_time;
+static uint32_t s_summary_window_s;
+
+static int16_t to_fixed(float value, agg_metric_t metric) {
+    float scaled = roundf(value * METRIC_SCALE[metric]);
+    if (isnan(scaled)) return 0;
+    if (scaled > INT16_MAX) return INT16_MAX;
+    if (scaled < INT16_MIN) return INT16_MIN;
+    return (int16_t)scaled;
+}
+
+// Returns a bit per metric present in the reading
+static uint8_t reading_metrics(const SensorData *sensor_data, int16_t values[AGG_METRIC_MAX]) {
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR: {
+            const AirSensor *air = &sensor_data->body.air_sensor;
+            values[AGG_METRIC_TEMPERATURE] = to_fixed(air->temperature, AGG_METRIC_TEMPERATURE);
+            values[AGG_METRIC_HUMIDITY] = to_fixed(air->humidity, AGG_METRIC_HUMIDITY);
+            values[AGG_METRIC_VOC_INDEX] = to_fixed(air->voc_index, AGG_METRIC_VOC_INDEX);
+            return METRIC_BIT(AGG_METRIC_TEMPERATURE) | METRIC_BIT(AGG_METRIC_HUMIDITY) | METRIC_BIT(AGG_METRIC_VOC_INDEX);
+        }
+        case SensorType_SOIL_SENSOR:
+            values[AGG_METRIC_MOISTURE] = to_fixed(sensor_data->body.soil_sensor.moisture, AGG_METRIC_MOISTURE);
+            return METRIC_BIT(AGG_METRIC_MOISTURE);
+        default:
+            return 0;
+    }
+}
+
+static void reset_entry(int index, const uint8_t *mac_addr) {
+    memcpy(s_table.mac_addr[index], mac_addr, ESP_NOW_ETH_ALEN);
+    s_table.seen[index] = 0;
+    for (int m = 0; m < AGG_METRIC_MAX; m++) {
+        s_table.count[m][index] = 0;
+    }
+}
+
+bool aggregate_reading(const pipeline_reading_t *reading) {
+    int16_t values[AGG_METRIC_MAX];
+    uint8_t metrics = reading_metrics(&reading->data, values);
+    if (metrics == 0) {
+        return true;
+    }
+
+    const peer_t *peer = peers_find(reading->mac_addr);
+    if (peer == NULL) {
+        return true;
+    }
+    int index = peers_index(peer);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // The index may have been handed to another sensor since it was last used
+    if (memcmp(s_table.mac_addr[index], reading->mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        reset_entry(index, reading->mac_addr);
+    }
+    s_table.sensor_type[index] = reading->data.sensor_type;
+
+    bool forward = false;
+    for (int m = 0; m < AGG_METRIC_MAX; m++) {
+        if (!(metrics & METRIC_BIT(m))) continue;
+        int16_t value = values[m];
+
+        uint16_t *count = &s_table.count[m][index];
+        if (*count == 0) {
+            s_table.min[m][index] = value;
+            s_table.max[m][index] = value;
+            s_table.sum[m][index] = 0;
+        }
+        if (*count < UINT16_MAX) {
+            if (value < s_table.min[m][index]) s_table.min[m][index] = value;
+            if (value > s_table.max[m][index]) s_table.max[m][index] = value;
+            s_table.sum[m][index] += value;
+            (*count)++;
+        }
+
+        int32_t *ewma = &s_table.ewma[m][index];
+        if (!(s_table.seen[index] & METRIC_BIT(m))) {
+            *ewma = (int32_t)value << EWMA_FRAC;
+            forward = true;
+        } else {
+            *ewma += (((int32_t)value << EWMA_FRAC) - *ewma) >> EWMA_SHIFT;
+            if (abs(value - s_table.last_sent[m][index]) >= DEADBAND[m]) {
+                forward = true;
+            }
+        }
+    }
+
+    if (forward) {
+        for (int m = 0; m < AGG_METRIC_MAX; m++) {
+            if (metrics & METRIC_BIT(m)) {
+                s_table.last_sent[m][index] = values[m];
+            }
+        }
+        s_table.seen[index] |= metrics;
+        s_forwarded++;
+    } else {
+        s_suppressed++;
+    }
+    xSemaphoreGive(s_lock);
+
+    return forward;
+}
+
+// Summaries report every metric in hundredths
+static int32_t to_hundredths(int32_t value, agg_metric_t metric) {
+    return value * 100 / METRIC_SCALE[metric];
+}
+
+typedef struct {
+    int index;
+    agg_metric_t metric;
+} metric_arg_t;
+
+static bool encode_metric(pb_ostream_t *stream, const void *arg) {
+    const metric_arg_t *a = arg;
+    int m = a->metric;
+    int i = a->index;
+    uint16_t count = s_table.count[m][i];
+
+    return pbw_uint(stream, 1, m) &&
+           pbw_uint(stream, 2, count) &&
+           pbw_sint(stream, 3, to_hundredths(s_table.min[m][i], m)) &&
+           pbw_sint(stream, 4, to_hundredths(s_table.max[m][i], m)) &&
+           pbw_sint(stream, 5, to_hundredths(s_table.sum[m][i] / count, m)) &&
+           pbw_sint(stream, 6, to_hundredths(s_table.ewma[m][i] >> EWMA_FRAC, m));
+}
+
+static bool encode_summary(pb_ostream_t *stream, const void *arg) {
+    int index = *(const int *)arg;
+
+    bool ok = pbw_bytes(stream, 1, s_table.mac_addr[index], ESP_NOW_ETH_ALEN) &&
+              pbw_uint(stream, 2, s_table.sensor_type[index]) &&
+              pbw_uint(stream, 4, s_summary_window_s);
+    if (s_summary_time >= VALID_TIME_FLOOR) {
+        ok = ok && pbw_uint(stream, 3, s_summary_time);
+    }
+
+    for (int m = 0; ok && m < AGG_METRIC_MAX; m++) {
+        if (s_table.count[m][index] > 0) {
+            metric_arg_t metric = { .index = index, .metric = m };
+            ok = pbw_submessage(stream, 5, encode_metric, &metric);
+        }
+    }
+    return ok;
+}
+
+static void publish_summaries(const uint8_t *buf, size_t len) {
+    if (len == 0) return;
+
+    if (mqtt_is_connected() &&
+        mqtt_publish(mqtt_topic(MQTT_TOPIC_SUMMARIES), (const char *)buf, len) == ESP_OK) {
+        return;
+    }
+#if CONFIG_MIST_BACKLOG
+    backlog_append(MQTT_TOPIC_SUMMARIES, buf, len);
+#endif
+}
+
+static bool has_samples(int index) {
+    for (int m = 0; m < AGG_METRIC_MAX; m++) {
+        if (s_table.count[m][index] > 0) return true;
+    }
+    return false;
+}
+
+// Encodes the summaries of sensors from *next on until the buffer is full, and
+// starts their next window. Returns the encoded length, *next is CAPACITY once
+// every sensor is done.
+static size_t encode_summaries(int *next) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_summary_buf, sizeof(s_summary_buf));
+
+    for (int i = *next; i < CAPACITY; i++) {
+        *next = i;
+        if (!has_samples(i)) continue;
+
+        // Split into several messages rather than drop sensors
+        if (stream.max_size - stream.bytes_written < SENSOR_SUMMARY_MAX_SIZE) {
+            return stream.bytes_written;
+        }
+        if (!pbw_submessage(&stream, 1, encode_summary, &i)) {
+            ESP_LOGE(TAG, "Encoding summary failed: %s", PB_GET_ERROR(&stream));
+            *next = CAPACITY;
+            return 0;
+        }
+
+        for (int m = 0; m < AGG_METRIC_MAX; m++) {
+            s_table.count[m][i] = 0;
+        }
+    }
+    *next = CAPACITY;
+    return stream.bytes_written;
+}
+
+static void summarize(void) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    s_summary_time = time(NULL);
+    s_summary_window_s = (esp_timer_get_time() - s_window_start_us) / 1000000;
+    s_window_start_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Forwarded %" PRIu32 " of %" PRIu32 " readings", s_forwarded, s_forwarded + s_suppressed);
+
+    // Publishing may wait for the uplink or the backlog, so the lock is only
+    // held while a message is encoded. Readings of sensors not encoded yet
+    // still count towards the window being reported.
+    int next = 0;
+    while (next < CAPACITY) {
+        size_t len = encode_summaries(&next);
+        xSemaphoreGive(s_lock);
+        publish_summaries(s_summary_buf, len);
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+static void summary_task(void *arg) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_MIST_AGG_SUMMARY_INTERVAL_S * 1000));
+        summarize();
+    }
+}
+
+esp_err_t aggregate_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_window_start_us = esp_timer_get_time();
+
+    if (xTaskCreate(summary_task, "aggregate", 4096, NULL, 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create summary task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <esp_err.h>
+#include "pipeline.h"
+
+// Edge aggregation of sensor readings. Per paired sensor and metric the master
+// keeps the last forwarded value, the window's min, max and mean and a long
+// running EWMA, in fixed point. A reading is only forwarded upstream when one
+// of its metrics moved by at least that metric's deadband since the last
+// forwarded reading, so a deadband of 0 forwards every reading. Every CONFIG_MIST_AGG_SUMMARY_INTERVAL_S the window
+// statistics of all sensors are published as SensorSummary messages
+// (master.proto) on the summaries topic and the window starts over.
+
+typedef enum {
+    AGG_METRIC_TEMPERATURE,
+    AGG_METRIC_HUMIDITY,
+    AGG_METRIC_VOC_INDEX,
+    AGG_METRIC_MOISTURE,
+    AGG_METRIC_MAX,
+} agg_metric_t;
+
+// Starts the summary task
+esp_err_t aggregate_init(void);
+
+// Adds the reading to its sensor's statistics. Returns true if it should be
+// forwarded as is, which is also the case for sensors that are not paired.
+bool aggregate_reading(const pipeline_reading_t *reading);
@@ -0,0 +1,456 @@
+#include <string.h>
+#include <stddef.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "backlog.h"
+
+#if CONFIG_MIST_BACKLOG
+
+static const char *TAG = "backlog";
+
+#define BACKLOG_PARTITION_LABEL "backlog"
+
+#define RECORD_MAGIC 0x4C4D
+// Flash bits can only be cleared without an erase, so record state moves from 0xFF to 0x00
+#define RECORD_FLAG_SET 0x00
+#define RECORD_FLAG_CLEAR 0xFF
+
+// Records never cross a sector, so one sector is the largest erase unit and the largest record
+#define SECTOR_SIZE 4096
+#define MAX_PAYLOAD (SECTOR_SIZE - sizeof(record_hdr_t))
+
+#define ALIGN4(x) (((x) + 3u) & ~3u)
+
+// Each record is written in three steps: header, payload, then the committed flag.
+// A record whose committed flag is still clear after a reset was torn and is skipped.
+// The consumed flag is cleared once the record was replayed.
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint16_t len;
+    uint32_t seq;
+    uint32_t crc;       // Over seq, len, topic and payload
+    uint8_t topic;
+    uint8_t committed;
+    uint8_t consumed;
+    uint8_t reserved;
+} record_hdr_t;
+
+_Static_assert(sizeof(record_hdr_t) == 16, "record header must stay word aligned");
+
+static const esp_partition_t *s_part;
+static uint32_t s_sector_count;
+
+// How long a replayed record waits for its PUBACK before it is published again
+#define REPLAY_ACK_TIMEOUT_MS 10000
+
+// Message ids of recently acknowledged publishes, slot chosen by msg_id
+#define REPLAY_ACKS 8
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_replay_task;
+
+// Offsets are always below the end of the partition, a record filling the last
+// sector is followed by offset 0
+static uint32_t s_write_off;    // Offset of the next record to write
+static bool s_write_erased;     // The rest of the sector at s_write_off is erased
+static uint32_t s_read_off;     // Offset of the oldest record not known to be replayed
+static uint32_t s_next_seq;
+
+static volatile int s_acked[REPLAY_ACKS];
+
+static backlog_stats_t s_stats;
+
+static uint8_t s_replay_buf[MAX_PAYLOAD];
+
+static inline uint32_t sector_of(uint32_t off) {
+    return off / SECTOR_SIZE;
+}
+
+static inline uint32_t sector_start(uint32_t sector) {
+    return (sector % s_sector_count) * SECTOR_SIZE;
+}
+
+static inline uint32_t record_size(const record_hdr_t *hdr) {
+    return ALIGN4(sizeof(record_hdr_t) + hdr->len);
+}
+
+// Offset following the record at off
+static inline uint32_t record_end(uint32_t off, const record_hdr_t *hdr) {
+    uint32_t end = off + record_size(hdr);
+    return end == s_sector_count * SECTOR_SIZE ? 0 : end;
+}
+
+static uint32_t record_crc(const record_hdr_t *hdr, const uint8_t *payload) {
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&hdr->seq, sizeof(hdr->seq));
+    crc = esp_rom_crc32_le(crc, (const uint8_t *)&hdr->len, sizeof(hdr->len));
+    crc = esp_rom_crc32_le(crc, &hdr->topic, sizeof(hdr->topic));
+    return esp_rom_crc32_le(crc, payload, hdr->len);
+}
+
+// Reads the header at off. Returns false when there is no record there, which
+// means the rest of the sector is unused.
+static bool read_header(uint32_t off, record_hdr_t *hdr) {
+    if (off + sizeof(record_hdr_t) > sector_start(sector_of(off)) + SECTOR_SIZE) {
+        return false;
+    }
+    if (esp_partition_read(s_part, off, hdr, sizeof(*hdr)) != ESP_OK) {
+        return false;
+    }
+    if (hdr->magic != RECORD_MAGIC || hdr->len > MAX_PAYLOAD ||
+        off + record_size(hdr) > sector_start(sector_of(off)) + SECTOR_SIZE) {
+        return false;
+    }
+    return true;
+}
+
+static bool is_blank(uint32_t off, size_t len) {
+    uint8_t buf[sizeof(record_hdr_t)];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (esp_partition_read(s_part, off, buf, n) != ESP_OK) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (buf[i] != 0xFF) return false;
+        }
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+static inline bool is_pending(const record_hdr_t *hdr) {
+    return hdr->committed == RECORD_FLAG_SET && hdr->consumed == RECORD_FLAG_CLEAR;
+}
+
+static uint32_t count_pending(uint32_t sector) {
+    uint32_t count = 0;
+    record_hdr_t hdr;
+    uint32_t end = sector_start(sector) + SECTOR_SIZE;
+    for (uint32_t off = sector_start(sector); off < end && read_header(off, &hdr); off += record_size(&hdr)) {
+        if (is_pending(&hdr)) count++;
+    }
+    return count;
+}
+
+// Moves the write position to the start of sector and erases it. If the reader
+// still has records there, the whole sector is dropped, oldest first. A reader
+// that caught up with the writer in the previous sector finds the rest of it
+// blank and follows on its own. When the erase fails, the next append retries it.
+static esp_err_t start_write_sector(uint32_t sector) {
+    sector %= s_sector_count;
+
+    if (s_read_off != s_write_off && sector_of(s_read_off) == sector) {
+        uint32_t lost = count_pending(sector);
+        s_stats.dropped += lost;
+        s_stats.pending -= lost;
+        s_read_off = sector_start(sector + 1);
+        ESP_LOGW(TAG, "Backlog full, dropped %" PRIu32 " records", lost);
+    }
+
+    s_write_off = sector_start(sector);
+    s_write_erased = false;
+    esp_err_t err = esp_partition_erase_range(s_part, s_write_off, SECTOR_SIZE);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase sector %" PRIu32 ": %s", sector, esp_err_to_name(err));
+        return err;
+    }
+    s_write_erased = true;
+    return ESP_OK;
+}
+
+esp_err_t backlog_append(mqtt_topic_t topic, const uint8_t *data, size_t len) {
+    if (s_part == NULL) return ESP_ERR_INVALID_STATE;
+    if (len > MAX_PAYLOAD) return ESP_ERR_INVALID_SIZE;
+
+    record_hdr_t hdr = {
+        .magic = RECORD_MAGIC,
+        .len = len,
+        .topic = topic,
+        .committed = RECORD_FLAG_CLEAR,
+        .consumed = RECORD_FLAG_CLEAR,
+        .reserved = 0xFF,
+    };
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    esp_err_t err = ESP_OK;
+    if (!s_write_erased) {
+        err = start_write_sector(sector_of(s_write_off));
+    } else if (s_write_off + record_size(&hdr) > sector_start(sector_of(s_write_off)) + SECTOR_SIZE) {
+        err = start_write_sector(sector_of(s_write_off) + 1);
+    }
+
+    if (err == ESP_OK) {
+        hdr.seq = s_next_seq;
+        hdr.crc = record_crc(&hdr, data);
+
+        uint8_t committed = RECORD_FLAG_SET;
+        err = esp_partition_write(s_part, s_write_off, &hdr, sizeof(hdr));
+        if (err == ESP_OK) {
+            err = esp_partition_write(s_part, s_write_off + sizeof(hdr), data, len);
+        }
+        if (err == ESP_OK) {
+            err = esp_partition_write(s_part, s_write_off + offsetof(record_hdr_t, committed), &committed, 1);
+        }
+
+        s_next_seq++;
+        if (err == ESP_OK) {
+            s_stats.appended++;
+            s_stats.pending++;
+        }
+
+        // Even a failed write may have consumed flash, so never reuse the space.
+        // Nothing fits behind a record that fills its sector, so the next one is
+        // erased right away rather than written unerased by the next append.
+        if ((s_write_off + record_size(&hdr)) % SECTOR_SIZE == 0) {
+            start_write_sector(sector_of(s_write_off) + 1);
+        } else {
+            s_write_off += record_size(&hdr);
+        }
+    }
+
+    xSemaphoreGive(s_lock);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to append record: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Finds the oldest pending record, skipping replayed and torn ones.
+// Must be called with s_lock held.
+static bool find_pending(record_hdr_t *hdr) {
+    while (s_read_off != s_write_off) {
+        if (!read_header(s_read_off, hdr)) {
+            s_read_off = sector_start(sector_of(s_read_off) + 1);
+            continue;
+        }
+        if (is_pending(hdr)) {
+            return true;
+        }
+        if (hdr->committed != RECORD_FLAG_SET) {
+            s_stats.corrupt++;
+        }
+        s_read_off = record_end(s_read_off, hdr);
+    }
+    return false;
+}
+
+static void mark_consumed(uint32_t off) {
+    uint8_t consumed = RECORD_FLAG_SET;
+    esp_partition_write(s_part, off + offsetof(record_hdr_t, consumed), &consumed, 1);
+}
+
+static void published_handler(int msg_id) {
+    s_acked[msg_id % REPLAY_ACKS] = msg_id;
+    if (s_replay_task != NULL) {
+        xTaskNotifyGive(s_replay_task);
+    }
+}
+
+// Waits until the broker acknowledged msg_id. Returns false on a disconnect or
+// when no PUBACK arrived in time, e.g. because the outbox evicted the message.
+static bool wait_acked(int msg_id) {
+    TickType_t start = xTaskGetTickCount();
+    while (s_acked[msg_id % REPLAY_ACKS] != msg_id) {
+        if (!mqtt_is_connected() || xTaskGetTickCount() - start >= pdMS_TO_TICKS(REPLAY_ACK_TIMEOUT_MS)) {
+            return false;
+        }
+        // Woken by every PUBACK and by connection changes
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(REPLAY_ACK_TIMEOUT_MS));
+    }
+    s_acked[msg_id % REPLAY_ACKS] = 0;
+    return true;
+}
+
+// Publishes the oldest pending record at QoS 1 and marks it consumed once the
+// broker acknowledged it. A record whose PUBACK does not arrive stays pending and
+// is published again, so a replayed batch may be delivered twice but is never
+// lost. Returns false when the backlog is empty or replay should wait for the
+// next connection.
+static bool replay_one(void) {
+    record_hdr_t hdr;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool found = find_pending(&hdr);
+    uint32_t off = s_read_off;
+    xSemaphoreGive(s_lock);
+
+    if (!found) return false;
+
+    // Records are only ever appended past s_write_off, so the one at off is stable
+    // unless the writer wraps around and drops this sector, which the CRC catches.
+    if (esp_partition_read(s_part, off + sizeof(hdr), s_replay_buf, hdr.len) != ESP_OK) {
+        return false;
+    }
+
+    bool valid = record_crc(&hdr, s_replay_buf) == hdr.crc && hdr.topic < MQTT_TOPIC_MAX;
+    if (valid) {
+        int msg_id;
+        if (mqtt_publish_class(mqtt_topic(hdr.topic), (const char *)s_replay_buf, hdr.len, 1,
+                               MIST_OUTBOX_BACKLOG, &msg_id) != ESP_OK) {
+            return false;
+        }
+        if (!wait_acked(msg_id)) {
+            return mqtt_is_connected();
+        }
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // Skip the record only if the writer has not already dropped its sector
+    if (s_read_off == off) {
+        mark_consumed(off);
+        s_read_off = record_end(off, &hdr);
+        s_stats.pending--;
+        if (valid) {
+            s_stats.replayed++;
+        } else {
+            s_stats.corrupt++;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    return true;
+}
+
+static void replay_task(void *arg) {
+    const TickType_t interval = pdMS_TO_TICKS(1000 / CONFIG_MIST_BACKLOG_REPLAY_RATE);
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Rate limited, one record in flight and at a lower priority than live
+        // publishing so replay never delays fresh readings. Also woken by the
+        // PUBACKs of other publishes, which find nothing to replay.
+        uint32_t rounds = 0;
+        while (mqtt_is_connected() && replay_one()) {
+            rounds++;
+            vTaskDelay(interval);
+        }
+
+        if (rounds > 0) {
+            ESP_LOGI(TAG, "Replay paused, %" PRIu32 " records pending", s_stats.pending);
+        }
+    }
+}
+
+static void connection_handler(bool connected) {
+    // A disconnect ends the wait for a PUBACK
+    if (s_replay_task != NULL) {
+        xTaskNotifyGive(s_replay_task);
+    }
+}
+
+// Recovers the write position from the sector whose first record is newest and
+// the read position from the first pending record after it in ring order.
+static void recover(void) {
+    record_hdr_t hdr;
+    bool found = false;
+    uint32_t head = 0;
+    uint32_t newest_seq = 0;
+
+    for (uint32_t sector = 0; sector < s_sector_count; sector++) {
+        if (read_header(sector_start(sector), &hdr) && (!found || (int32_t)(hdr.seq - newest_seq) > 0)) {
+            found = true;
+            head = sector;
+            newest_seq = hdr.seq;
+        }
+    }
+
+    if (!found) {
+        ESP_LOGI(TAG, "Backlog is empty");
+        s_write_off = s_read_off = 0;
+        s_next_seq = 0;
+        start_write_sector(0);
+        return;
+    }
+
+    // Walk the head sector to the end of the last record
+    uint32_t sector_end = sector_start(head) + SECTOR_SIZE;
+    uint32_t off = sector_start(head);
+    while (off < sector_end && read_header(off, &hdr)) {
+        newest_seq = hdr.seq;
+        off += record_size(&hdr);
+    }
+    s_next_seq = newest_seq + 1;
+
+    // Nothing more is written to the head sector when the last record fills it
+    // or a torn header leaves the rest unusable
+    bool head_full = off == sector_end || !is_blank(off, sector_end - off);
+    s_write_off = head_full ? sector_start(head) : off;
+    s_write_erased = !head_full;
+
+    // The oldest data is in the first written sector after the head
+    s_read_off = s_write_off;
+    for (uint32_t i = 1; i <= s_sector_count; i++) {
+        uint32_t sector = (head + i) % s_sector_count;
+        if (read_header(sector_start(sector), &hdr)) {
+            s_read_off = sector_start(sector);
+            break;
+        }
+    }
+
+    // Count pending records from the oldest sector up to the head
+    for (uint32_t sector = sector_of(s_read_off);; sector = (sector + 1) % s_sector_count) {
+        s_stats.pending += count_pending(sector);
+        if (sector == head) break;
+    }
+
+    // The reader has not caught up with a write position in the head sector, so
+    // records of the oldest sector are dropped if it is the next one
+    if (head_full) {
+        start_write_sector(head + 1);
+    }
+
+    if (find_pending(&hdr)) {
+        ESP_LOGI(TAG, "Recovered %" PRIu32 " pending records", s_stats.pending);
+    }
+}
+
+esp_err_t backlog_init(void) {
+    s_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, BACKLOG_PARTITION_LABEL);
+    if (s_part == NULL) {
+        ESP_LOGE(TAG, "No %s partition", BACKLOG_PARTITION_LABEL);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    s_sector_count = s_part->size / SECTOR_SIZE;
+    if (s_sector_count < 3) {
+        ESP_LOGE(TAG, "Backlog partition needs at least 3 sectors");
+        s_part = NULL;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        s_part = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    recover();
+
+    if (xTaskCreate(replay_task, "backlog_replay", 4096, NULL, 3, &s_replay_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create replay task");
+        return ESP_FAIL;
+    }
+
+    mqtt_register_connection_handler(connection_handler);
+    mqtt_register_published_handler(published_handler);
+    if (mqtt_is_connected()) {
+        xTaskNotifyGive(s_replay_task);
+    }
+
+    return ESP_OK;
+}
+
+void backlog_get_stats(backlog_stats_t *stats) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "mqtt.h"
+
+// Append-only ring log of encoded payloads in the "backlog" data partition.
+// Payloads that could not be published while the broker was unreachable are
+// written here and replayed, oldest first, after the client reconnects. Replay
+// publishes at QoS 1 and a record counts as replayed once the broker acknowledged
+// it, so a record may be delivered twice but is not lost to a dropped connection.
+
+typedef struct {
+    uint32_t pending;
+    uint32_t appended;
+    uint32_t replayed;
+    uint32_t dropped;   // Unreplayed records overwritten because the log was full
+    uint32_t corrupt;   // Torn or CRC-failed records skipped
+} backlog_stats_t;
+
+// Scans the partition to recover the read and write positions and starts the replay task
+esp_err_t backlog_init(void);
+
+// Appends a payload destined for topic. When the log is full the oldest sector is dropped.
+esp_err_t backlog_append(mqtt_topic_t topic, const uint8_t *data, size_t len);
+
+void backlog_get_stats(backlog_stats_t *stats);
@@ -0,0 +1,196 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_now.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "pb_encode.h"
+#include "mqtt.h"
+#include "batch.h"
+#include "backlog.h"
+#include "boot.h"
+#include "metrics.h"
+#include "tsblock.h"
+
+#if CONFIG_MIST_SENSOR_BATCHING
+
+static const char *TAG = "batch";
+
+#define BATCH_MAX_READINGS CONFIG_MIST_BATCH_MAX_READINGS
+
+#ifdef SensorData_size
+// Every reading is a length delimited field: one byte tag, up to two bytes length
+_Static_assert(CONFIG_MIST_BATCH_BUF_SIZE >= BATCH_MAX_READINGS * (SensorData_size + 3),
+               "batch buffer cannot hold a full batch");
+#endif
+
+#if CONFIG_MIST_BATCH_ENCODING_TSBLOCK
+_Static_assert(BATCH_MAX_READINGS <= TSBLOCK_MAX_READINGS, "batch does not fit one time series block");
+#endif
+
+typedef struct {
+    SensorData readings[BATCH_MAX_READINGS];
+    uint8_t mac_addr[BATCH_MAX_READINGS][ESP_NOW_ETH_ALEN];
+    size_t count;
+} batch_t;
+
+// Double buffered: readings are added to one batch while the other is being encoded
+static batch_t s_batches[2];
+static batch_t *s_filling = &s_batches[0];
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_flush_task;
+
+static uint8_t s_encode_buf[CONFIG_MIST_BATCH_BUF_SIZE];
+#if CONFIG_MIST_BATCH_ENCODING_TSBLOCK
+static tsblock_buf_t s_tsblock;
+#endif
+
+static batch_stats_t s_stats;
+
+static size_t encode_readings(const batch_t *batch) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_encode_buf, sizeof(s_encode_buf));
+
+    for (size_t i = 0; i < batch->count; i++) {
+        if (!pb_encode_tag(&stream, PB_WT_STRING, SENSOR_DATA_BATCH_READINGS_TAG) ||
+            !pb_encode_submessage(&stream, SensorData_fields, &batch->readings[i])) {
+            ESP_LOGE(TAG, "Encoding batch failed: %s", PB_GET_ERROR(&stream));
+            return 0;
+        }
+    }
+
+    return stream.bytes_written;
+}
+
+#if CONFIG_MIST_BATCH_ENCODING_TSBLOCK
+// One TimeSeriesBlock per sensor and type, readings in arrival order
+static size_t encode_blocks(const batch_t *batch) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_encode_buf, sizeof(s_encode_buf));
+    const SensorData *series[BATCH_MAX_READINGS];
+    bool taken[BATCH_MAX_READINGS] = { false };
+
+    for (size_t i = 0; i < batch->count; i++) {
+        if (taken[i]) continue;
+
+        size_t count = 0;
+        for (size_t j = i; j < batch->count; j++) {
+            if (!taken[j] && batch->readings[j].sensor_type == batch->readings[i].sensor_type &&
+                memcmp(batch->mac_addr[j], batch->mac_addr[i], ESP_NOW_ETH_ALEN) == 0) {
+                series[count++] = &batch->readings[j];
+                taken[j] = true;
+            }
+        }
+
+        if (!tsblock_encode(&s_tsblock, &stream, SENSOR_DATA_BATCH_BLOCKS_TAG, batch->mac_addr[i], series, count)) {
+            return 0;
+        }
+    }
+
+    return stream.bytes_written;
+}
+#endif
+
+static size_t encode_batch(const batch_t *batch) {
+#if CONFIG_MIST_BATCH_ENCODING_TSBLOCK
+    size_t len = encode_blocks(batch);
+    if (len > 0) {
+        return len;
+    }
+    // Noisy series can compress worse than the plain readings
+    ESP_LOGW(TAG, "Time series blocks do not fit, sending readings");
+#endif
+    return encode_readings(batch);
+}
+
+static void flush(void) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    batch_t *batch = s_filling;
+    s_filling = (batch == &s_batches[0]) ? &s_batches[1] : &s_batches[0];
+    xSemaphoreGive(s_lock);
+
+    if (batch->count == 0) return;
+
+    uint32_t start = metrics_now();
+    size_t len = encode_batch(batch);
+    bool published = false;
+    bool stored = false;
+    if (len > 0) {
+        published = mqtt_is_connected() &&
+                    mqtt_publish(mqtt_topic(MQTT_TOPIC_SENSORS), (const char *)s_encode_buf, len) == ESP_OK;
+#if CONFIG_MIST_BACKLOG
+        // Keep the batch in flash until the broker is reachable again
+        stored = !published && backlog_append(MQTT_TOPIC_SENSORS, s_encode_buf, len) == ESP_OK;
+#endif
+    }
+
+    if (published) {
+        metrics_record(METRICS_STAGE_PUBLISH, start);
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (published) {
+        boot_mark(BOOT_PHASE_FIRST_PUBLISH);
+        s_stats.batches++;
+        s_stats.readings += batch->count;
+        s_stats.bytes += len;
+    } else if (stored) {
+        s_stats.stored += batch->count;
+    } else {
+        s_stats.dropped += batch->count;
+    }
+    xSemaphoreGive(s_lock);
+
+    ESP_LOGD(TAG, "Flushed %u readings in %u bytes", (unsigned)batch->count, (unsigned)len);
+    batch->count = 0;
+}
+
+static void flush_task(void *arg) {
+    while (1) {
+        // Woken early by batch_add() when the batch fills up
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_MIST_BATCH_WINDOW_MS));
+        flush();
+    }
+}
+
+esp_err_t batch_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(flush_task, "batch_flush", 4096, NULL, 5, &s_flush_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create flush task");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Batching up to %d readings every %d ms", BATCH_MAX_READINGS, CONFIG_MIST_BATCH_WINDOW_MS);
+    return ESP_OK;
+}
+
+esp_err_t batch_add(const SensorData *sensor_data, const uint8_t *mac_addr) {
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_filling->count < BATCH_MAX_READINGS) {
+        memcpy(s_filling->mac_addr[s_filling->count], mac_addr, ESP_NOW_ETH_ALEN);
+        s_filling->readings[s_filling->count++] = *sensor_data;
+        if (s_filling->count == BATCH_MAX_READINGS) {
+            xTaskNotifyGive(s_flush_task);
+        }
+    } else {
+        s_stats.dropped++;
+        err = ESP_ERR_NO_MEM;
+    }
+    xSemaphoreGive(s_lock);
+
+    return err;
+}
+
+void batch_get_stats(batch_stats_t *stats) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+#include "messages.pb.h"
+
+// Field numbers of SensorDataBatch.readings and .blocks, see master.proto
+#define SENSOR_DATA_BATCH_READINGS_TAG 1
+#define SENSOR_DATA_BATCH_BLOCKS_TAG 2
+
+typedef struct {
+    uint32_t batches;
+    uint32_t readings;
+    uint32_t bytes;
+    uint32_t stored;    // Readings written to the backlog while disconnected
+    uint32_t dropped;
+} batch_stats_t;
+
+// Starts the task that flushes a batch when it is full or the window expires
+esp_err_t batch_init(void);
+
+// Copies a reading from the sensor at mac_addr into the current batch. Returns
+// ESP_ERR_NO_MEM and counts a drop when the batch is full and the previous one is
+// still being published.
+esp_err_t batch_add(const SensorData *sensor_data, const uint8_t *mac_addr);
+
+void batch_get_stats(batch_stats_t *stats);
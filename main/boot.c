@@ -0,0 +1,58 @@
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "boot.h"
+
+static const char *TAG = "boot";
+
+static const char *const PHASE_NAMES[BOOT_PHASE_MAX] = {
+    [BOOT_PHASE_WIFI_STARTED] = "wifi started",
+    [BOOT_PHASE_COMM_READY] = "esp-now ready",
+    [BOOT_PHASE_MQTT_CONNECTED] = "mqtt connected",
+    [BOOT_PHASE_TIME_VALID] = "time valid",
+    [BOOT_PHASE_FIRST_READING] = "first reading",
+    [BOOT_PHASE_FIRST_PUBLISH] = "first publish",
+};
+
+static EventGroupHandle_t s_events;
+static int64_t s_phase_time_us[BOOT_PHASE_MAX];
+
+void boot_init(void) {
+    s_events = xEventGroupCreate();
+}
+
+static void report(void) {
+    // esp_timer starts counting at boot, so phase times are already boot relative
+    for (int i = 0; i < BOOT_PHASE_MAX; i++) {
+        if (s_phase_time_us[i] != 0) {
+            ESP_LOGI(TAG, "%-15s %6lld ms", PHASE_NAMES[i], s_phase_time_us[i] / 1000);
+        } else {
+            ESP_LOGI(TAG, "%-15s pending", PHASE_NAMES[i]);
+        }
+    }
+}
+
+void boot_mark(boot_phase_t phase) {
+    if (xEventGroupGetBits(s_events) & BOOT_BIT(phase)) {
+        return;
+    }
+
+    s_phase_time_us[phase] = esp_timer_get_time();
+    xEventGroupSetBits(s_events, BOOT_BIT(phase));
+    ESP_LOGI(TAG, "Reached %s after %lld ms", PHASE_NAMES[phase], s_phase_time_us[phase] / 1000);
+
+    if (phase == BOOT_PHASE_FIRST_PUBLISH) {
+        report();
+    }
+}
+
+bool boot_reached(boot_phase_t phase) {
+    return (xEventGroupGetBits(s_events) & BOOT_BIT(phase)) != 0;
+}
+
+bool boot_wait(EventBits_t bits, TickType_t timeout) {
+    return (xEventGroupWaitBits(s_events, bits, pdFALSE, pdTRUE, timeout) & bits) == bits;
+}
+
+int64_t boot_phase_time_us(boot_phase_t phase) {
+    return s_phase_time_us[phase];
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+
+// Boot phases, in the order they usually complete. Phases after
+// BOOT_PHASE_COMM_READY progress concurrently and may complete in any order.
+typedef enum {
+    BOOT_PHASE_WIFI_STARTED,
+    BOOT_PHASE_COMM_READY,
+    BOOT_PHASE_MQTT_CONNECTED,
+    BOOT_PHASE_TIME_VALID,
+    BOOT_PHASE_FIRST_READING,
+    BOOT_PHASE_FIRST_PUBLISH,
+    BOOT_PHASE_MAX,
+} boot_phase_t;
+
+#define BOOT_BIT(phase) ((EventBits_t)1 << (phase))
+
+void boot_init(void);
+
+// Records the first time phase completes and sets its event group bit.
+// Reaching BOOT_PHASE_FIRST_PUBLISH logs the latency of every phase.
+void boot_mark(boot_phase_t phase);
+
+bool boot_reached(boot_phase_t phase);
+
+// Waits until all phases in bits have completed. Returns false on timeout.
+bool boot_wait(EventBits_t bits, TickType_t timeout);
+
+// esp_timer time the phase completed, or 0 if it has not yet
+int64_t boot_phase_time_us(boot_phase_t phase);
@@ -0,0 +1,400 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "pb_encode.h"
+#include "comm.h"
+#include "pbw.h"
+#include "mqtt.h"
+#include "peers.h"
+#include "commands.h"
+#include "rlink.h"
+
+static const char *TAG = "commands";
+
+#define MAX_ACTIVE CONFIG_MIST_COMMANDS_MAX_ACTIVE
+#define SPACING_MS CONFIG_MIST_COMMAND_SPACING_MS
+#define MAX_ATTEMPTS CONFIG_MIST_COMMAND_MAX_ATTEMPTS
+
+// At least one tick, even when the spacing is shorter than a tick
+#define SPACING_TICKS (pdMS_TO_TICKS(SPACING_MS) > 0 ? pdMS_TO_TICKS(SPACING_MS) : 1)
+
+// Ids of this many recent commands are remembered for duplicate suppression
+#define RECENT_IDS 32
+
+// Rejections waiting for the commands task to publish their CommandStatus
+#define REJECTIONS 8
+
+// CommandStatus.error, see master.proto
+typedef enum {
+    COMMAND_ERROR_NONE = 0,
+    COMMAND_ERROR_NO_TARGETS = 1,
+    COMMAND_ERROR_BUSY = 2,
+} command_error_t;
+
+typedef enum {
+    TARGET_PENDING,
+    TARGET_ACKED,
+    TARGET_FAILED,
+} target_state_t;
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint8_t state;
+    uint8_t attempts;
+    int64_t due_us;     // Next send, or when the last attempt times out
+} target_t;
+
+typedef struct {
+    bool active;
+    bool local;             // Originated on the master, no CommandStatus
+    SensorCommand cmd;
+    commands_extend_fn extend;
+    commands_done_fn done;
+    int64_t started_us;
+    uint16_t count;
+    uint16_t pending;
+    target_t targets[CONFIG_MIST_PEER_CAPACITY];
+} command_t;
+
+static command_t s_commands[MAX_ACTIVE];
+
+static int64_t s_recent_ids[RECENT_IDS];
+static uint32_t s_recent_count;
+
+typedef struct {
+    int64_t id;
+    command_error_t error;
+} rejection_t;
+
+static rejection_t s_rejections[REJECTIONS];
+static uint32_t s_rejection_count;
+
+// Ids of commands originating on the master count down from -1, those of
+// consumers are positive
+static int64_t s_next_local_id = -1;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+
+static const uint8_t GROUP_PREFIX[] = { 0x01, 'M', 'I', 'S', 'T' };
+
+// Only touched by the commands task
+static uint8_t s_tx_buf[ESP_NOW_MAX_DATA_LEN];
+static uint8_t s_status_buf[32 + CONFIG_MIST_PEER_CAPACITY * (ESP_NOW_ETH_ALEN + 2)];
+
+static bool seen_recently(int64_t id) {
+    uint32_t count = s_recent_count < RECENT_IDS ? s_recent_count : RECENT_IDS;
+    for (uint32_t i = 0; i < count; i++) {
+        if (s_recent_ids[i] == id) return true;
+    }
+    return false;
+}
+
+static void remember(int64_t id) {
+    s_recent_ids[s_recent_count++ % RECENT_IDS] = id;
+}
+
+static void add_target(command_t *command, const uint8_t *mac_addr, int64_t now_us) {
+    target_t *target = &command->targets[command->count++];
+    memcpy(target->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    target->state = TARGET_PENDING;
+    target->attempts = 0;
+    target->due_us = now_us;
+}
+
+static void resolve_targets(command_t *command, int64_t now_us) {
+    const uint8_t *addr = command->cmd.sensor_mac_addr;
+    bool all = COMM_IS_BROADCAST_ADDR(addr);
+    bool group = memcmp(addr, GROUP_PREFIX, sizeof(GROUP_PREFIX)) == 0;
+
+    if (!all && !group) {
+        if (peers_find(addr) != NULL) {
+            add_target(command, addr, now_us);
+        }
+        return;
+    }
+
+    for (int i = 0; i < CONFIG_MIST_PEER_CAPACITY; i++) {
+        const peer_t *peer = peers_at(i);
+        if (peer != NULL && (all || peer->sensor_type == addr[ESP_NOW_ETH_ALEN - 1])) {
+            add_target(command, peer->mac_addr, now_us);
+        }
+    }
+}
+
+static size_t encode_status(uint8_t *buf, size_t size, const command_t *command, int64_t id, command_error_t error) {
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, size);
+    bool ok = pbw_sint(&stream, 1, id);
+
+    if (command != NULL) {
+        uint32_t acked = 0;
+        for (int i = 0; i < command->count; i++) {
+            acked += command->targets[i].state == TARGET_ACKED;
+        }
+        ok = ok && pbw_uint(&stream, 2, command->count) &&
+                   pbw_uint(&stream, 3, acked) &&
+                   pbw_uint(&stream, 5, (esp_timer_get_time() - command->started_us) / 1000);
+        for (int i = 0; ok && i < command->count; i++) {
+            if (command->targets[i].state == TARGET_FAILED) {
+                ok = pbw_bytes(&stream, 4, command->targets[i].mac_addr, ESP_NOW_ETH_ALEN);
+            }
+        }
+    }
+    if (error != COMMAND_ERROR_NONE) {
+        ok = ok && pbw_uint(&stream, 6, error);
+    }
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Encoding status failed: %s", PB_GET_ERROR(&stream));
+        return 0;
+    }
+    return stream.bytes_written;
+}
+
+static void publish_status(const uint8_t *buf, size_t len) {
+    if (len > 0) {
+        mqtt_publish_qos(mqtt_topic(MQTT_TOPIC_COMMANDS_STATUS), (const char *)buf, len, 1);
+    }
+}
+
+static esp_err_t submit(SensorCommand *cmd, commands_extend_fn extend, commands_done_fn done, bool local) {
+    int64_t now_us = esp_timer_get_time();
+    command_error_t error = COMMAND_ERROR_NONE;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (local) {
+        cmd->id = s_next_local_id--;
+    } else if (seen_recently(cmd->id)) {
+        xSemaphoreGive(s_lock);
+        ESP_LOGW(TAG, "Ignoring duplicate command %lld", cmd->id);
+        return ESP_OK;
+    }
+
+    command_t *command = NULL;
+    for (int i = 0; i < MAX_ACTIVE && command == NULL; i++) {
+        if (!s_commands[i].active) {
+            command = &s_commands[i];
+        }
+    }
+
+    // Only accepted ids are remembered, a rejected command may be sent again
+    // with the same id once it can be delivered
+    if (command == NULL) {
+        error = COMMAND_ERROR_BUSY;
+    } else {
+        command->cmd = *cmd;
+        command->extend = extend;
+        command->done = done;
+        command->local = local;
+        command->started_us = now_us;
+        command->count = 0;
+        resolve_targets(command, now_us);
+        command->pending = command->count;
+        command->active = command->count > 0;
+        if (command->count == 0) {
+            error = COMMAND_ERROR_NO_TARGETS;
+        } else if (!local) {
+            remember(cmd->id);
+        }
+    }
+
+    // Callers run on the MQTT task, so the status is published by the commands task
+    bool reported = true;
+    if (error != COMMAND_ERROR_NONE && !local) {
+        reported = s_rejection_count < REJECTIONS;
+        if (reported) {
+            s_rejections[s_rejection_count++] = (rejection_t){ .id = cmd->id, .error = error };
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (error != COMMAND_ERROR_NONE) {
+        ESP_LOGW(TAG, "Rejecting command %lld: %s", cmd->id,
+                 error == COMMAND_ERROR_BUSY ? "too many active commands" : "no paired sensor addressed");
+        if (!reported) {
+            ESP_LOGW(TAG, "Too many rejections pending, no status for command %lld", cmd->id);
+        }
+        if (!local) {
+            xTaskNotifyGive(s_task);
+        }
+        return error == COMMAND_ERROR_BUSY ? ESP_ERR_NO_MEM : ESP_ERR_NOT_FOUND;
+    }
+
+    ESP_LOGI(TAG, "Command %lld addressed to %u sensors", cmd->id, command->count);
+    xTaskNotifyGive(s_task);
+    return ESP_OK;
+}
+
+esp_err_t commands_submit(const SensorCommand *cmd) {
+    SensorCommand copy = *cmd;
+    return submit(&copy, NULL, NULL, false);
+}
+
+esp_err_t commands_submit_local(SensorCommand *cmd, commands_extend_fn extend, commands_done_fn done) {
+    return submit(cmd, extend, done, true);
+}
+
+void commands_ack(const uint8_t *mac_addr, int64_t id) {
+    bool done = false;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < MAX_ACTIVE; i++) {
+        command_t *command = &s_commands[i];
+        if (!command->active || command->cmd.id != id) continue;
+
+        for (int j = 0; j < command->count; j++) {
+            target_t *target = &command->targets[j];
+            if (target->state == TARGET_PENDING && memcmp(target->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+                target->state = TARGET_ACKED;
+                done = --command->pending == 0;
+                if (command->done != NULL) {
+                    command->done(mac_addr, id, true);
+                }
+                break;
+            }
+        }
+        break;
+    }
+    xSemaphoreGive(s_lock);
+
+    if (done) {
+        xTaskNotifyGive(s_task);
+    }
+}
+
+// Picks the target due soonest. Targets whose last attempt timed out are failed
+// on the way. Returns the time the next target is due, INT64_MAX if none is.
+static int64_t next_send(int64_t now_us, command_t **out_command, target_t **out_target) {
+    int64_t next_us = INT64_MAX;
+    *out_command = NULL;
+    *out_target = NULL;
+
+    for (int i = 0; i < MAX_ACTIVE; i++) {
+        command_t *command = &s_commands[i];
+        if (!command->active) continue;
+
+        for (int j = 0; j < command->count; j++) {
+            target_t *target = &command->targets[j];
+            if (target->state != TARGET_PENDING) continue;
+
+            if (target->attempts >= MAX_ATTEMPTS && target->due_us <= now_us) {
+                ESP_LOGW(TAG, "No ack for command %lld from "MACSTR, command->cmd.id, MAC2STR(target->mac_addr));
+                target->state = TARGET_FAILED;
+                command->pending--;
+                if (command->done != NULL) {
+                    command->done(target->mac_addr, command->cmd.id, false);
+                }
+                continue;
+            }
+
+            if (target->due_us < next_us) {
+                next_us = target->due_us;
+                if (target->attempts < MAX_ATTEMPTS) {
+                    *out_command = command;
+                    *out_target = target;
+                }
+            }
+        }
+    }
+
+    return next_us;
+}
+
+static esp_err_t send_frame(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
+#if CONFIG_MIST_RLINK
+    // Retransmitted until the sensor acknowledges the frame, below the command retries
+    return rlink_send(mac_addr, data, len);
+#else
+    return peers_send(data, len, mac_addr);
+#endif
+}
+
+// Sends the target due next if it is due by now_us and publishes one pending
+// status. Returns whether it did either, and in next_us when the next target
+// is due, INT64_MAX if none is.
+static bool service(int64_t now_us, int64_t *next_us) {
+    size_t status_len = 0;
+    size_t tx_len = 0;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    command_t *command;
+    target_t *target;
+    *next_us = next_send(now_us, &command, &target);
+
+    if (command != NULL && *next_us <= now_us) {
+        // Every sensor gets the command addressed to itself
+        SensorCommand cmd = command->cmd;
+        memcpy(cmd.sensor_mac_addr, target->mac_addr, ESP_NOW_ETH_ALEN);
+        pb_ostream_t stream = pb_ostream_from_buffer(s_tx_buf, sizeof(s_tx_buf));
+        if (pb_encode(&stream, SensorCommand_fields, &cmd)) {
+            tx_len = stream.bytes_written;
+            if (command->extend != NULL) {
+                tx_len += command->extend(target->mac_addr, s_tx_buf + tx_len, sizeof(s_tx_buf) - tx_len);
+            }
+        }
+        memcpy(mac_addr, target->mac_addr, ESP_NOW_ETH_ALEN);
+
+        target->attempts++;
+        target->due_us = now_us + ((int64_t)CONFIG_MIST_COMMAND_RETRY_MS * 1000 << (target->attempts - 1));
+    }
+
+    // Rejections first, they are reported as soon as possible
+    if (s_rejection_count > 0) {
+        rejection_t rejection = s_rejections[0];
+        memmove(&s_rejections[0], &s_rejections[1], --s_rejection_count * sizeof(s_rejections[0]));
+        status_len = encode_status(s_status_buf, sizeof(s_status_buf), NULL, rejection.id, rejection.error);
+    }
+
+    // Commands are reported once no target is pending any more
+    for (int i = 0; i < MAX_ACTIVE && status_len == 0; i++) {
+        if (s_commands[i].active && s_commands[i].pending == 0) {
+            if (!s_commands[i].local) {
+                status_len = encode_status(s_status_buf, sizeof(s_status_buf), &s_commands[i], s_commands[i].cmd.id, COMMAND_ERROR_NONE);
+            }
+            s_commands[i].active = false;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (tx_len > 0 && send_frame(mac_addr, s_tx_buf, tx_len) != ESP_OK) {
+        ESP_LOGW(TAG, "Sending command to "MACSTR" failed", MAC2STR(mac_addr));
+    }
+    publish_status(s_status_buf, status_len);
+    return tx_len > 0 || status_len > 0;
+}
+
+static void commands_task(void *arg) {
+    while (1) {
+        int64_t now_us = esp_timer_get_time();
+        int64_t next_us;
+
+        if (service(now_us, &next_us)) {
+            // Space sends out so fan-outs leave airtime for sensor traffic
+            vTaskDelay(SPACING_TICKS);
+        } else if (next_us == INT64_MAX) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            TickType_t wait = pdMS_TO_TICKS((next_us - now_us) / 1000);
+            ulTaskNotifyTake(pdTRUE, wait > 0 ? wait : 1);
+        }
+    }
+}
+
+esp_err_t commands_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(commands_task, "commands", 4096, NULL, 3, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create commands task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
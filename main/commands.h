@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "messages.pb.h"
+
+// Delivers sensor commands received over MQTT to one sensor, a group of sensors
+// or every paired sensor. Sends are spaced CONFIG_MIST_COMMAND_SPACING_MS apart
+// so a fan-out does not flood the channel. Each sensor acknowledges by echoing
+// the SensorCommand with the same id; unacknowledged sends are retried with
+// exponential backoff. Once every target has acknowledged or run out of
+// attempts, one CommandStatus (master.proto) is published on the commands/status
+// topic. A command id accepted recently is ignored, so broker redeliveries do
+// not reach the sensors twice. Rejected commands get a CommandStatus with the
+// error instead, published from the commands task, and may be sent again with
+// the same id.
+
+// sensor_mac_addr of a command addressed to every paired sensor of one SensorType
+#define COMMANDS_GROUP_MAC(sensor_type) { 0x01, 'M', 'I', 'S', 'T', (sensor_type) }
+
+esp_err_t commands_init(void);
+
+// Schedules cmd for delivery to the sensors its sensor_mac_addr addresses:
+// a paired sensor, COMMANDS_GROUP_MAC or the broadcast address for all sensors
+esp_err_t commands_submit(const SensorCommand *cmd);
+
+// Writes fields appended to the encoded SensorCommand sent to mac_addr, such as
+// the extension fields in master.proto, and returns their length. Called from
+// the commands task for every send, with the commands lock held.
+typedef size_t (*commands_extend_fn)(const uint8_t *mac_addr, uint8_t *buf, size_t size);
+
+// Reports that the sensor at mac_addr acknowledged command id, or ran out of
+// attempts. Called once per target with the commands lock held, from the task
+// recording the ack or from the commands task.
+typedef void (*commands_done_fn)(const uint8_t *mac_addr, int64_t id, bool acked);
+
+// Schedules a command originating on the master, addressed like commands_submit().
+// cmd->id is set to a fresh negative id, extend and done may be NULL. No
+// CommandStatus is published for it.
+esp_err_t commands_submit_local(SensorCommand *cmd, commands_extend_fn extend, commands_done_fn done);
+
+// Records the acknowledgement of command id by the sensor at mac_addr
+void commands_ack(const uint8_t *mac_addr, int64_t id);
@@ -0,0 +1,56 @@
+#include <string.h>
+#include <math.h>
+#include "fixfmt.h"
+
+static size_t fmt_u64(char *out, uint64_t value) {
+    char tmp[FIXFMT_I64_MAX_LEN];
+    size_t n = 0;
+
+    // Emit digits in reverse, then copy them out in order
+    do {
+        tmp[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (size_t i = 0; i < n; i++) {
+        out[i] = tmp[n - 1 - i];
+    }
+    return n;
+}
+
+size_t fixfmt_i64(char *out, int64_t value) {
+    if (value < 0) {
+        *out = '-';
+        // Negate in unsigned space so INT64_MIN does not overflow
+        return 1 + fmt_u64(out + 1, (uint64_t)0 - (uint64_t)value);
+    }
+    return fmt_u64(out, (uint64_t)value);
+}
+
+size_t fixfmt_2dp(char *out, float value) {
+    if (isnan(value)) {
+        memcpy(out, "null", 4);
+        return 4;
+    }
+
+    // Scale to hundredths and round half away from zero, the same as "%.2f".
+    // Clamp to what fits in 10 integer digits, far beyond any sensor range.
+    float scaled = value * 100.0f;
+    if (scaled > 9.99e11f) scaled = 9.99e11f;
+    if (scaled < -9.99e11f) scaled = -9.99e11f;
+    int64_t centi = (int64_t)(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+
+    size_t n = 0;
+    uint64_t magnitude = (uint64_t)centi;
+    if (centi < 0) {
+        out[n++] = '-';
+        magnitude = (uint64_t)0 - (uint64_t)centi;
+    }
+
+    n += fmt_u64(out + n, magnitude / 100);
+    uint32_t frac = (uint32_t)(magnitude % 100);
+    out[n++] = '.';
+    out[n++] = (char)('0' + frac / 10);
+    out[n++] = (char)('0' + frac % 10);
+    return n;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest output of fixfmt_i64(): sign + 19 digits
+#define FIXFMT_I64_MAX_LEN 20
+// Longest output of fixfmt_2dp(): sign + 10 integer digits + '.' + 2 decimals
+#define FIXFMT_2DP_MAX_LEN 14
+
+// Writes the decimal representation of value to out without a terminator.
+// Returns the number of characters written.
+size_t fixfmt_i64(char *out, int64_t value);
+
+// Writes value rounded to two decimal places like printf("%.2f"), without going
+// through libc float formatting. Values are rounded in single precision, so the last
+// digit may differ from printf on exact ties, and negative values that round to zero
+// are written as "0.00" where printf writes "-0.00". NaN is written as "null" so the
+// output stays valid JSON. Returns the number of characters written.
+size_t fixfmt_2dp(char *out, float value);
@@ -0,0 +1,378 @@
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_now.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "pb_decode.h"
+#include "pbw.h"
+#include "mqtt.h"
+#include "tsblock.h"
+#include "history_store.h"
+#include "history.h"
+
+#if CONFIG_MIST_HISTORY
+
+static const char *TAG = "history";
+
+// Sensor timestamps before this (2023-11-14) come from a clock that was never synced
+#define VALID_TIME_FLOOR 1700000000LL
+
+#define MAX_SERIES CONFIG_MIST_HISTORY_SENSORS
+#define MAX_POINTS CONFIG_MIST_HISTORY_MAX_POINTS
+
+// The budget is split evenly between series, samples take what their header leaves
+#define SERIES_BYTES (CONFIG_MIST_HISTORY_BUDGET_KB * 1024 / MAX_SERIES)
+#define SAMPLE_BYTES (sizeof(uint32_t) + HISTORY_COLUMNS * sizeof(int16_t))
+#define SLOTS_PER_SERIES ((SERIES_BYTES - sizeof(history_series_t)) / SAMPLE_BYTES)
+
+_Static_assert(SERIES_BYTES >= sizeof(history_series_t) + 4 * SAMPLE_BYTES,
+               "history budget too small for the number of sensors");
+_Static_assert(MAX_POINTS <= TSBLOCK_MAX_READINGS, "history response does not fit one time series block");
+
+// Half the samples raw, a quarter in each tier of means
+#define RAW_SLOTS (SLOTS_PER_SERIES / 2)
+#define TIER1_SLOTS (SLOTS_PER_SERIES / 4)
+#define TIER2_SLOTS (SLOTS_PER_SERIES - RAW_SLOTS - TIER1_SLOTS)
+
+// Sensors named in one query, and queries waiting for the task
+#define QUERY_MAX_SENSORS 16
+#define QUERY_QUEUE_LEN 4
+
+// HistoryQuery and HistoryResponse field numbers, see master.proto
+#define QUERY_ID_TAG 1
+#define QUERY_MAC_TAG 2
+#define QUERY_FROM_TAG 3
+#define QUERY_TO_TAG 4
+#define QUERY_START_TAG 5
+#define RESPONSE_ID_TAG 1
+#define RESPONSE_BLOCKS_TAG 2
+#define RESPONSE_TRUNCATED_TAG 3
+#define RESPONSE_NEXT_TAG 4
+
+// Space kept for the truncated and next fields, next being below 256
+#define TRAILER_SIZE 5
+
+typedef struct {
+    int64_t id;
+    uint32_t from_s;
+    uint32_t to_s;
+    uint32_t start;             // Position of the first sensor to answer for
+    uint8_t count;              // Sensors named, 0 for every sensor with history
+    bool truncated;             // More sensors were named than fit
+    uint8_t mac_addr[QUERY_MAX_SENSORS][ESP_NOW_ETH_ALEN];
+} history_query_t;
+
+// Fixed point scale of each column per sensor type, 0 for unused columns
+static const int32_t SCALE[][HISTORY_COLUMNS] = {
+    [SensorType_AIR_SENSOR] = { 100, 100, 1 },      // temperature, humidity, voc_index
+    [SensorType_SOIL_SENSOR] = { 100 },             // moisture
+    [SensorType_MIST_SENSOR] = { 100, 100 },        // temperature, humidity
+    [SensorType_LIGHT_SENSOR] = { 1 },              // intensity
+};
+
+#define SCALED_TYPES (sizeof(SCALE) / sizeof(SCALE[0]))
+
+static history_series_t s_series[MAX_SERIES];
+static uint32_t s_times[MAX_SERIES * SLOTS_PER_SERIES];
+static int16_t s_values[MAX_SERIES * SLOTS_PER_SERIES][HISTORY_COLUMNS];
+static history_store_t s_store;
+
+static SemaphoreHandle_t s_lock;
+static QueueHandle_t s_queries;
+
+// Used by the query task only
+static history_sample_t s_samples[MAX_POINTS];
+static SensorData s_readings[MAX_POINTS];
+static const SensorData *s_reading_ptrs[MAX_POINTS];
+static tsblock_buf_t s_tsblock;
+static uint8_t s_response[CONFIG_MIST_HISTORY_RESPONSE_BYTES];
+
+static int16_t to_fixed(float value, int32_t scale) {
+    float scaled = roundf(value * scale);
+    if (isnan(scaled)) return 0;
+    if (scaled > INT16_MAX) return INT16_MAX;
+    if (scaled < INT16_MIN) return INT16_MIN;
+    return (int16_t)scaled;
+}
+
+// Fills values and returns the sensor's own timestamp, -1 for unsupported types
+static int64_t reading_values(const SensorData *sensor_data, int16_t values[HISTORY_COLUMNS]) {
+    const int32_t *scale = SCALE[sensor_data->sensor_type];
+    memset(values, 0, HISTORY_COLUMNS * sizeof(values[0]));
+
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR: {
+            const AirSensor *air = &sensor_data->body.air_sensor;
+            values[0] = to_fixed(air->temperature, scale[0]);
+            values[1] = to_fixed(air->humidity, scale[1]);
+            values[2] = to_fixed(air->voc_index, scale[2]);
+            return air->timestamp;
+        }
+        case SensorType_SOIL_SENSOR:
+            values[0] = to_fixed(sensor_data->body.soil_sensor.moisture, scale[0]);
+            return sensor_data->body.soil_sensor.timestamp;
+        case SensorType_MIST_SENSOR: {
+            const MistSensor *mist = &sensor_data->body.mist_sensor;
+            values[0] = to_fixed(mist->temperature, scale[0]);
+            values[1] = to_fixed(mist->humidity, scale[1]);
+            return mist->timestamp;
+        }
+        case SensorType_LIGHT_SENSOR:
+            values[0] = to_fixed(sensor_data->body.light_sensor.intensity, scale[0]);
+            return sensor_data->body.light_sensor.timestamp;
+        default:
+            return -1;
+    }
+}
+
+static void to_reading(SensorType sensor_type, const history_sample_t *sample, SensorData *sensor_data) {
+    const int32_t *scale = SCALE[sensor_type];
+    memset(sensor_data, 0, sizeof(*sensor_data));
+    sensor_data->message_type = MessageType_SENSOR_DATA;
+    sensor_data->sensor_type = sensor_type;
+
+    switch (sensor_type) {
+        case SensorType_AIR_SENSOR: {
+            AirSensor *air = &sensor_data->body.air_sensor;
+            sensor_data->which_body = SensorData_air_sensor_tag;
+            air->timestamp = sample->time_s;
+            air->temperature = (float)sample->values[0] / scale[0];
+            air->humidity = (float)sample->values[1] / scale[1];
+            air->voc_index = sample->values[2] / scale[2];
+            break;
+        }
+        case SensorType_SOIL_SENSOR:
+            sensor_data->which_body = SensorData_soil_sensor_tag;
+            sensor_data->body.soil_sensor.timestamp = sample->time_s;
+            sensor_data->body.soil_sensor.moisture = (float)sample->values[0] / scale[0];
+            break;
+        case SensorType_MIST_SENSOR: {
+            MistSensor *mist = &sensor_data->body.mist_sensor;
+            sensor_data->which_body = SensorData_mist_sensor_tag;
+            mist->timestamp = sample->time_s;
+            mist->temperature = (float)sample->values[0] / scale[0];
+            mist->humidity = (float)sample->values[1] / scale[1];
+            break;
+        }
+        case SensorType_LIGHT_SENSOR:
+            sensor_data->which_body = SensorData_light_sensor_tag;
+            sensor_data->body.light_sensor.timestamp = sample->time_s;
+            sensor_data->body.light_sensor.intensity = sample->values[0] / scale[0];
+            break;
+        default:
+            break;
+    }
+}
+
+// Wall clock second the reading was received at, false while the clock is not set
+static bool received_at(const pipeline_reading_t *reading, uint32_t *time_s) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (now.tv_sec < VALID_TIME_FLOOR) {
+        return false;
+    }
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    *time_s = (now_us - (esp_timer_get_time() - reading->rx_time_us)) / 1000000;
+    return true;
+}
+
+void history_add(const pipeline_reading_t *reading) {
+    int16_t values[HISTORY_COLUMNS];
+    uint32_t time_s;
+
+    if (s_lock == NULL || (size_t)reading->data.sensor_type >= SCALED_TYPES) {
+        return;
+    }
+    int64_t timestamp = reading_values(&reading->data, values);
+    if (timestamp >= VALID_TIME_FLOOR && timestamp <= UINT32_MAX) {
+        time_s = timestamp;
+    } else if (timestamp < 0 || !received_at(reading, &time_s)) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    history_store_add(&s_store, reading->mac_addr, reading->data.sensor_type, time_s, values);
+    xSemaphoreGive(s_lock);
+}
+
+static bool decode_query(const uint8_t *data, size_t len, history_query_t *query) {
+    pb_istream_t stream = pb_istream_from_buffer(data, len);
+    pb_wire_type_t type;
+    uint32_t field;
+    bool eof;
+
+    memset(query, 0, sizeof(*query));
+    while (pb_decode_tag(&stream, &type, &field, &eof)) {
+        if (field == QUERY_ID_TAG && type == PB_WT_VARINT) {
+            if (!pb_decode_svarint(&stream, &query->id)) return false;
+        } else if (field == QUERY_MAC_TAG && type == PB_WT_STRING) {
+            uint32_t size;
+            if (!pb_decode_varint32(&stream, &size)) return false;
+            if (size != ESP_NOW_ETH_ALEN || query->count == QUERY_MAX_SENSORS) {
+                query->truncated |= size == ESP_NOW_ETH_ALEN;
+                if (!pb_read(&stream, NULL, size)) return false;
+            } else if (!pb_read(&stream, query->mac_addr[query->count++], size)) {
+                return false;
+            }
+        } else if (field == QUERY_FROM_TAG && type == PB_WT_VARINT) {
+            if (!pb_decode_varint32(&stream, &query->from_s)) return false;
+        } else if (field == QUERY_TO_TAG && type == PB_WT_VARINT) {
+            if (!pb_decode_varint32(&stream, &query->to_s)) return false;
+        } else if (field == QUERY_START_TAG && type == PB_WT_VARINT) {
+            if (!pb_decode_varint32(&stream, &query->start)) return false;
+        } else if (!pb_skip_field(&stream, type)) {
+            return false;
+        }
+    }
+    if (query->to_s == 0) {
+        query->to_s = UINT32_MAX;
+    }
+    return eof;
+}
+
+esp_err_t history_handle_query(const char *topic, size_t topic_len, const uint8_t *data, size_t len) {
+    history_query_t query;
+    if (s_queries == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!decode_query(data, len, &query)) {
+        ESP_LOGW(TAG, "Invalid history query");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (xQueueSend(s_queries, &query, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Too many history queries, dropping %" PRId64, query.id);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+// Appends the samples of series index as a TimeSeriesBlock. Sets *truncated if
+// samples were left out. Returns false if the block did not fit.
+static bool encode_series(pb_ostream_t *stream, const history_query_t *query, int index, bool *truncated) {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    SensorType sensor_type;
+    bool more;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (!s_series[index].used) {
+        xSemaphoreGive(s_lock);
+        return true;
+    }
+    size_t count = history_store_query(&s_store, index, query->from_s, query->to_s, s_samples, MAX_POINTS, &more);
+    memcpy(mac_addr, s_series[index].mac_addr, ESP_NOW_ETH_ALEN);
+    sensor_type = s_series[index].sensor_type;
+    xSemaphoreGive(s_lock);
+
+    *truncated |= more;
+    if (count == 0) {
+        return true;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        to_reading(sensor_type, &s_samples[i], &s_readings[i]);
+        s_reading_ptrs[i] = &s_readings[i];
+    }
+
+    // A buffer stream is only its position, so a block that does not fit is
+    // undone by going back to the copy
+    pb_ostream_t before = *stream;
+    if (!tsblock_encode(&s_tsblock, stream, RESPONSE_BLOCKS_TAG, mac_addr, s_reading_ptrs, count)) {
+        *stream = before;
+        return false;
+    }
+    return true;
+}
+
+// Answers for the sensors from query->start on, in history entry order or in
+// the order they were named. The first sensor that does not fit ends the
+// response, whose next field then tells where to continue. A sensor that does
+// not fit an empty response either is left out and marked as truncated.
+static size_t encode_response(const history_query_t *query) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_response, sizeof(s_response) - TRAILER_SIZE);
+    bool truncated = query->truncated;
+    uint32_t next = 0;
+
+    if (!pbw_sint(&stream, RESPONSE_ID_TAG, query->id)) {
+        return 0;
+    }
+    size_t empty = stream.bytes_written;
+
+    uint32_t positions = query->count > 0 ? query->count : MAX_SERIES;
+    for (uint32_t i = query->start; i < positions; i++) {
+        int index = i;
+        if (query->count > 0) {
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            index = history_store_find(&s_store, query->mac_addr[i]);
+            xSemaphoreGive(s_lock);
+            if (index < 0) continue;
+        }
+        if (encode_series(&stream, query, index, &truncated)) continue;
+
+        if (stream.bytes_written > empty) {
+            next = i;
+            break;
+        }
+        truncated = true;
+    }
+
+    stream.max_size = sizeof(s_response);
+    if (truncated && !pbw_uint(&stream, RESPONSE_TRUNCATED_TAG, 1)) {
+        return 0;
+    }
+    if (next > 0 && !pbw_uint(&stream, RESPONSE_NEXT_TAG, next)) {
+        return 0;
+    }
+    return stream.bytes_written;
+}
+
+static void history_task(void *arg) {
+    history_query_t query;
+
+    while (1) {
+        xQueueReceive(s_queries, &query, portMAX_DELAY);
+
+        int64_t start_us = esp_timer_get_time();
+        size_t len = encode_response(&query);
+        if (len == 0) {
+            ESP_LOGE(TAG, "Encoding history response %" PRId64 " failed", query.id);
+            continue;
+        }
+        ESP_LOGD(TAG, "History response %" PRId64 ": %u bytes in %" PRId64 " us",
+                 query.id, (unsigned)len, esp_timer_get_time() - start_us);
+
+        if (mqtt_publish_qos(mqtt_topic(MQTT_TOPIC_HISTORY), (const char *)s_response, len, 1) != ESP_OK) {
+            ESP_LOGW(TAG, "Publishing history response %" PRId64 " failed", query.id);
+        }
+    }
+}
+
+esp_err_t history_init(void) {
+    const uint16_t slots[HISTORY_TIERS] = { RAW_SLOTS, TIER1_SLOTS, TIER2_SLOTS };
+    const uint32_t bucket_s[HISTORY_TIERS] = { 0, CONFIG_MIST_HISTORY_TIER1_S, CONFIG_MIST_HISTORY_TIER2_S };
+    history_store_init(&s_store, s_series, MAX_SERIES, s_times, s_values, slots, bucket_s);
+
+    s_queries = xQueueCreate(QUERY_QUEUE_LEN, sizeof(history_query_t));
+    if (s_queries == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(history_task, "history", 4096, NULL, 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create history task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "%d sensors, %d raw readings and %d + %d means each",
+             MAX_SERIES, (int)RAW_SLOTS, (int)TIER1_SLOTS, (int)TIER2_SLOTS);
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "pipeline.h"
+
+// Recent readings of every sensor, with CONFIG_MIST_HISTORY, so dashboards get
+// history from the master instead of waiting for new readings. Readings are kept
+// in history_store rings within CONFIG_MIST_HISTORY_BUDGET_KB, raw and as means
+// over CONFIG_MIST_HISTORY_TIER1_S and CONFIG_MIST_HISTORY_TIER2_S buckets.
+// A HistoryQuery (master.proto) on the history/query topic is answered with one
+// HistoryResponse on the history topic, holding a TimeSeriesBlock per sensor.
+// Sensors that do not fit are returned by a follow-up query starting at the
+// response's next field.
+
+// Starts the query task
+esp_err_t history_init(void);
+
+// Adds a reading, timestamped with the master clock if the sensor's is not set.
+// Readings received while neither clock is valid are not kept.
+void history_add(const pipeline_reading_t *reading);
+
+// mqtt_recv_msg_handler_t for the history/query topic. Queues the query, the
+// response is encoded and published from the query task.
+esp_err_t history_handle_query(const char *topic, size_t topic_len, const uint8_t *data, size_t len);
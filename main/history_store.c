@@ -0,0 +1,175 @@
+#include <string.h>
+#include "history_store.h"
+
+void history_store_init(history_store_t *store, history_series_t *series, int max_series,
+                        uint32_t *times, int16_t (*values)[HISTORY_COLUMNS],
+                        const uint16_t slots[HISTORY_TIERS], const uint32_t bucket_s[HISTORY_TIERS]) {
+    memset(store, 0, sizeof(*store));
+    store->series = series;
+    store->max_series = max_series;
+    store->times = times;
+    store->values = values;
+
+    uint32_t offset = 0;
+    for (int t = 0; t < HISTORY_TIERS; t++) {
+        store->slots[t] = slots[t];
+        store->offset[t] = offset;
+        store->bucket_s[t] = bucket_s[t];
+        offset += slots[t];
+    }
+    store->slots_per_series = offset;
+    memset(series, 0, max_series * sizeof(*series));
+}
+
+static inline size_t slot_at(const history_store_t *store, int index, int tier, uint32_t slot) {
+    return (size_t)index * store->slots_per_series + store->offset[tier] + slot;
+}
+
+static void push(history_store_t *store, int index, int tier, uint32_t time_s, const int16_t values[HISTORY_COLUMNS]) {
+    history_series_t *series = &store->series[index];
+    if (store->slots[tier] == 0) {
+        return;
+    }
+
+    size_t slot = slot_at(store, index, tier, series->head[tier]);
+    store->times[slot] = time_s;
+    memcpy(store->values[slot], values, sizeof(store->values[slot]));
+    series->head[tier] = (series->head[tier] + 1) % store->slots[tier];
+    if (series->count[tier] < store->slots[tier]) {
+        series->count[tier]++;
+    }
+}
+
+static void bucket_mean(const history_bucket_t *bucket, int16_t values[HISTORY_COLUMNS]) {
+    int32_t half = bucket->count / 2;
+    for (int c = 0; c < HISTORY_COLUMNS; c++) {
+        int32_t sum = bucket->sums[c];
+        values[c] = (sum >= 0 ? sum + half : sum - half) / (int32_t)bucket->count;
+    }
+}
+
+int history_store_find(const history_store_t *store, const uint8_t *mac_addr) {
+    for (int i = 0; i < store->max_series; i++) {
+        if (store->series[i].used && memcmp(store->series[i].mac_addr, mac_addr, sizeof(store->series[i].mac_addr)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A free series, or the one updated least recently
+static int take_series(history_store_t *store) {
+    int victim = 0;
+    for (int i = 0; i < store->max_series; i++) {
+        if (!store->series[i].used) {
+            return i;
+        }
+        if (store->series[i].updated_s < store->series[victim].updated_s) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+void history_store_add(history_store_t *store, const uint8_t *mac_addr, uint8_t sensor_type,
+                       uint32_t time_s, const int16_t values[HISTORY_COLUMNS]) {
+    int index = history_store_find(store, mac_addr);
+    if (index < 0) {
+        index = take_series(store);
+    }
+
+    // Columns mean something else for another sensor type
+    history_series_t *series = &store->series[index];
+    if (!series->used || series->sensor_type != sensor_type) {
+        memset(series, 0, sizeof(*series));
+        series->used = true;
+        memcpy(series->mac_addr, mac_addr, sizeof(series->mac_addr));
+        series->sensor_type = sensor_type;
+    }
+    series->updated_s = time_s;
+
+    push(store, index, 0, time_s, values);
+
+    for (int t = 1; t < HISTORY_TIERS; t++) {
+        history_bucket_t *bucket = &series->pending[t];
+        uint32_t start_s = time_s - time_s % store->bucket_s[t];
+        if (bucket->count > 0 && bucket->start_s != start_s) {
+            int16_t mean[HISTORY_COLUMNS];
+            bucket_mean(bucket, mean);
+            push(store, index, t, bucket->start_s, mean);
+            bucket->count = 0;
+        }
+        if (bucket->count == 0) {
+            memset(bucket, 0, sizeof(*bucket));
+            bucket->start_s = start_s;
+        }
+        bucket->count++;
+        for (int c = 0; c < HISTORY_COLUMNS; c++) {
+            bucket->sums[c] += values[c];
+        }
+    }
+}
+
+// Oldest time tier holds, UINT32_MAX if it holds nothing
+static uint32_t oldest(const history_store_t *store, int index, int tier) {
+    const history_series_t *series = &store->series[index];
+    if (series->count[tier] > 0) {
+        uint32_t slot = (series->head[tier] + store->slots[tier] - series->count[tier]) % store->slots[tier];
+        return store->times[slot_at(store, index, tier, slot)];
+    }
+    if (tier > 0 && series->pending[tier].count > 0) {
+        return series->pending[tier].start_s;
+    }
+    return UINT32_MAX;
+}
+
+size_t history_store_query(const history_store_t *store, int index, uint32_t from_s, uint32_t to_s,
+                           history_sample_t *out, size_t max, bool *truncated) {
+    const history_series_t *series = &store->series[index];
+    size_t n = 0;
+    *truncated = false;
+
+    // Each tier answers for the times before everything its finer tiers hold
+    uint32_t cutoff[HISTORY_TIERS];
+    uint32_t covered = UINT32_MAX;
+    for (int t = 0; t < HISTORY_TIERS; t++) {
+        cutoff[t] = covered;
+        uint32_t tier_oldest = oldest(store, index, t);
+        if (tier_oldest < covered) {
+            covered = tier_oldest;
+        }
+    }
+
+    for (int t = HISTORY_TIERS - 1; t >= 0; t--) {
+        uint32_t end_s = to_s < cutoff[t] ? to_s : cutoff[t];
+        uint32_t count = series->count[t];
+
+        for (uint32_t k = 0; k < count; k++) {
+            uint32_t slot = (series->head[t] + store->slots[t] - count + k) % store->slots[t];
+            size_t at = slot_at(store, index, t, slot);
+            uint32_t time_s = store->times[at];
+            if (time_s < from_s || time_s >= end_s) continue;
+
+            if (n == max) {
+                *truncated = true;
+                return n;
+            }
+            out[n].time_s = time_s;
+            memcpy(out[n].values, store->values[at], sizeof(out[n].values));
+            n++;
+        }
+
+        // The bucket still being filled is the newest sample of its tier
+        const history_bucket_t *bucket = &series->pending[t];
+        if (t > 0 && bucket->count > 0 && bucket->start_s >= from_s && bucket->start_s < end_s) {
+            if (n == max) {
+                *truncated = true;
+                return n;
+            }
+            out[n].time_s = bucket->start_s;
+            bucket_mean(bucket, out[n].values);
+            n++;
+        }
+    }
+    return n;
+}
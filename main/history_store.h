@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recent readings per sensor in fixed rings. Pure computation, no platform
+// dependencies; the caller provides all memory and serializes access.
+//
+// Every series, one per sensor, keeps HISTORY_TIERS rings. Tier 0 holds raw
+// readings, each further tier the means of the readings in buckets of
+// bucket_s[tier] seconds, so older data survives at a coarser resolution once
+// the finer rings wrap. Values are fixed point int16 columns whose meaning
+// depends on the sensor type. When every series is taken, a new sensor takes
+// over the one updated least recently.
+
+#define HISTORY_TIERS 3
+#define HISTORY_COLUMNS 3
+
+typedef struct {
+    uint32_t time_s;                    // Seconds since the epoch, bucket start for tiers above 0
+    int16_t values[HISTORY_COLUMNS];
+} history_sample_t;
+
+typedef struct {
+    uint32_t start_s;
+    uint32_t count;
+    int32_t sums[HISTORY_COLUMNS];
+} history_bucket_t;
+
+typedef struct {
+    uint8_t mac_addr[6];
+    uint8_t sensor_type;
+    bool used;
+    uint32_t updated_s;
+    uint16_t head[HISTORY_TIERS];       // Next slot to write
+    uint16_t count[HISTORY_TIERS];
+    history_bucket_t pending[HISTORY_TIERS];    // Bucket being filled, unused for tier 0
+} history_series_t;
+
+typedef struct {
+    history_series_t *series;
+    int max_series;
+    // Samples of series i and tier t start at (i * slots_per_series + offset[t])
+    uint32_t *times;
+    int16_t (*values)[HISTORY_COLUMNS];
+    uint16_t slots[HISTORY_TIERS];
+    uint32_t offset[HISTORY_TIERS];
+    uint32_t slots_per_series;
+    uint32_t bucket_s[HISTORY_TIERS];
+} history_store_t;
+
+// times and values hold max_series times the sum of slots entries
+void history_store_init(history_store_t *store, history_series_t *series, int max_series,
+                        uint32_t *times, int16_t (*values)[HISTORY_COLUMNS],
+                        const uint16_t slots[HISTORY_TIERS], const uint32_t bucket_s[HISTORY_TIERS]);
+
+void history_store_add(history_store_t *store, const uint8_t *mac_addr, uint8_t sensor_type,
+                       uint32_t time_s, const int16_t values[HISTORY_COLUMNS]);
+
+// Index of the series of mac_addr, -1 if there is none
+int history_store_find(const history_store_t *store, const uint8_t *mac_addr);
+
+// Copies up to max samples of series index with from_s <= time_s < to_s into
+// out, oldest first, taking each period from the finest tier that still covers
+// it. Sets *truncated if more samples matched.
+size_t history_store_query(const history_store_t *store, int index, uint32_t from_s, uint32_t to_s,
+                           history_sample_t *out, size_t max, bool *truncated);
@@ -0,0 +1,317 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_now.h>
+#include <esp_wifi.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "sdkconfig.h"
+#include "spsc_ring.h"
+#include "peers.h"
+#include "rate_adapt.h"
+#include "linkq.h"
+
+#if CONFIG_MIST_LINKQ
+
+static const char *TAG = "linkq";
+
+#define CAPACITY CONFIG_MIST_PEER_CAPACITY
+#define STALE_US (CONFIG_MIST_LINKQ_STALE_S * 1000000LL)
+
+#if CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI
+// Frames captured between two drains, a power of two. Beyond that frames are
+// simply not sampled.
+#define RX_SAMPLES 64
+#define WAKE_MS 100
+
+// EWMA weight of a new RSSI sample, as a right shift
+#define RSSI_SHIFT 3
+
+// ESP-NOW frames are vendor specific action frames carrying Espressif's OUI
+#define FRAME_CTRL_ACTION 0xD0
+#define ADDR2_OFFSET 10
+#define HEADER_LEN 24
+#define CATEGORY_VENDOR 127
+static const uint8_t ESPRESSIF_OUI[] = { 0x18, 0xfe, 0x34 };
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int8_t rssi;
+    uint8_t rate;
+} rx_sample_t;
+#else
+// Nothing to drain, the task only wakes for the interval
+#define WAKE_MS CONFIG_MIST_LINKQ_INTERVAL_MS
+#endif
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint32_t rx_frames;         // peer_link_t and peer_t counters at the last interval
+    uint32_t rx_count;
+    uint32_t tx_attempts;
+    uint32_t tx_delivered;
+    int64_t heard_us;
+    bool rate_applied;
+} linkq_peer_t;
+
+#if CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI
+static rx_sample_t s_sample_slots[RX_SAMPLES];
+static spsc_ring_t s_samples;
+#endif
+
+// Indexed by peers_index()
+static linkq_peer_t s_peers[CAPACITY];
+
+#if CONFIG_MIST_LINKQ_RATE_ADAPT
+typedef struct {
+    wifi_phy_mode_t mode;
+    wifi_phy_rate_t rate;
+    const char *name;
+} phy_rate_t;
+
+// Most robust first. Sensitivities are typical for ESP32 series chips; the
+// overhead covers the preamble, the ack and SIFS. Long range rates need the LR
+// protocol, which only CONFIG_ESPNOW_ENABLE_LONG_RANGE enables.
+static const rate_adapt_rate_t RATES[] = {
+#if CONFIG_ESPNOW_ENABLE_LONG_RANGE
+    { .kbps = 250, .overhead_us = 1200, .min_rssi = -102 },
+    { .kbps = 500, .overhead_us = 1000, .min_rssi = -99 },
+#endif
+    { .kbps = 1000, .overhead_us = 500, .min_rssi = -98 },
+    { .kbps = 6000, .overhead_us = 60, .min_rssi = -93 },
+    { .kbps = 12000, .overhead_us = 60, .min_rssi = -90 },
+    { .kbps = 24000, .overhead_us = 60, .min_rssi = -85 },
+    { .kbps = 52000, .overhead_us = 90, .min_rssi = -77 },
+    { .kbps = 65000, .overhead_us = 90, .min_rssi = -72 },
+};
+
+static const phy_rate_t PHY_RATES[] = {
+#if CONFIG_ESPNOW_ENABLE_LONG_RANGE
+    { WIFI_PHY_MODE_LR, WIFI_PHY_RATE_LORA_250K, "LR 250K" },
+    { WIFI_PHY_MODE_LR, WIFI_PHY_RATE_LORA_500K, "LR 500K" },
+#endif
+    { WIFI_PHY_MODE_11B, WIFI_PHY_RATE_1M_L, "1M" },
+    { WIFI_PHY_MODE_11G, WIFI_PHY_RATE_6M, "6M" },
+    { WIFI_PHY_MODE_11G, WIFI_PHY_RATE_12M, "12M" },
+    { WIFI_PHY_MODE_11G, WIFI_PHY_RATE_24M, "24M" },
+    { WIFI_PHY_MODE_HT20, WIFI_PHY_RATE_MCS5_LGI, "MCS5" },
+    { WIFI_PHY_MODE_HT20, WIFI_PHY_RATE_MCS7_LGI, "MCS7" },
+};
+
+#define RATE_COUNT (sizeof(RATES) / sizeof(RATES[0]))
+_Static_assert(RATE_COUNT == sizeof(PHY_RATES) / sizeof(PHY_RATES[0]), "rate tables differ");
+_Static_assert(RATE_COUNT <= RATE_ADAPT_MAX_RATES, "too many rates");
+
+static const rate_adapt_config_t CONFIG = {
+    .rates = RATES,
+    .count = RATE_COUNT,
+    .frame_bytes = ESP_NOW_MAX_DATA_LEN,
+    .margin_db = 6,
+    .min_attempts = 2,
+    .hysteresis_pct = 10,
+    .stale_ticks = (CONFIG_MIST_LINKQ_STALE_S * 1000 + CONFIG_MIST_LINKQ_INTERVAL_MS - 1) / CONFIG_MIST_LINKQ_INTERVAL_MS,
+};
+
+// Indexed by peers_index()
+static rate_adapt_peer_t s_adapt[CAPACITY];
+#endif
+
+#if CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI
+// Runs in the Wi-Fi task for every management frame, keep it short
+static void promiscuous_cb(void *buf, wifi_promiscuous_pkt_type_t type) {
+    const wifi_promiscuous_pkt_t *pkt = buf;
+    const uint8_t *frame = pkt->payload;
+
+    if (type != WIFI_PKT_MGMT || pkt->rx_ctrl.sig_len < HEADER_LEN + 1 + sizeof(ESPRESSIF_OUI) ||
+        frame[0] != FRAME_CTRL_ACTION || frame[HEADER_LEN] != CATEGORY_VENDOR ||
+        memcmp(frame + HEADER_LEN + 1, ESPRESSIF_OUI, sizeof(ESPRESSIF_OUI)) != 0) {
+        return;
+    }
+
+    rx_sample_t *sample = spsc_ring_write_slot(&s_samples);
+    if (sample == NULL) {
+        return;
+    }
+    memcpy(sample->mac_addr, frame + ADDR2_OFFSET, ESP_NOW_ETH_ALEN);
+    sample->rssi = pkt->rx_ctrl.rssi;
+    sample->rate = pkt->rx_ctrl.rate;
+    spsc_ring_commit(&s_samples);
+}
+
+static void add_sample(peer_t *peer, void *arg) {
+    const rx_sample_t *sample = arg;
+    peer_link_t *link = &peer->link;
+    int16_t rssi_x16 = sample->rssi * 16;
+    link->rssi_x16 = link->rx_frames == 0 ? rssi_x16 : link->rssi_x16 + ((rssi_x16 - link->rssi_x16) >> RSSI_SHIFT);
+    link->rx_rate = sample->rate;
+    link->rx_frames++;
+}
+
+static void drain_samples(void) {
+    rx_sample_t *sample;
+    while ((sample = spsc_ring_read_slot(&s_samples)) != NULL) {
+        peers_update(sample->mac_addr, add_sample, sample);
+        spsc_ring_release(&s_samples);
+    }
+}
+
+static void start_capture(void) {
+    spsc_ring_init(&s_samples, s_sample_slots, sizeof(rx_sample_t), RX_SAMPLES);
+
+    // Only management frames, ESP-NOW travels in action frames
+    const wifi_promiscuous_filter_t filter = { .filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT };
+    esp_err_t err = esp_wifi_set_promiscuous_filter(&filter);
+    if (err == ESP_OK) {
+        err = esp_wifi_set_promiscuous_rx_cb(promiscuous_cb);
+    }
+    if (err == ESP_OK) {
+        err = esp_wifi_set_promiscuous(true);
+    }
+    if (err != ESP_OK) {
+        // Delivery, staleness and rates still work without RSSI
+        ESP_LOGW(TAG, "Capturing frames failed, no RSSI: %s", esp_err_to_name(err));
+    }
+}
+#endif
+
+typedef struct {
+    uint32_t attempts;
+    bool delivered;
+} tx_outcome_t;
+
+static void add_outcome(peer_t *peer, void *arg) {
+    const tx_outcome_t *outcome = arg;
+    peer->link.tx_attempts += outcome->attempts;
+    peer->link.tx_delivered += outcome->delivered;
+}
+
+void linkq_tx_outcome(const uint8_t *mac_addr, uint32_t attempts, bool delivered) {
+    tx_outcome_t outcome = { .attempts = attempts, .delivered = delivered };
+    peers_update(mac_addr, add_outcome, &outcome);
+}
+
+static void set_stale(peer_t *peer, void *arg) {
+    peer->link.stale = *(const bool *)arg;
+}
+
+// Registry entries are reused after a peer is removed
+static linkq_peer_t *peer_state(int index, const peer_t *peer, int64_t now_us) {
+    linkq_peer_t *state = &s_peers[index];
+    if (memcmp(state->mac_addr, peer->mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        memset(state, 0, sizeof(*state));
+        memcpy(state->mac_addr, peer->mac_addr, ESP_NOW_ETH_ALEN);
+        state->rx_frames = peer->link.rx_frames;
+        state->rx_count = peer->rx_count;
+        state->tx_attempts = peer->link.tx_attempts;
+        state->tx_delivered = peer->link.tx_delivered;
+        // Sensors restored at boot get the full time to show up
+        state->heard_us = now_us;
+#if CONFIG_MIST_LINKQ_RATE_ADAPT
+        rate_adapt_init_peer(&s_adapt[index]);
+#endif
+    }
+    return state;
+}
+
+#if CONFIG_MIST_LINKQ_RATE_ADAPT
+static void set_tx_rate(peer_t *peer, void *arg) {
+    peer->link.tx_rate = *(const uint8_t *)arg;
+}
+
+static void apply_rate(const peer_t *peer, linkq_peer_t *state, int rate) {
+    const phy_rate_t *phy = &PHY_RATES[rate];
+    esp_now_rate_config_t config = { .phymode = phy->mode, .rate = phy->rate };
+
+    // Kept by peers and applied again whenever the peer gets an ESP-NOW entry
+    esp_err_t err = peers_set_rate(peer->mac_addr, &config);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "Setting rate of "MACSTR" failed: %s", MAC2STR(peer->mac_addr), esp_err_to_name(err));
+        state->rate_applied = false;
+        return;
+    }
+    if (state->rate_applied) {
+        ESP_LOGI(TAG, "Sending to "MACSTR" at %s, RSSI %d dBm", MAC2STR(peer->mac_addr), phy->name, peer->link.rssi_x16 / 16);
+    }
+    state->rate_applied = true;
+    uint8_t tx_rate = phy->rate;
+    peers_update(peer->mac_addr, set_tx_rate, &tx_rate);
+}
+#endif
+
+// peer is a copy, changes go through peers_update()
+static void update_peer(int index, const peer_t *peer, int64_t now_us) {
+    linkq_peer_t *state = peer_state(index, peer, now_us);
+    const peer_link_t *link = &peer->link;
+
+    bool heard = link->rx_frames != state->rx_frames || peer->rx_count != state->rx_count;
+    if (heard) {
+        state->heard_us = now_us;
+    }
+
+    bool stale = now_us - state->heard_us >= STALE_US;
+    if (stale != link->stale) {
+        if (stale) {
+            ESP_LOGW(TAG, "No frames from "MACSTR" for %d s", MAC2STR(peer->mac_addr), CONFIG_MIST_LINKQ_STALE_S);
+        } else {
+            ESP_LOGI(TAG, MACSTR" is back", MAC2STR(peer->mac_addr));
+        }
+        peers_update(peer->mac_addr, set_stale, &stale);
+    }
+
+#if CONFIG_MIST_LINKQ_RATE_ADAPT
+    rate_adapt_signals_t signals = {
+        .heard = heard,
+        .has_rssi = link->rx_frames > 0,
+        .rssi_dbm = link->rssi_x16 / 16,
+        .attempts = link->tx_attempts - state->tx_attempts,
+        .delivered = link->tx_delivered - state->tx_delivered,
+    };
+    rate_adapt_peer_t *adapt = &s_adapt[index];
+    if (rate_adapt_step(&CONFIG, adapt, &signals) || !state->rate_applied) {
+        apply_rate(peer, state, adapt->rate);
+    }
+#endif
+
+    state->rx_frames = link->rx_frames;
+    state->rx_count = peer->rx_count;
+    state->tx_attempts = link->tx_attempts;
+    state->tx_delivered = link->tx_delivered;
+}
+
+static void linkq_task(void *arg) {
+    int64_t next_us = esp_timer_get_time();
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(WAKE_MS));
+#if CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI
+        drain_samples();
+#endif
+
+        // Delays are rounded to ticks, a wake up to half a wake early is on time
+        int64_t now_us = esp_timer_get_time();
+        if (now_us + WAKE_MS * 500LL < next_us) continue;
+        next_us = now_us + CONFIG_MIST_LINKQ_INTERVAL_MS * 1000LL;
+
+        for (int i = 0; i < CAPACITY; i++) {
+            peer_t peer;
+            if (peers_get(i, &peer)) {
+                update_peer(i, &peer, now_us);
+            }
+        }
+    }
+}
+
+esp_err_t linkq_init(void) {
+#if CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI
+    start_capture();
+#endif
+
+    if (xTaskCreate(linkq_task, "linkq", 3072, NULL, 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create linkq task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#endif
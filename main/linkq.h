@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+// Link quality per paired sensor, with CONFIG_MIST_LINKQ, kept in the link field
+// of its peer_t. Send outcomes come from rlink acks. A sensor not heard from for
+// CONFIG_MIST_LINKQ_STALE_S is stale, which the MetricsSnapshot shows.
+//
+// comm owns the ESP-NOW receive callback and does not pass on the RSSI, so only
+// with CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI the RSSI and PHY rate of every ESP-NOW
+// frame received are taken from the Wi-Fi promiscuous callback and smoothed into
+// an EWMA. Promiscuous mode runs the callback for every management frame on the
+// channel, which costs CPU time and power. With CONFIG_MIST_LINKQ_RATE_ADAPT,
+// which needs the RSSI, every CONFIG_MIST_LINKQ_INTERVAL_MS rate_adapt picks the
+// PHY rate frames to each sensor are sent at.
+
+// Starts the link task, and capturing frames with
+// CONFIG_MIST_LINKQ_PROMISCUOUS_RSSI. Wi-Fi must be started and peers restored.
+esp_err_t linkq_init(void);
+
+// Records a frame to mac_addr that was sent attempts times, and whether it was
+// acknowledged in the end
+void linkq_tx_outcome(const uint8_t *mac_addr, uint32_t attempts, bool delivered);
@@ -0,0 +1,278 @@
+#include <string.h>
+#include <time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_wifi.h>
+#include <esp_now.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "sdkconfig.h"
+#include "pb_encode.h"
+#include "messages.pb.h"
+#include "comm.h"
+#include "mqtt.h"
+#include "boot.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "loadgen.h"
+
+#if CONFIG_MIST_LOADGEN
+
+static const char *TAG = "loadgen";
+
+#define LOADGEN_TICK_MS 10
+#define LOADGEN_PROGRESS_US (10 * 1000000LL)
+
+// Time for the pipeline and the last batch to drain before the final numbers
+#if CONFIG_MIST_SENSOR_BATCHING
+#define LOADGEN_DRAIN_MS (CONFIG_MIST_BATCH_WINDOW_MS + 1000)
+#else
+#define LOADGEN_DRAIN_MS 1000
+#endif
+
+// The mix repeats every MIX_PERIOD messages: readings up to MIX_SYNC_TIME,
+// SyncTime requests up to MIX_COMMAND and one SensorCommand at the end
+#define MIX_PERIOD 20
+#define MIX_SYNC_TIME 16
+#define MIX_COMMAND 19
+
+// Field number of sensor_tx_us in SyncTimeExtension, see master.proto
+#define SYNC_TIME_SENSOR_TX_US_TAG 100
+
+// Topic the master subscribes to for sensor commands
+#define COMMAND_TOPIC "/sensor_command"
+
+typedef struct {
+    int64_t time_us;
+    uint32_t free_heap;
+    pipeline_stats_t pipeline;
+    mqtt_stats_t mqtt;
+    uint32_t stages[METRICS_STAGE_MAX][METRICS_BUCKETS];
+} loadgen_sample_t;
+
+static const char *const STAGE_NAME[METRICS_STAGE_MAX] = {
+    [METRICS_STAGE_RX_QUEUE] = "rx queue",
+    [METRICS_STAGE_DECODE] = "decode",
+    [METRICS_STAGE_READING_QUEUE] = "reading queue",
+    [METRICS_STAGE_HANDLE] = "handle",
+    [METRICS_STAGE_PUBLISH] = "publish",
+    [METRICS_STAGE_ACK] = "ack",
+    [METRICS_STAGE_TLS_CONNECT] = "tls connect",
+    [METRICS_STAGE_MQTT_CONNECT] = "mqtt connect",
+};
+
+static uint8_t s_master_mac[ESP_NOW_ETH_ALEN];
+static uint8_t s_frame[ESP_NOW_MAX_DATA_LEN];
+
+static uint32_t s_offered;
+static uint32_t s_rejected;
+
+// Locally administered addresses that cannot belong to a real sensor
+static void fake_mac(uint32_t peer, uint8_t *mac_addr) {
+    mac_addr[0] = 0x02;
+    mac_addr[1] = 'L';
+    mac_addr[2] = 'G';
+    mac_addr[3] = peer >> 16;
+    mac_addr[4] = peer >> 8;
+    mac_addr[5] = peer;
+}
+
+static size_t encode_reading(uint32_t seq) {
+    SensorData sensor_data = SensorData_init_default;
+    sensor_data.message_type = MessageType_SENSOR_DATA;
+
+    if (seq & 1) {
+        sensor_data.sensor_type = SensorType_SOIL_SENSOR;
+        sensor_data.which_body = SensorData_soil_sensor_tag;
+        sensor_data.body.soil_sensor.timestamp = time(NULL);
+        sensor_data.body.soil_sensor.moisture = 30.0f + (seq % 400) / 10.0f;
+    } else {
+        sensor_data.sensor_type = SensorType_AIR_SENSOR;
+        sensor_data.which_body = SensorData_air_sensor_tag;
+        sensor_data.body.air_sensor.timestamp = time(NULL);
+        sensor_data.body.air_sensor.temperature = 18.0f + (seq % 100) / 10.0f;
+        sensor_data.body.air_sensor.humidity = 40.0f + (seq % 300) / 10.0f;
+        sensor_data.body.air_sensor.voc_index = 100 + seq % 50;
+    }
+
+    pb_ostream_t stream = pb_ostream_from_buffer(s_frame, sizeof(s_frame));
+    return pb_encode(&stream, SensorData_fields, &sensor_data) ? stream.bytes_written : 0;
+}
+
+static size_t encode_sync_time(void) {
+    SyncTime sync_time = SyncTime_init_default;
+    sync_time.message_type = MessageType_SYNC_TIME;
+
+    uint64_t t1 = esp_timer_get_time();
+    pb_ostream_t stream = pb_ostream_from_buffer(s_frame, sizeof(s_frame));
+    bool ok = pb_encode(&stream, SyncTime_fields, &sync_time) &&
+              pb_encode_tag(&stream, PB_WT_64BIT, SYNC_TIME_SENSOR_TX_US_TAG) &&
+              pb_encode_fixed64(&stream, &t1);
+    return ok ? stream.bytes_written : 0;
+}
+
+static size_t encode_command(uint32_t seq, const uint8_t *sensor_mac_addr) {
+    SensorCommand cmd = SensorCommand_init_default;
+    cmd.message_type = MessageType_SENSOR_COMMAND;
+    cmd.id = seq;
+    cmd.has_master_mac_addr = true;
+    memcpy(cmd.master_mac_addr, s_master_mac, ESP_NOW_ETH_ALEN);
+    memcpy(cmd.sensor_mac_addr, sensor_mac_addr, ESP_NOW_ETH_ALEN);
+    cmd.which_body = SensorCommand_sample_rate_tag;
+    cmd.body.sample_rate.rate = 60;
+
+    pb_ostream_t stream = pb_ostream_from_buffer(s_frame, sizeof(s_frame));
+    return pb_encode(&stream, SensorCommand_fields, &cmd) ? stream.bytes_written : 0;
+}
+
+static void inject_frame(const uint8_t *mac_addr, size_t len) {
+    CommTask_t task = {
+        .buffer = s_frame,
+        .buffer_size = len,
+    };
+    memcpy(task.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+
+    // The pipeline copies the frame, so s_frame can be reused right away
+    if (len == 0 || pipeline_submit_frame(&task) != ESP_OK) {
+        s_rejected++;
+    }
+}
+
+static void send_one(uint32_t seq) {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    fake_mac(seq % CONFIG_MIST_LOADGEN_PEERS, mac_addr);
+
+    uint32_t kind = seq % MIX_PERIOD;
+    if (kind < MIX_SYNC_TIME) {
+        inject_frame(mac_addr, encode_reading(seq));
+    } else if (kind < MIX_COMMAND) {
+        inject_frame(mac_addr, encode_sync_time());
+    } else {
+        size_t len = encode_command(seq, mac_addr);
+        if (len == 0 || mqtt_inject(COMMAND_TOPIC, s_frame, len) != ESP_OK) {
+            s_rejected++;
+        }
+    }
+    s_offered++;
+}
+
+static void take_sample(loadgen_sample_t *sample) {
+    sample->time_us = esp_timer_get_time();
+    sample->free_heap = esp_get_free_heap_size();
+    pipeline_get_stats(&sample->pipeline);
+    mqtt_get_stats(&sample->mqtt);
+    for (int i = 0; i < METRICS_STAGE_MAX; i++) {
+        metrics_get_totals(i, sample->stages[i]);
+    }
+}
+
+// Upper bound of the bucket holding the given percentile, in microseconds
+static uint32_t percentile_us(const uint32_t *start, const uint32_t *end, uint32_t percent, uint32_t *count) {
+    uint32_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        total += end[i] - start[i];
+    }
+    *count = total;
+    if (total == 0) return 0;
+
+    uint32_t rank = (uint64_t)total * percent / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += end[i] - start[i];
+        if (seen > rank) {
+            return 1u << i;
+        }
+    }
+    return 1u << (METRICS_BUCKETS - 1);
+}
+
+static void report(const loadgen_sample_t *start, const loadgen_sample_t *end) {
+    float seconds = (end->time_us - start->time_us) / 1e6f;
+    uint32_t frames = end->pipeline.frames_received - start->pipeline.frames_received;
+    uint32_t dropped = (end->pipeline.frames_dropped - start->pipeline.frames_dropped) +
+                       (end->pipeline.readings_dropped - start->pipeline.readings_dropped);
+    uint32_t failed = end->pipeline.frames_failed - start->pipeline.frames_failed;
+    uint32_t readings = end->pipeline.readings_published - start->pipeline.readings_published;
+    uint32_t publishes = end->mqtt.publishes - start->mqtt.publishes;
+    uint32_t bytes = end->mqtt.bytes - start->mqtt.bytes;
+    uint32_t min_free = esp_get_minimum_free_heap_size();
+
+    ESP_LOGI(TAG, "%.1f s: offered %lu msgs (%.0f msg/s), %lu frames, %lu dropped, %lu failed, %lu rejected",
+             seconds, (unsigned long)s_offered, s_offered / seconds, (unsigned long)frames,
+             (unsigned long)dropped, (unsigned long)failed, (unsigned long)s_rejected);
+    ESP_LOGI(TAG, "Handled %.0f readings/s, %lu publishes, %.0f bytes/s", readings / seconds,
+             (unsigned long)publishes, bytes / seconds);
+
+    for (int i = 0; i < METRICS_STAGE_MAX; i++) {
+        uint32_t count;
+        uint32_t p50 = percentile_us(start->stages[i], end->stages[i], 50, &count);
+        uint32_t p99 = percentile_us(start->stages[i], end->stages[i], 99, &count);
+        if (count > 0) {
+            ESP_LOGI(TAG, "  %-13s p50 <%lu us, p99 <%lu us, %lu samples", STAGE_NAME[i],
+                     (unsigned long)p50, (unsigned long)p99, (unsigned long)count);
+        }
+    }
+
+    // The heap low-water mark is kept since boot, so this is the peak use over
+    // the free heap at the start if the run went deeper than anything before it
+    ESP_LOGI(TAG, "Heap: %lu free at start, %lu now, low-water %lu, peak use %ld",
+             (unsigned long)start->free_heap, (unsigned long)end->free_heap, (unsigned long)min_free,
+             (long)start->free_heap - (long)min_free);
+}
+
+static void loadgen_task(void *arg) {
+    static loadgen_sample_t start;
+    static loadgen_sample_t now;
+
+    boot_wait(BOOT_BIT(BOOT_PHASE_TIME_VALID) | BOOT_BIT(BOOT_PHASE_MQTT_CONNECTED), portMAX_DELAY);
+    ESP_LOGW(TAG, "Generating %d msg/s from %d fake sensors for %d s", CONFIG_MIST_LOADGEN_RATE,
+             CONFIG_MIST_LOADGEN_PEERS, CONFIG_MIST_LOADGEN_DURATION_S);
+
+    take_sample(&start);
+    int64_t end_us = start.time_us + CONFIG_MIST_LOADGEN_DURATION_S * 1000000LL;
+    int64_t progress_us = start.time_us + LOADGEN_PROGRESS_US;
+
+    // Messages are sent in bursts every tick, carrying the remainder so the
+    // average rate is exact even when it is not a multiple of the tick rate
+    uint32_t seq = 0;
+    uint32_t credit = 0;
+    TickType_t last_wake = xTaskGetTickCount();
+    while (esp_timer_get_time() < end_us) {
+        credit += CONFIG_MIST_LOADGEN_RATE * LOADGEN_TICK_MS;
+        for (; credit >= 1000; credit -= 1000) {
+            send_one(seq++);
+        }
+
+        if (esp_timer_get_time() >= progress_us) {
+            take_sample(&now);
+            report(&start, &now);
+            progress_us += LOADGEN_PROGRESS_US;
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(LOADGEN_TICK_MS));
+    }
+
+    vTaskDelay(pdMS_TO_TICKS(LOADGEN_DRAIN_MS));
+    take_sample(&now);
+    ESP_LOGW(TAG, "Load generation finished");
+    report(&start, &now);
+
+    vTaskDelete(NULL);
+}
+
+esp_err_t loadgen_start(void) {
+    esp_err_t err = esp_wifi_get_mac(ESP_IF_WIFI_STA, s_master_mac);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to get MAC address: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    if (xTaskCreate(loadgen_task, "loadgen", 4096, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create load generator task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <esp_err.h>
+
+// Synthetic load for measuring the master's throughput without real sensors.
+// Replays SensorData, SyncTime and SensorCommand messages from
+// CONFIG_MIST_LOADGEN_PEERS fake sensors at CONFIG_MIST_LOADGEN_RATE messages
+// per second through the same pipeline, router and publish path that real
+// traffic takes, then logs messages/sec, stage latency percentiles and heap use.
+//
+// The generator is the only producer of ESP-NOW frames while it runs, so
+// frames from real sensors must not be fed into the pipeline at the same time.
+
+// Starts the load generator task. Load starts once the clock is valid and the
+// broker, or its dry publish stand-in, is connected.
+esp_err_t loadgen_start(void);
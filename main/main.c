@@ -6,6 +6,7 @@
 #include <esp_wifi.h>
 #include <string.h>
 #include <esp_mac.h>
+#include <esp_timer.h>
 
 #include "pb_encode.h"
 #include "pb_decode.h"
@@ -16,14 +17,28 @@
 #include "comm.h"
 #include "led.h"
 #include "mqtt.h"
+#include "telemetry.h"
+#include "batch.h"
+#include "backlog.h"
+#include "pipeline.h"
+#include "router.h"
+#include "peers.h"
+#include "boot.h"
+#include "time_service.h"
+#include "metrics.h"
+#include "loadgen.h"
+#include "commands.h"
+#include "aggregate.h"
+#include "slots.h"
+#include "rlink.h"
+#include "ratectl.h"
+#include "history.h"
+#include "linkq.h"
 
 #define BROKER_URL "mqtt://192.168.3.105:1883"  // Replace with your broker URL
 
 static const char *TAG = "Mist";
 
-// Task handle to notify when slave has sent over its the address
-static TaskHandle_t s_handshake_notify = NULL;
-
 static uint8_t s_mac[6];
 
 void nvs_init() {
@@ -36,51 +51,35 @@ void nvs_init() {
     ESP_ERROR_CHECK(ret);
 }
 
-static void handle_sensor_data(const SensorData* sensor_data) {
+// Runs in the pipeline publisher task for every decoded reading
+static void handle_sensor_data(const pipeline_reading_t* reading) {
+    const SensorData* sensor_data = &reading->data;
     esp_err_t err;
     
     switch (sensor_data->sensor_type) {
         case SensorType_AIR_SENSOR:
 
-            ESP_LOGI(TAG, "Received AIR_SENSOR sensor_data, timestamp: %lld, humidity: %f, temperature: %f, voc_index: %d", 
+            HOT_LOGI(TAG, "Received AIR_SENSOR sensor_data, timestamp: %lld, humidity: %f, temperature: %f, voc_index: %d", 
                      sensor_data->body.air_sensor.timestamp, sensor_data->body.air_sensor.humidity, sensor_data->body.air_sensor.temperature, sensor_data->body.air_sensor.voc_index);
 
             led_action();
 
-            
-            // Publish JSON data to MQTT topic
-            char* temperature_str = malloc(30 * sizeof(char));
-            snprintf(temperature_str, 30, "%.2f", sensor_data->body.air_sensor.temperature);
-            err = mqtt_publish("/esp32/air/temperature", temperature_str);
-            char* humidity_str = malloc(30 * sizeof(char));
-            snprintf(humidity_str, 30, "%.2f", sensor_data->body.air_sensor.humidity);
-            err = mqtt_publish("/esp32/air/humidity", humidity_str);
-            char* voc_index_str = malloc(30 * sizeof(char));
-            snprintf(voc_index_str, 30, "%.2f", sensor_data->body.air_sensor.humidity);
-            err = mqtt_publish("/esp32/air/voc_index", voc_index_str);
-
+            // Encode the whole reading into one JSON payload and publish it once
+            err = telemetry_publish(reading);
             if(err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to publish message");
                 led_fail();
             }
 
-            free(temperature_str);
-            free(humidity_str);
-            free(voc_index_str);
-
             break;
         case SensorType_SOIL_SENSOR:
 
-            ESP_LOGI(TAG, "Received SOIL_SENSOR sensor_data, timestamp: %lld, moisture: %f", 
+            HOT_LOGI(TAG, "Received SOIL_SENSOR sensor_data, timestamp: %lld, moisture: %f", 
                      sensor_data->body.soil_sensor.timestamp, sensor_data->body.soil_sensor.moisture);
 
             led_action();
-            
-            char* moisture_str = malloc(30 * sizeof(char));
-            snprintf(moisture_str, 30, "%.2f", sensor_data->body.soil_sensor.moisture);
-            err = mqtt_publish("/esp32/soil/moisture", moisture_str);
-            free(moisture_str);
 
+            err = telemetry_publish(reading);
             if(err != ESP_OK) {
                 ESP_LOGE(TAG, "Failed to publish message");
                 led_fail();
@@ -88,11 +87,11 @@ static void handle_sensor_data(const SensorData* sensor_data) {
 
             break;
         case SensorType_MIST_SENSOR:
-            ESP_LOGI(TAG, "Received MIST_SENSOR sensor_data, timestamp: %lld, humidity: %f, temperature: %f", 
+            HOT_LOGI(TAG, "Received MIST_SENSOR sensor_data, timestamp: %lld, humidity: %f, temperature: %f", 
                      sensor_data->body.mist_sensor.timestamp, sensor_data->body.mist_sensor.humidity, sensor_data->body.mist_sensor.temperature);
             break;
         case SensorType_LIGHT_SENSOR:
-            ESP_LOGI(TAG, "Received LIGHT_SENSOR sensor_data, timestamp: %lld, light intensity: %f", 
+            HOT_LOGI(TAG, "Received LIGHT_SENSOR sensor_data, timestamp: %lld, light intensity: %f", 
                      sensor_data->body.light_sensor.timestamp, sensor_data->body.light_sensor.intensity);
             break;
             
@@ -120,195 +119,159 @@ static void handle_sensor_command(const SensorCommand* cmd) {
     }
 }
 
-static esp_err_t recv_msg_cb(const CommTask_t* task) {
-    pb_istream_t stream = pb_istream_from_buffer(task->buffer, task->buffer_size);
-    
-    // In Protocol Buffers, each field is prefixed with a tag that contains two pieces of information:
-    //      1. The field number from your .proto file
-    //      2. The wire type (encoding type)
-    // It is encoded as the first byte, the tag: (field_number << 3) | wire_type
-    uint32_t tag;
-    if (!pb_decode_varint32(&stream, &tag)) {
-        ESP_LOGE(TAG, "Failed to decode message type");
-        return ESP_FAIL; 
+static esp_err_t on_sensor_data(const router_msg_t *msg, const void *decoded) {
+    const SensorData *sensor_data = decoded;
+
+    peer_t *peer = peers_touch(msg->mac_addr, msg->rx_time_us);
+    if (peer != NULL) {
+        peer->sensor_type = sensor_data->sensor_type;
     }
 
-    // Decode the actual message type
-    MessageType message_type;
-    if (!pb_decode_varint32(&stream, (uint32_t*)&message_type)) {
-        return ESP_FAIL; 
+    // Logging and publishing happen in the pipeline publisher task
+    return pipeline_submit_reading(sensor_data, msg->mac_addr, msg->rx_time_us);
+}
+
+static esp_err_t on_slavery_handshake(const router_msg_t *msg, const void *decoded) {
+    const SlaveryHandshake *handshake = decoded;
+
+    ESP_LOGI(TAG, "Received slave MAC address: "MACSTR"", MAC2STR(handshake->slave_mac_addr));
+
+    // Persists the pairing if it is new
+    if (peers_add(handshake->slave_mac_addr) == NULL) {
+        return ESP_ERR_NO_MEM;
     }
+#if CONFIG_MIST_SLOTS
+    slots_hello(handshake->slave_mac_addr);
+#endif
+    return ESP_OK;
+}
 
-    ESP_LOGI(TAG, "Received message type: %d", message_type);
-
-    // In order to decode the message using the correct message type, we need to reset the stream. 
-    // Reset stream to beginning, by setting the bytes_left to the total buffer size 
-    stream.bytes_left = task->buffer_size;
-    // and setting pointer to the beginning of the buffer
-    stream.state = (void*)task->buffer;
-
-    switch (message_type) {
-        case MessageType_SENSOR_DATA: {
-            SensorData sensor_data = SensorData_init_default;
-            if (pb_decode(&stream, SensorData_fields, &sensor_data)) {
-                handle_sensor_data(&sensor_data);
-            } else {
-                ESP_LOGE(TAG, "Failed to decode SensorData: %s", PB_GET_ERROR(&stream));
-                return ESP_FAIL;
-            }
-            break;
-        }
-        case MessageType_SLAVERY_HANDSHAKE: {
-            SlaveryHandshake handshake = SlaveryHandshake_init_default;
-            if (pb_decode(&stream, SlaveryHandshake_fields, &handshake)) {                
-                ESP_LOGI(TAG, "Received slave MAC address: "MACSTR"", MAC2STR(handshake.slave_mac_addr));
-                comm_add_peer(handshake.slave_mac_addr, false);
-                
-                // Notify that slave has sent the address, and handshake is complete
-                xTaskNotifyGive(s_handshake_notify);
-            } else {
-                ESP_LOGE(TAG, "Failed to decode SlaveryHandshake: %s", PB_GET_ERROR(&stream));
-                return ESP_FAIL;
-            }
-            break;
-        }
-        case MessageType_SYNC_TIME: {
-            SyncTime sync_time = SyncTime_init_default;
-            if (pb_decode(&stream, SyncTime_fields, &sync_time)) {
-                ESP_LOGI(TAG, "Received SyncTime message from slave, "MACSTR"", MAC2STR(task->mac_addr));
-
-                time_t now;
-                time(&now);
-                sync_time.has_master_timestamp = true;
-                sync_time.master_timestamp = now;
-
-                // Encode the SyncTime message
-                size_t buffer_size = 0;
-                if (!pb_get_encoded_size(&buffer_size, SyncTime_fields, &sync_time)) {
-                    ESP_LOGE(TAG, "Failed to get SyncTime encoded size");
-                    return ESP_FAIL;
-                }
-                uint8_t buffer[buffer_size];
-                pb_ostream_t stream = pb_ostream_from_buffer(buffer, buffer_size);
-                if(!pb_encode(&stream, SyncTime_fields, &sync_time)) {
-                    ESP_LOGE(TAG, "Encoding SyncTime failed: %s", PB_GET_ERROR(&stream));
-                    return ESP_FAIL;
-                }
-                ESP_LOGI(TAG, "Sending SyncTime message, timestamp: %lld", sync_time.master_timestamp);
-                // Send back the SyncTime message
-                comm_send(buffer, buffer_size, task->mac_addr);
-
-                return ESP_OK;
-            } else {
-                ESP_LOGE(TAG, "Failed to decode SyncTime: %s", PB_GET_ERROR(&stream));
-                return ESP_FAIL;
-            }
-            break;
+static esp_err_t on_sync_time(const router_msg_t *msg, const void *decoded) {
+    HOT_LOGI(TAG, "Received SyncTime message from slave, "MACSTR"", MAC2STR(msg->mac_addr));
+
+    // Handing out an unsynced clock would make the sensor stamp readings in 1970.
+    // Without a reply the sensor retries, by which time SNTP has usually completed.
+    if (!boot_reached(BOOT_PHASE_TIME_VALID)) {
+        ESP_LOGW(TAG, "Clock not valid yet, ignoring SyncTime request");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    return time_service_handle(msg);
+}
+
+static esp_err_t on_sensor_command(const router_msg_t *msg, const void *decoded) {
+    const SensorCommand *cmd = decoded;
+
+    if ((cmd->has_master_mac_addr && memcmp(cmd->master_mac_addr, s_mac, ESP_NOW_ETH_ALEN) == 0) || COMM_IS_BROADCAST_ADDR(cmd->master_mac_addr)) {
+        handle_sensor_command(cmd);
+        // Fans out to the addressed sensors and reports on commands/status
+        esp_err_t err = commands_submit(cmd);
+#if CONFIG_MIST_RATECTL
+        // An operator's sample rate wins over the controller's, once it is on its way
+        if (err == ESP_OK) {
+            ratectl_command(cmd);
         }
-        default:
-            ESP_LOGE(TAG, "Unknown message type: %d", message_type);
-            return ESP_FAIL;
+#endif
+        return err;
     }
 
     return ESP_OK;
 }
 
-static esp_err_t mqtt_recv_msg_handler(const char *topic, const uint8_t *buffer, int buffer_size) {
-    pb_istream_t stream = pb_istream_from_buffer(buffer, buffer_size);
-    
-    // In Protocol Buffers, each field is prefixed with a tag that contains two pieces of information:
-    //      1. The field number from your .proto file
-    //      2. The wire type (encoding type)
-    // It is encoded as the first byte, the tag: (field_number << 3) | wire_type
-    uint32_t tag;
-    if (!pb_decode_varint32(&stream, &tag)) {
-        ESP_LOGE(TAG, "Failed to decode message type");
-        return ESP_FAIL; 
-    }
+// Sensors acknowledge a command by echoing it back with the same id
+static esp_err_t on_sensor_command_ack(const router_msg_t *msg, const void *decoded) {
+    const SensorCommand *cmd = decoded;
 
-    // Decode the actual message type
-    MessageType message_type;
-    if (!pb_decode_varint32(&stream, (uint32_t*)&message_type)) {
-        return ESP_FAIL; 
-    }
+    commands_ack(msg->mac_addr, cmd->id);
+    return ESP_OK;
+}
 
-    ESP_LOGI(TAG, "Received message type: %d", message_type);
-
-    // In order to decode the message using the correct message type, we need to reset the stream. 
-    // Reset stream to beginning, by setting the bytes_left to the total buffer size 
-    stream.bytes_left = buffer_size;
-    // and setting pointer to the beginning of the buffer
-    stream.state = (void*)buffer;
-
-    switch (message_type) {
-        case MessageType_SENSOR_COMMAND: {
-            SensorCommand cmd = SensorCommand_init_default;
-            if (pb_decode(&stream, &SensorCommand_msg, &cmd)) {
-                if ((cmd.has_master_mac_addr  && memcmp(cmd.master_mac_addr, s_mac, ESP_NOW_ETH_ALEN) == 0) || COMM_IS_BROADCAST_ADDR(cmd.master_mac_addr)) {
-                    switch (cmd.which_body) {
-                        case SensorCommand_sample_rate_tag:
-                            ESP_LOGI(TAG, "Forward received sample rate command with rate: %lld", cmd.body.sample_rate.rate);  
-                            comm_send(buffer, buffer_size, cmd.sensor_mac_addr);
-                            break;
-                        default:
-                            ESP_LOGE(TAG, "Unknown command body type");
-                            break;
-                    }
-                }
-
-            } else {
-                ESP_LOGE(TAG, "Failed to decode command: %s", PB_GET_ERROR(&stream));
-                return ESP_FAIL;
-            }
-            break;
+// Runs in the pipeline decode task for every frame received over ESP-NOW
+static esp_err_t recv_msg_cb(const pipeline_frame_t* frame) {
+    router_msg_t msg = {
+        .transport = ROUTER_TRANSPORT_ESPNOW,
+        .mac_addr = frame->mac_addr,
+        .raw = frame->data,
+        .raw_len = frame->len,
+        .rx_time_us = frame->rx_time_us,
+    };
+#if CONFIG_MIST_RLINK
+    if (rlink_is_frame(frame->data, frame->len)) {
+        rlink_msg_t rlink_msg;
+        esp_err_t err = rlink_receive(frame->mac_addr, frame->data, frame->len, &rlink_msg);
+        if (err != ESP_OK) {
+            // Acks, duplicates and fragments of messages still incomplete
+            return err == ESP_ERR_NOT_FINISHED ? ESP_OK : err;
         }
-        default:
-            ESP_LOGE(TAG, "Unknown message type: %d", message_type);
-            return ESP_FAIL;
+        msg.raw = rlink_msg.data;
+        msg.raw_len = rlink_msg.len;
     }
+#endif
+    return router_dispatch(&msg);
+}
 
-    return ESP_OK;
+static esp_err_t mqtt_recv_msg_handler(const char *topic, size_t topic_len, const uint8_t *buffer, size_t buffer_size) {
+    router_msg_t msg = {
+        .transport = ROUTER_TRANSPORT_MQTT,
+        .topic = topic,
+        .topic_len = topic_len,
+        .raw = buffer,
+        .raw_len = buffer_size,
+        .rx_time_us = esp_timer_get_time(),
+    };
+    return router_dispatch(&msg);
 }
 
-void start_slavery_handshake() {
-    // Store the handle of the current handshake task
-    s_handshake_notify = xTaskGetCurrentTaskHandle();
+static void register_routes(void) {
+    router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SENSOR_DATA, on_sensor_data);
+    router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SLAVERY_HANDSHAKE, on_slavery_handshake);
+    router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SYNC_TIME, on_sync_time);
+    router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SENSOR_COMMAND, on_sensor_command_ack);
+    router_register(ROUTER_TRANSPORT_MQTT, MessageType_SENSOR_COMMAND, on_sensor_command);
+}
+
+// Keeps inviting sensors to pair for as long as the master runs. Known sensors are
+// restored from NVS at boot, so this only matters for sensors that are new.
+static void handshake_task(void *arg) {
     ESP_LOGI(TAG, "Starting Handshake");
 
-    // Get master's mac address
-    uint8_t mac[6];
-    esp_err_t ret = esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to get MAC address");
-        return;
-    }
     // Broadcast SlaveryHandshake message
     SlaveryHandshake handshake = SlaveryHandshake_init_default;
     handshake.message_type = MessageType_SLAVERY_HANDSHAKE;
     handshake.has_master_mac_addr = true;
-    memcpy(handshake.master_mac_addr, mac, ESP_NOW_ETH_ALEN);
+    memcpy(handshake.master_mac_addr, s_mac, ESP_NOW_ETH_ALEN);
     ESP_LOGI(TAG, "Master MAC address: "MACSTR"", MAC2STR(handshake.master_mac_addr));
-    size_t buffer_size = 0;
-    if (!pb_get_encoded_size(&buffer_size, SlaveryHandshake_fields, &handshake)) {
-        ESP_LOGE(TAG, "Failed to get encoded size");
-        return;
-    }
-    uint8_t buffer[buffer_size];
-    pb_ostream_t stream = pb_ostream_from_buffer(buffer, buffer_size);
-    bool status = pb_encode(&stream, SlaveryHandshake_fields, &handshake);
-    if (!status) {
+
+    uint8_t buffer[SlaveryHandshake_size];
+    pb_ostream_t stream = pb_ostream_from_buffer(buffer, sizeof(buffer));
+    if (!pb_encode(&stream, SlaveryHandshake_fields, &handshake)) {
         ESP_LOGE(TAG, "Encoding failed: %s", PB_GET_ERROR(&stream));
+        vTaskDelete(NULL);
         return;
     }
 
-    for(uint i = 0; i < 5; i++) {
-        ESP_LOGI(TAG, "Broadcasting slavery handshake with master MAC address...");
-        comm_broadcast(buffer, buffer_size);
+    for (uint32_t i = 0; ; i++) {
+        ESP_LOGD(TAG, "Broadcasting slavery handshake with master MAC address...");
+        comm_broadcast(buffer, stream.bytes_written);
 
-        if(ulTaskNotifyTake(pdTRUE, 1000 / portTICK_PERIOD_MS) == 1) {
-            ESP_LOGI(TAG, "Main: Exiting loop as signaled");
-            break;
-        }
+        // Announce quickly right after boot, then at a slower pace in the background
+        vTaskDelay(pdMS_TO_TICKS(i < 5 ? 1000 : CONFIG_MIST_HANDSHAKE_INTERVAL_MS));
+    }
+}
+
+void start_slavery_handshake() {
+    xTaskCreate(handshake_task, "handshake", 3072, NULL, 2, NULL);
+}
+
+// Runs in the lwIP tcpip thread, see time_sync()
+static void on_time_synced(void) {
+    boot_mark(BOOT_PHASE_TIME_VALID);
+    telemetry_time_valid();
+}
+
+static void on_mqtt_connection(bool connected) {
+    if (connected) {
+        boot_mark(BOOT_PHASE_MQTT_CONNECTED);
     }
 }
 
@@ -317,9 +280,11 @@ void app_main(void)
     led_blink();
     // Initialize NVS for wifi station mode
     nvs_init();
+    boot_init();
 
     led_wait();
     wl_wifi_init();
+    boot_mark(BOOT_PHASE_WIFI_STARTED);
 
     // Get device MAC address
     esp_err_t ret = esp_wifi_get_mac(ESP_IF_WIFI_STA, s_mac);
@@ -329,21 +294,84 @@ void app_main(void)
     }
 
     led_blink();
-    // Sync time
-    time_sync();
+    // SNTP, ESP-NOW and the MQTT connection progress concurrently from here on.
+    // Nothing below waits for the clock or the broker; readings received before
+    // the clock is valid are held and restamped by telemetry.
+    register_routes();
+    // Before SNTP starts, since on_time_synced hands the held readings to it
+    telemetry_init();
+    time_sync(on_time_synced);
+    time_service_init();
+    commands_init();
+#if CONFIG_MIST_SLOTS
+    // Hands out transmit slots through commands
+    slots_init();
+#endif
+#if CONFIG_MIST_RATECTL
+    // Lowers sample rates through commands while the uplink is congested
+    ratectl_init();
+#endif
+#if CONFIG_MIST_AGGREGATION
+    aggregate_init();
+#endif
+#if CONFIG_MIST_HISTORY
+    // Keeps recent readings for history queries
+    history_init();
+#endif
+
+#if CONFIG_MIST_BACKLOG
+    // Recover readings stored during a previous outage, replayed once connected
+    backlog_init();
+#endif
+
+#if CONFIG_MIST_SENSOR_BATCHING
+    // Start collecting readings into one publish per batching window
+    batch_init();
+#endif
 
     // Initialize ESPNOW communication and add broadcast peer
     comm_init();
     comm_add_peer(COMM_BROADCAST_MAC_ADDR, false);
-    comm_register_recv_msg_cb(recv_msg_cb);
-    
-    // Init MTQQ client to be ready to publish sensor data
+    // Restore sensors paired before the last reboot
+    peers_init();
+#if CONFIG_MIST_RLINK
+    // Acks and retransmissions for sensors speaking the reliable link
+    rlink_init();
+#endif
+#if CONFIG_MIST_LINKQ
+    // RSSI, delivery and PHY rate per sensor
+    linkq_init();
+#endif
+    // Received frames are queued and handled off the comm task
+    pipeline_init(recv_msg_cb, handle_sensor_data);
+#if CONFIG_MIST_LOADGEN
+    // Synthetic sensors take the place of ESP-NOW reception
+    loadgen_start();
+#else
+    comm_register_recv_msg_cb(pipeline_submit_frame);
+#endif
+    boot_mark(BOOT_PHASE_COMM_READY);
+
+    // Publish pipeline latencies and counters periodically
+    metrics_init();
+
+    // Create the MQTT client, subscribe, then connect
+    mqtt_register_connection_handler(on_mqtt_connection);
     init_mqtt();
-    mqtt_register_recv_msg_handler(mqtt_recv_msg_handler);
-
-    // Start broadcasting master MAC address and wait for slave to send its address to complete the handshake.
+    // Commands on the per-master topic, and on the shared topic older consumers use
+    mqtt_subscribe(mqtt_topic(MQTT_TOPIC_COMMANDS), 1, mqtt_recv_msg_handler);
+    mqtt_subscribe("/sensor_command", 0, mqtt_recv_msg_handler);
+#if CONFIG_MIST_HISTORY
+    mqtt_subscribe(mqtt_topic(MQTT_TOPIC_HISTORY_QUERY), 0, history_handle_query);
+#endif
+    // Only once every filter is registered, the client task reads them without a lock
+    mqtt_start();
+
+    // Start broadcasting master MAC address in the background so new sensors can pair at any time
     start_slavery_handshake();
 
+    // Keep the LED busy until the master is fully online
+    boot_wait(BOOT_BIT(BOOT_PHASE_MQTT_CONNECTED) | BOOT_BIT(BOOT_PHASE_TIME_VALID), portMAX_DELAY);
     led_off();
 
     // Dummy main loop
@@ -0,0 +1,244 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_sys.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "pbw.h"
+#include "mqtt.h"
+#include "peers.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "backlog.h"
+#include "pub_pool.h"
+#include "rlink.h"
+#include "metrics.h"
+
+static const char *TAG = "metrics";
+
+typedef struct {
+    uint32_t buckets[METRICS_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} histogram_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t errors;
+} peer_counters_t;
+
+static histogram_t s_histograms[METRICS_STAGE_MAX];
+static uint32_t s_totals[METRICS_STAGE_MAX][METRICS_BUCKETS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Indexed by peers_index()
+static peer_counters_t s_peer_counters[CONFIG_MIST_PEER_CAPACITY];
+
+static uint8_t s_snapshot_buf[CONFIG_MIST_METRICS_BUF_SIZE];
+
+// Worst case size of one PeerCounters entry including its tag and length
+#if CONFIG_MIST_LINKQ
+#define PEER_COUNTERS_MAX_SIZE 56
+#else
+#define PEER_COUNTERS_MAX_SIZE 32
+#endif
+
+void metrics_record(metrics_stage_t stage, uint32_t start) {
+    metrics_record_us(stage, (metrics_now() - start) / esp_rom_get_cpu_ticks_per_us());
+}
+
+void metrics_record_us(metrics_stage_t stage, uint32_t us) {
+    int bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+    if (bucket >= METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS - 1;
+    }
+
+    histogram_t *histogram = &s_histograms[stage];
+    portENTER_CRITICAL(&s_lock);
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    s_totals[stage][bucket]++;
+    if (us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void metrics_get_totals(metrics_stage_t stage, uint32_t buckets[METRICS_BUCKETS]) {
+    portENTER_CRITICAL(&s_lock);
+    memcpy(buckets, s_totals[stage], sizeof(s_totals[stage]));
+    portEXIT_CRITICAL(&s_lock);
+}
+
+void metrics_peer_frame(const uint8_t *mac_addr, bool ok) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return;
+    }
+
+    peer_counters_t *counters = &s_peer_counters[peers_index(peer)];
+    counters->frames++;
+    if (!ok) {
+        counters->errors++;
+    }
+}
+
+typedef struct {
+    metrics_stage_t stage;
+    const histogram_t *histogram;
+} stage_arg_t;
+
+static bool encode_stage(pb_ostream_t *stream, const void *arg) {
+    const stage_arg_t *stage = arg;
+    return pbw_uint(stream, 1, stage->stage) &&
+           pbw_uint(stream, 2, stage->histogram->count) &&
+           pbw_uint(stream, 3, stage->histogram->max_us) &&
+           pbw_packed_uint32(stream, 4, stage->histogram->buckets, METRICS_BUCKETS);
+}
+
+static bool encode_counters(pb_ostream_t *stream, const void *arg) {
+    pipeline_stats_t pipeline;
+    pipeline_get_stats(&pipeline);
+    bool ok = pbw_uint(stream, 1, pipeline.frames_received) &&
+              pbw_uint(stream, 2, pipeline.frames_dropped) &&
+              pbw_uint(stream, 3, pipeline.frames_failed) &&
+              pbw_uint(stream, 4, pipeline.readings_dropped) &&
+              pbw_uint(stream, 9, pub_pool_exhausted_count());
+
+#if CONFIG_MIST_SENSOR_BATCHING
+    batch_stats_t batch;
+    batch_get_stats(&batch);
+    ok = ok && pbw_uint(stream, 5, batch.batches) && pbw_uint(stream, 6, batch.bytes);
+#endif
+#if CONFIG_MIST_BACKLOG
+    backlog_stats_t backlog;
+    backlog_get_stats(&backlog);
+    ok = ok && pbw_uint(stream, 7, backlog.pending) && pbw_uint(stream, 8, backlog.dropped);
+#endif
+#if CONFIG_MIST_RLINK
+    rlink_stats_t rlink;
+    rlink_get_stats(&rlink);
+    ok = ok && pbw_uint(stream, 10, rlink.duplicates) && pbw_uint(stream, 11, rlink.retransmits) &&
+         pbw_uint(stream, 12, rlink.reassembled) && pbw_uint(stream, 13, rlink.dropped);
+#endif
+    return ok;
+}
+
+typedef struct {
+    peer_t peer;                // Copy taken under the registry lock
+    const peer_counters_t *counters;
+} peer_arg_t;
+
+static bool encode_peer(pb_ostream_t *stream, const void *arg) {
+    const peer_t *peer = &((const peer_arg_t *)arg)->peer;
+    const peer_counters_t *counters = ((const peer_arg_t *)arg)->counters;
+    int64_t age_ms = peer->last_seen_us != 0 ? (esp_timer_get_time() - peer->last_seen_us) / 1000 : 0;
+
+    bool ok = pbw_bytes(stream, 1, peer->mac_addr, ESP_NOW_ETH_ALEN) &&
+              pbw_uint(stream, 2, counters->frames) &&
+              pbw_uint(stream, 3, counters->errors) &&
+              pbw_uint(stream, 4, age_ms);
+#if CONFIG_MIST_LINKQ
+    const peer_link_t *link = &peer->link;
+    if (link->rx_frames > 0) {
+        ok = ok && pbw_sint(stream, 5, link->rssi_x16 / 16) && pbw_uint(stream, 6, link->rx_rate);
+    }
+    ok = ok && pbw_uint(stream, 7, link->tx_rate) &&
+         pbw_uint(stream, 8, link->tx_attempts) &&
+         pbw_uint(stream, 9, link->tx_delivered);
+    if (link->stale) {
+        ok = ok && pbw_uint(stream, 10, 1);
+    }
+#endif
+    return ok;
+}
+
+#if CONFIG_MIST_MQTT_OUTBOX
+static bool encode_outbox(pb_ostream_t *stream, const void *arg) {
+    mist_outbox_class_t cls = *(const mist_outbox_class_t *)arg;
+    mist_outbox_stats_t stats;
+    mist_outbox_get_stats(cls, &stats);
+
+    return pbw_uint(stream, 1, cls) &&
+           pbw_uint(stream, 2, stats.bytes) &&
+           pbw_uint(stream, 3, stats.items) &&
+           pbw_uint(stream, 4, stats.high_water) &&
+           pbw_uint(stream, 5, stats.evicted) &&
+           pbw_uint(stream, 6, stats.rejected);
+}
+#endif
+
+static size_t encode_snapshot(const histogram_t *histograms) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_snapshot_buf, sizeof(s_snapshot_buf));
+
+    bool ok = pbw_uint(&stream, 1, esp_timer_get_time() / 1000) &&
+              pbw_uint(&stream, 2, CONFIG_MIST_METRICS_INTERVAL_MS) &&
+              pbw_uint(&stream, 3, esp_get_free_heap_size()) &&
+              pbw_uint(&stream, 4, esp_get_minimum_free_heap_size()) &&
+              pbw_uint(&stream, 5, heap_caps_get_largest_free_block(MALLOC_CAP_DEFAULT));
+
+    for (int i = 0; ok && i < METRICS_STAGE_MAX; i++) {
+        if (histograms[i].count > 0) {
+            stage_arg_t stage = { .stage = i, .histogram = &histograms[i] };
+            ok = pbw_submessage(&stream, 6, encode_stage, &stage);
+        }
+    }
+
+    ok = ok && pbw_submessage(&stream, 7, encode_counters, NULL);
+
+#if CONFIG_MIST_MQTT_OUTBOX
+    for (mist_outbox_class_t cls = 0; ok && cls < MIST_OUTBOX_CLASS_MAX; cls++) {
+        ok = pbw_submessage(&stream, 9, encode_outbox, &cls);
+    }
+#endif
+
+    // Peers go last and are cut off when the buffer runs out
+    for (int i = 0; ok && i < CONFIG_MIST_PEER_CAPACITY; i++) {
+        peer_arg_t peer = { .counters = &s_peer_counters[i] };
+        if (!peers_get(i, &peer.peer)) continue;
+        if (stream.max_size - stream.bytes_written < PEER_COUNTERS_MAX_SIZE) {
+            ESP_LOGW(TAG, "Snapshot buffer full, omitting remaining peers");
+            break;
+        }
+        ok = pbw_submessage(&stream, 8, encode_peer, &peer);
+    }
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Encoding snapshot failed: %s", PB_GET_ERROR(&stream));
+        return 0;
+    }
+    return stream.bytes_written;
+}
+
+static void metrics_task(void *arg) {
+    static histogram_t histograms[METRICS_STAGE_MAX];
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_MIST_METRICS_INTERVAL_MS));
+
+        // Latencies are reported per interval, counters since boot
+        portENTER_CRITICAL(&s_lock);
+        memcpy(histograms, s_histograms, sizeof(histograms));
+        memset(s_histograms, 0, sizeof(s_histograms));
+        portEXIT_CRITICAL(&s_lock);
+
+        if (!mqtt_is_connected()) {
+            continue;
+        }
+
+        size_t len = encode_snapshot(histograms);
+        if (len > 0) {
+            mqtt_publish_qos(mqtt_topic(MQTT_TOPIC_METRICS), (const char *)s_snapshot_buf, len, 1);
+        }
+    }
+}
+
+esp_err_t metrics_init(void) {
+    if (xTaskCreate(metrics_task, "metrics", 4096, NULL, 1, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create metrics task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_cpu.h>
+#include <esp_log.h>
+#include "sdkconfig.h"
+
+// Logging on the per-frame path costs more than the work it describes, especially
+// on UART. These compile out unless CONFIG_MIST_HOT_PATH_LOGGING is enabled.
+#if CONFIG_MIST_HOT_PATH_LOGGING
+#define HOT_LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define HOT_LOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+#else
+#define HOT_LOGI(tag, format, ...) do { } while (0)
+#define HOT_LOGD(tag, format, ...) do { } while (0)
+#endif
+
+// Latency stages between an ESP-NOW frame arriving and its data reaching the
+// broker, and of (re)connecting to the broker
+typedef enum {
+    METRICS_STAGE_RX_QUEUE,         // Frame received until the decode task picks it up
+    METRICS_STAGE_DECODE,           // Decoding and routing a frame
+    METRICS_STAGE_READING_QUEUE,    // Reading queued until the publisher task picks it up
+    METRICS_STAGE_HANDLE,           // Publisher task handling a reading
+    METRICS_STAGE_PUBLISH,          // Encoding a batch and handing it to the MQTT client
+    METRICS_STAGE_ACK,              // QoS 1 publish until MQTT_EVENT_PUBLISHED
+    METRICS_STAGE_TLS_CONNECT,      // DNS lookup, TCP connect and TLS handshake to the broker
+    METRICS_STAGE_MQTT_CONNECT,     // MQTT connect attempt until MQTT_EVENT_CONNECTED
+    METRICS_STAGE_MAX,
+} metrics_stage_t;
+
+// Bucket 0 counts latencies under 1 us, bucket i those in [2^(i-1), 2^i) us.
+// The last bucket is open ended, from about 4 s.
+#define METRICS_BUCKETS 24
+
+// Cycle counter timestamp, cheap enough for every frame
+static inline uint32_t metrics_now(void) {
+    return esp_cpu_get_cycle_count();
+}
+
+// Records the time elapsed since start, a metrics_now() timestamp
+void metrics_record(metrics_stage_t stage, uint32_t start);
+
+// Records a duration measured otherwise, for stages that can outlast the cycle
+// counter wrapping around
+void metrics_record_us(metrics_stage_t stage, uint32_t us);
+
+// Copies the histogram of stage accumulated since boot, unlike the snapshots
+// published on the metrics topic which cover one interval
+void metrics_get_totals(metrics_stage_t stage, uint32_t buckets[METRICS_BUCKETS]);
+
+// Counts a frame received from mac_addr and whether it was handled successfully
+void metrics_peer_frame(const uint8_t *mac_addr, bool ok);
+
+// Starts the task publishing a MetricsSnapshot every CONFIG_MIST_METRICS_INTERVAL_MS
+esp_err_t metrics_init(void);
@@ -1,8 +1,20 @@
 #include <esp_err.h>
 #include <stddef.h>
+#include <string.h>
 #include <nvs_flash.h>
 #include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_wifi.h>
+#include <esp_timer.h>
 #include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include "sdkconfig.h"
+#include "metrics.h"
+#include "topic_trie.h"
+#include "reassembly.h"
+#include "tls_transport.h"
 #include "mqtt.h"
 
 static const char *TAG = "mqtt";
@@ -11,7 +23,122 @@ static esp_mqtt_client_handle_t s_client;
 
 static nvs_handle_t s_nvs_handle;
 
-static mqtt_recv_msg_handler_t s_recv_msg_handler;
+#define MQTT_MAX_SUBSCRIPTIONS 8
+
+typedef struct {
+    const char *filter;
+    int qos;
+    mqtt_recv_msg_handler_t handler;
+} subscription_t;
+
+static subscription_t s_subscriptions[MQTT_MAX_SUBSCRIPTIONS];
+static int s_subscription_count;
+
+// Maps inbound topics to an index into s_subscriptions
+static topic_trie_t s_topic_trie;
+
+#define MQTT_MAX_CONNECTION_HANDLERS 4
+
+static mqtt_connection_handler_t s_connection_handlers[MQTT_MAX_CONNECTION_HANDLERS];
+
+#define MQTT_MAX_PUBLISHED_HANDLERS 2
+
+static mqtt_published_handler_t s_published_handlers[MQTT_MAX_PUBLISHED_HANDLERS];
+
+static volatile bool s_connected;
+// Subscriptions are fixed once the client runs, the client task reads them unlocked
+static bool s_started;
+
+#define MQTT_USER_ID_LEN 64
+#define MQTT_TOPIC_LEN 128
+
+// Credentials read from NVS. The client keeps pointing at the CA certificate, so
+// these live as long as the client does.
+static char s_broker_uri[128];
+static char s_username[64];
+static char s_password[128];
+static char s_ca_cert[2048];
+
+// Start of the current connect attempt, 0 while none is in progress
+static int64_t s_connect_start_us;
+
+static const char *const TOPIC_SUFFIX[MQTT_TOPIC_MAX] = {
+    [MQTT_TOPIC_SENSORS] = "sensors",
+    [MQTT_TOPIC_COMMANDS] = "commands",
+    [MQTT_TOPIC_COMMANDS_STATUS] = "commands/status",
+    [MQTT_TOPIC_METRICS] = "metrics",
+    [MQTT_TOPIC_SUMMARIES] = "summaries",
+    [MQTT_TOPIC_HISTORY] = "history",
+    [MQTT_TOPIC_HISTORY_QUERY] = "history/query",
+};
+
+static char s_topics[MQTT_TOPIC_MAX][MQTT_TOPIC_LEN];
+
+static mqtt_stats_t s_stats;
+
+// Send times of unacknowledged QoS > 0 publishes, slot chosen by msg_id. An entry
+// overwritten before its ack arrives is simply not measured.
+#define MQTT_PENDING_ACKS 8
+
+typedef struct {
+    int msg_id;
+    // esp_timer time, acks can take longer than the cycle counter takes to wrap
+    int64_t sent_us;
+} pending_ack_t;
+
+static pending_ack_t s_pending_acks[MQTT_PENDING_ACKS];
+static portMUX_TYPE s_pending_acks_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Task the client dispatches events on, which holds the client lock meanwhile
+static TaskHandle_t volatile s_client_task;
+
+#if CONFIG_MIST_MQTT5
+static const char *const CONTENT_TYPE[MQTT_TOPIC_MAX] = {
+#if CONFIG_MIST_SENSOR_BATCHING
+    [MQTT_TOPIC_SENSORS] = "application/x-protobuf",
+#else
+    [MQTT_TOPIC_SENSORS] = "application/json",
+#endif
+    [MQTT_TOPIC_COMMANDS] = "application/x-protobuf",
+    [MQTT_TOPIC_COMMANDS_STATUS] = "application/x-protobuf",
+    [MQTT_TOPIC_METRICS] = "application/x-protobuf",
+    [MQTT_TOPIC_SUMMARIES] = "application/x-protobuf",
+    [MQTT_TOPIC_HISTORY] = "application/x-protobuf",
+    [MQTT_TOPIC_HISTORY_QUERY] = "application/x-protobuf",
+};
+
+// Topic aliases of the topics published most often, 0 for none. Messages carry
+// both topic and alias, the outbox leaves the topic out once the broker knows
+// the alias. Only QoS 0 telemetry uses them, since the outbox drops a message it
+// sent without topic when the connection fails before it was delivered.
+#define MQTT_TOPIC_ALIAS_MAX 2
+
+static const uint16_t TOPIC_ALIAS[MQTT_TOPIC_MAX] = {
+    [MQTT_TOPIC_SENSORS] = 1,
+    [MQTT_TOPIC_SUMMARIES] = 2,
+};
+
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+// Injected messages are handed to one task standing in for the client task, so
+// handlers never run concurrently as with a broker
+#define INJECT_QUEUE_LEN 8
+#define INJECT_MAX_LEN 256
+
+typedef struct {
+    char topic[MQTT_TOPIC_LEN];
+    size_t len;
+    uint8_t data[INJECT_MAX_LEN];
+} injected_t;
+
+static QueueHandle_t s_injected;
+#endif
+
+static esp_mqtt_client_config_t s_mqtt_cfg;
+// Only changed before the client starts and on the client task, which is also
+// the only one reading it. Publishers never look at it: the outbox adds MQTT 5
+// properties under the client lock, see mist_outbox_set_protocol().
+static esp_mqtt_protocol_ver_t s_protocol;
+#endif
 
 esp_err_t read_nvs_value(const char *key, char *value, size_t *length) {
     esp_err_t err;
@@ -28,7 +155,7 @@ esp_err_t read_nvs_value(const char *key, char *value, size_t *length) {
     return ESP_OK;
 }
 
-esp_err_t read_credentials(char *broker_uri, size_t broker_uri_len, char *username, size_t username_len, char *password, size_t password_len, char *ca_cert, size_t ca_cert_len) {
+esp_err_t read_credentials(char *broker_uri, size_t broker_uri_len, char *username, size_t username_len, char *password, size_t password_len, char *ca_cert, size_t ca_cert_len, char *user_id, size_t user_id_len) {
     esp_err_t err;
 
     // Open NVS handle
@@ -54,25 +181,146 @@ esp_err_t read_credentials(char *broker_uri, size_t broker_uri_len, char *userna
     err = read_nvs_value("MQTT_CA_CERT", ca_cert, &ca_cert_len);
     if (err != ESP_OK) return err;
 
+    // Read the user id used in topic names. Devices provisioned before per-master
+    // topics existed do not have it, so fall back to the MQTT username.
+    err = nvs_get_str(s_nvs_handle, "MQTT_USER_ID", user_id, &user_id_len);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "MQTT_USER_ID not set, using MQTT username in topics");
+        strlcpy(user_id, username, user_id_len);
+    }
+
     // Close NVS handle
     nvs_close(s_nvs_handle);
 
     return ESP_OK;
 }
 
+static esp_err_t build_topics(const char *user_id) {
+    uint8_t mac[6];
+    esp_err_t err = esp_wifi_get_mac(ESP_IF_WIFI_STA, mac);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to get MAC address: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    for (int i = 0; i < MQTT_TOPIC_MAX; i++) {
+        int len = snprintf(s_topics[i], MQTT_TOPIC_LEN, "/%s/master/"MACSTR"/%s", user_id, MAC2STR(mac), TOPIC_SUFFIX[i]);
+        if (len >= MQTT_TOPIC_LEN) {
+            ESP_LOGE(TAG, "Topic too long for user id %s", user_id);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    return ESP_OK;
+}
+
+static void ack_received(int msg_id) {
+    pending_ack_t *pending = &s_pending_acks[msg_id % MQTT_PENDING_ACKS];
+    int64_t sent_us = 0;
+    bool found = false;
+
+    portENTER_CRITICAL(&s_pending_acks_lock);
+    if (pending->msg_id == msg_id) {
+        sent_us = pending->sent_us;
+        pending->msg_id = 0;
+        found = true;
+    }
+    portEXIT_CRITICAL(&s_pending_acks_lock);
+
+    if (found) {
+        int64_t elapsed_us = esp_timer_get_time() - sent_us;
+        metrics_record_us(METRICS_STAGE_ACK, elapsed_us < UINT32_MAX ? elapsed_us : UINT32_MAX);
+    }
+}
+
+static void notify_published(int msg_id) {
+    for (int i = 0; i < MQTT_MAX_PUBLISHED_HANDLERS && s_published_handlers[i] != NULL; i++) {
+        s_published_handlers[i](msg_id);
+    }
+}
+
+static void notify_connection(bool connected) {
+    s_connected = connected;
+    for (int i = 0; i < MQTT_MAX_CONNECTION_HANDLERS && s_connection_handlers[i] != NULL; i++) {
+        s_connection_handlers[i](connected);
+    }
+}
+
+static esp_err_t dispatch(const char *topic, size_t topic_len, const uint8_t *data, size_t len) {
+    int index = topic_trie_match(&s_topic_trie, topic, topic_len);
+    if (index == TOPIC_TRIE_NO_MATCH) {
+        ESP_LOGW(TAG, "No subscription matches %.*s", (int)topic_len, topic);
+        return ESP_ERR_NOT_FOUND;
+    }
+    return s_subscriptions[index].handler(topic, topic_len, data, len);
+}
+
+#if CONFIG_MIST_MQTT5
+// Brokers that only speak 3.1.1 refuse the MQTT 5 CONNECT, the client then
+// reconnects with 3.1.1 for the rest of the session
+static void fall_back_to_311(void) {
+    if (s_protocol != MQTT_PROTOCOL_V_5) {
+        return;
+    }
+    ESP_LOGW(TAG, "Broker refused MQTT 5, falling back to 3.1.1");
+    s_protocol = MQTT_PROTOCOL_V_3_1_1;
+    s_mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_3_1_1;
+    esp_mqtt_set_config(s_client, &s_mqtt_cfg);
+    // Queued messages were encoded for MQTT 5
+    mist_outbox_set_protocol(false);
+    mist_outbox_drop_unsent();
+}
+
+// Highest of our topic aliases the broker accepts. The client only tells by
+// refusing publish properties with a larger alias, so probe from the top, then
+// leave it with no properties since the outbox adds them to each publish.
+static uint16_t accepted_topic_aliases(void) {
+    static const esp_mqtt5_publish_property_config_t none;
+    uint16_t alias = MQTT_TOPIC_ALIAS_MAX;
+    while (alias > 0) {
+        esp_mqtt5_publish_property_config_t probe = { .topic_alias = alias };
+        if (esp_mqtt5_client_set_publish_property(s_client, &probe) == ESP_OK) {
+            break;
+        }
+        alias--;
+    }
+    esp_mqtt5_client_set_publish_property(s_client, &none);
+    return alias;
+}
+#endif
+
 static void event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
 {
     ESP_LOGD(TAG, "Event dispatched from event loop base=%s, event_id=%" PRIi32 "", base, event_id);
     esp_mqtt_event_handle_t event = event_data;
+    s_client_task = xTaskGetCurrentTaskHandle();
     switch ((esp_mqtt_event_id_t)event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            s_connect_start_us = esp_timer_get_time();
+            break;
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+            if (s_connect_start_us != 0) {
+                int64_t elapsed_us = esp_timer_get_time() - s_connect_start_us;
+                metrics_record_us(METRICS_STAGE_MQTT_CONNECT, elapsed_us);
+                ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED after %lld ms", elapsed_us / 1000);
+                s_connect_start_us = 0;
+            } else {
+                ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+            }
+#if CONFIG_MIST_MQTT5
+            mist_outbox_new_connection(s_protocol == MQTT_PROTOCOL_V_5 ? accepted_topic_aliases() : 0);
+#endif
 
-            esp_mqtt_client_subscribe_single(s_client, "/sensor_command", 0);
+            for (int i = 0; i < s_subscription_count; i++) {
+                esp_mqtt_client_subscribe_single(s_client, s_subscriptions[i].filter, s_subscriptions[i].qos);
+            }
 
+            notify_connection(true);
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            reassembly_reset();
+            notify_connection(false);
             break;
         case MQTT_EVENT_SUBSCRIBED:
             ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -81,28 +329,32 @@ static void event_handler(void *handler_args, esp_event_base_t base, int32_t eve
             ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            HOT_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            ack_received(event->msg_id);
+            notify_published(event->msg_id);
             break;
-        case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            if(strncmp(event->topic, "/sensor_command", 13) == 0) {
-                ESP_LOGI(TAG, "Received sensor command");
-                if (s_recv_msg_handler != NULL) {
-                    s_recv_msg_handler(event->topic, (const unsigned char *)event->data, event->data_len);
-                } else {
-                    ESP_LOGW(TAG, "No message handler registered");
-                }
-            }
-            else {
-                printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-                printf("DATA=%.*s\r\n", event->data_len, event->data);
+        case MQTT_EVENT_DATA: {
+            HOT_LOGI(TAG, "MQTT_EVENT_DATA");
+            reassembly_msg_t msg;
+            if (reassembly_feed(event->msg_id, event->topic, event->topic_len, event->data, event->data_len,
+                                event->current_data_offset, event->total_data_len, &msg)) {
+                dispatch(msg.topic, msg.topic_len, msg.data, msg.len);
+                reassembly_release(&msg);
             }
             break;
+        }
         case MQTT_EVENT_ERROR:
             ESP_LOGW(TAG, "MQTT_EVENT_ERROR");
             if (event->error_handle->error_type == MQTT_ERROR_TYPE_TCP_TRANSPORT) {
                 ESP_LOGW(TAG, "Last errno string (%s)", strerror(event->error_handle->esp_transport_sock_errno));
             }
+#if CONFIG_MIST_MQTT5
+            if (event->error_handle->error_type == MQTT_ERROR_TYPE_CONNECTION_REFUSED &&
+                (event->error_handle->connect_return_code == MQTT_CONNECTION_REFUSE_PROTOCOL ||
+                 (int)event->error_handle->connect_return_code == MQTT5_UNSUPPORTED_PROTOCOL_VER)) {
+                fall_back_to_311();
+            }
+#endif
             break;
         default:
             ESP_LOGW(TAG, "Unknown event id:%d", event->event_id);
@@ -110,32 +362,55 @@ static void event_handler(void *handler_args, esp_event_base_t base, int32_t eve
     }
 }
 
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+static void inject_task(void *arg) {
+    injected_t msg;
+    s_client_task = xTaskGetCurrentTaskHandle();
+    while (1) {
+        xQueueReceive(s_injected, &msg, portMAX_DELAY);
+        dispatch(msg.topic, strlen(msg.topic), msg.data, msg.len);
+    }
+}
+#endif
+
 esp_err_t init_mqtt() {
     ESP_LOGI(TAG, "Initializing MQTT s_client");
 
-    size_t broker_uri_len = 128;
-    size_t username_len = 64;
-    size_t password_len = 128;
-    size_t ca_cert_len = 2048;
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+    // Stand-in broker for load generation: the connection is up from the start
+    // and publishes are counted, then dropped
+    ESP_LOGW(TAG, "Dry publish mode, nothing is sent to the broker");
+    s_injected = xQueueCreate(INJECT_QUEUE_LEN, sizeof(injected_t));
+    if (s_injected == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(inject_task, "mqtt_inject", 4096, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create inject task");
+        return ESP_FAIL;
+    }
+    return build_topics("loadgen");
+#endif
 
-    // Buffers to hold the credentials
-    char *broker_uri = malloc(broker_uri_len);
-    char *username = malloc(username_len);
-    char *password = malloc(password_len);
-    char *ca_cert = malloc(ca_cert_len); 
+    char user_id[MQTT_USER_ID_LEN];
 
     // Read credentials from NVS
-    esp_err_t err = read_credentials(broker_uri, broker_uri_len, username, username_len, password, password_len, ca_cert, ca_cert_len);
+    esp_err_t err = read_credentials(s_broker_uri, sizeof(s_broker_uri), s_username, sizeof(s_username),
+                                     s_password, sizeof(s_password), s_ca_cert, sizeof(s_ca_cert), user_id, sizeof(user_id));
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read MQTT credentials");
         return err;
     }
 
+    err = build_topics(user_id);
+    if (err != ESP_OK) {
+        return err;
+    }
+
     esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = broker_uri,
-        .credentials.username = username,
-        .credentials.authentication.password = password,
-        .broker.verification.certificate = ca_cert,
+        .broker.address.uri = s_broker_uri,
+        .credentials.username = s_username,
+        .credentials.authentication.password = s_password,
+        .broker.verification.certificate = s_ca_cert,
         .network.timeout_ms = 10000,
         .network.reconnect_timeout_ms = 5000,
         .session.keepalive = 60,
@@ -143,25 +418,233 @@ esp_err_t init_mqtt() {
         .broker.verification.skip_cert_common_name_check = false,
     };
 
+#if CONFIG_MIST_TLS_SESSION_RESUMPTION
+    // The client applies none of the TLS settings above to a transport it is
+    // given, the transport verifies against the CA certificate itself. Only
+    // for mqtts://, a plain broker URI must not be upgraded to TLS.
+    if (strncmp(s_broker_uri, "mqtts://", strlen("mqtts://")) == 0) {
+        mqtt_cfg.network.transport = tls_transport_init(s_ca_cert);
+        if (mqtt_cfg.network.transport == NULL) {
+            ESP_LOGE(TAG, "Failed to create TLS transport");
+            return ESP_ERR_NO_MEM;
+        }
+    } else {
+        ESP_LOGI(TAG, "Broker URI is not mqtts://, TLS session resumption unused");
+    }
+#endif
+
+#if CONFIG_MIST_MQTT5
+    mqtt_cfg.session.protocol_ver = MQTT_PROTOCOL_V_5;
+    s_protocol = MQTT_PROTOCOL_V_5;
+    mist_outbox_set_protocol(true);
+    // Kept to switch the protocol version on a running client
+    s_mqtt_cfg = mqtt_cfg;
+#endif
+
     s_client = esp_mqtt_client_init(&mqtt_cfg);
+    if (s_client == NULL) {
+        ESP_LOGE(TAG, "Failed to create MQTT client");
+        return ESP_FAIL;
+    }
     esp_mqtt_client_register_event(s_client, ESP_EVENT_ANY_ID, event_handler, NULL);
-    esp_mqtt_client_start(s_client);
-    
+
     ESP_LOGI(TAG, "MQTT client initialized");
 
     return ESP_OK;
 }
 
-esp_err_t mqtt_publish(const char *topic, const char *data) {
-    int msg_id = esp_mqtt_client_publish(s_client, topic, data, 0, 0, 0);
-    ESP_LOGI(TAG, "Sent publish successful, msg_id=%d", msg_id);
+esp_err_t mqtt_start(void) {
+    if (s_started) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s_started = true;
+
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+    // The stand-in broker is connected from the start
+    notify_connection(true);
     return ESP_OK;
+#endif
+
+    if (s_client == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = esp_mqtt_client_start(s_client);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start MQTT client: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Returns the index of one of our topics, MQTT_TOPIC_MAX for any other topic
+static mqtt_topic_t topic_index(const char *topic) {
+    for (int i = 0; i < MQTT_TOPIC_MAX; i++) {
+        if (topic == s_topics[i] || strcmp(topic, s_topics[i]) == 0) {
+            return i;
+        }
+    }
+    return MQTT_TOPIC_MAX;
+}
+
+// Hands a message to the client, which copies it. With the outbox, class and
+// publish properties go along with the message itself: the client calls the
+// outbox from this task with its lock held, so nothing another task publishes
+// meanwhile can take them.
+static int client_publish(const char *topic, const char *data, size_t len, int qos, mist_outbox_class_t cls) {
+#if CONFIG_MIST_MQTT_OUTBOX
+    mist_outbox_publish_t publish = { .cls = cls };
+#if CONFIG_MIST_MQTT5
+    mqtt_topic_t index = topic_index(topic);
+    if (index < MQTT_TOPIC_MAX) {
+        publish.content_type = CONTENT_TYPE[index];
+        if (qos == 0 && cls == MIST_OUTBOX_TELEMETRY) {
+            publish.topic_alias = TOPIC_ALIAS[index];
+        }
+    }
+#endif
+    // Even QoS 0 messages go through the outbox, otherwise they would be written
+    // from the calling task right away, ahead of any queued control message
+    mist_outbox_set_next_publish(&publish);
+    int msg_id = esp_mqtt_client_enqueue(s_client, topic, data, len, qos, 0, true);
+    mist_outbox_set_next_publish(NULL);
+    return msg_id;
+#else
+    return esp_mqtt_client_publish(s_client, topic, data, len, qos, 0);
+#endif
+}
+
+esp_err_t mqtt_publish(const char *topic, const char *data, size_t len) {
+    return mqtt_publish_qos(topic, data, len, 0);
 }
 
-void mqtt_register_recv_msg_handler(mqtt_recv_msg_handler_t handler) {
-    s_recv_msg_handler = handler;
+esp_err_t mqtt_publish_qos(const char *topic, const char *data, size_t len, int qos) {
+    bool control = topic_index(topic) == MQTT_TOPIC_COMMANDS_STATUS;
+    return mqtt_publish_class(topic, data, len, qos, control ? MIST_OUTBOX_CONTROL : MIST_OUTBOX_TELEMETRY, NULL);
 }
 
-void mqtt_deregister_recv_msg_handler(void) {
-    s_recv_msg_handler = NULL;
+esp_err_t mqtt_publish_class(const char *topic, const char *data, size_t len, int qos, mist_outbox_class_t cls, int *msg_id_out) {
+    int64_t sent_us = esp_timer_get_time();
+
+    // Handlers run on the client task with the client lock held. Publishing from
+    // there re-enters the client in the middle of its dispatch, so handlers hand
+    // anything to publish to a task of their own instead.
+    if (xTaskGetCurrentTaskHandle() == s_client_task) {
+        ESP_LOGE(TAG, "Publish to %s from an MQTT handler refused, hand it to a task", topic);
+        s_stats.failed++;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+    static int s_dry_msg_id;
+    s_stats.publishes++;
+    s_stats.bytes += len > 0 ? len : strlen(data);
+    if (qos > 0) {
+        // Acknowledged as soon as it is sent
+        int dry_msg_id = ++s_dry_msg_id & 0xFFFF;
+        if (msg_id_out != NULL) *msg_id_out = dry_msg_id;
+        notify_published(dry_msg_id);
+    }
+    return ESP_OK;
+#endif
+
+    // The client copies the payload, so callers may reuse data as soon as this returns
+    int msg_id = client_publish(topic, data, len, qos, cls);
+    if (msg_id < 0) {
+        s_stats.failed++;
+        ESP_LOGE(TAG, "Failed to publish to %s", topic);
+        return ESP_FAIL;
+    }
+    s_stats.publishes++;
+    s_stats.bytes += len > 0 ? len : strlen(data);
+    HOT_LOGI(TAG, "Sent publish successful, msg_id=%d", msg_id);
+    if (msg_id_out != NULL) {
+        *msg_id_out = msg_id;
+    }
+
+    if (qos > 0) {
+        pending_ack_t *pending = &s_pending_acks[msg_id % MQTT_PENDING_ACKS];
+        portENTER_CRITICAL(&s_pending_acks_lock);
+        pending->msg_id = msg_id;
+        pending->sent_us = sent_us;
+        portEXIT_CRITICAL(&s_pending_acks_lock);
+    }
+    return ESP_OK;
+}
+
+esp_err_t mqtt_inject(const char *topic, const uint8_t *data, size_t len) {
+#if CONFIG_MIST_LOADGEN_DRY_PUBLISH
+    size_t topic_len = strlen(topic);
+    if (s_injected == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (topic_len >= MQTT_TOPIC_LEN || len > INJECT_MAX_LEN) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    injected_t msg = { .len = len };
+    memcpy(msg.topic, topic, topic_len + 1);
+    memcpy(msg.data, data, len);
+    return xQueueSend(s_injected, &msg, 0) == pdTRUE ? ESP_OK : ESP_ERR_NO_MEM;
+#else
+    // The broker delivers it back to us since we are subscribed to the topic
+    if (xTaskGetCurrentTaskHandle() == s_client_task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    int msg_id = client_publish(topic, (const char *)data, len, 0, MIST_OUTBOX_CONTROL);
+    return msg_id < 0 ? ESP_FAIL : ESP_OK;
+#endif
+}
+
+void mqtt_get_stats(mqtt_stats_t *stats) {
+    *stats = s_stats;
+}
+
+const char *mqtt_topic(mqtt_topic_t topic) {
+    return s_topics[topic];
+}
+
+bool mqtt_is_connected(void) {
+    return s_connected;
+}
+
+esp_err_t mqtt_register_connection_handler(mqtt_connection_handler_t handler) {
+    for (int i = 0; i < MQTT_MAX_CONNECTION_HANDLERS; i++) {
+        if (s_connection_handlers[i] == NULL) {
+            s_connection_handlers[i] = handler;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t mqtt_register_published_handler(mqtt_published_handler_t handler) {
+    for (int i = 0; i < MQTT_MAX_PUBLISHED_HANDLERS; i++) {
+        if (s_published_handlers[i] == NULL) {
+            s_published_handlers[i] = handler;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+esp_err_t mqtt_subscribe(const char *filter, int qos, mqtt_recv_msg_handler_t handler) {
+    if (s_started) {
+        ESP_LOGE(TAG, "Subscribing to %s after the client started", filter);
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_subscription_count == MQTT_MAX_SUBSCRIPTIONS) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_subscription_count == 0) {
+        topic_trie_init(&s_topic_trie);
+    }
+
+    int index = s_subscription_count;
+    s_subscriptions[index] = (subscription_t){ .filter = filter, .qos = qos, .handler = handler };
+    esp_err_t err = topic_trie_add(&s_topic_trie, filter, index);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to add topic filter %s: %s", filter, esp_err_to_name(err));
+        return err;
+    }
+    s_subscription_count++;
+    return ESP_OK;
 }
\ No newline at end of file
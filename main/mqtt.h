@@ -1,11 +1,86 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+#include "mist_outbox.h"
+
+// Per-master topics, see README.md
+typedef enum {
+    MQTT_TOPIC_SENSORS,
+    MQTT_TOPIC_COMMANDS,
+    MQTT_TOPIC_COMMANDS_STATUS,
+    MQTT_TOPIC_METRICS,
+    MQTT_TOPIC_SUMMARIES,
+    MQTT_TOPIC_HISTORY,
+    MQTT_TOPIC_HISTORY_QUERY,
+    MQTT_TOPIC_MAX,
+} mqtt_topic_t;
+
+// Reads the credentials and creates the client without connecting it
 esp_err_t init_mqtt();
 
-esp_err_t mqtt_publish(const char *topic, const char *data);
+// Connects the client. Every mqtt_subscribe() must have happened before, the
+// filters are subscribed to on every connect.
+esp_err_t mqtt_start(void);
+
+// Returns /<user_id>/master/<master_mac_address>/<suffix> for the given topic.
+// Only valid after init_mqtt() succeeded.
+const char *mqtt_topic(mqtt_topic_t topic);
+
+// Publishes len bytes of data. A len of 0 publishes data as a null terminated string.
+// Returns ESP_ERR_INVALID_STATE when called from one of the handlers below, which
+// run on the client task; they hand anything to publish to another task.
+esp_err_t mqtt_publish(const char *topic, const char *data, size_t len);
+
+// Same as mqtt_publish() at the given QoS. The time until a QoS 1 or 2 publish is
+// acknowledged is recorded as METRICS_STAGE_ACK.
+esp_err_t mqtt_publish_qos(const char *topic, const char *data, size_t len, int qos);
+
+// Same as mqtt_publish_qos() in the given outbox class. The other publish
+// functions put commands/status in MIST_OUTBOX_CONTROL and everything else in
+// MIST_OUTBOX_TELEMETRY; besides command status, MIST_OUTBOX_CONTROL only holds
+// the client's own packets, e.g. SUBSCRIBE. With CONFIG_MIST_MQTT_OUTBOX every
+// publish is queued and sent by the client task in class order, otherwise the
+// class is ignored. If msg_id is not NULL it receives the id the published
+// handlers are called with once a QoS 1 or 2 publish is acknowledged.
+esp_err_t mqtt_publish_class(const char *topic, const char *data, size_t len, int qos, mist_outbox_class_t cls, int *msg_id);
+
+bool mqtt_is_connected(void);
+
+// Delivers data as if it had been received on topic. With MIST_LOADGEN_DRY_PUBLISH
+// the message is copied to a queue and the registered handler is called from the
+// task draining it, as the client task would; ESP_ERR_NO_MEM when the queue is
+// full. Otherwise data is published to topic and comes back through the broker,
+// so the master must be subscribed to it.
+esp_err_t mqtt_inject(const char *topic, const uint8_t *data, size_t len);
+
+typedef struct {
+    uint32_t publishes;
+    uint32_t bytes;
+    uint32_t failed;
+} mqtt_stats_t;
+
+void mqtt_get_stats(mqtt_stats_t *stats);
+
+// topic is not null terminated. data holds the complete message, reassembled if
+// the client received it in fragments, and is only valid until the handler returns.
+typedef esp_err_t (*mqtt_recv_msg_handler_t)(const char *topic, size_t topic_len, const uint8_t *data, size_t len);
+
+// Subscribes to filter, which may contain + and # wildcards and must stay valid,
+// and delivers matching messages to handler. When several filters match a topic,
+// the one with the most exact levels wins. Only between init_mqtt() and
+// mqtt_start(), ESP_ERR_INVALID_STATE afterwards.
+esp_err_t mqtt_subscribe(const char *filter, int qos, mqtt_recv_msg_handler_t handler);
+typedef void (*mqtt_connection_handler_t)(bool connected);
 
-typedef esp_err_t (*mqtt_recv_msg_handler_t)(const char *topic, const uint8_t *data, int data_len);
+// Registers a handler called from the MQTT event task on every connect and disconnect
+esp_err_t mqtt_register_connection_handler(mqtt_connection_handler_t handler);
 
-void mqtt_register_recv_msg_handler(mqtt_recv_msg_handler_t handler);
+typedef void (*mqtt_published_handler_t)(int msg_id);
 
-void mqtt_deregister_recv_msg_handler(void);
\ No newline at end of file
+// Registers a handler called from the MQTT event task when the broker acknowledged
+// a QoS 1 or 2 publish. The handler must not publish, as the event task holds the
+// client lock. With MIST_LOADGEN_DRY_PUBLISH it is called from the publishing task.
+esp_err_t mqtt_register_published_handler(mqtt_published_handler_t handler);
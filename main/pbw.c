@@ -0,0 +1,37 @@
+#include "pbw.h"
+
+bool pbw_uint(pb_ostream_t *stream, uint32_t field, uint64_t value) {
+    return pb_encode_tag(stream, PB_WT_VARINT, field) && pb_encode_varint(stream, value);
+}
+
+bool pbw_sint(pb_ostream_t *stream, uint32_t field, int64_t value) {
+    return pb_encode_tag(stream, PB_WT_VARINT, field) && pb_encode_svarint(stream, value);
+}
+
+bool pbw_bytes(pb_ostream_t *stream, uint32_t field, const void *data, size_t len) {
+    return pb_encode_tag(stream, PB_WT_STRING, field) && pb_encode_string(stream, data, len);
+}
+
+bool pbw_packed_uint32(pb_ostream_t *stream, uint32_t field, const uint32_t *values, size_t count) {
+    pb_ostream_t sizing = PB_OSTREAM_SIZING;
+    for (size_t i = 0; i < count; i++) {
+        pb_encode_varint(&sizing, values[i]);
+    }
+
+    if (!pb_encode_tag(stream, PB_WT_STRING, field) || !pb_encode_varint(stream, sizing.bytes_written)) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!pb_encode_varint(stream, values[i])) return false;
+    }
+    return true;
+}
+
+bool pbw_submessage(pb_ostream_t *stream, uint32_t field, pbw_encode_fn fn, const void *arg) {
+    pb_ostream_t sizing = PB_OSTREAM_SIZING;
+    if (!fn(&sizing, arg)) {
+        return false;
+    }
+    return pb_encode_tag(stream, PB_WT_STRING, field) && pb_encode_varint(stream, sizing.bytes_written) &&
+           fn(stream, arg);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pb_encode.h"
+
+// Helpers for encoding the master's own messages (master.proto) field by field
+// with the nanopb stream primitives, since they are not generated by nanopb.
+
+bool pbw_uint(pb_ostream_t *stream, uint32_t field, uint64_t value);
+
+bool pbw_sint(pb_ostream_t *stream, uint32_t field, int64_t value);
+
+bool pbw_bytes(pb_ostream_t *stream, uint32_t field, const void *data, size_t len);
+
+// Packed repeated uint32
+bool pbw_packed_uint32(pb_ostream_t *stream, uint32_t field, const uint32_t *values, size_t count);
+
+typedef bool (*pbw_encode_fn)(pb_ostream_t *stream, const void *arg);
+
+// Encodes fn as a length delimited submessage. fn runs twice, once to size it.
+bool pbw_submessage(pb_ostream_t *stream, uint32_t field, pbw_encode_fn fn, const void *arg);
@@ -0,0 +1,394 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <nvs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "comm.h"
+#include "peers.h"
+
+static const char *TAG = "peers";
+
+#define PEER_CAPACITY CONFIG_MIST_PEER_CAPACITY
+
+// Index buckets at twice the capacity keep linear probe chains short
+#define BUCKET_COUNT (2 * PEER_CAPACITY)
+#define BUCKET_EMPTY 0xFFFF
+
+_Static_assert((PEER_CAPACITY & (PEER_CAPACITY - 1)) == 0, "peer capacity must be a power of two");
+_Static_assert(PEER_CAPACITY < BUCKET_EMPTY, "peer index must fit in a bucket");
+
+// ESP-NOW holds a peer entry, which unicast frames need, for only a few
+// addresses, one of them the broadcast address. They are kept for the addresses
+// sent to most recently.
+#define ESPNOW_ENTRIES (ESP_NOW_MAX_TOTAL_PEER_NUM - 1)
+
+#define NVS_NAMESPACE "mist"
+#define NVS_KEY_PEERS "peers"
+
+static peer_t s_peers[PEER_CAPACITY];
+static uint16_t s_buckets[BUCKET_COUNT];
+static uint32_t s_count;
+
+static SemaphoreHandle_t s_lock;
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    bool used;
+    uint32_t last_used;     // s_espnow_clock at the last send
+} espnow_entry_t;
+
+// Rate frames to a peer are sent at, applied again whenever its entry is added
+typedef struct {
+    uint8_t phymode;        // wifi_phy_mode_t
+    uint8_t rate;           // wifi_phy_rate_t
+    bool set;
+} peer_rate_t;
+
+// Guarded by s_espnow_lock, which is never held together with s_lock
+static espnow_entry_t s_espnow[ESPNOW_ENTRIES];
+static uint32_t s_espnow_clock;
+// Indexed by peers_index()
+static peer_rate_t s_rates[PEER_CAPACITY];
+
+static SemaphoreHandle_t s_espnow_lock;
+
+// Pairings are stored in NVS as a packed array of MAC addresses
+static uint8_t s_nvs_macs[PEER_CAPACITY][ESP_NOW_ETH_ALEN];
+
+static inline uint32_t hash_mac(const uint8_t *mac) {
+    // The vendor prefix is shared by every sensor, so mix mostly the device specific bytes
+    uint32_t low = (uint32_t)mac[2] << 24 | (uint32_t)mac[3] << 16 | (uint32_t)mac[4] << 8 | mac[5];
+    uint32_t high = (uint32_t)mac[0] << 8 | mac[1];
+    return (low ^ (high * 0x9E3779B1u)) * 0x85EBCA6Bu;
+}
+
+static inline uint32_t home_bucket(const uint8_t *mac) {
+    return hash_mac(mac) >> 16 & (BUCKET_COUNT - 1);
+}
+
+// Returns the bucket holding mac, or the empty bucket where it would be inserted
+static uint32_t probe(const uint8_t *mac) {
+    uint32_t bucket = home_bucket(mac);
+    while (s_buckets[bucket] != BUCKET_EMPTY &&
+           memcmp(s_peers[s_buckets[bucket]].mac_addr, mac, ESP_NOW_ETH_ALEN) != 0) {
+        bucket = (bucket + 1) & (BUCKET_COUNT - 1);
+    }
+    return bucket;
+}
+
+static esp_err_t persist(void) {
+    size_t n = 0;
+    for (int i = 0; i < PEER_CAPACITY; i++) {
+        if (s_peers[i].state != PEER_STATE_FREE) {
+            memcpy(s_nvs_macs[n++], s_peers[i].mac_addr, ESP_NOW_ETH_ALEN);
+        }
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+    err = nvs_set_blob(handle, NVS_KEY_PEERS, s_nvs_macs, n * ESP_NOW_ETH_ALEN);
+    if (err == ESP_OK) {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to persist peers: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+static peer_t *insert(const uint8_t *mac_addr, bool *added) {
+    *added = false;
+    uint32_t bucket = probe(mac_addr);
+    if (s_buckets[bucket] != BUCKET_EMPTY) {
+        return &s_peers[s_buckets[bucket]];
+    }
+
+    if (s_count == PEER_CAPACITY) {
+        return NULL;
+    }
+
+    int index = 0;
+    while (s_peers[index].state != PEER_STATE_FREE) index++;
+
+    peer_t *peer = &s_peers[index];
+    memset(peer, 0, sizeof(*peer));
+    memcpy(peer->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    peer->state = PEER_STATE_PAIRED;
+    peer->sensor_type = 0xFF;
+
+    s_buckets[bucket] = index;
+    s_count++;
+    *added = true;
+    return peer;
+}
+
+// Index of the ESP-NOW entry of mac_addr, -1 if it has none
+static int find_entry(const uint8_t *mac_addr) {
+    for (int i = 0; i < ESPNOW_ENTRIES; i++) {
+        if (s_espnow[i].used && memcmp(s_espnow[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static esp_err_t apply_rate(const uint8_t *mac_addr, const peer_rate_t *rate) {
+    esp_now_rate_config_t config = { .phymode = rate->phymode, .rate = rate->rate };
+    esp_err_t err = esp_now_set_peer_rate_config(mac_addr, &config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Setting rate of "MACSTR" failed: %s", MAC2STR(mac_addr), esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Makes sure mac_addr has an ESP-NOW entry, in place of the least recently used
+// one when all are taken. index is the registry index of mac_addr, -1 for
+// addresses that are not paired.
+static esp_err_t use_entry(const uint8_t *mac_addr, int index) {
+    int victim = 0;
+    for (int i = 0; i < ESPNOW_ENTRIES; i++) {
+        espnow_entry_t *entry = &s_espnow[i];
+        if (entry->used && memcmp(entry->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            entry->last_used = ++s_espnow_clock;
+            return ESP_OK;
+        }
+        if (s_espnow[victim].used && (!entry->used || entry->last_used < s_espnow[victim].last_used)) {
+            victim = i;
+        }
+    }
+
+    espnow_entry_t *entry = &s_espnow[victim];
+    if (entry->used) {
+        ESP_LOGD(TAG, "ESP-NOW entry of "MACSTR" goes to "MACSTR"", MAC2STR(entry->mac_addr), MAC2STR(mac_addr));
+        esp_now_del_peer(entry->mac_addr);
+        entry->used = false;
+    }
+    esp_err_t err = comm_add_peer(mac_addr, false);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Could not add ESP-NOW peer "MACSTR": %s", MAC2STR(mac_addr), esp_err_to_name(err));
+        return err;
+    }
+    memcpy(entry->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    entry->used = true;
+    entry->last_used = ++s_espnow_clock;
+
+    if (index >= 0 && s_rates[index].set) {
+        apply_rate(mac_addr, &s_rates[index]);
+    }
+    return ESP_OK;
+}
+
+static void forget_espnow(const uint8_t *mac_addr, int index) {
+    xSemaphoreTake(s_espnow_lock, portMAX_DELAY);
+    int entry = find_entry(mac_addr);
+    if (entry >= 0) {
+        esp_now_del_peer(mac_addr);
+        s_espnow[entry].used = false;
+    }
+    s_rates[index].set = false;
+    xSemaphoreGive(s_espnow_lock);
+}
+
+peer_t *peers_add(const uint8_t *mac_addr) {
+    bool added;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    peer_t *peer = insert(mac_addr, &added);
+    if (added) {
+        persist();
+    }
+    xSemaphoreGive(s_lock);
+
+    if (peer == NULL) {
+        ESP_LOGW(TAG, "Peer registry full, ignoring "MACSTR"", MAC2STR(mac_addr));
+    } else if (added) {
+        ESP_LOGI(TAG, "Paired "MACSTR", %" PRIu32 " peers", MAC2STR(mac_addr), s_count);
+    }
+    return peer;
+}
+
+esp_err_t peers_remove(const uint8_t *mac_addr) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+
+    uint32_t bucket = probe(mac_addr);
+    if (s_buckets[bucket] == BUCKET_EMPTY) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    int index = s_buckets[bucket];
+    s_peers[index].state = PEER_STATE_FREE;
+    s_buckets[bucket] = BUCKET_EMPTY;
+    s_count--;
+
+    // Backward shift deletion: move later entries of the probe chain into the hole
+    // so lookups never need tombstones
+    uint32_t hole = bucket;
+    for (uint32_t next = (hole + 1) & (BUCKET_COUNT - 1); s_buckets[next] != BUCKET_EMPTY;
+         next = (next + 1) & (BUCKET_COUNT - 1)) {
+        uint32_t home = home_bucket(s_peers[s_buckets[next]].mac_addr);
+        // Move the entry unless its home lies cyclically in (hole, next]
+        bool in_place = (hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!in_place) {
+            s_buckets[hole] = s_buckets[next];
+            s_buckets[next] = BUCKET_EMPTY;
+            hole = next;
+        }
+    }
+
+    persist();
+    xSemaphoreGive(s_lock);
+
+    forget_espnow(mac_addr, index);
+    return ESP_OK;
+}
+
+peer_t *peers_find(const uint8_t *mac_addr) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t bucket = probe(mac_addr);
+    peer_t *peer = s_buckets[bucket] == BUCKET_EMPTY ? NULL : &s_peers[s_buckets[bucket]];
+    xSemaphoreGive(s_lock);
+    return peer;
+}
+
+peer_t *peers_touch(const uint8_t *mac_addr, int64_t now_us) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t bucket = probe(mac_addr);
+    peer_t *peer = s_buckets[bucket] == BUCKET_EMPTY ? NULL : &s_peers[s_buckets[bucket]];
+    if (peer != NULL) {
+        peer->state = PEER_STATE_ACTIVE;
+        peer->last_seen_us = now_us;
+        peer->rx_count++;
+    }
+    xSemaphoreGive(s_lock);
+    return peer;
+}
+
+esp_err_t peers_update(const uint8_t *mac_addr, void (*fn)(peer_t *peer, void *arg), void *arg) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t bucket = probe(mac_addr);
+    bool found = s_buckets[bucket] != BUCKET_EMPTY;
+    if (found) {
+        fn(&s_peers[s_buckets[bucket]], arg);
+    }
+    xSemaphoreGive(s_lock);
+    return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+bool peers_get(int index, peer_t *copy) {
+    if (index < 0 || index >= PEER_CAPACITY) {
+        return false;
+    }
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    bool found = s_peers[index].state != PEER_STATE_FREE;
+    if (found) {
+        *copy = s_peers[index];
+    }
+    xSemaphoreGive(s_lock);
+    return found;
+}
+
+esp_err_t peers_send(const void *data, size_t len, const uint8_t *mac_addr) {
+    peer_t *peer = peers_find(mac_addr);
+    int index = peer != NULL ? peers_index(peer) : -1;
+
+    // Held until the frame is handed to ESP-NOW, so no other send takes the entry meanwhile
+    xSemaphoreTake(s_espnow_lock, portMAX_DELAY);
+    esp_err_t err = use_entry(mac_addr, index);
+    if (err == ESP_OK) {
+        err = comm_send(data, len, mac_addr);
+    }
+    xSemaphoreGive(s_espnow_lock);
+    return err;
+}
+
+esp_err_t peers_set_rate(const uint8_t *mac_addr, const esp_now_rate_config_t *config) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    xSemaphoreTake(s_espnow_lock, portMAX_DELAY);
+    peer_rate_t *rate = &s_rates[peers_index(peer)];
+    rate->phymode = config->phymode;
+    rate->rate = config->rate;
+    rate->set = true;
+    // Otherwise applied once the peer gets an entry
+    esp_err_t err = find_entry(mac_addr) >= 0 ? apply_rate(mac_addr, rate) : ESP_OK;
+    xSemaphoreGive(s_espnow_lock);
+    return err;
+}
+
+int peers_index(const peer_t *peer) {
+    return peer - s_peers;
+}
+
+peer_t *peers_at(int index) {
+    if (index < 0 || index >= PEER_CAPACITY || s_peers[index].state == PEER_STATE_FREE) {
+        return NULL;
+    }
+    return &s_peers[index];
+}
+
+uint32_t peers_count(void) {
+    return s_count;
+}
+
+void peers_foreach(void (*fn)(peer_t *peer, void *arg), void *arg) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < PEER_CAPACITY; i++) {
+        if (s_peers[i].state != PEER_STATE_FREE) {
+            fn(&s_peers[i], arg);
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t peers_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    s_espnow_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL || s_espnow_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memset(s_buckets, 0xFF, sizeof(s_buckets));
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No persisted peers");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NVS: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    size_t len = sizeof(s_nvs_macs);
+    err = nvs_get_blob(handle, NVS_KEY_PEERS, s_nvs_macs, &len);
+    nvs_close(handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No persisted peers");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read persisted peers: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    // ESP-NOW entries are added on the first send to each peer
+    for (size_t i = 0; i < len / ESP_NOW_ETH_ALEN; i++) {
+        bool added;
+        insert(s_nvs_macs[i], &added);
+    }
+
+    ESP_LOGI(TAG, "Restored %" PRIu32 " peers", s_count);
+    return ESP_OK;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_now.h>
+
+// Registry of paired sensors, keyed by MAC address. Lookups are O(1) through an
+// open addressing index; peer entries never move, so a peer_t pointer stays
+// valid until the peer is removed. Pairings are persisted in NVS and restored
+// at boot without a new handshake.
+//
+// ESP-NOW needs a peer entry to send a unicast frame and holds only
+// ESP_NOW_MAX_TOTAL_PEER_NUM of them, far fewer than the registry. Entries are
+// therefore a cache of the addresses sent to most recently: peers_send() adds
+// the entry of its destination, evicting the least recently used one when all
+// are taken. Every unicast frame goes through it.
+
+typedef enum {
+    PEER_STATE_FREE = 0,
+    PEER_STATE_PAIRED,      // Handshake seen, nothing received since boot
+    PEER_STATE_ACTIVE,      // Sent data since boot
+} peer_state_t;
+
+// Link quality, kept by linkq with CONFIG_MIST_LINKQ. Written through
+// peers_update(): linkq for the receive side and the rate, rlink for send outcomes.
+typedef struct {
+    int16_t rssi_x16;       // EWMA of the RSSI of received frames in 1/16 dBm, valid once rx_frames > 0
+    uint8_t rx_rate;        // wifi_phy_rate_t of the last frame received
+    uint8_t tx_rate;        // wifi_phy_rate_t frames to the peer are sent at
+    uint32_t rx_frames;     // Frames whose RSSI was seen
+    uint32_t tx_attempts;   // Transmissions whose outcome is known
+    uint32_t tx_delivered;
+    bool stale;             // Not heard from for CONFIG_MIST_LINKQ_STALE_S
+} peer_link_t;
+
+// Fields other than the MAC address change under the registry lock, through
+// peers_touch() and peers_update(). Read them through peers_get() where a
+// consistent view matters; last_seen_us alone takes two loads on the C6.
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint8_t state;
+    uint8_t sensor_type;    // SensorType of the last reading, 0xFF until one is received
+    int64_t last_seen_us;
+    uint32_t rx_count;
+    peer_link_t link;
+} peer_t;
+
+// Restores persisted pairings
+esp_err_t peers_init(void);
+
+// Adds a peer, or returns the existing one. New pairings are persisted.
+// Returns NULL when the registry is full.
+peer_t *peers_add(const uint8_t *mac_addr);
+
+esp_err_t peers_remove(const uint8_t *mac_addr);
+
+peer_t *peers_find(const uint8_t *mac_addr);
+
+// Records a frame received from mac_addr. Returns NULL for unknown peers.
+peer_t *peers_touch(const uint8_t *mac_addr, int64_t now_us);
+
+// Calls fn on the peer with mac_addr under the registry lock. fn must not call
+// into peers. Returns ESP_ERR_NOT_FOUND for unknown peers.
+esp_err_t peers_update(const uint8_t *mac_addr, void (*fn)(peer_t *peer, void *arg), void *arg);
+
+// Copies the peer at index under the registry lock. Returns false if that entry is free.
+bool peers_get(int index, peer_t *copy);
+
+// Index of peer in [0, CONFIG_MIST_PEER_CAPACITY), stable while the peer is paired.
+// Modules keeping per-peer state use it to index their own tables.
+int peers_index(const peer_t *peer);
+
+// Returns the peer at index, or NULL if that entry is free
+peer_t *peers_at(int index);
+
+uint32_t peers_count(void);
+
+// Sends a unicast frame through comm, adding the ESP-NOW entry of mac_addr first
+// if it has none. mac_addr need not be paired.
+esp_err_t peers_send(const void *data, size_t len, const uint8_t *mac_addr);
+
+// Sets the PHY rate frames to a paired peer are sent at. Kept with the peer and
+// applied again whenever it gets an ESP-NOW entry anew.
+esp_err_t peers_set_rate(const uint8_t *mac_addr, const esp_now_rate_config_t *config);
+
+// Calls fn for every paired peer. fn must not add or remove peers.
+void peers_foreach(void (*fn)(peer_t *peer, void *arg), void *arg);
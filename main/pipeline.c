@@ -0,0 +1,150 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include "sdkconfig.h"
+#include "spsc_ring.h"
+#include "metrics.h"
+#include "pipeline.h"
+
+static const char *TAG = "pipeline";
+
+#define FRAME_DEPTH CONFIG_MIST_PIPELINE_FRAME_DEPTH
+#define READING_DEPTH CONFIG_MIST_PIPELINE_READING_DEPTH
+
+_Static_assert((FRAME_DEPTH & (FRAME_DEPTH - 1)) == 0, "frame ring depth must be a power of two");
+_Static_assert((READING_DEPTH & (READING_DEPTH - 1)) == 0, "reading ring depth must be a power of two");
+
+static pipeline_frame_t s_frame_slots[FRAME_DEPTH];
+static pipeline_reading_t s_reading_slots[READING_DEPTH];
+
+static spsc_ring_t s_frames;
+static spsc_ring_t s_readings;
+
+static TaskHandle_t s_decode_task;
+static TaskHandle_t s_publish_task;
+
+static pipeline_frame_handler_t s_frame_handler;
+static pipeline_reading_handler_t s_reading_handler;
+
+// Each counter has a single writer, the stage that owns it
+static pipeline_stats_t s_stats;
+
+esp_err_t pipeline_submit_frame(const CommTask_t *task) {
+    s_stats.frames_received++;
+
+    if (task->buffer_size <= 0 || task->buffer_size > ESP_NOW_MAX_DATA_LEN) {
+        s_stats.frames_invalid++;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    pipeline_frame_t *frame = spsc_ring_write_slot(&s_frames);
+    if (frame == NULL) {
+        s_stats.frames_dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    frame->rx_cycles = metrics_now();
+    frame->rx_time_us = esp_timer_get_time();
+    memcpy(frame->mac_addr, task->mac_addr, ESP_NOW_ETH_ALEN);
+    frame->len = task->buffer_size;
+    memcpy(frame->data, task->buffer, task->buffer_size);
+    spsc_ring_commit(&s_frames);
+
+    xTaskNotifyGive(s_decode_task);
+    return ESP_OK;
+}
+
+esp_err_t pipeline_submit_reading(const SensorData *sensor_data, const uint8_t *mac_addr, int64_t rx_time_us) {
+    pipeline_reading_t *slot = spsc_ring_write_slot(&s_readings);
+
+    // Hold the decode stage back while the publisher catches up. Frames keep
+    // arriving into the frame ring in the meantime.
+    for (int waited = 0; slot == NULL && waited < CONFIG_MIST_PIPELINE_BACKPRESSURE_MS; waited += portTICK_PERIOD_MS) {
+        vTaskDelay(1);
+        slot = spsc_ring_write_slot(&s_readings);
+    }
+
+    if (slot == NULL) {
+        s_stats.readings_dropped++;
+        return ESP_ERR_NO_MEM;
+    }
+
+    slot->data = *sensor_data;
+    memcpy(slot->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    slot->rx_time_us = rx_time_us;
+    slot->queued_cycles = metrics_now();
+    spsc_ring_commit(&s_readings);
+    s_stats.readings_queued++;
+
+    xTaskNotifyGive(s_publish_task);
+    return ESP_OK;
+}
+
+static void decode_frames(void) {
+    pipeline_frame_t *frame;
+    while ((frame = spsc_ring_read_slot(&s_frames)) != NULL) {
+        metrics_record(METRICS_STAGE_RX_QUEUE, frame->rx_cycles);
+
+        uint32_t start = metrics_now();
+        bool ok = s_frame_handler(frame) == ESP_OK;
+        metrics_record(METRICS_STAGE_DECODE, start);
+        metrics_peer_frame(frame->mac_addr, ok);
+        if (!ok) {
+            s_stats.frames_failed++;
+        }
+        spsc_ring_release(&s_frames);
+    }
+}
+
+static void publish_readings(void) {
+    pipeline_reading_t *reading;
+    while ((reading = spsc_ring_read_slot(&s_readings)) != NULL) {
+        metrics_record(METRICS_STAGE_READING_QUEUE, reading->queued_cycles);
+
+        uint32_t start = metrics_now();
+        s_reading_handler(reading);
+        metrics_record(METRICS_STAGE_HANDLE, start);
+        spsc_ring_release(&s_readings);
+        s_stats.readings_published++;
+    }
+}
+
+static void decode_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        decode_frames();
+    }
+}
+
+static void publish_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        publish_readings();
+    }
+}
+
+esp_err_t pipeline_init(pipeline_frame_handler_t frame_handler, pipeline_reading_handler_t reading_handler) {
+    s_frame_handler = frame_handler;
+    s_reading_handler = reading_handler;
+
+    spsc_ring_init(&s_frames, s_frame_slots, sizeof(s_frame_slots[0]), FRAME_DEPTH);
+    spsc_ring_init(&s_readings, s_reading_slots, sizeof(s_reading_slots[0]), READING_DEPTH);
+
+    // Decode above publish so ingest keeps up while the uplink is slow
+    if (xTaskCreate(decode_task, "pipe_decode", 4096, NULL, 6, &s_decode_task) != pdPASS ||
+        xTaskCreate(publish_task, "pipe_publish", 4096, NULL, 4, &s_publish_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create pipeline tasks");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Pipeline started, frame depth %d, reading depth %d", FRAME_DEPTH, READING_DEPTH);
+    return ESP_OK;
+}
+
+void pipeline_get_stats(pipeline_stats_t *stats) {
+    *stats = s_stats;
+    stats->frames_high_water = s_frames.high_water;
+    stats->readings_high_water = s_readings.high_water;
+}
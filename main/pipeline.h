@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_now.h>
+#include "comm.h"
+#include "messages.pb.h"
+
+// Receive path split into three stages so a slow uplink never stalls ESP-NOW:
+//
+//   comm callback --frames--> decode task --readings--> publisher task
+//
+// The comm callback only copies the raw frame into a lock-free ring. Frames are
+// dropped when that ring is full, since the radio cannot be slowed down. The
+// decode task applies backpressure instead: when the readings ring is full it
+// waits up to CONFIG_MIST_PIPELINE_BACKPRESSURE_MS for the publisher before
+// dropping the reading.
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint8_t len;
+    int64_t rx_time_us;     // esp_timer time the frame was received
+    uint32_t rx_cycles;     // metrics_now() when the frame was received
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} pipeline_frame_t;
+
+typedef struct {
+    SensorData data;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int64_t rx_time_us;     // esp_timer time the frame carrying the reading was received
+    uint32_t queued_cycles; // metrics_now() when the reading was queued
+} pipeline_reading_t;
+
+typedef struct {
+    uint32_t frames_received;
+    uint32_t frames_invalid;        // Empty or larger than an ESP-NOW frame
+    uint32_t frames_dropped;        // Frame ring full
+    uint32_t frames_failed;         // Rejected by the frame handler
+    uint32_t frames_high_water;
+    uint32_t readings_queued;
+    uint32_t readings_dropped;      // Readings ring still full after backpressure
+    uint32_t readings_published;
+    uint32_t readings_high_water;
+} pipeline_stats_t;
+
+// Runs in the decode task for every received frame
+typedef esp_err_t (*pipeline_frame_handler_t)(const pipeline_frame_t *frame);
+
+// Runs in the publisher task for every reading queued with pipeline_submit_reading()
+typedef void (*pipeline_reading_handler_t)(const pipeline_reading_t *reading);
+
+esp_err_t pipeline_init(pipeline_frame_handler_t frame_handler, pipeline_reading_handler_t reading_handler);
+
+// Comm receive callback: copies the frame into the frame ring and returns immediately
+esp_err_t pipeline_submit_frame(const CommTask_t *task);
+
+// Decode stage only: queues a decoded reading for the publisher task
+esp_err_t pipeline_submit_reading(const SensorData *sensor_data, const uint8_t *mac_addr, int64_t rx_time_us);
+
+void pipeline_get_stats(pipeline_stats_t *stats);
@@ -0,0 +1,40 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "sdkconfig.h"
+#include "pub_pool.h"
+
+#define POOL_COUNT CONFIG_MIST_PUB_POOL_COUNT
+
+_Static_assert(POOL_COUNT > 0 && POOL_COUNT <= 32, "publish pool uses a 32 bit free mask");
+
+static pub_buf_t s_bufs[POOL_COUNT];
+
+// Bit i set means s_bufs[i] is free
+static atomic_uint_fast32_t s_free_mask = (POOL_COUNT == 32) ? UINT32_MAX : ((1u << POOL_COUNT) - 1);
+
+static atomic_uint_fast32_t s_exhausted;
+
+pub_buf_t *pub_pool_acquire(void) {
+    uint_fast32_t mask = atomic_load_explicit(&s_free_mask, memory_order_relaxed);
+    while (mask != 0) {
+        int index = __builtin_ctz((unsigned)mask);
+        if (atomic_compare_exchange_weak_explicit(&s_free_mask, &mask, mask & ~(1u << index),
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            s_bufs[index].len = 0;
+            return &s_bufs[index];
+        }
+    }
+
+    atomic_fetch_add_explicit(&s_exhausted, 1, memory_order_relaxed);
+    return NULL;
+}
+
+void pub_pool_release(pub_buf_t *buf) {
+    if (buf == NULL) return;
+    int index = buf - s_bufs;
+    atomic_fetch_or_explicit(&s_free_mask, 1u << index, memory_order_release);
+}
+
+uint32_t pub_pool_exhausted_count(void) {
+    return atomic_load_explicit(&s_exhausted, memory_order_relaxed);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// Fixed-capacity pool of publish buffers. Payloads are encoded into a pool
+// buffer and handed to mqtt_publish(), which copies them into the MQTT client,
+// so no heap allocation is needed per reading.
+typedef struct {
+    char data[CONFIG_MIST_PUB_BUF_SIZE];
+    size_t len;
+} pub_buf_t;
+
+// Returns a free buffer with len reset to 0, or NULL when all buffers are in use
+pub_buf_t *pub_pool_acquire(void);
+
+void pub_pool_release(pub_buf_t *buf);
+
+// Number of times pub_pool_acquire() found the pool exhausted
+uint32_t pub_pool_exhausted_count(void);
@@ -0,0 +1,108 @@
+#include <string.h>
+#include "rate_adapt.h"
+
+#define PERMILLE 1000
+
+// Weight of a measured ratio, and of the RSSI prediction for rates without one,
+// as a right shift
+#define MEASURE_SHIFT 2
+#define DRIFT_SHIFT 3
+
+// Longest pause of the drift after falling back from a rate, and the intervals
+// without a fallback that halve the next pause
+#define MAX_BACKOFF_TICKS 64
+#define STEADY_TICKS 32
+
+void rate_adapt_init_peer(rate_adapt_peer_t *peer) {
+    memset(peer, 0, sizeof(*peer));
+}
+
+// Delivery ratio the RSSI predicts for rate. Without RSSI only the most robust
+// rate is expected to work.
+static int32_t predicted(const rate_adapt_config_t *config, const rate_adapt_signals_t *signals, int rate) {
+    if (!signals->has_rssi) {
+        return rate == 0 ? PERMILLE : 0;
+    }
+    int32_t margin = signals->rssi_dbm - config->rates[rate].min_rssi;
+    if (margin <= 0) return 0;
+    if (margin >= config->margin_db) return PERMILLE;
+    return margin * PERMILLE / config->margin_db;
+}
+
+static inline void move_towards(uint16_t *estimate, int32_t target, int shift) {
+    int32_t value = *estimate;
+    // Round away from the estimate so it reaches the target
+    int32_t step = (target - value) >> shift;
+    if (step == 0 && target != value) step = target > value ? 1 : -1;
+    *estimate = value + step;
+}
+
+uint32_t rate_adapt_goodput_kbps(const rate_adapt_config_t *config, const rate_adapt_peer_t *peer, int rate) {
+    const rate_adapt_rate_t *r = &config->rates[rate];
+    uint64_t bits = (uint64_t)config->frame_bytes * 8;
+    uint64_t airtime_us = r->overhead_us + bits * 1000 / r->kbps;
+    // Bits per us are Mbps, permille of them kbps
+    return peer->delivery[rate] * bits / airtime_us;
+}
+
+bool rate_adapt_step(const rate_adapt_config_t *config, rate_adapt_peer_t *peer, const rate_adapt_signals_t *signals) {
+    uint8_t prev = peer->rate;
+
+    if (signals->heard) {
+        peer->idle_ticks = 0;
+        peer->stale = false;
+    } else if (peer->idle_ticks < UINT32_MAX) {
+        peer->idle_ticks++;
+    }
+    if (peer->stale || peer->idle_ticks >= config->stale_ticks) {
+        // Nothing to go by, whatever reaches the peer first is sent robustly
+        peer->stale = true;
+        peer->rate = 0;
+        return peer->rate != prev;
+    }
+
+    for (int i = 0; i < config->count; i++) {
+        int32_t prior = predicted(config, signals, i);
+        if (!peer->estimated) {
+            peer->delivery[i] = prior;
+        } else if (i == peer->rate && signals->attempts >= config->min_attempts && signals->attempts > 0) {
+            uint32_t delivered = signals->delivered < signals->attempts ? signals->delivered : signals->attempts;
+            move_towards(&peer->delivery[i], delivered * PERMILLE / signals->attempts, MEASURE_SHIFT);
+        } else if (peer->hold_ticks == 0) {
+            move_towards(&peer->delivery[i], prior, DRIFT_SHIFT);
+        }
+    }
+    peer->estimated = true;
+    if (peer->hold_ticks > 0) {
+        peer->hold_ticks--;
+    }
+
+    // Ties go to the more robust rate
+    int best = 0;
+    uint32_t best_kbps = rate_adapt_goodput_kbps(config, peer, 0);
+    for (int i = 1; i < config->count; i++) {
+        uint32_t kbps = rate_adapt_goodput_kbps(config, peer, i);
+        if (kbps > best_kbps) {
+            best = i;
+            best_kbps = kbps;
+        }
+    }
+
+    uint32_t current_kbps = rate_adapt_goodput_kbps(config, peer, peer->rate);
+    if (best != peer->rate && (uint64_t)best_kbps * 100 > (uint64_t)current_kbps * (100 + config->hysteresis_pct)) {
+        peer->rate = best;
+    }
+
+    // A rate that just failed is retried later each time it fails again in a
+    // row, and sooner again while the link stays steady
+    if (peer->rate < prev) {
+        peer->hold_ticks = peer->backoff_ticks;
+        peer->backoff_ticks = peer->backoff_ticks == 0 ? 1 : peer->backoff_ticks * 2;
+        if (peer->backoff_ticks > MAX_BACKOFF_TICKS) peer->backoff_ticks = MAX_BACKOFF_TICKS;
+        peer->steady_ticks = 0;
+    } else if (++peer->steady_ticks >= STEADY_TICKS && peer->backoff_ticks > 0) {
+        peer->backoff_ticks /= 2;
+        peer->steady_ticks = 0;
+    }
+    return peer->rate != prev;
+}
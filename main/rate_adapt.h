@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// PHY rate selection for one peer, fed once per interval. Pure computation, no
+// platform dependencies, and deterministic: the same link trace gives the same
+// decisions.
+//
+// Every rate has an estimated delivery ratio. Intervals with enough transmission
+// outcomes at the current rate move its estimate towards the measured ratio;
+// every other estimate drifts towards what the RSSI predicts, a ratio rising
+// from 0 at the rate's sensitivity to 1 at margin_db above it. A rate that
+// failed is therefore tried again once the RSSI has kept pointing at it for a
+// while. The peer uses the rate with the highest expected goodput, the delivery
+// ratio times the payload bits over the airtime of one frame, and only moves
+// when that gains more than hysteresis_pct. Falling back from a rate pauses the
+// drift for twice as long as the previous fallback did, so a rate that keeps
+// failing despite a good RSSI, e.g. under interference, is retried less and
+// less often. A peer not heard from for stale_ticks intervals is stale and
+// falls back to the most robust rate.
+
+#define RATE_ADAPT_MAX_RATES 8
+
+typedef struct {
+    uint32_t kbps;
+    uint32_t overhead_us;           // Preamble, header and ack of one frame
+    int32_t min_rssi;               // Sensitivity at this rate, in dBm
+} rate_adapt_rate_t;
+
+typedef struct {
+    const rate_adapt_rate_t *rates; // Most robust first
+    int count;
+    uint32_t frame_bytes;           // Frame length goodput is computed for
+    int32_t margin_db;
+    uint32_t min_attempts;          // Outcomes in an interval needed to measure a ratio
+    uint32_t hysteresis_pct;
+    uint32_t stale_ticks;
+} rate_adapt_config_t;
+
+typedef struct {
+    bool heard;                     // A frame was received in the interval
+    bool has_rssi;
+    int32_t rssi_dbm;               // Smoothed RSSI of received frames
+    uint32_t attempts;              // Transmissions with a known outcome in the interval
+    uint32_t delivered;
+} rate_adapt_signals_t;
+
+typedef struct {
+    uint8_t rate;                   // Index into rates
+    bool stale;
+    bool estimated;                 // delivery holds estimates
+    uint32_t idle_ticks;            // Intervals since a frame was received
+    uint32_t hold_ticks;            // Intervals the drift is still paused for
+    uint32_t backoff_ticks;         // Pause after the next fallback
+    uint32_t steady_ticks;          // Intervals since the last fallback or halving
+    uint16_t delivery[RATE_ADAPT_MAX_RATES];    // Permille
+} rate_adapt_peer_t;
+
+// Starts peer at the most robust rate, not stale
+void rate_adapt_init_peer(rate_adapt_peer_t *peer);
+
+// Runs one interval. Returns true if peer->rate changed.
+bool rate_adapt_step(const rate_adapt_config_t *config, rate_adapt_peer_t *peer, const rate_adapt_signals_t *signals);
+
+// Expected goodput of rate for peer in kbps
+uint32_t rate_adapt_goodput_kbps(const rate_adapt_config_t *config, const rate_adapt_peer_t *peer, int rate);
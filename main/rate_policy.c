@@ -0,0 +1,149 @@
+#include <string.h>
+#include "rate_policy.h"
+
+// Sensors sending less than this per interval are not worth throttling
+#define MIN_FRAMES 2
+
+void rate_policy_init(rate_policy_t *policy, const rate_policy_config_t *config, rate_sensor_t *sensors, int count) {
+    memset(policy, 0, sizeof(*policy));
+    policy->config = config;
+    policy->sensors = sensors;
+    policy->count = count;
+    memset(sensors, 0, count * sizeof(*sensors));
+}
+
+void rate_policy_reset_sensor(rate_sensor_t *sensor, uint32_t base_ms) {
+    sensor->base_ms = base_ms;
+    sensor->interval_ms = 0;
+}
+
+static uint64_t total_frames(const rate_policy_t *policy) {
+    uint64_t total = 0;
+    for (int i = 0; i < policy->count; i++) {
+        total += policy->sensors[i].frames;
+    }
+    return total;
+}
+
+// Whether sensor i comes after the one at prev in descending key order, ties
+// broken by index
+static inline bool after(uint32_t key, int i, uint32_t prev_key, int prev) {
+    return key < prev_key || (key == prev_key && i > prev);
+}
+
+// Doubles the interval of the noisiest sensors, most frames first. Sensors
+// without a known base are left alone, they could not be restored to it.
+static bool decrease(rate_policy_t *policy) {
+    const rate_policy_config_t *config = policy->config;
+    uint64_t target = total_frames(policy) * config->decrease_pct / 100;
+    uint64_t saved = 0;
+    uint32_t prev_frames = UINT32_MAX;
+    int prev = -1;
+    int changed = 0;
+
+    while (saved < target || changed == 0) {
+        int best = -1;
+        for (int i = 0; i < policy->count; i++) {
+            const rate_sensor_t *sensor = &policy->sensors[i];
+            if (sensor->base_ms == 0 || sensor->frames < MIN_FRAMES || !after(sensor->frames, i, prev_frames, prev)) continue;
+            if (sensor->interval_ms != 0 && (uint64_t)sensor->interval_ms * 2 > (uint64_t)sensor->base_ms * config->max_slowdown) continue;
+            if (best < 0 || sensor->frames > policy->sensors[best].frames) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        rate_sensor_t *sensor = &policy->sensors[best];
+        sensor->interval_ms = (sensor->interval_ms != 0 ? sensor->interval_ms : sensor->base_ms) * 2;
+        saved += sensor->frames / 2;
+        prev_frames = sensor->frames;
+        prev = best;
+        changed++;
+    }
+    return changed > 0;
+}
+
+// Halves the interval of the most throttled sensors, back to their base at most
+static bool restore(rate_policy_t *policy) {
+    uint64_t target = total_frames(policy) * policy->config->restore_pct / 100;
+    uint64_t gained = 0;
+    uint32_t prev_slowdown = UINT32_MAX;
+    int prev = -1;
+    int changed = 0;
+
+    while (gained < target || changed == 0) {
+        int best = -1;
+        uint32_t best_slowdown = 0;
+        for (int i = 0; i < policy->count; i++) {
+            const rate_sensor_t *sensor = &policy->sensors[i];
+            if (sensor->interval_ms == 0) continue;
+
+            uint32_t slowdown = sensor->interval_ms / sensor->base_ms;
+            if (after(slowdown, i, prev_slowdown, prev) && (best < 0 || slowdown > best_slowdown)) {
+                best = i;
+                best_slowdown = slowdown;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        rate_sensor_t *sensor = &policy->sensors[best];
+        sensor->interval_ms /= 2;
+        if (sensor->interval_ms <= sensor->base_ms) {
+            sensor->interval_ms = 0;
+        }
+        // Halving the interval doubles what the sensor sends
+        gained += sensor->frames;
+        prev_slowdown = best_slowdown;
+        prev = best;
+        changed++;
+    }
+    return changed > 0;
+}
+
+rate_action_t rate_policy_step(rate_policy_t *policy, const rate_signals_t *signals) {
+    const rate_policy_config_t *config = policy->config;
+    bool high = signals->queue_permille >= config->queue_high_permille ||
+                signals->latency_ms >= config->latency_high_ms ||
+                signals->dropped > 0;
+    bool low = signals->queue_permille <= config->queue_low_permille &&
+               signals->latency_ms <= config->latency_low_ms;
+
+    if (policy->cooldown > 0) {
+        policy->cooldown--;
+    }
+
+    // A queue shrinking fast enough to fall below the high mark within
+    // recover_ticks intervals drains without further cuts
+    uint32_t shrink = policy->last_queue_permille > signals->queue_permille ?
+                      policy->last_queue_permille - signals->queue_permille : 0;
+    bool draining = signals->dropped == 0 && shrink > 0 && signals->latency_ms <= policy->last_latency_ms &&
+                    signals->queue_permille < config->queue_high_permille + (uint64_t)shrink * config->recover_ticks;
+    policy->last_queue_permille = signals->queue_permille;
+    policy->last_latency_ms = signals->latency_ms;
+
+    if (high) {
+        policy->congested = true;
+        policy->clear_ticks = 0;
+        // Sensors apply a new interval and the queue drains only after a while
+        if (policy->cooldown == 0 && !draining && decrease(policy)) {
+            policy->cooldown = config->cooldown_ticks;
+            return RATE_POLICY_DECREASE;
+        }
+        return RATE_POLICY_HOLD;
+    }
+    if (!low) {
+        policy->clear_ticks = 0;
+        return RATE_POLICY_HOLD;
+    }
+
+    policy->congested = false;
+    if (++policy->clear_ticks < config->recover_ticks) {
+        return RATE_POLICY_HOLD;
+    }
+    policy->clear_ticks = 0;
+    return restore(policy) ? RATE_POLICY_RESTORE : RATE_POLICY_HOLD;
+}
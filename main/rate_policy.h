@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sensor reading intervals driven by uplink congestion, fed once per control
+// interval. Pure computation, no platform dependencies, and deterministic: the
+// same signals give the same decisions.
+//
+// The uplink is congested when the telemetry queue fill or the publish to ack
+// latency reach their high marks, or data was dropped, and clear once all of
+// them are at or below their low marks. In between, nothing changes.
+//
+// On a congested interval, unless a decrease happened within the cooldown or
+// the queue shrinks without drops fast enough to fall below its high mark within
+// recover_ticks intervals, the noisiest sensors with a known base interval get
+// their reading interval doubled until the frames they would no longer send add up
+// to decrease_pct of all frames received. After recover_ticks clear intervals
+// in a row, the most throttled sensors get their interval halved until the
+// frames they would send again add up to restore_pct, and the count starts
+// over. Restoring is slower than throttling, so the link settles instead of
+// swinging back and forth.
+
+typedef struct {
+    uint32_t interval_ms;           // Length of one control interval
+    uint32_t queue_high_permille;
+    uint32_t queue_low_permille;
+    uint32_t latency_high_ms;
+    uint32_t latency_low_ms;
+    uint32_t decrease_pct;
+    uint32_t restore_pct;
+    uint32_t cooldown_ticks;        // Intervals after a decrease before the next one
+    uint32_t recover_ticks;         // Clear intervals before a restore
+    uint32_t max_slowdown;          // Largest interval over the base interval, a power of two
+} rate_policy_config_t;
+
+typedef struct {
+    uint32_t queue_permille;        // Telemetry queue fill
+    uint32_t latency_ms;            // High percentile of publish to ack latency, 0 without acks
+    uint32_t dropped;               // Frames, readings or messages dropped in the interval
+} rate_signals_t;
+
+typedef struct {
+    uint32_t frames;                // Received in the last interval, set by the caller
+    uint32_t base_ms;               // Reading interval without throttling, 0 while unknown
+    uint32_t interval_ms;           // Interval the sensor should use, 0 while not throttled
+} rate_sensor_t;
+
+typedef enum {
+    RATE_POLICY_HOLD,
+    RATE_POLICY_DECREASE,
+    RATE_POLICY_RESTORE,
+} rate_action_t;
+
+typedef struct {
+    const rate_policy_config_t *config;
+    rate_sensor_t *sensors;
+    int count;
+    bool congested;
+    uint32_t clear_ticks;
+    uint32_t cooldown;
+    uint32_t last_queue_permille;
+    uint32_t last_latency_ms;
+} rate_policy_t;
+
+void rate_policy_init(rate_policy_t *policy, const rate_policy_config_t *config, rate_sensor_t *sensors, int count);
+
+// Runs one control interval. Sensors whose interval_ms changed must be told
+// their new interval, or their base interval once it drops back to 0.
+rate_action_t rate_policy_step(rate_policy_t *policy, const rate_signals_t *signals);
+
+// Stops throttling sensor, e.g. when its entry is reused or an operator set its
+// interval. A base_ms of 0 keeps the sensor from being throttled.
+void rate_policy_reset_sensor(rate_sensor_t *sensor, uint32_t base_ms);
@@ -0,0 +1,277 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "comm.h"
+#include "mqtt.h"
+#include "peers.h"
+#include "pipeline.h"
+#include "metrics.h"
+#include "commands.h"
+#include "rate_policy.h"
+#include "ratectl.h"
+
+#if CONFIG_MIST_RATECTL
+
+static const char *TAG = "ratectl";
+
+#define CAPACITY CONFIG_MIST_PEER_CAPACITY
+// Latency percentile compared against the thresholds
+#define LATENCY_PERCENTILE 90
+
+#if CONFIG_MIST_MQTT_OUTBOX
+#define QUEUE_HIGH_PERMILLE (CONFIG_MIST_RATECTL_QUEUE_HIGH_PCT * 10)
+#define QUEUE_LOW_PERMILLE (CONFIG_MIST_RATECTL_QUEUE_LOW_PCT * 10)
+#else
+// Without the outbox the queue fill reads 0, which always counts as clear
+#define QUEUE_HIGH_PERMILLE 1000
+#define QUEUE_LOW_PERMILLE 1000
+#endif
+
+static const rate_policy_config_t CONFIG = {
+    .interval_ms = CONFIG_MIST_RATECTL_INTERVAL_MS,
+    .queue_high_permille = QUEUE_HIGH_PERMILLE,
+    .queue_low_permille = QUEUE_LOW_PERMILLE,
+    .latency_high_ms = CONFIG_MIST_RATECTL_LATENCY_HIGH_MS,
+    .latency_low_ms = CONFIG_MIST_RATECTL_LATENCY_LOW_MS,
+    .decrease_pct = CONFIG_MIST_RATECTL_DECREASE_PCT,
+    .restore_pct = CONFIG_MIST_RATECTL_RESTORE_PCT,
+    // One interval for sensors to pick up the command, one for the queue to drain
+    .cooldown_ticks = 2,
+    .recover_ticks = CONFIG_MIST_RATECTL_RECOVER_INTERVALS,
+    .max_slowdown = CONFIG_MIST_RATECTL_MAX_SLOWDOWN,
+};
+
+// command_id of a SampleRate command being submitted, before it has an id
+#define SUBMITTING INT64_MIN
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint32_t rx_count;          // peer_t rx_count at the last interval
+    uint32_t sent_ms;           // Interval the sensor acknowledged last, 0 for the base interval
+    uint32_t sending_ms;        // Interval of the command under way
+    int64_t command_id;         // Of the command under way, 0 if there is none
+} ratectl_peer_t;
+
+// Indexed by peers_index()
+static rate_sensor_t s_sensors[CAPACITY];
+static ratectl_peer_t s_peers[CAPACITY];
+static rate_policy_t s_policy;
+
+static uint32_t s_acks[METRICS_BUCKETS];
+static uint32_t s_dropped;
+
+static SemaphoreHandle_t s_lock;
+
+// Registry entries are reused after a peer is removed
+static ratectl_peer_t *peer_state(int index, const peer_t *peer) {
+    ratectl_peer_t *state = &s_peers[index];
+    if (memcmp(state->mac_addr, peer->mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        memcpy(state->mac_addr, peer->mac_addr, ESP_NOW_ETH_ALEN);
+        state->rx_count = peer->rx_count;
+        state->sent_ms = 0;
+        state->command_id = 0;
+        rate_policy_reset_sensor(&s_sensors[index], 0);
+    }
+    return state;
+}
+
+// Upper bound of the bucket holding the percentile of the acks since the last
+// call, 0 without acks
+static uint32_t ack_latency_ms(void) {
+    uint32_t totals[METRICS_BUCKETS];
+    uint32_t delta[METRICS_BUCKETS];
+    uint32_t count = 0;
+
+    metrics_get_totals(METRICS_STAGE_ACK, totals);
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        delta[i] = totals[i] - s_acks[i];
+        count += delta[i];
+    }
+    memcpy(s_acks, totals, sizeof(s_acks));
+
+    uint32_t rank = (uint64_t)count * LATENCY_PERCENTILE / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS && count > 0; i++) {
+        seen += delta[i];
+        if (seen > rank) {
+            return (1u << i) / 1000;
+        }
+    }
+    return 0;
+}
+
+static void read_signals(rate_signals_t *signals) {
+    pipeline_stats_t pipeline;
+    pipeline_get_stats(&pipeline);
+    uint32_t dropped = pipeline.frames_dropped + pipeline.readings_dropped;
+
+#if CONFIG_MIST_MQTT_OUTBOX
+    mist_outbox_stats_t outbox;
+    mist_outbox_get_stats(MIST_OUTBOX_TELEMETRY, &outbox);
+    signals->queue_permille = (uint64_t)outbox.bytes * 1000 / CONFIG_MIST_OUTBOX_TELEMETRY_BYTES;
+    dropped += outbox.evicted;
+#else
+    signals->queue_permille = 0;
+#endif
+
+    signals->latency_ms = ack_latency_ms();
+    signals->dropped = dropped - s_dropped;
+    s_dropped = dropped;
+}
+
+// SampleRate.rate, whole seconds between readings
+static uint32_t rate_s(uint32_t interval_ms) {
+    return interval_ms < 1000 ? 1 : (interval_ms + 500) / 1000;
+}
+
+// Takes note of the outcome of a SampleRate command. One the sensor did not
+// acknowledge is sent again on the next interval.
+static void interval_done(const uint8_t *mac_addr, int64_t id, bool acked) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ratectl_peer_t *state = &s_peers[peers_index(peer)];
+    if (memcmp(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0 &&
+        (state->command_id == id || state->command_id == SUBMITTING)) {
+        if (acked) {
+            state->sent_ms = state->sending_ms;
+        }
+        state->command_id = 0;
+    }
+    xSemaphoreGive(s_lock);
+}
+
+static esp_err_t send_interval(const uint8_t *mac_addr, uint32_t interval_ms, int64_t *id) {
+    SensorCommand cmd = SensorCommand_init_default;
+    cmd.message_type = MessageType_SENSOR_COMMAND;
+    cmd.has_master_mac_addr = esp_read_mac(cmd.master_mac_addr, ESP_MAC_WIFI_STA) == ESP_OK;
+    memcpy(cmd.sensor_mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    cmd.which_body = SensorCommand_sample_rate_tag;
+    cmd.body.sample_rate.rate = rate_s(interval_ms);
+
+    esp_err_t err = commands_submit_local(&cmd, NULL, interval_done);
+    *id = cmd.id;
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Sending sample rate to "MACSTR" failed: %s", MAC2STR(mac_addr), esp_err_to_name(err));
+    }
+    return err;
+}
+
+static void ratectl_task(void *arg) {
+    rate_signals_t signals;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_MIST_RATECTL_INTERVAL_MS));
+        read_signals(&signals);
+
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        for (int i = 0; i < CAPACITY; i++) {
+            const peer_t *peer = peers_at(i);
+            if (peer == NULL) {
+                s_sensors[i].frames = 0;
+                continue;
+            }
+            ratectl_peer_t *state = peer_state(i, peer);
+            s_sensors[i].frames = peer->rx_count - state->rx_count;
+            state->rx_count = peer->rx_count;
+        }
+
+        // Without a broker there is nothing to measure, the backlog takes over
+        if (mqtt_is_connected()) {
+            rate_action_t action = rate_policy_step(&s_policy, &signals);
+            if (action != RATE_POLICY_HOLD) {
+                ESP_LOGI(TAG, "%s sample rates, queue %" PRIu32 "/1000, ack latency %" PRIu32 " ms, %" PRIu32 " dropped",
+                         action == RATE_POLICY_DECREASE ? "Lowering" : "Restoring",
+                         signals.queue_permille, signals.latency_ms, signals.dropped);
+            }
+        }
+
+        xSemaphoreGive(s_lock);
+
+        // Commands that could not be submitted or were not acknowledged are
+        // sent again on the next interval. The lock is not held while
+        // submitting, interval_done() takes it under the commands lock.
+        for (int i = 0; i < CAPACITY; i++) {
+            rate_sensor_t *sensor = &s_sensors[i];
+            ratectl_peer_t *state = &s_peers[i];
+            uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            bool send = sensor->interval_ms != state->sent_ms && state->command_id == 0 && peers_at(i) != NULL;
+            uint32_t interval_ms = sensor->interval_ms != 0 ? sensor->interval_ms : sensor->base_ms;
+            if (send) {
+                memcpy(mac_addr, state->mac_addr, ESP_NOW_ETH_ALEN);
+                state->sending_ms = sensor->interval_ms;
+                state->command_id = SUBMITTING;
+            }
+            xSemaphoreGive(s_lock);
+            if (!send) continue;
+
+            int64_t id;
+            esp_err_t err = send_interval(mac_addr, interval_ms, &id);
+
+            // Unless the outcome is in already
+            xSemaphoreTake(s_lock, portMAX_DELAY);
+            if (state->command_id == SUBMITTING) {
+                state->command_id = err == ESP_OK ? id : 0;
+            }
+            xSemaphoreGive(s_lock);
+        }
+    }
+}
+
+void ratectl_command(const SensorCommand *cmd) {
+    static const uint8_t group[] = COMMANDS_GROUP_MAC(0);
+    if (cmd->which_body != SensorCommand_sample_rate_tag || s_lock == NULL) {
+        return;
+    }
+
+    const uint8_t *addr = cmd->sensor_mac_addr;
+    bool all = COMM_IS_BROADCAST_ADDR(addr);
+    bool is_group = memcmp(addr, group, ESP_NOW_ETH_ALEN - 1) == 0;
+    int64_t rate = cmd->body.sample_rate.rate;
+    uint32_t base_ms = rate > 0 ? (rate < UINT32_MAX / 1000 ? rate * 1000 : UINT32_MAX / 1000 * 1000) : 0;
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CAPACITY; i++) {
+        const peer_t *peer = peers_at(i);
+        if (peer == NULL) continue;
+        if (!all && !(is_group && peer->sensor_type == addr[ESP_NOW_ETH_ALEN - 1]) &&
+            memcmp(peer->mac_addr, addr, ESP_NOW_ETH_ALEN) != 0) continue;
+
+        // The operator's command reaches the sensor, there is nothing to restore.
+        // The outcome of a command of the controller no longer matters.
+        ratectl_peer_t *state = peer_state(i, peer);
+        state->sent_ms = 0;
+        state->command_id = 0;
+        rate_policy_reset_sensor(&s_sensors[i], base_ms);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t ratectl_init(void) {
+    rate_policy_init(&s_policy, &CONFIG, s_sensors, CAPACITY);
+    // Counters start from here, not from boot
+    rate_signals_t signals;
+    read_signals(&signals);
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(ratectl_task, "ratectl", 3072, NULL, 2, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create ratectl task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <esp_err.h>
+#include "messages.pb.h"
+
+// Slows sensors down while the uplink to the broker is congested, with
+// CONFIG_MIST_RATECTL. Every CONFIG_MIST_RATECTL_INTERVAL_MS the telemetry
+// outbox fill, the publish to ack latency, drops and the frames received per
+// sensor feed rate_policy, and sensors whose reading interval changed get a
+// SampleRate command through the commands module. SampleRate.rate is the
+// interval between readings in seconds. A sensor counts as running at an
+// interval once it acknowledges the command. Nothing changes while the broker
+// is disconnected, the backlog covers outages.
+//
+// Only sensors an operator sent a SampleRate command since the master booted
+// are throttled: their base interval is known, so they can be restored to it.
+// Others keep their rate.
+
+// Starts the control task
+esp_err_t ratectl_init(void);
+
+// Takes note of a SampleRate command from an operator, which becomes the base
+// interval of the sensors it addresses and ends their throttling. Call it once
+// commands_submit() accepted the command.
+void ratectl_command(const SensorCommand *cmd);
@@ -0,0 +1,122 @@
+#include <string.h>
+#include <esp_log.h>
+#include "sdkconfig.h"
+#include "reassembly.h"
+
+static const char *TAG = "reassembly";
+
+#define TOPIC_LEN 128
+
+typedef struct {
+    bool used;
+    int msg_id;
+    size_t total_len;
+    size_t received;
+    size_t topic_len;
+    char topic[TOPIC_LEN];
+    uint8_t data[CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE];
+} reassembly_buf_t;
+
+static reassembly_buf_t s_bufs[CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS];
+
+static uint32_t s_dropped;
+
+static reassembly_buf_t *find(int msg_id) {
+    for (int i = 0; i < CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS; i++) {
+        if (s_bufs[i].used && s_bufs[i].msg_id == msg_id) {
+            return &s_bufs[i];
+        }
+    }
+    return NULL;
+}
+
+static reassembly_buf_t *claim(int msg_id) {
+    // A message with the same id that never completed is abandoned
+    reassembly_buf_t *buf = find(msg_id);
+    if (buf != NULL) {
+        ESP_LOGW(TAG, "Incomplete message %d replaced", msg_id);
+        s_dropped++;
+        return buf;
+    }
+
+    for (int i = 0; i < CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS; i++) {
+        if (!s_bufs[i].used) {
+            return &s_bufs[i];
+        }
+    }
+    return NULL;
+}
+
+bool reassembly_feed(int msg_id, const char *topic, int topic_len, const char *data, int data_len,
+                     int offset, int total_len, reassembly_msg_t *msg) {
+    if (offset == 0 && data_len == total_len) {
+        msg->topic = topic;
+        msg->topic_len = topic_len;
+        msg->data = (const uint8_t *)data;
+        msg->len = data_len;
+        return true;
+    }
+
+    reassembly_buf_t *buf;
+    if (offset == 0) {
+        // Only the first fragment carries the topic
+        buf = claim(msg_id);
+        if (buf == NULL || total_len > CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE || topic_len > TOPIC_LEN) {
+            ESP_LOGW(TAG, "Dropping %d byte message on %.*s", total_len, topic_len, topic);
+            if (buf != NULL) buf->used = false;
+            s_dropped++;
+            return false;
+        }
+        buf->used = true;
+        buf->msg_id = msg_id;
+        buf->total_len = total_len;
+        buf->received = 0;
+        buf->topic_len = topic_len;
+        memcpy(buf->topic, topic, topic_len);
+    } else {
+        // Later fragments of a dropped message have no buffer and are ignored
+        buf = find(msg_id);
+        if (buf == NULL) {
+            return false;
+        }
+        if (buf->received != (size_t)offset || buf->received + data_len > buf->total_len) {
+            ESP_LOGW(TAG, "Fragment of message %d out of order", msg_id);
+            buf->used = false;
+            s_dropped++;
+            return false;
+        }
+    }
+
+    memcpy(buf->data + buf->received, data, data_len);
+    buf->received += data_len;
+    if (buf->received < buf->total_len) {
+        return false;
+    }
+
+    msg->topic = buf->topic;
+    msg->topic_len = buf->topic_len;
+    msg->data = buf->data;
+    msg->len = buf->total_len;
+    return true;
+}
+
+void reassembly_release(const reassembly_msg_t *msg) {
+    for (int i = 0; i < CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS; i++) {
+        if (msg->data == s_bufs[i].data) {
+            s_bufs[i].used = false;
+        }
+    }
+}
+
+void reassembly_reset(void) {
+    for (int i = 0; i < CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS; i++) {
+        if (s_bufs[i].used) {
+            s_bufs[i].used = false;
+            s_dropped++;
+        }
+    }
+}
+
+uint32_t reassembly_dropped_count(void) {
+    return s_dropped;
+}
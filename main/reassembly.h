@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reassembles inbound MQTT messages the client delivers in several
+// MQTT_EVENT_DATA events because they exceed its receive buffer. Fragments are
+// copied into one of CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS fixed buffers, keyed by
+// msg_id. Messages that arrive in one piece are passed through without a copy.
+// Must only be used from the MQTT event task.
+
+typedef struct {
+    const char *topic;      // Not null terminated
+    size_t topic_len;
+    const uint8_t *data;
+    size_t len;
+} reassembly_msg_t;
+
+// Feeds the fields of one MQTT_EVENT_DATA. Returns true once msg holds a
+// complete message, which stays valid until reassembly_release().
+bool reassembly_feed(int msg_id, const char *topic, int topic_len, const char *data, int data_len,
+                     int offset, int total_len, reassembly_msg_t *msg);
+
+void reassembly_release(const reassembly_msg_t *msg);
+
+// Drops partially received messages, e.g. after the connection was lost
+void reassembly_reset(void);
+
+// Messages dropped because they were too large, no buffer was free or a fragment was missing
+uint32_t reassembly_dropped_count(void);
@@ -0,0 +1,421 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "peers.h"
+#include "linkq.h"
+#include "rlink.h"
+
+#if CONFIG_MIST_RLINK
+
+static const char *TAG = "rlink";
+
+#define CAPACITY CONFIG_MIST_PEER_CAPACITY
+#define WINDOW 64
+#define MAX_MESSAGE CONFIG_MIST_RLINK_MAX_MESSAGE
+#define MAX_FRAGMENTS ((MAX_MESSAGE + RLINK_FRAGMENT_LEN - 1) / RLINK_FRAGMENT_LEN)
+#define TX_FRAMES CONFIG_MIST_RLINK_TX_FRAMES
+#define REASSEMBLY_BUFFERS CONFIG_MIST_RLINK_REASSEMBLY_BUFFERS
+#define RETRY_US (CONFIG_MIST_RLINK_RETRY_MS * 1000LL)
+#define MAX_ATTEMPTS CONFIG_MIST_RLINK_MAX_ATTEMPTS
+
+// The sender gives up on a fragment after its last retransmission times out
+#define REASSEMBLY_TIMEOUT_US (RETRY_US << MAX_ATTEMPTS)
+
+_Static_assert(MAX_FRAGMENTS <= 32, "fragments of a message must fit in a 32 bit mask");
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    bool rlink_peer;            // Sent rlink frames, so it understands them
+    bool tx_synced;             // Acknowledged one of our frames
+    bool rx_valid;
+    bool ack_pending;
+    uint16_t rx_top;            // Highest sequence number received
+    uint16_t tx_next;
+    uint64_t rx_received;       // Bit i: rx_top - i received
+} link_t;
+
+typedef struct {
+    bool used;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t first_seq;
+    uint8_t count;
+    uint32_t received;          // Bit per fragment
+    size_t len;
+    int64_t started_us;
+    uint8_t data[MAX_MESSAGE];
+} rx_buf_t;
+
+typedef struct {
+    bool used;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint16_t seq;
+    uint8_t attempts;
+    uint8_t len;
+    int64_t sent_us;
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+} tx_frame_t;
+
+// Indexed by peers_index()
+static link_t s_links[CAPACITY];
+static tx_frame_t s_tx[TX_FRAMES];
+
+static rx_buf_t s_rx[REASSEMBLY_BUFFERS];
+
+static SemaphoreHandle_t s_lock;
+
+// Written with s_lock held
+static uint32_t s_duplicates;
+static uint32_t s_reassembled;
+static uint32_t s_rx_dropped;
+static uint32_t s_retransmits;
+static uint32_t s_tx_dropped;
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static inline void put_u16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+// Link of a paired peer, NULL for others. Call with s_lock held.
+static link_t *link_of(const uint8_t *mac_addr) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    // Registry entries are reused after a peer is removed
+    link_t *link = &s_links[peers_index(peer)];
+    if (memcmp(link->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        memset(link, 0, sizeof(*link));
+        memcpy(link->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+        link->tx_next = esp_random();
+    }
+    return link;
+}
+
+// Whether seq is new to the receive window. Frames older than the window count
+// as duplicates.
+static bool is_fresh(const link_t *link, uint16_t seq, bool syn) {
+    int16_t diff = (int16_t)(uint16_t)(seq - link->rx_top);
+
+    // A sender that starts over lands anywhere relative to the old window
+    if (!link->rx_valid || diff > 0 || (syn && diff <= -WINDOW)) {
+        return true;
+    }
+    if (-diff >= WINDOW) {
+        return false;
+    }
+    return !(link->rx_received >> -diff & 1);
+}
+
+// Whether a frame shows that its sender started over, e.g. after a reboot: it
+// is flagged and lands outside the window kept for the sender
+static bool starts_over(const link_t *link, uint16_t seq, bool syn) {
+    int16_t diff = (int16_t)(uint16_t)(seq - link->rx_top);
+    return syn && link->rx_valid && (diff >= WINDOW || diff <= -WINDOW);
+}
+
+// Gives up on the frames to the peer of link waiting for an ack, which a peer
+// that started over will never send, and flags frames to it again. Call with
+// s_lock held.
+static void restart(link_t *link) {
+    link->tx_synced = false;
+    for (int i = 0; i < TX_FRAMES; i++) {
+        tx_frame_t *tx = &s_tx[i];
+        if (!tx->used || memcmp(tx->mac_addr, link->mac_addr, ESP_NOW_ETH_ALEN) != 0) continue;
+
+        tx->used = false;
+        s_tx_dropped++;
+#if CONFIG_MIST_LINKQ
+        linkq_tx_outcome(tx->mac_addr, tx->attempts, false);
+#endif
+    }
+}
+
+// Records a fresh seq in the receive window, acknowledging it with the next ack
+static void accept(link_t *link, uint16_t seq) {
+    int16_t diff = (int16_t)(uint16_t)(seq - link->rx_top);
+
+    if (!link->rx_valid || diff >= WINDOW || diff <= -WINDOW) {
+        link->rx_valid = true;
+        link->rx_top = seq;
+        link->rx_received = 1;
+    } else if (diff > 0) {
+        link->rx_received = link->rx_received << diff | 1;
+        link->rx_top = seq;
+    } else {
+        link->rx_received |= 1ULL << -diff;
+    }
+}
+
+static esp_err_t reassemble(const uint8_t *mac_addr, uint16_t seq, uint8_t index, uint8_t count,
+                            const uint8_t *payload, size_t len, rlink_msg_t *msg) {
+    uint16_t first_seq = seq - index;
+    int64_t now_us = esp_timer_get_time();
+    rx_buf_t *buf = NULL;
+    rx_buf_t *unused = NULL;
+
+    for (int i = 0; i < REASSEMBLY_BUFFERS; i++) {
+        rx_buf_t *b = &s_rx[i];
+        if (b->used && now_us - b->started_us > REASSEMBLY_TIMEOUT_US) {
+            ESP_LOGW(TAG, "Message from "MACSTR" incomplete, %d of %d fragments", MAC2STR(b->mac_addr),
+                     __builtin_popcount(b->received), b->count);
+            b->used = false;
+            s_rx_dropped++;
+        }
+        if (b->used && b->first_seq == first_seq && memcmp(b->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            buf = b;
+        } else if (!b->used) {
+            unused = b;
+        }
+    }
+
+    if (buf == NULL) {
+        if (unused == NULL) {
+            ESP_LOGD(TAG, "No reassembly buffer for "MACSTR", awaiting retransmission", MAC2STR(mac_addr));
+            return ESP_ERR_NO_MEM;
+        }
+        buf = unused;
+        *buf = (rx_buf_t){ .used = true, .first_seq = first_seq, .count = count, .started_us = now_us };
+        memcpy(buf->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    }
+
+    // Only the last fragment may be short
+    size_t offset = (size_t)index * RLINK_FRAGMENT_LEN;
+    bool last = index == count - 1;
+    if (buf->count != count || (!last && len != RLINK_FRAGMENT_LEN) || offset + len > MAX_MESSAGE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memcpy(buf->data + offset, payload, len);
+    buf->received |= 1u << index;
+    if (last) {
+        buf->len = offset + len;
+    }
+
+    if (buf->received != (count == 32 ? UINT32_MAX : (1u << count) - 1)) {
+        return ESP_ERR_NOT_FINISHED;
+    }
+    buf->used = false;
+    s_reassembled++;
+    msg->data = buf->data;
+    msg->len = buf->len;
+    return ESP_OK;
+}
+
+static void handle_ack(const uint8_t *mac_addr, uint16_t top, uint64_t received) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    link_t *link = link_of(mac_addr);
+    if (link != NULL) {
+        link->rlink_peer = true;
+        link->tx_synced = true;
+    }
+
+    for (int i = 0; i < TX_FRAMES; i++) {
+        tx_frame_t *tx = &s_tx[i];
+        if (!tx->used || memcmp(tx->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) != 0) continue;
+
+        int16_t age = (int16_t)(uint16_t)(top - tx->seq);
+        if (age >= 0 && age < WINDOW && (received >> age & 1)) {
+            tx->used = false;
+#if CONFIG_MIST_LINKQ
+            linkq_tx_outcome(mac_addr, tx->attempts, true);
+#endif
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+esp_err_t rlink_receive(const uint8_t *mac_addr, const uint8_t *data, size_t len, rlink_msg_t *msg) {
+    if (len < 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    uint8_t type = data[1] & RLINK_TYPE_MASK;
+    if (type == RLINK_TYPE_ACK && len >= RLINK_ACK_LEN) {
+        uint64_t received = 0;
+        for (int i = 0; i < 8; i++) {
+            received |= (uint64_t)data[4 + i] << (8 * i);
+        }
+        handle_ack(mac_addr, get_u16(data + 2), received);
+        return ESP_ERR_NOT_FINISHED;
+    }
+    if (type != RLINK_TYPE_DATA || len < RLINK_DATA_HEADER_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    uint16_t seq = get_u16(data + 2);
+    uint8_t index = data[4];
+    uint8_t count = data[5];
+    if (count == 0 || count > MAX_FRAGMENTS || index >= count) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // Frames of peers that are not paired pass without duplicate filtering
+    link_t *link = link_of(mac_addr);
+    if (link != NULL) {
+        bool syn = data[1] & RLINK_FLAG_SYN;
+        if (starts_over(link, seq, syn)) {
+            ESP_LOGI(TAG, MACSTR" started over at frame %u", MAC2STR(mac_addr), seq);
+            restart(link);
+        }
+        link->rlink_peer = true;
+        // Duplicates are acknowledged too, the ack of the original may have been lost
+        link->ack_pending = true;
+        if (!is_fresh(link, seq, syn)) {
+            s_duplicates++;
+            xSemaphoreGive(s_lock);
+            return ESP_ERR_NOT_FINISHED;
+        }
+    }
+
+    const uint8_t *payload = data + RLINK_DATA_HEADER_LEN;
+    size_t payload_len = len - RLINK_DATA_HEADER_LEN;
+    esp_err_t err = ESP_OK;
+    if (count == 1) {
+        msg->data = payload;
+        msg->len = payload_len;
+    } else {
+        err = reassemble(mac_addr, seq, index, count, payload, payload_len, msg);
+    }
+
+    // Fragments that found no room stay unacknowledged, the sender retransmits them
+    if (link != NULL && (err == ESP_OK || err == ESP_ERR_NOT_FINISHED)) {
+        accept(link, seq);
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+esp_err_t rlink_send(const uint8_t *mac_addr, const void *data, size_t len) {
+    if (len > MAX_MESSAGE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    link_t *link = link_of(mac_addr);
+    if (link == NULL || !link->rlink_peer) {
+        xSemaphoreGive(s_lock);
+        return len <= ESP_NOW_MAX_DATA_LEN ? peers_send(data, len, mac_addr) : ESP_ERR_INVALID_SIZE;
+    }
+
+    int count = len == 0 ? 1 : (len + RLINK_FRAGMENT_LEN - 1) / RLINK_FRAGMENT_LEN;
+    tx_frame_t *frames[MAX_FRAGMENTS];
+    int found = 0;
+    for (int i = 0; i < TX_FRAMES && found < count; i++) {
+        if (!s_tx[i].used) {
+            frames[found++] = &s_tx[i];
+        }
+    }
+    if (found < count) {
+        xSemaphoreGive(s_lock);
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = ESP_OK;
+    int64_t now_us = esp_timer_get_time();
+    for (int i = 0; i < count; i++) {
+        tx_frame_t *tx = frames[i];
+        size_t offset = (size_t)i * RLINK_FRAGMENT_LEN;
+        size_t payload_len = len - offset < RLINK_FRAGMENT_LEN ? len - offset : RLINK_FRAGMENT_LEN;
+
+        tx->used = true;
+        memcpy(tx->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+        tx->seq = link->tx_next++;
+        tx->attempts = 1;
+        tx->len = RLINK_DATA_HEADER_LEN + payload_len;
+        tx->sent_us = now_us;
+        tx->frame[0] = RLINK_MAGIC;
+        tx->frame[1] = RLINK_TYPE_DATA | (link->tx_synced ? 0 : RLINK_FLAG_SYN);
+        put_u16(tx->frame + 2, tx->seq);
+        tx->frame[4] = i;
+        tx->frame[5] = count;
+        memcpy(tx->frame + RLINK_DATA_HEADER_LEN, (const uint8_t *)data + offset, payload_len);
+
+        // A fragment that fails to go out now is retransmitted like a lost one
+        if (peers_send(tx->frame, tx->len, mac_addr) != ESP_OK) {
+            err = ESP_FAIL;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+void rlink_get_stats(rlink_stats_t *stats) {
+    stats->duplicates = s_duplicates;
+    stats->retransmits = s_retransmits;
+    stats->reassembled = s_reassembled;
+    stats->dropped = s_rx_dropped + s_tx_dropped;
+}
+
+// Sends the acks collected since the last round and retransmits what timed out
+static void service(int64_t now_us) {
+    uint8_t ack[RLINK_ACK_LEN];
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CAPACITY; i++) {
+        link_t *link = &s_links[i];
+        if (!link->ack_pending) continue;
+
+        link->ack_pending = false;
+        ack[0] = RLINK_MAGIC;
+        ack[1] = RLINK_TYPE_ACK;
+        put_u16(ack + 2, link->rx_top);
+        for (int j = 0; j < 8; j++) {
+            ack[4 + j] = link->rx_received >> (8 * j);
+        }
+        peers_send(ack, sizeof(ack), link->mac_addr);
+    }
+
+    for (int i = 0; i < TX_FRAMES; i++) {
+        tx_frame_t *tx = &s_tx[i];
+        if (!tx->used || now_us - tx->sent_us < RETRY_US << (tx->attempts - 1)) continue;
+
+        if (tx->attempts >= MAX_ATTEMPTS) {
+            ESP_LOGW(TAG, "No ack for frame %u to "MACSTR"", tx->seq, MAC2STR(tx->mac_addr));
+            tx->used = false;
+            s_tx_dropped++;
+#if CONFIG_MIST_LINKQ
+            linkq_tx_outcome(tx->mac_addr, tx->attempts, false);
+#endif
+            continue;
+        }
+        tx->attempts++;
+        tx->sent_us = now_us;
+        s_retransmits++;
+        peers_send(tx->frame, tx->len, tx->mac_addr);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+static void rlink_task(void *arg) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_MIST_RLINK_ACK_DELAY_MS));
+        service(esp_timer_get_time());
+    }
+}
+
+esp_err_t rlink_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(rlink_task, "rlink", 3072, NULL, 4, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create rlink task");
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+#endif
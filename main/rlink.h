@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_now.h>
+
+// Reliability layer over mist_comm, with CONFIG_MIST_RLINK. Its frames start
+// with RLINK_MAGIC, which cannot start a protobuf message (wire type 6), so they
+// share the channel with the plain frames of sensors without it.
+//
+//   data:  magic, type | flags, seq (u16 LE), fragment index, fragment count, payload
+//   ack:   magic, type, top (u16 LE), received (u64 LE)
+//
+// Every data frame carries a sequence number of its own, counted per sender and
+// peer from a random start. The receiver keeps the highest sequence number seen
+// and a bitmap of the 64 up to it, drops duplicates and frames older than that
+// window, and once every CONFIG_MIST_RLINK_ACK_DELAY_MS sends each peer one ack
+// frame: the highest sequence number and the bitmap, which acknowledges every
+// frame received meanwhile and shows the sender the gaps to retransmit. Senders
+// flag their frames with RLINK_FLAG_SYN until their first ack, so a receiver that
+// lost track of them, e.g. after a reboot, starts a new window. A flagged frame
+// outside the window tells the receiver that the sender started over: frames
+// still waiting for its ack are given up on and counted as dropped.
+//
+// Messages larger than one frame are split into fragments of RLINK_FRAGMENT_LEN
+// bytes, the last one shorter, with consecutive sequence numbers. The receiver
+// reassembles them in one of CONFIG_MIST_RLINK_REASSEMBLY_BUFFERS buffers.
+
+#define RLINK_MAGIC 0xEE
+
+#define RLINK_TYPE_DATA 0x01
+#define RLINK_TYPE_ACK 0x02
+#define RLINK_TYPE_MASK 0x0F
+#define RLINK_FLAG_SYN 0x80
+
+#define RLINK_DATA_HEADER_LEN 6
+#define RLINK_ACK_LEN 12
+#define RLINK_FRAGMENT_LEN (ESP_NOW_MAX_DATA_LEN - RLINK_DATA_HEADER_LEN)
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} rlink_msg_t;
+
+typedef struct {
+    uint32_t duplicates;        // Data frames received before, or older than the window
+    uint32_t retransmits;
+    uint32_t reassembled;       // Messages of more than one fragment
+    uint32_t dropped;           // Frames sent without ack, messages received incomplete
+} rlink_stats_t;
+
+esp_err_t rlink_init(void);
+
+static inline bool rlink_is_frame(const uint8_t *data, size_t len) {
+    return len > 0 && data[0] == RLINK_MAGIC;
+}
+
+// Handles a frame from mac_addr. Returns ESP_OK once msg holds a complete message,
+// valid until the next call, or ESP_ERR_NOT_FINISHED when there is nothing to
+// deliver. Must only be called from one task.
+esp_err_t rlink_receive(const uint8_t *mac_addr, const uint8_t *data, size_t len, rlink_msg_t *msg);
+
+// Sends a message of up to CONFIG_MIST_RLINK_MAX_MESSAGE bytes, retransmitting
+// fragments until acknowledged. Peers that never sent an rlink frame get the
+// message as a plain frame instead.
+esp_err_t rlink_send(const uint8_t *mac_addr, const void *data, size_t len);
+
+void rlink_get_stats(rlink_stats_t *stats);
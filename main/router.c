@@ -0,0 +1,78 @@
+#include <esp_log.h>
+#include "pb_decode.h"
+#include "router.h"
+
+static const char *TAG = "router";
+
+// Every message starts with field 1, its MessageType
+#define MESSAGE_TYPE_TAG ((1 << 3) | PB_WT_VARINT)
+
+typedef struct {
+    const pb_msgdesc_t *fields;
+    const char *name;
+} route_type_t;
+
+static const route_type_t ROUTE_TYPES[_MessageType_ARRAYSIZE] = {
+    [MessageType_SENSOR_DATA] = { SensorData_fields, "SensorData" },
+    [MessageType_SLAVERY_HANDSHAKE] = { SlaveryHandshake_fields, "SlaveryHandshake" },
+    [MessageType_SYNC_TIME] = { SyncTime_fields, "SyncTime" },
+    [MessageType_SENSOR_COMMAND] = { SensorCommand_fields, "SensorCommand" },
+};
+
+// Messages are decoded in place here rather than on the stack of the receiving
+// task. Each transport is dispatched from a single task, so one slot per transport.
+typedef union {
+    SensorData sensor_data;
+    SlaveryHandshake slavery_handshake;
+    SyncTime sync_time;
+    SensorCommand sensor_command;
+} route_storage_t;
+
+static route_storage_t s_storage[ROUTER_TRANSPORT_MAX];
+
+static router_handler_t s_handlers[ROUTER_TRANSPORT_MAX][_MessageType_ARRAYSIZE];
+
+esp_err_t router_register(router_transport_t transport, MessageType type, router_handler_t handler) {
+    if (transport >= ROUTER_TRANSPORT_MAX || type < _MessageType_MIN || type > _MessageType_MAX ||
+        ROUTE_TYPES[type].fields == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_handlers[transport][type] = handler;
+    return ESP_OK;
+}
+
+// Reads the MessageType from the leading field without decoding the rest
+static bool peek_message_type(const uint8_t *buf, size_t len, uint32_t *type) {
+    pb_istream_t stream = pb_istream_from_buffer(buf, len);
+    uint32_t tag;
+    return pb_decode_varint32(&stream, &tag) && tag == MESSAGE_TYPE_TAG && pb_decode_varint32(&stream, type);
+}
+
+esp_err_t router_dispatch(const router_msg_t *msg) {
+    uint32_t type;
+    if (!peek_message_type(msg->raw, msg->raw_len, &type)) {
+        ESP_LOGE(TAG, "Failed to decode message type");
+        return ESP_FAIL;
+    }
+
+    if (type > _MessageType_MAX || ROUTE_TYPES[type].fields == NULL) {
+        ESP_LOGE(TAG, "Unknown message type: %" PRIu32, type);
+        return ESP_FAIL;
+    }
+
+    router_handler_t handler = s_handlers[msg->transport][type];
+    if (handler == NULL) {
+        ESP_LOGW(TAG, "No handler for %s on transport %d", ROUTE_TYPES[type].name, msg->transport);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    route_storage_t *storage = &s_storage[msg->transport];
+    pb_istream_t stream = pb_istream_from_buffer(msg->raw, msg->raw_len);
+    if (!pb_decode(&stream, ROUTE_TYPES[type].fields, storage)) {
+        ESP_LOGE(TAG, "Failed to decode %s: %s", ROUTE_TYPES[type].name, PB_GET_ERROR(&stream));
+        return ESP_FAIL;
+    }
+
+    ESP_LOGD(TAG, "Dispatching %s", ROUTE_TYPES[type].name);
+    return handler(msg, storage);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+#include "messages.pb.h"
+
+// Routes protobuf messages from either transport to handlers registered per
+// MessageType. Each message is decoded exactly once, into storage reserved
+// statically per transport, and dispatched through a constant table.
+
+typedef enum {
+    ROUTER_TRANSPORT_ESPNOW,
+    ROUTER_TRANSPORT_MQTT,
+    ROUTER_TRANSPORT_MAX,
+} router_transport_t;
+
+typedef struct {
+    router_transport_t transport;
+    const uint8_t *mac_addr;    // Sender, ESP-NOW only
+    const char *topic;          // MQTT only, not null terminated
+    size_t topic_len;
+    const uint8_t *raw;         // Encoded message, e.g. for forwarding
+    size_t raw_len;
+    int64_t rx_time_us;         // esp_timer time the message was received
+} router_msg_t;
+
+// decoded points at the decoded message of the registered type, e.g. a SensorData.
+// It is only valid until the handler returns.
+typedef esp_err_t (*router_handler_t)(const router_msg_t *msg, const void *decoded);
+
+esp_err_t router_register(router_transport_t transport, MessageType type, router_handler_t handler);
+
+// Decodes msg->raw and calls the handler registered for its type and transport.
+// Must only be called from one task per transport.
+esp_err_t router_dispatch(const router_msg_t *msg);
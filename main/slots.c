@@ -0,0 +1,315 @@
+#include <string.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include "sdkconfig.h"
+#include "messages.pb.h"
+#include "comm.h"
+#include "pbw.h"
+#include "peers.h"
+#include "commands.h"
+#include "slots.h"
+
+#if CONFIG_MIST_SLOTS
+
+static const char *TAG = "slots";
+
+#define CAPACITY CONFIG_MIST_PEER_CAPACITY
+
+#if CONFIG_ESPNOW_ENABLE_POWER_SAVE
+// Sensors wake at the start of every frame, so slots must fit in the wake window
+#define FRAME_US (CONFIG_ESPNOW_WAKE_INTERVAL * 1000)
+#define WINDOW_US (CONFIG_ESPNOW_WAKE_WINDOW * 1000)
+#else
+#define FRAME_US (CONFIG_MIST_SLOT_FRAME_MS * 1000)
+#define WINDOW_US FRAME_US
+#endif
+
+#define WIDTH_US CONFIG_MIST_SLOT_WIDTH_US
+// Slots per frame that can be assigned, after the open slot 0
+#define SLOTS ((int)(WINDOW_US / WIDTH_US) - 1)
+
+#define IDLE_US (CONFIG_MIST_SLOT_IDLE_S * 1000000LL)
+
+// SlotAssignment extension fields of SensorCommand, see master.proto
+#define FIELD_FRAME_US 110
+#define FIELD_OFFSET_US 111
+#define FIELD_WIDTH_US 112
+#define FIELD_PERIOD 113
+#define FIELD_PHASE 114
+
+typedef enum {
+    SEND_NONE = 0,
+    SEND_SUBMITTING,        // Part of the command being submitted
+    SEND_WAITING,           // Waiting for the sensor's ack or its last attempt
+} send_state_t;
+
+// The sensor knows its assignment once acked equals assignment. Versions only
+// ever compare equal or not, so they may wrap.
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    bool live;
+    uint8_t send;           // send_state_t
+    int16_t position;       // -1 without a slot
+    uint16_t assignment;    // Bumped whenever the sensor needs to be told again
+    uint16_t sent;          // assignment when last encoded for the sensor
+    uint16_t acked;         // sent when the sensor last acknowledged
+    int64_t hello_us;       // Last handshake
+} slot_peer_t;
+
+// Indexed by peers_index()
+static slot_peer_t s_peers[CAPACITY];
+// Peer index per position, -1 if free. Positions are (slot, phase) pairs,
+// interleaved so that filling them from 0 up spreads sensors evenly over the
+// phases. Sensors take the lowest free position, so positions in use stay below
+// the capacity.
+static int16_t s_owners[CAPACITY];
+static uint32_t s_period = 1;
+
+static SemaphoreHandle_t s_lock;
+static TaskHandle_t s_task;
+
+// Registry entries are reused after a peer is removed
+static slot_peer_t *peer_state(int index, const uint8_t *mac_addr) {
+    slot_peer_t *state = &s_peers[index];
+    if (memcmp(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        if (state->position >= 0) {
+            s_owners[state->position] = -1;
+        }
+        memcpy(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+        state->live = false;
+        state->send = SEND_NONE;
+        state->position = -1;
+        state->assignment = 0;
+        state->sent = 0;
+        state->acked = 0;
+        state->hello_us = 0;
+    }
+    return state;
+}
+
+static void release(slot_peer_t *state) {
+    if (state->position >= 0) {
+        s_owners[state->position] = -1;
+        state->position = -1;
+    }
+}
+
+static bool is_pending(const slot_peer_t *state) {
+    return state->live && state->send == SEND_NONE && state->acked != state->assignment;
+}
+
+static bool is_live(const peer_t *peer, const slot_peer_t *state, int64_t now_us) {
+    int64_t last_us = peer->state == PEER_STATE_ACTIVE ? peer->last_seen_us : 0;
+    if (state->hello_us > last_us) {
+        last_us = state->hello_us;
+    }
+    return last_us != 0 && now_us - last_us < IDLE_US;
+}
+
+// Updates the assignments to the live peers. Returns how many of them wait for
+// their assignment and are not being sent it, and the index of one of them in
+// any_index.
+static uint32_t rebalance(int64_t now_us, int *any_index) {
+    uint32_t live = 0;
+    for (int i = 0; i < CAPACITY; i++) {
+        peer_t peer;
+        if (!peers_get(i, &peer)) {
+            release(&s_peers[i]);
+            s_peers[i].live = false;
+            s_peers[i].send = SEND_NONE;
+            continue;
+        }
+        slot_peer_t *state = peer_state(i, peer.mac_addr);
+        state->live = is_live(&peer, state, now_us);
+        if (!state->live) {
+            release(state);
+        } else {
+            live++;
+        }
+    }
+
+    uint32_t period = 1;
+    while ((uint32_t)SLOTS * period < live) {
+        period <<= 1;
+    }
+    uint32_t positions = SLOTS * period;
+
+    // A new period moves everyone, and leaves the positions beyond it unused
+    if (period != s_period) {
+        ESP_LOGI(TAG, "%" PRIu32 " live sensors, period %" PRIu32 " -> %" PRIu32 " frames", live, s_period, period);
+        for (int i = 0; i < CAPACITY; i++) {
+            s_peers[i].assignment++;
+            if (s_peers[i].position >= (int)positions) {
+                release(&s_peers[i]);
+            }
+        }
+        s_period = period;
+    }
+
+    uint32_t next = 0;
+    uint32_t pending = 0;
+    for (int i = 0; i < CAPACITY; i++) {
+        slot_peer_t *state = &s_peers[i];
+        if (!state->live) continue;
+
+        if (state->position < 0) {
+            while (s_owners[next] >= 0) next++;
+            s_owners[next] = i;
+            state->position = next;
+            state->assignment++;
+        }
+        if (is_pending(state)) {
+            pending++;
+            *any_index = i;
+        }
+    }
+    return pending;
+}
+
+// Writes the SlotAssignment of mac_addr after its SensorCommand
+static size_t encode_assignment(const uint8_t *mac_addr, uint8_t *buf, size_t size) {
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, size);
+    peer_t *peer = peers_find(mac_addr);
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    slot_peer_t *state = peer != NULL ? &s_peers[peers_index(peer)] : NULL;
+    if (state != NULL && memcmp(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        state = NULL;
+    }
+    if (state != NULL) {
+        state->sent = state->assignment;
+    }
+    bool ok;
+    if (state != NULL && state->position >= 0) {
+        uint32_t slot = 1 + state->position / s_period;
+        ok = pbw_uint(&stream, FIELD_FRAME_US, FRAME_US) &&
+             pbw_uint(&stream, FIELD_OFFSET_US, slot * WIDTH_US) &&
+             pbw_uint(&stream, FIELD_WIDTH_US, WIDTH_US) &&
+             pbw_uint(&stream, FIELD_PERIOD, s_period) &&
+             pbw_uint(&stream, FIELD_PHASE, state->position % s_period);
+    } else {
+        // A zero width takes the slot away, the sensor transmits at will
+        ok = pbw_uint(&stream, FIELD_WIDTH_US, 0);
+    }
+    xSemaphoreGive(s_lock);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Encoding slot assignment failed: %s", PB_GET_ERROR(&stream));
+        return 0;
+    }
+    return stream.bytes_written;
+}
+
+// Takes note of the outcome of sending the assignment to mac_addr. One the sensor
+// did not acknowledge is sent again after the next rebalance.
+static void assignment_done(const uint8_t *mac_addr, int64_t id, bool acked) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    slot_peer_t *state = &s_peers[peers_index(peer)];
+    if (memcmp(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+        state->send = SEND_NONE;
+        if (acked) {
+            state->acked = state->sent;
+        } else {
+            ESP_LOGW(TAG, "No ack for the slot assignment of "MACSTR", resending", MAC2STR(mac_addr));
+        }
+    }
+    xSemaphoreGive(s_lock);
+}
+
+// Rebalances and sends the live sensors waiting for their assignment one command
+static void announce(int64_t now_us) {
+    int index = -1;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t pending = rebalance(now_us, &index);
+    // Not sent again while the command is under way
+    for (int i = 0; i < CAPACITY && pending > 0; i++) {
+        if (is_pending(&s_peers[i])) {
+            s_peers[i].send = SEND_SUBMITTING;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    if (pending == 0) {
+        return;
+    }
+
+    // One command to the sensor concerned, or to every paired sensor. The
+    // assignment is encoded as each one is sent, so it is never stale.
+    SensorCommand cmd = SensorCommand_init_default;
+    cmd.message_type = MessageType_SENSOR_COMMAND;
+    cmd.has_master_mac_addr = esp_read_mac(cmd.master_mac_addr, ESP_MAC_WIFI_STA) == ESP_OK;
+    memcpy(cmd.sensor_mac_addr, pending == 1 ? s_peers[index].mac_addr : COMM_BROADCAST_MAC_ADDR, ESP_NOW_ETH_ALEN);
+
+    // Called without the lock, the commands lock is taken before it. Sensors
+    // that already have their outcome are left as they are.
+    esp_err_t err = commands_submit_local(&cmd, encode_assignment, assignment_done);
+
+    // Commands are busy or no sensor matched, try again next round
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CAPACITY; i++) {
+        if (s_peers[i].send == SEND_SUBMITTING) {
+            s_peers[i].send = err == ESP_OK ? SEND_WAITING : SEND_NONE;
+        }
+    }
+    xSemaphoreGive(s_lock);
+
+    if (err == ESP_OK) {
+        ESP_LOGD(TAG, "Announcing slots to %" PRIu32 " sensors with command %lld", pending, cmd.id);
+    }
+}
+
+static void slots_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CONFIG_MIST_SLOT_REBALANCE_MS));
+        announce(esp_timer_get_time());
+    }
+}
+
+void slots_hello(const uint8_t *mac_addr) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL || s_task == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    slot_peer_t *state = peer_state(peers_index(peer), mac_addr);
+    state->hello_us = esp_timer_get_time();
+    state->assignment++;
+    xSemaphoreGive(s_lock);
+
+    xTaskNotifyGive(s_task);
+}
+
+esp_err_t slots_init(void) {
+    if (SLOTS < 1) {
+        ESP_LOGE(TAG, "No room for a slot of %d us in a window of %d us", WIDTH_US, WINDOW_US);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    for (int i = 0; i < CAPACITY; i++) {
+        s_peers[i].position = -1;
+    }
+    memset(s_owners, 0xFF, sizeof(s_owners));
+
+    s_lock = xSemaphoreCreateMutex();
+    if (s_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(slots_task, "slots", 3072, NULL, 2, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create slots task");
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "%d slots of %d us per %d us frame", SLOTS, WIDTH_US, FRAME_US);
+    return ESP_OK;
+}
+
+#endif
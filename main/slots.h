@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+#include <esp_now.h>
+
+// Transmit slots for paired sensors. Time is cut into frames of the master
+// clock, frame n starting at master time n * frame length, and every frame into
+// slots of CONFIG_MIST_SLOT_WIDTH_US. With ESP-NOW power save a frame is one
+// wake interval and only its wake window holds slots. Slot 0 stays open for the
+// master's broadcasts and sensors without a slot.
+//
+// Each live sensor, one that sent data or a handshake within
+// CONFIG_MIST_SLOT_IDLE_S, owns one slot every period frames, and transmits only
+// in frames whose number modulo period is its phase. The period is the smallest
+// power of two that gives every live sensor a slot of its own. Sensors that go
+// quiet give their slot back, and assignments are reshuffled only when the
+// period changes. New assignments are sent as SensorCommand extension fields
+// (SlotAssignment in master.proto) through the commands module. A sensor counts
+// as knowing its assignment once it acknowledges the command; one that runs out
+// of attempts is sent it again after the next rebalance.
+
+// Starts the task assigning slots
+esp_err_t slots_init(void);
+
+// Records a handshake from mac_addr, which gets its slot announced again as the
+// sensor may have rebooted and forgotten it
+void slots_hello(const uint8_t *mac_addr);
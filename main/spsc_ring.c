@@ -0,0 +1,49 @@
+#include "spsc_ring.h"
+
+void spsc_ring_init(spsc_ring_t *ring, void *slots, size_t slot_size, uint32_t capacity) {
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->mask = capacity - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->high_water = 0;
+}
+
+void *spsc_ring_write_slot(spsc_ring_t *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t depth = head - tail;
+
+    if (depth > ring->mask) {
+        return NULL;
+    }
+    if (depth + 1 > ring->high_water) {
+        ring->high_water = depth + 1;
+    }
+    return ring->slots + (size_t)(head & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_commit(spsc_ring_t *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void *spsc_ring_read_slot(spsc_ring_t *ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->slots + (size_t)(tail & ring->mask) * ring->slot_size;
+}
+
+void spsc_ring_release(spsc_ring_t *ring) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+uint32_t spsc_ring_depth(spsc_ring_t *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
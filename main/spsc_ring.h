@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded single-producer/single-consumer ring of fixed size slots. Lock free:
+// the producer only writes head and the consumer only writes tail. Slots are
+// filled and drained in place, so nothing is copied through the ring itself.
+typedef struct {
+    uint8_t *slots;
+    size_t slot_size;
+    uint32_t mask;
+    _Atomic uint32_t head;  // Next slot to write, owned by the producer
+    _Atomic uint32_t tail;  // Next slot to read, owned by the consumer
+    uint32_t high_water;    // Largest depth seen by the producer
+} spsc_ring_t;
+
+// slots must hold capacity * slot_size bytes and capacity must be a power of two
+void spsc_ring_init(spsc_ring_t *ring, void *slots, size_t slot_size, uint32_t capacity);
+
+// Producer: returns the slot to fill, or NULL when the ring is full
+void *spsc_ring_write_slot(spsc_ring_t *ring);
+
+// Producer: publishes the slot returned by spsc_ring_write_slot()
+void spsc_ring_commit(spsc_ring_t *ring);
+
+// Consumer: returns the oldest filled slot, or NULL when the ring is empty
+void *spsc_ring_read_slot(spsc_ring_t *ring);
+
+// Consumer: frees the slot returned by spsc_ring_read_slot()
+void spsc_ring_release(spsc_ring_t *ring);
+
+uint32_t spsc_ring_depth(spsc_ring_t *ring);
@@ -0,0 +1,223 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "sdkconfig.h"
+#include "fixfmt.h"
+#include "pub_pool.h"
+#include "mqtt.h"
+#include "batch.h"
+#include "boot.h"
+#include "metrics.h"
+#include "aggregate.h"
+#include "history.h"
+#include "telemetry.h"
+
+static const char *TAG = "telemetry";
+
+// Sensor timestamps before this (2023-11-14) come from a clock that was never synced
+#define VALID_TIME_FLOOR 1700000000LL
+
+// Readings held until the master clock is valid
+static pipeline_reading_t s_early[CONFIG_MIST_EARLY_READINGS];
+static size_t s_early_count;
+static uint32_t s_early_dropped;
+static bool s_time_valid;
+
+static SemaphoreHandle_t s_early_lock;
+
+// Restamps and forwards the held readings once the clock is valid, then exits
+static TaskHandle_t s_release_task;
+static atomic_bool s_release_requested;
+
+#if !CONFIG_MIST_SENSOR_BATCHING
+
+// Worst case AIR_SENSOR object: four keys plus two int64 and two float values
+_Static_assert(CONFIG_MIST_PUB_BUF_SIZE >= 128, "publish buffer too small for an AIR_SENSOR reading");
+
+static inline void put(pub_buf_t *buf, const char *str, size_t len) {
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+#define PUT_LITERAL(buf, lit) put(buf, lit, sizeof(lit) - 1)
+
+static inline void put_i64(pub_buf_t *buf, int64_t value) {
+    buf->len += fixfmt_i64(buf->data + buf->len, value);
+}
+
+static inline void put_2dp(pub_buf_t *buf, float value) {
+    buf->len += fixfmt_2dp(buf->data + buf->len, value);
+}
+
+static esp_err_t publish_json(const SensorData *sensor_data) {
+    const char *topic;
+    pub_buf_t *buf = pub_pool_acquire();
+    if (buf == NULL) {
+        ESP_LOGW(TAG, "Publish pool exhausted, dropping reading");
+        return ESP_ERR_NO_MEM;
+    }
+
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR: {
+            const AirSensor *air = &sensor_data->body.air_sensor;
+            topic = "/esp32/air";
+            PUT_LITERAL(buf, "{\"timestamp\":");
+            put_i64(buf, air->timestamp);
+            PUT_LITERAL(buf, ",\"temperature\":");
+            put_2dp(buf, air->temperature);
+            PUT_LITERAL(buf, ",\"humidity\":");
+            put_2dp(buf, air->humidity);
+            PUT_LITERAL(buf, ",\"voc_index\":");
+            put_i64(buf, air->voc_index);
+            PUT_LITERAL(buf, "}");
+            break;
+        }
+        case SensorType_SOIL_SENSOR: {
+            const SoilSensor *soil = &sensor_data->body.soil_sensor;
+            topic = "/esp32/soil";
+            PUT_LITERAL(buf, "{\"timestamp\":");
+            put_i64(buf, soil->timestamp);
+            PUT_LITERAL(buf, ",\"moisture\":");
+            put_2dp(buf, soil->moisture);
+            PUT_LITERAL(buf, "}");
+            break;
+        }
+        default:
+            pub_pool_release(buf);
+            return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // Live readings, however many, must not crowd out command status
+    esp_err_t err = mqtt_publish_class(topic, buf->data, buf->len, 0, MIST_OUTBOX_TELEMETRY, NULL);
+    pub_pool_release(buf);
+    return err;
+}
+
+#endif
+
+static esp_err_t forward(const SensorData *sensor_data, const uint8_t *mac_addr) {
+#if CONFIG_MIST_SENSOR_BATCHING
+    return batch_add(sensor_data, mac_addr);
+#else
+    uint32_t start = metrics_now();
+    esp_err_t err = publish_json(sensor_data);
+    if (err == ESP_OK) {
+        metrics_record(METRICS_STAGE_PUBLISH, start);
+        boot_mark(BOOT_PHASE_FIRST_PUBLISH);
+    }
+    return err;
+#endif
+}
+
+static int64_t *reading_timestamp(SensorData *sensor_data) {
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR:
+            return &sensor_data->body.air_sensor.timestamp;
+        case SensorType_SOIL_SENSOR:
+            return &sensor_data->body.soil_sensor.timestamp;
+        case SensorType_MIST_SENSOR:
+            return &sensor_data->body.mist_sensor.timestamp;
+        case SensorType_LIGHT_SENSOR:
+            return &sensor_data->body.light_sensor.timestamp;
+        default:
+            return NULL;
+    }
+}
+
+// Forwards a reading with its timestamp replaced by the wall clock time it was
+// received at, derived from the monotonic receive time. Timestamps are in seconds,
+// the resolution the master hands out in SyncTime.
+static esp_err_t forward_restamped(const pipeline_reading_t *reading) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    int64_t rx_wall_us = now_us - (esp_timer_get_time() - reading->rx_time_us);
+
+    SensorData sensor_data = reading->data;
+    *reading_timestamp(&sensor_data) = rx_wall_us / 1000000;
+    return forward(&sensor_data, reading->mac_addr);
+}
+
+esp_err_t telemetry_publish(const pipeline_reading_t *reading) {
+    boot_mark(BOOT_PHASE_FIRST_READING);
+
+#if CONFIG_MIST_HISTORY
+    // Every reading, including those aggregation keeps back
+    history_add(reading);
+#endif
+
+#if CONFIG_MIST_AGGREGATION
+    // Readings within the deadbands of the last forwarded one only feed the summaries
+    if (!aggregate_reading(reading)) {
+        return ESP_OK;
+    }
+#endif
+
+    SensorData sensor_data = reading->data;
+    int64_t *timestamp = reading_timestamp(&sensor_data);
+    if (timestamp == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (*timestamp >= VALID_TIME_FLOOR) {
+        return forward(&reading->data, reading->mac_addr);
+    }
+
+    xSemaphoreTake(s_early_lock, portMAX_DELAY);
+    bool time_valid = s_time_valid;
+    if (!time_valid) {
+        if (s_early_count < CONFIG_MIST_EARLY_READINGS) {
+            s_early[s_early_count++] = *reading;
+        } else {
+            s_early_dropped++;
+        }
+    }
+    xSemaphoreGive(s_early_lock);
+
+    return time_valid ? forward_restamped(reading) : ESP_OK;
+}
+
+static void release_task(void *arg) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    // Once s_time_valid is set the publisher no longer touches s_early, so the
+    // held readings are forwarded without the lock
+    xSemaphoreTake(s_early_lock, portMAX_DELAY);
+    s_time_valid = true;
+    xSemaphoreGive(s_early_lock);
+
+    ESP_LOGI(TAG, "Clock valid, restamping %u held readings", (unsigned)s_early_count);
+    if (s_early_dropped > 0) {
+        ESP_LOGW(TAG, "%" PRIu32 " readings were dropped while waiting for the clock", s_early_dropped);
+    }
+    for (size_t i = 0; i < s_early_count; i++) {
+        forward_restamped(&s_early[i]);
+    }
+    s_early_count = 0;
+
+    vTaskDelete(NULL);
+}
+
+void telemetry_time_valid(void) {
+    // Runs in the lwIP tcpip thread on every sync, which must never wait on a
+    // lock or the uplink
+    if (!atomic_exchange(&s_release_requested, true)) {
+        xTaskNotifyGive(s_release_task);
+    }
+}
+
+esp_err_t telemetry_init(void) {
+    s_early_lock = xSemaphoreCreateMutex();
+    if (s_early_lock == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(release_task, "tm_release", 4096, NULL, 4, &s_release_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create release task");
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <esp_err.h>
+#include "pipeline.h"
+
+esp_err_t telemetry_init(void);
+
+// Forwards a reading upstream. With CONFIG_MIST_SENSOR_BATCHING the reading is
+// queued for the next SensorDataBatch on the per-master sensors topic, otherwise
+// it is encoded as a single JSON object and published in one MQTT message.
+//
+// With CONFIG_MIST_AGGREGATION, readings that stay within the deadbands of the
+// sensor's last forwarded reading are only added to its summary statistics.
+//
+// Readings whose timestamp predates a valid clock, because the sensor synced
+// against a master that had no time yet, are held until SNTP completes and are
+// then restamped from their receive time.
+//
+// Returns ESP_ERR_NOT_SUPPORTED for sensor types that are not forwarded upstream.
+esp_err_t telemetry_publish(const pipeline_reading_t *reading);
+
+// Called when the system clock is valid, from any context including the SNTP
+// callback. Only wakes a task, which restamps and forwards the readings held
+// since boot. telemetry_init() must have been called.
+void telemetry_time_valid(void);
@@ -0,0 +1,85 @@
+#include <string.h>
+#include "time_est.h"
+
+// Weight kept by older samples on every new one, roughly a 10 sample memory
+#define FORGET 0.9
+// A sample is used when its delay is within this of the minimum delay seen
+#define DELAY_TOLERANCE_US 2000
+// The minimum delay creeps up so a permanent path change is eventually accepted
+#define MIN_DELAY_AGING_US 100
+
+void time_est_reset(time_est_t *est) {
+    memset(est, 0, sizeof(*est));
+    est->min_delay_us = UINT32_MAX;
+}
+
+bool time_est_add(time_est_t *est, int64_t t1, int64_t t2, int64_t t3, int64_t t4) {
+    int64_t delay = (t4 - t1) - (t3 - t2);
+    int64_t offset = ((t1 - t2) + (t4 - t3)) / 2;
+    int64_t master_us = t2 + (t3 - t2) / 2;
+
+    if (delay < 0 || delay > UINT32_MAX) {
+        est->rejected++;
+        return false;
+    }
+
+    if (est->min_delay_us != UINT32_MAX && est->min_delay_us < UINT32_MAX - MIN_DELAY_AGING_US) {
+        est->min_delay_us += MIN_DELAY_AGING_US;
+    }
+    if ((uint32_t)delay < est->min_delay_us) {
+        est->min_delay_us = delay;
+    }
+    if (delay > (int64_t)est->min_delay_us + DELAY_TOLERANCE_US) {
+        est->rejected++;
+        return false;
+    }
+
+    if (est->samples == 0) {
+        est->base_master_us = master_us;
+        est->base_offset_us = offset;
+    }
+
+    // Seconds since the first sample against offset relative to the first sample
+    double x = (double)(master_us - est->base_master_us) / 1e6;
+    double y = (double)(offset - est->base_offset_us);
+
+    est->sw = est->sw * FORGET + 1.0;
+    est->sx = est->sx * FORGET + x;
+    est->sy = est->sy * FORGET + y;
+    est->sxx = est->sxx * FORGET + x * x;
+    est->sxy = est->sxy * FORGET + x * y;
+    est->samples++;
+    return true;
+}
+
+bool time_est_has_offset(const time_est_t *est) {
+    return est->samples > 0;
+}
+
+bool time_est_has_drift(const time_est_t *est) {
+    return est->samples >= 2 && est->sw * est->sxx - est->sx * est->sx >= 1e-6;
+}
+
+// Returns the fitted slope in microseconds per second, or 0 without enough spread in time
+static double slope(const time_est_t *est) {
+    if (!time_est_has_drift(est)) {
+        return 0.0;
+    }
+    return (est->sw * est->sxy - est->sx * est->sy) / (est->sw * est->sxx - est->sx * est->sx);
+}
+
+int64_t time_est_offset_at(const time_est_t *est, int64_t master_us) {
+    if (est->samples == 0) {
+        return 0;
+    }
+
+    double b = slope(est);
+    double a = (est->sy - b * est->sx) / est->sw;
+    double x = (double)(master_us - est->base_master_us) / 1e6;
+    return est->base_offset_us + (int64_t)(a + b * x);
+}
+
+int32_t time_est_drift_ppb(const time_est_t *est) {
+    // One microsecond per second is 1000 ppb
+    return (int32_t)(slope(est) * 1000.0);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-peer clock offset and drift estimator fed with NTP style four timestamp
+// exchanges. All times are in microseconds; t1 and t4 are on the sensor clock,
+// t2 and t3 on the master clock. Pure computation, no platform dependencies.
+//
+// Each exchange yields a sensor minus master offset sample ((t1 - t2) + (t4 - t3)) / 2
+// with round trip delay (t4 - t1) - (t3 - t2). Samples whose delay is well above the
+// recent minimum were delayed asymmetrically and are discarded. The remaining
+// samples are fitted with exponentially weighted least squares, giving an
+// offset that can be extrapolated with the estimated drift.
+
+typedef struct {
+    int64_t base_master_us;     // Origin of the fit on the master clock
+    int64_t base_offset_us;     // Offset of the first sample, the fit is relative to it
+    double sw, sx, sy, sxx, sxy;
+    uint32_t min_delay_us;
+    uint32_t samples;
+    uint32_t rejected;
+} time_est_t;
+
+void time_est_reset(time_est_t *est);
+
+// Adds one exchange. Returns false if the sample was rejected.
+bool time_est_add(time_est_t *est, int64_t t1, int64_t t2, int64_t t3, int64_t t4);
+
+// Whether there is an offset estimate, which takes one accepted exchange
+bool time_est_has_offset(const time_est_t *est);
+
+// Whether there is a drift estimate, which takes accepted exchanges spread in time
+bool time_est_has_drift(const time_est_t *est);
+
+// Estimated sensor clock minus master clock at master time master_us, 0 without an estimate
+int64_t time_est_offset_at(const time_est_t *est, int64_t master_us);
+
+// Estimated rate of the sensor clock relative to the master, in parts per
+// billion, 0 without an estimate
+int32_t time_est_drift_ppb(const time_est_t *est);
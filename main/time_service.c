@@ -0,0 +1,176 @@
+#include <string.h>
+#include <sys/time.h>
+#include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_timer.h>
+#include "sdkconfig.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+#include "messages.pb.h"
+#include "peers.h"
+#include "time_est.h"
+#include "time_service.h"
+
+static const char *TAG = "time_service";
+
+// SyncTime extension fields, see master.proto
+#define FIELD_SENSOR_TX_US 100
+#define FIELD_PREV_SENSOR_RX_US 101
+#define FIELD_MASTER_RX_US 102
+#define FIELD_MASTER_TX_US 103
+#define FIELD_OFFSET_US 104
+#define FIELD_DRIFT_PPB 105
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    bool pending;           // t1..t3 await the sensor's receive time
+    int64_t t1, t2, t3;
+    time_est_t est;
+} time_peer_t;
+
+// Indexed by peers_index()
+static time_peer_t s_peers[CONFIG_MIST_PEER_CAPACITY];
+
+// The reply is a fixed template of fixed width fields patched in place, followed
+// by the encoded SyncTime carrying master_timestamp
+#define REPLY_TEMPLATE_MAX 64
+static uint8_t s_reply[REPLY_TEMPLATE_MAX + SyncTime_size];
+static size_t s_template_len;
+static size_t s_off_t1, s_off_t2, s_off_t3, s_off_offset, s_off_drift;
+// Template lengths leaving out the estimate fields, which come last
+static size_t s_len_no_offset, s_len_no_drift;
+
+static inline void put_le(uint8_t *dst, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        dst[i] = value >> (8 * i);
+    }
+}
+
+static bool encode_fixed_field(pb_ostream_t *stream, uint32_t field, pb_wire_type_t type, size_t *offset) {
+    static const uint64_t zero = 0;
+    if (!pb_encode_tag(stream, type, field)) return false;
+    *offset = stream->bytes_written;
+    return type == PB_WT_64BIT ? pb_encode_fixed64(stream, &zero) : pb_encode_fixed32(stream, &zero);
+}
+
+esp_err_t time_service_init(void) {
+    pb_ostream_t stream = pb_ostream_from_buffer(s_reply, REPLY_TEMPLATE_MAX);
+
+    // MessageType leads so receivers can peek it before decoding
+    bool ok = pb_encode_tag(&stream, PB_WT_VARINT, 1) &&
+              pb_encode_varint(&stream, MessageType_SYNC_TIME) &&
+              encode_fixed_field(&stream, FIELD_SENSOR_TX_US, PB_WT_64BIT, &s_off_t1) &&
+              encode_fixed_field(&stream, FIELD_MASTER_RX_US, PB_WT_64BIT, &s_off_t2) &&
+              encode_fixed_field(&stream, FIELD_MASTER_TX_US, PB_WT_64BIT, &s_off_t3);
+    s_len_no_offset = stream.bytes_written;
+    ok = ok && encode_fixed_field(&stream, FIELD_OFFSET_US, PB_WT_64BIT, &s_off_offset);
+    s_len_no_drift = stream.bytes_written;
+    ok = ok && encode_fixed_field(&stream, FIELD_DRIFT_PPB, PB_WT_32BIT, &s_off_drift);
+    if (!ok) {
+        ESP_LOGE(TAG, "Encoding reply template failed: %s", PB_GET_ERROR(&stream));
+        return ESP_FAIL;
+    }
+
+    s_template_len = stream.bytes_written;
+    return ESP_OK;
+}
+
+// Master clock in microseconds, at esp_timer time mono_us
+static int64_t master_time_us(int64_t mono_us) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t now_us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+    return now_us - (esp_timer_get_time() - mono_us);
+}
+
+// Extracts the sensor timestamps carried as extension fields, if any
+static void parse_request(const router_msg_t *msg, uint64_t *t1, uint64_t *prev_t4) {
+    pb_istream_t stream = pb_istream_from_buffer(msg->raw, msg->raw_len);
+    pb_wire_type_t type;
+    uint32_t field;
+    bool eof;
+
+    *t1 = 0;
+    *prev_t4 = 0;
+    while (pb_decode_tag(&stream, &type, &field, &eof)) {
+        if (field == FIELD_SENSOR_TX_US && type == PB_WT_64BIT) {
+            if (!pb_decode_fixed64(&stream, t1)) return;
+        } else if (field == FIELD_PREV_SENSOR_RX_US && type == PB_WT_64BIT) {
+            if (!pb_decode_fixed64(&stream, prev_t4)) return;
+        } else if (!pb_skip_field(&stream, type)) {
+            return;
+        }
+    }
+}
+
+static time_peer_t *peer_state(const uint8_t *mac_addr) {
+    peer_t *peer = peers_find(mac_addr);
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    // Registry slots are reused after a peer is removed
+    time_peer_t *state = &s_peers[peers_index(peer)];
+    if (memcmp(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN) != 0) {
+        memcpy(state->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+        state->pending = false;
+        time_est_reset(&state->est);
+    }
+    return state;
+}
+
+esp_err_t time_service_handle(const router_msg_t *msg) {
+    int64_t t2 = master_time_us(msg->rx_time_us);
+
+    uint64_t t1, prev_t4;
+    parse_request(msg, &t1, &prev_t4);
+
+    time_peer_t *state = peer_state(msg->mac_addr);
+    if (state != NULL && state->pending && prev_t4 != 0) {
+        // The sensor reports when it received our previous reply, completing that exchange
+        time_est_add(&state->est, state->t1, state->t2, state->t3, prev_t4);
+        state->pending = false;
+    }
+
+    // Without an estimate the fields are left out rather than sent as zeros,
+    // which a sensor would take for a perfectly matched clock
+    bool has_offset = state != NULL && time_est_has_offset(&state->est);
+    bool has_drift = has_offset && time_est_has_drift(&state->est);
+    int64_t offset = has_offset ? time_est_offset_at(&state->est, t2) : 0;
+    int32_t drift = has_drift ? time_est_drift_ppb(&state->est) : 0;
+    size_t template_len = has_drift ? s_template_len : has_offset ? s_len_no_drift : s_len_no_offset;
+
+    put_le(&s_reply[s_off_t1], t1, 8);
+    put_le(&s_reply[s_off_t2], t2, 8);
+    put_le(&s_reply[s_off_offset], offset, 8);
+    put_le(&s_reply[s_off_drift], (uint32_t)drift, 4);
+
+    SyncTime sync_time = SyncTime_init_default;
+    sync_time.message_type = MessageType_SYNC_TIME;
+    sync_time.has_master_timestamp = true;
+
+    // Stamp t3 as late as possible, right before encoding the seconds and sending
+    int64_t t3 = master_time_us(esp_timer_get_time());
+    sync_time.master_timestamp = t3 / 1000000;
+    put_le(&s_reply[s_off_t3], t3, 8);
+
+    pb_ostream_t stream = pb_ostream_from_buffer(s_reply + template_len, sizeof(s_reply) - template_len);
+    if (!pb_encode(&stream, SyncTime_fields, &sync_time)) {
+        ESP_LOGE(TAG, "Encoding SyncTime failed: %s", PB_GET_ERROR(&stream));
+        return ESP_FAIL;
+    }
+
+    esp_err_t err = peers_send(s_reply, template_len + stream.bytes_written, msg->mac_addr);
+
+    if (state != NULL && t1 != 0) {
+        state->t1 = t1;
+        state->t2 = t2;
+        state->t3 = t3;
+        state->pending = true;
+    }
+
+    ESP_LOGD(TAG, "SyncTime reply to "MACSTR", offset %lld us, drift %ld ppb%s",
+             MAC2STR(msg->mac_addr), offset, (long)drift,
+             has_drift ? "" : has_offset ? " (no drift estimate)" : " (no estimate)");
+    return err;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <esp_err.h>
+#include "router.h"
+
+// Answers SyncTime requests from sensors. Besides the one second resolution
+// master_timestamp understood by every sensor, replies carry the microsecond
+// timestamps of an NTP style exchange and the master's running estimate of the
+// sensor's offset and drift once it has one, as extension fields described in
+// master.proto.
+// Sensors that send their own transmit and receive times get a compensated
+// offset and can extrapolate with the drift, so they need far fewer syncs.
+
+// Encodes the reply template once
+esp_err_t time_service_init(void);
+
+// Replies to a SyncTime request received over ESP-NOW
+esp_err_t time_service_handle(const router_msg_t *msg);
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_tls.h>
+#include <mbedtls/ssl.h>
+#include <esp_rom_crc.h>
+#include <nvs.h>
+#include "sdkconfig.h"
+#include "metrics.h"
+#include "tls_transport.h"
+
+#if CONFIG_MIST_TLS_SESSION_RESUMPTION
+
+static const char *TAG = "tls_transport";
+
+#define NVS_NAMESPACE "mist"
+#define NVS_KEY_HOST "tls_host"
+#define NVS_KEY_SESSION "tls_session"
+
+#define HOST_LEN 128
+
+static const char *s_ca_cert;
+static esp_tls_t *s_tls;
+
+// Session of the last successful connection to s_host
+static esp_tls_client_session_t *s_session;
+static char s_host[HOST_LEN];
+
+#if CONFIG_MIST_TLS_SESSION_PERSIST
+// CRC of the session blob in NVS, to skip rewriting an unchanged session
+static uint32_t s_persisted_crc;
+
+static void persist_session(void) {
+    mbedtls_ssl_session *session = &s_session->saved_session;
+    size_t len = 0;
+    mbedtls_ssl_session_save(session, NULL, 0, &len);
+    uint8_t *blob = malloc(len);
+    if (blob == NULL || mbedtls_ssl_session_save(session, blob, len, &len) != 0) {
+        ESP_LOGW(TAG, "Failed to serialize TLS session");
+        free(blob);
+        return;
+    }
+
+    uint32_t crc = esp_rom_crc32_le(0, blob, len);
+    if (crc == s_persisted_crc) {
+        free(blob);
+        return;
+    }
+
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err == ESP_OK) {
+        err = nvs_set_str(handle, NVS_KEY_HOST, s_host);
+        if (err == ESP_OK) err = nvs_set_blob(handle, NVS_KEY_SESSION, blob, len);
+        if (err == ESP_OK) err = nvs_commit(handle);
+        nvs_close(handle);
+    }
+    free(blob);
+
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to persist TLS session: %s", esp_err_to_name(err));
+        return;
+    }
+    s_persisted_crc = crc;
+}
+
+// Restores the session saved for host before the last reboot, if any
+static void load_session(const char *host) {
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+
+    char saved_host[HOST_LEN];
+    size_t host_len = sizeof(saved_host);
+    size_t len = 0;
+    uint8_t *blob = NULL;
+    if (nvs_get_str(handle, NVS_KEY_HOST, saved_host, &host_len) == ESP_OK && strcmp(saved_host, host) == 0 &&
+        nvs_get_blob(handle, NVS_KEY_SESSION, NULL, &len) == ESP_OK && (blob = malloc(len)) != NULL &&
+        nvs_get_blob(handle, NVS_KEY_SESSION, blob, &len) == ESP_OK) {
+        esp_tls_client_session_t *session = calloc(1, sizeof(*session));
+        if (session != NULL) {
+            mbedtls_ssl_session_init(&session->saved_session);
+            if (mbedtls_ssl_session_load(&session->saved_session, blob, len) == 0) {
+                s_session = session;
+                s_persisted_crc = esp_rom_crc32_le(0, blob, len);
+                ESP_LOGI(TAG, "Restored TLS session for %s", host);
+            } else {
+                // Saved by a build with a different mbedTLS configuration
+                esp_tls_free_client_session(session);
+            }
+        }
+    }
+    free(blob);
+    nvs_close(handle);
+}
+#endif
+
+static void drop_session(void) {
+    if (s_session != NULL) {
+        esp_tls_free_client_session(s_session);
+        s_session = NULL;
+    }
+}
+
+static int tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms) {
+    // A session is only valid for the server it was negotiated with
+    if (strncmp(s_host, host, sizeof(s_host)) != 0) {
+        drop_session();
+        strlcpy(s_host, host, sizeof(s_host));
+#if CONFIG_MIST_TLS_SESSION_PERSIST
+        load_session(host);
+#endif
+    }
+
+    s_tls = esp_tls_init();
+    if (s_tls == NULL) {
+        return -1;
+    }
+
+    esp_tls_cfg_t cfg = {
+        .cacert_buf = (const unsigned char *)s_ca_cert,
+        .cacert_bytes = strlen(s_ca_cert) + 1,
+        .timeout_ms = timeout_ms,
+        .client_session = s_session,
+    };
+
+    bool offered = s_session != NULL;
+    int64_t start_us = esp_timer_get_time();
+    if (esp_tls_conn_new_sync(host, strlen(host), port, &cfg, s_tls) <= 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", host, port);
+        esp_tls_conn_destroy(s_tls);
+        s_tls = NULL;
+        return -1;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    metrics_record_us(METRICS_STAGE_TLS_CONNECT, elapsed_us);
+    ESP_LOGI(TAG, "Connected to %s in %lld ms%s", host, elapsed_us / 1000, offered ? ", session offered" : "");
+
+    // The server may have issued a new ticket, keep the latest session
+    esp_tls_client_session_t *session = esp_tls_get_client_session(s_tls);
+    if (session != NULL) {
+        drop_session();
+        s_session = session;
+#if CONFIG_MIST_TLS_SESSION_PERSIST
+        persist_session();
+#endif
+    }
+    return 0;
+}
+
+// Returns 1 when the socket is ready, 0 on timeout and -1 on error
+static int poll_socket(bool write, int timeout_ms) {
+    int fd;
+    if (s_tls == NULL || esp_tls_get_conn_sockfd(s_tls, &fd) != ESP_OK) {
+        return -1;
+    }
+
+    fd_set fds;
+    fd_set errfds;
+    FD_ZERO(&fds);
+    FD_ZERO(&errfds);
+    FD_SET(fd, &fds);
+    FD_SET(fd, &errfds);
+    struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+
+    int ret = select(fd + 1, write ? NULL : &fds, write ? &fds : NULL, &errfds, timeout_ms < 0 ? NULL : &timeout);
+    if (ret > 0 && FD_ISSET(fd, &errfds)) {
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms) {
+    // Records already decrypted do not show up on the socket
+    if (s_tls != NULL && esp_tls_get_bytes_avail(s_tls) > 0) {
+        return 1;
+    }
+    return poll_socket(false, timeout_ms);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms) {
+    return poll_socket(true, timeout_ms);
+}
+
+static int tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms) {
+    int ready = tls_poll_read(t, timeout_ms);
+    if (ready <= 0) {
+        return ready;
+    }
+
+    ssize_t ret = esp_tls_conn_read(s_tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    return ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms) {
+    int ready = tls_poll_write(t, timeout_ms);
+    if (ready <= 0) {
+        ESP_LOGW(TAG, "Socket not writable within %d ms", timeout_ms);
+        return ready;
+    }
+
+    ssize_t ret = esp_tls_conn_write(s_tls, buffer, len);
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Write failed: -0x%x", (unsigned)-ret);
+    }
+    return ret;
+}
+
+static int tls_close(esp_transport_handle_t t) {
+    if (s_tls != NULL) {
+        esp_tls_conn_destroy(s_tls);
+        s_tls = NULL;
+    }
+    return 0;
+}
+
+static int tls_destroy(esp_transport_handle_t t) {
+    tls_close(t);
+    drop_session();
+    s_host[0] = '\0';
+    return 0;
+}
+
+esp_transport_handle_t tls_transport_init(const char *ca_cert) {
+    esp_transport_handle_t t = esp_transport_init();
+    if (t == NULL) {
+        return NULL;
+    }
+
+    s_ca_cert = ca_cert;
+    esp_transport_set_default_port(t, 8883);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+    return t;
+}
+
+#endif
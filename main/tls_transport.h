@@ -0,0 +1,14 @@
+#pragma once
+
+#include <esp_transport.h>
+
+// MQTT transport over esp-tls that keeps the client session of the last
+// connection and offers it on the next one, so reconnects resume the session
+// with an abbreviated handshake instead of verifying the broker certificate and
+// running the key exchange again. With CONFIG_MIST_TLS_SESSION_PERSIST the
+// session is also kept in NVS and reused after a reboot. mqtt.c only installs
+// it for mqtts:// broker URIs.
+//
+// The server certificate is verified against ca_cert, a PEM string that must stay
+// valid as long as the transport. Only one transport may exist at a time.
+esp_transport_handle_t tls_transport_init(const char *ca_cert);
@@ -0,0 +1,127 @@
+#include <string.h>
+#include "topic_trie.h"
+
+typedef enum {
+    LEVEL_LITERAL,
+    LEVEL_SINGLE,       // +
+    LEVEL_MULTI,        // #
+} topic_level_kind_t;
+
+void topic_trie_init(topic_trie_t *trie) {
+    memset(trie, 0, sizeof(*trie));
+    trie->nodes[0].value = TOPIC_TRIE_NO_MATCH;
+    trie->count = 1;
+}
+
+static int find_child(const topic_trie_t *trie, int parent, const char *level, size_t len) {
+    for (int child = trie->nodes[parent].first_child; child != 0; child = trie->nodes[child].next_sibling) {
+        const topic_node_t *node = &trie->nodes[child];
+        if (node->level_len == len && memcmp(node->level, level, len) == 0) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+esp_err_t topic_trie_add(topic_trie_t *trie, const char *filter, int value) {
+    if (value < 0 || value > INT8_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int node = 0;
+    const char *level = filter;
+    while (1) {
+        const char *end = strchr(level, '/');
+        size_t len = end != NULL ? (size_t)(end - level) : strlen(level);
+        if (len > UINT8_MAX) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+
+        topic_level_kind_t kind = LEVEL_LITERAL;
+        if (len == 1 && level[0] == '+') {
+            kind = LEVEL_SINGLE;
+        } else if (len == 1 && level[0] == '#') {
+            // # must be the last level
+            if (end != NULL) return ESP_ERR_INVALID_ARG;
+            kind = LEVEL_MULTI;
+        }
+
+        int child = find_child(trie, node, level, len);
+        if (child == 0) {
+            if (trie->count == TOPIC_TRIE_MAX_NODES) {
+                return ESP_ERR_NO_MEM;
+            }
+            child = trie->count++;
+            topic_node_t *new_node = &trie->nodes[child];
+            new_node->level = level;
+            new_node->level_len = len;
+            new_node->kind = kind;
+            new_node->value = TOPIC_TRIE_NO_MATCH;
+            new_node->first_child = 0;
+            new_node->next_sibling = trie->nodes[node].first_child;
+            trie->nodes[node].first_child = child;
+        }
+        node = child;
+
+        if (end == NULL) break;
+        level = end + 1;
+    }
+
+    trie->nodes[node].value = value;
+    return ESP_OK;
+}
+
+// Value of a # directly below node, which also matches the parent level itself
+static int multi_child_value(const topic_trie_t *trie, int node) {
+    for (int child = trie->nodes[node].first_child; child != 0; child = trie->nodes[child].next_sibling) {
+        if (trie->nodes[child].kind == LEVEL_MULTI) {
+            return trie->nodes[child].value;
+        }
+    }
+    return TOPIC_TRIE_NO_MATCH;
+}
+
+static int match_level(const topic_trie_t *trie, int parent, const char *topic, size_t len) {
+    const char *end = memchr(topic, '/', len);
+    size_t level_len = end != NULL ? (size_t)(end - topic) : len;
+
+    int literal = TOPIC_TRIE_NO_MATCH;
+    int single = TOPIC_TRIE_NO_MATCH;
+    int multi = TOPIC_TRIE_NO_MATCH;
+
+    for (int child = trie->nodes[parent].first_child; child != 0; child = trie->nodes[child].next_sibling) {
+        const topic_node_t *node = &trie->nodes[child];
+        int *result;
+
+        switch (node->kind) {
+            case LEVEL_MULTI:
+                multi = node->value;
+                continue;
+            case LEVEL_SINGLE:
+                result = &single;
+                break;
+            default:
+                if (node->level_len != level_len || memcmp(node->level, topic, level_len) != 0) continue;
+                result = &literal;
+                break;
+        }
+
+        if (end == NULL) {
+            *result = node->value != TOPIC_TRIE_NO_MATCH ? node->value : multi_child_value(trie, child);
+        } else {
+            *result = match_level(trie, child, end + 1, len - level_len - 1);
+        }
+    }
+
+    if (literal != TOPIC_TRIE_NO_MATCH) return literal;
+    if (single != TOPIC_TRIE_NO_MATCH) return single;
+    return multi;
+}
+
+int topic_trie_match(const topic_trie_t *trie, const char *topic, size_t len) {
+    // The broker's own $ topics are never of interest
+    if (len > 0 && topic[0] == '$') {
+        return TOPIC_TRIE_NO_MATCH;
+    }
+    return match_level(trie, 0, topic, len);
+}
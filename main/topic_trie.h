@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_err.h>
+
+// Matches MQTT topics against a fixed set of topic filters, with the + and #
+// wildcards of the MQTT specification. Filters are added once at startup into
+// a trie of topic levels; matching walks the topic a level at a time without
+// copying or allocating. Exact levels take precedence over +, and + over #.
+
+#define TOPIC_TRIE_MAX_NODES 32
+#define TOPIC_TRIE_NO_MATCH (-1)
+
+typedef struct {
+    const char *level;      // Points into the filter, not null terminated
+    uint8_t level_len;
+    uint8_t kind;           // topic_level_kind_t
+    int8_t value;           // Value of the filter ending here, TOPIC_TRIE_NO_MATCH if none
+    uint8_t first_child;    // 0 if none, the root is never a child
+    uint8_t next_sibling;   // 0 if none
+} topic_node_t;
+
+typedef struct {
+    topic_node_t nodes[TOPIC_TRIE_MAX_NODES];
+    uint8_t count;
+} topic_trie_t;
+
+void topic_trie_init(topic_trie_t *trie);
+
+// Adds filter, which must stay valid as long as trie is used, with value in [0, 127]
+esp_err_t topic_trie_add(topic_trie_t *trie, const char *filter, int value);
+
+// Returns the value of the best matching filter, or TOPIC_TRIE_NO_MATCH.
+// topic does not need to be null terminated.
+int topic_trie_match(const topic_trie_t *trie, const char *topic, size_t len);
@@ -0,0 +1,227 @@
+#include <string.h>
+#include <esp_now.h>
+#include "pbw.h"
+#include "tsblock.h"
+
+// TimeSeriesBlock field numbers, see master.proto
+#define BLOCK_MAC_TAG 1
+#define BLOCK_SENSOR_TYPE_TAG 2
+#define BLOCK_COUNT_TAG 3
+#define BLOCK_TIMESTAMPS_TAG 4
+#define BLOCK_VALUES_TAG 5
+#define BLOCK_VOC_INDEX_TAG 6
+
+// Float columns per sensor type, in the order they appear in the block
+#define MAX_FLOAT_COLUMNS 2
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    uint64_t acc;       // Bits not yet written, right aligned
+    int acc_bits;
+    bool overflow;
+} bit_writer_t;
+
+typedef struct {
+    uint32_t prev;
+    int lead;           // Leading and trailing zeros of the current window
+    int trail;
+    bool has_window;
+} xor_state_t;
+
+static void bits_init(bit_writer_t *w, uint8_t *buf, size_t size) {
+    *w = (bit_writer_t){ .buf = buf, .size = size };
+}
+
+// Appends the low bits of value, most significant first. bits is at most 32.
+static inline void bits_put(bit_writer_t *w, uint32_t value, int bits) {
+    if (bits == 0) return;
+    w->acc = (w->acc << bits) | (value & (((uint64_t)1 << bits) - 1));
+    w->acc_bits += bits;
+    while (w->acc_bits >= 8) {
+        w->acc_bits -= 8;
+        if (w->len < w->size) {
+            w->buf[w->len++] = (uint8_t)(w->acc >> w->acc_bits);
+        } else {
+            w->overflow = true;
+        }
+    }
+}
+
+// Pads the last byte with zero bits. Returns the number of bytes written.
+static size_t bits_finish(bit_writer_t *w) {
+    if (w->acc_bits > 0) {
+        bits_put(w, 0, 8 - w->acc_bits);
+    }
+    return w->overflow ? 0 : w->len;
+}
+
+static uint32_t float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Gorilla XOR encoding: 0 for an unchanged value, 10 and the meaningful bits when
+// they fit the previous window, otherwise 11, 5 bits of leading zeros, 5 bits of
+// length - 1 and the meaningful bits.
+static void xor_put(bit_writer_t *w, xor_state_t *state, uint32_t value, bool first) {
+    if (first) {
+        bits_put(w, value, 32);
+        state->prev = value;
+        state->has_window = false;
+        return;
+    }
+
+    uint32_t x = value ^ state->prev;
+    state->prev = value;
+    if (x == 0) {
+        bits_put(w, 0, 1);
+        return;
+    }
+
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+    if (lead > 31) lead = 31;
+
+    if (state->has_window && lead >= state->lead && trail >= state->trail) {
+        bits_put(w, 0x2, 2);
+        bits_put(w, x >> state->trail, 32 - state->lead - state->trail);
+        return;
+    }
+
+    int len = 32 - lead - trail;
+    bits_put(w, 0x3, 2);
+    bits_put(w, lead, 5);
+    bits_put(w, len - 1, 5);
+    bits_put(w, x >> trail, len);
+    state->lead = lead;
+    state->trail = trail;
+    state->has_window = true;
+}
+
+static int64_t reading_timestamp(const SensorData *sensor_data) {
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR:
+            return sensor_data->body.air_sensor.timestamp;
+        case SensorType_SOIL_SENSOR:
+            return sensor_data->body.soil_sensor.timestamp;
+        case SensorType_MIST_SENSOR:
+            return sensor_data->body.mist_sensor.timestamp;
+        case SensorType_LIGHT_SENSOR:
+            return sensor_data->body.light_sensor.timestamp;
+        default:
+            return 0;
+    }
+}
+
+// Returns the number of float columns of the reading's type and their values
+static int reading_floats(const SensorData *sensor_data, float values[MAX_FLOAT_COLUMNS]) {
+    switch (sensor_data->sensor_type) {
+        case SensorType_AIR_SENSOR:
+            values[0] = sensor_data->body.air_sensor.humidity;
+            values[1] = sensor_data->body.air_sensor.temperature;
+            return 2;
+        case SensorType_SOIL_SENSOR:
+            values[0] = sensor_data->body.soil_sensor.moisture;
+            return 1;
+        case SensorType_MIST_SENSOR:
+            values[0] = sensor_data->body.mist_sensor.humidity;
+            values[1] = sensor_data->body.mist_sensor.temperature;
+            return 2;
+        case SensorType_LIGHT_SENSOR:
+            values[0] = sensor_data->body.light_sensor.intensity;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static bool encode_timestamps(tsblock_buf_t *buf, pb_ostream_t *block, const SensorData *const *readings, size_t count) {
+    pb_ostream_t column = pb_ostream_from_buffer(buf->column, sizeof(buf->column));
+    int64_t prev = 0;
+    int64_t prev_delta = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int64_t timestamp = reading_timestamp(readings[i]);
+        int64_t delta = timestamp - prev;
+        // The first value is absolute, the second a delta, the rest deltas of deltas
+        int64_t value = i == 0 ? timestamp : i == 1 ? delta : delta - prev_delta;
+        if (!pb_encode_svarint(&column, value)) return false;
+        prev = timestamp;
+        prev_delta = delta;
+    }
+
+    return pbw_bytes(block, BLOCK_TIMESTAMPS_TAG, buf->column, column.bytes_written);
+}
+
+static bool encode_float_column(tsblock_buf_t *buf, pb_ostream_t *block, const SensorData *const *readings, size_t count, int column) {
+    bit_writer_t w;
+    xor_state_t state = { 0 };
+    bits_init(&w, buf->column, sizeof(buf->column));
+
+    for (size_t i = 0; i < count; i++) {
+        float values[MAX_FLOAT_COLUMNS];
+        reading_floats(readings[i], values);
+        xor_put(&w, &state, float_bits(values[column]), i == 0);
+    }
+
+    size_t len = bits_finish(&w);
+    return len > 0 && pbw_bytes(block, BLOCK_VALUES_TAG, buf->column, len);
+}
+
+// Zigzag varint minimum, one byte of bit width, then every value minus the
+// minimum in that many bits
+static bool encode_voc_index(tsblock_buf_t *buf, pb_ostream_t *block, const SensorData *const *readings, size_t count) {
+    int32_t min = INT32_MAX;
+    int32_t max = INT32_MIN;
+    for (size_t i = 0; i < count; i++) {
+        int32_t voc = readings[i]->body.air_sensor.voc_index;
+        if (voc < min) min = voc;
+        if (voc > max) max = voc;
+    }
+    uint32_t range = (uint32_t)(max - min);
+    int width = range == 0 ? 0 : 32 - __builtin_clz(range);
+
+    pb_ostream_t header = pb_ostream_from_buffer(buf->column, sizeof(buf->column));
+    if (!pb_encode_svarint(&header, min)) return false;
+    buf->column[header.bytes_written] = width;
+
+    bit_writer_t w;
+    size_t header_len = header.bytes_written + 1;
+    bits_init(&w, buf->column + header_len, sizeof(buf->column) - header_len);
+    for (size_t i = 0; i < count; i++) {
+        bits_put(&w, (uint32_t)(readings[i]->body.air_sensor.voc_index - min), width);
+    }
+
+    size_t len = bits_finish(&w);
+    return !w.overflow && pbw_bytes(block, BLOCK_VOC_INDEX_TAG, buf->column, header_len + len);
+}
+
+bool tsblock_encode(tsblock_buf_t *buf, pb_ostream_t *stream, uint32_t field, const uint8_t *mac_addr,
+                    const SensorData *const *readings, size_t count) {
+    if (count == 0 || count > TSBLOCK_MAX_READINGS) {
+        return false;
+    }
+
+    float values[MAX_FLOAT_COLUMNS];
+    int columns = reading_floats(readings[0], values);
+    SensorType sensor_type = readings[0]->sensor_type;
+
+    pb_ostream_t block = pb_ostream_from_buffer(buf->block, sizeof(buf->block));
+    bool ok = pbw_bytes(&block, BLOCK_MAC_TAG, mac_addr, ESP_NOW_ETH_ALEN) &&
+              pbw_uint(&block, BLOCK_SENSOR_TYPE_TAG, sensor_type) &&
+              pbw_uint(&block, BLOCK_COUNT_TAG, count) &&
+              encode_timestamps(buf, &block, readings, count);
+
+    for (int c = 0; ok && c < columns; c++) {
+        ok = encode_float_column(buf, &block, readings, count, c);
+    }
+    if (ok && sensor_type == SensorType_AIR_SENSOR) {
+        ok = encode_voc_index(buf, &block, readings, count);
+    }
+
+    // Same wire format as a submessage, without encoding the block twice to size it
+    return ok && pbw_bytes(stream, field, buf->block, block.bytes_written);
+}
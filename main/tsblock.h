@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pb_encode.h"
+#include "messages.pb.h"
+
+// Columnar encoding of one sensor's readings as a TimeSeriesBlock (master.proto).
+// Timestamps are stored as zigzag varint deltas of deltas, float values as
+// Gorilla style XOR bit streams and voc_index bit-packed against the block's
+// minimum, which takes a fraction of the bytes of one SensorData per reading
+// for slowly changing series. scripts/decode_tsblock.py is the reference decoder.
+
+// Largest number of readings in one block
+#define TSBLOCK_MAX_READINGS 256
+
+// Worst cases per reading: a 10 byte varint, a 44 bit XOR value, a 32 bit voc_index
+#define TSBLOCK_COLUMN_BUF_SIZE (TSBLOCK_MAX_READINGS * 10 + 16)
+
+// A block larger than this cannot be sent in one MQTT message of the batch buffer anyway
+#define TSBLOCK_BLOCK_BUF_SIZE 4096
+
+// Scratch space of one encoder, each task encoding blocks brings its own
+typedef struct {
+    uint8_t block[TSBLOCK_BLOCK_BUF_SIZE];
+    uint8_t column[TSBLOCK_COLUMN_BUF_SIZE];
+} tsblock_buf_t;
+
+// Encodes readings, all from the sensor at mac_addr and of the same SensorType
+// and ordered by arrival, as a TimeSeriesBlock in field of stream
+bool tsblock_encode(tsblock_buf_t *buf, pb_ostream_t *stream, uint32_t field, const uint8_t *mac_addr,
+                    const SensorData *const *readings, size_t count);
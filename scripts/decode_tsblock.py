@@ -0,0 +1,161 @@
+import struct
+import sys
+
+# Reference decoder for SensorDataBatch messages carrying TimeSeriesBlock
+# (see main/master.proto). Reads a raw payload from the sensors topic on stdin,
+# or from the file given as argument, and prints one JSON line per reading.
+
+SENSOR_TYPES = {0: "AIR_SENSOR", 1: "SOIL_SENSOR", 2: "MIST_SENSOR", 3: "LIGHT_SENSOR"}
+
+# Float columns per sensor type, in block order
+FLOAT_COLUMNS = {
+    0: ["humidity", "temperature"],
+    1: ["moisture"],
+    2: ["humidity", "temperature"],
+    3: ["intensity"],
+}
+
+
+def read_varint(buf, pos):
+    result = 0
+    shift = 0
+    while True:
+        byte = buf[pos]
+        pos += 1
+        result |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return result, pos
+        shift += 7
+
+
+def zigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def fields(buf):
+    """Yields (field, wire_type, value) of a protobuf message."""
+    pos = 0
+    while pos < len(buf):
+        key, pos = read_varint(buf, pos)
+        field, wire_type = key >> 3, key & 7
+        if wire_type == 0:
+            value, pos = read_varint(buf, pos)
+        elif wire_type == 2:
+            length, pos = read_varint(buf, pos)
+            value = bytes(buf[pos:pos + length])
+            pos += length
+        elif wire_type == 1:
+            value = bytes(buf[pos:pos + 8])
+            pos += 8
+        elif wire_type == 5:
+            value = bytes(buf[pos:pos + 4])
+            pos += 4
+        else:
+            raise ValueError(f"unsupported wire type {wire_type}")
+        yield field, wire_type, value
+
+
+class BitReader:
+    def __init__(self, buf):
+        self.buf = buf
+        self.pos = 0
+
+    def read(self, bits):
+        value = 0
+        for _ in range(bits):
+            byte = self.buf[self.pos >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.pos & 7))) & 1)
+            self.pos += 1
+        return value
+
+
+def decode_timestamps(buf, count):
+    timestamps = []
+    pos = 0
+    prev = 0
+    delta = 0
+    for i in range(count):
+        value, pos = read_varint(buf, pos)
+        value = zigzag(value)
+        if i == 0:
+            prev = value
+        else:
+            delta = value if i == 1 else delta + value
+            prev += delta
+        timestamps.append(prev)
+    return timestamps
+
+
+def decode_floats(buf, count):
+    reader = BitReader(buf)
+    bits = reader.read(32)
+    values = [bits]
+    lead = trail = 0
+    for _ in range(count - 1):
+        if reader.read(1):
+            if reader.read(1):
+                lead = reader.read(5)
+                length = reader.read(5) + 1
+                trail = 32 - lead - length
+            bits ^= reader.read(32 - lead - trail) << trail
+        values.append(bits)
+    return [struct.unpack("<f", struct.pack("<I", v))[0] for v in values]
+
+
+def decode_packed(buf, count):
+    minimum, pos = read_varint(buf, 0)
+    minimum = zigzag(minimum)
+    width = buf[pos]
+    reader = BitReader(buf[pos + 1:])
+    return [minimum + reader.read(width) for _ in range(count)]
+
+
+def decode_block(buf):
+    block = {"values": []}
+    for field, _, value in fields(buf):
+        if field == 1:
+            block["mac_addr"] = value
+        elif field == 2:
+            block["sensor_type"] = value
+        elif field == 3:
+            block["count"] = value
+        elif field == 4:
+            block["timestamps"] = value
+        elif field == 5:
+            block["values"].append(value)
+        elif field == 6:
+            block["voc_index"] = value
+
+    count = block["count"]
+    sensor_type = block.get("sensor_type", 0)
+    columns = {"timestamp": decode_timestamps(block["timestamps"], count)}
+    for name, column in zip(FLOAT_COLUMNS[sensor_type], block["values"]):
+        columns[name] = decode_floats(column, count)
+    if "voc_index" in block:
+        columns["voc_index"] = decode_packed(block["voc_index"], count)
+
+    mac = ":".join(f"{b:02x}" for b in block["mac_addr"])
+    for i in range(count):
+        reading = {"mac_addr": mac, "sensor_type": SENSOR_TYPES.get(sensor_type, sensor_type)}
+        reading.update({name: values[i] for name, values in columns.items()})
+        yield reading
+
+
+def decode_batch(buf):
+    """Yields the readings of every TimeSeriesBlock in a SensorDataBatch."""
+    for field, wire_type, value in fields(buf):
+        if field == 2 and wire_type == 2:
+            yield from decode_block(value)
+
+
+if __name__ == "__main__":
+    import json
+
+    if len(sys.argv) > 1:
+        with open(sys.argv[1], "rb") as file:
+            payload = file.read()
+    else:
+        payload = sys.stdin.buffer.read()
+
+    for reading in decode_batch(payload):
+        print(json.dumps(reading))
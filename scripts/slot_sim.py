@@ -0,0 +1,176 @@
+import argparse
+import heapq
+import random
+
+# Airtime simulator for sensors reporting to one master over ESP-NOW, comparing
+# contention (CSMA with hidden sensors) against the transmit slots the master
+# assigns with MIST_SLOTS (see main/slots.h). Prints the share of transmissions
+# lost to collisions and the delay from a reading being ready to its delivery.
+# Slotted sensors either take readings at their own pace and hold them for the
+# next slot, or, as "aligned", take them right before their slot.
+#
+#   python3 scripts/slot_sim.py --sensors 50 --interval-ms 1000
+
+PREAMBLE_US = 192           # 802.11b long preamble at 1 Mbps
+MAC_OVERHEAD = 60           # MAC header, vendor action frame and ESP-NOW header bytes
+ACK_US = 304
+DIFS_US = 50
+BACKOFF_SLOT_US = 20
+CW_MIN = 31
+CW_MAX = 1023
+MAX_ATTEMPTS = 8
+
+
+def airtime_us(payload, rate_mbps):
+    return PREAMBLE_US + (payload + MAC_OVERHEAD) * 8 / rate_mbps + ACK_US
+
+
+class Channel:
+    def __init__(self, hidden):
+        self.hidden = hidden
+        self.active = []    # [start, end, sensor, collided]
+
+    def expire(self, now):
+        self.active = [tx for tx in self.active if tx[1] > now]
+
+    def busy_until(self, sensor, now):
+        # End of the transmissions the sensor can hear, 0 if it hears none
+        self.expire(now)
+        ends = [tx[1] for tx in self.active if not self.hidden[sensor][tx[2]]]
+        return max(ends, default=0)
+
+    def start(self, sensor, now, duration):
+        self.expire(now)
+        tx = [now, now + duration, sensor, False]
+        for other in self.active:
+            other[3] = True
+            tx[3] = True
+        self.active.append(tx)
+        return tx
+
+
+def simulate(args, slotted, aligned=False):
+    rng = random.Random(args.seed)
+    n = args.sensors
+    hidden = [[False] * n for _ in range(n)]
+    for i in range(n):
+        for j in range(i + 1, n):
+            hidden[i][j] = hidden[j][i] = rng.random() < args.hidden
+    channel = Channel(hidden)
+
+    air = airtime_us(args.payload, args.rate)
+    interval = args.interval_ms * 1000
+    frame = args.frame_ms * 1000
+    width = args.slot_us
+    slots = frame // width - 1
+    period = 1
+    while slots * period < n:
+        period *= 2
+
+    # Events: (time, seq, kind, sensor, ready times, attempt, contention window)
+    events = []
+    seq = 0
+    for sensor in range(n):
+        readings = []
+        t = rng.uniform(0, interval)
+        while t < args.duration_s * 1e6:
+            readings.append(t + rng.uniform(-args.jitter_us, args.jitter_us))
+            t += interval
+
+        if not slotted:
+            for ready in readings:
+                heapq.heappush(events, (ready, seq, "tx", sensor, [ready], 1, CW_MIN))
+                seq += 1
+            continue
+
+        # Sensors take positions from 0 up, as the master hands them out
+        slot, phase = 1 + sensor // period, sensor % period
+        cycle = frame * period
+        base = phase * frame + slot * width + (width - air) / 2
+        if aligned:
+            # Readings are taken right before the slot, one per cycle or interval
+            step = max(1, interval // cycle) * cycle
+            sends = {base + k * step: [base + k * step] for k in range(int(args.duration_s * 1e6 // step))}
+        else:
+            # Readings wait for the next slot, those waiting together share a frame
+            sends = {}
+            for ready in readings:
+                k = max(0, -(-(ready - base) // cycle))
+                sends.setdefault(base + k * cycle, []).append(ready)
+        for start, ready in sends.items():
+            start += rng.uniform(-args.clock_error_us, args.clock_error_us)
+            heapq.heappush(events, (start, seq, "tx", sensor, ready, 1, CW_MIN))
+            seq += 1
+
+    attempts = collisions = lost = 0
+    latencies = []
+    while events:
+        now, _, kind, sensor, ready, attempt, cw = heapq.heappop(events)
+        if kind == "tx":
+            if not slotted:
+                busy = channel.busy_until(sensor, now)
+                if busy > now:
+                    backoff = busy + DIFS_US + rng.randint(0, cw) * BACKOFF_SLOT_US
+                    heapq.heappush(events, (backoff, seq, "tx", sensor, ready, attempt, cw))
+                    seq += 1
+                    continue
+            attempts += 1
+            tx = channel.start(sensor, now, air)
+            heapq.heappush(events, (now + air, seq, ("end", tx), sensor, ready, attempt, cw))
+            seq += 1
+        else:
+            tx = kind[1]
+            if not tx[3]:
+                latencies.extend(now - r for r in ready)
+                continue
+            collisions += 1
+            if attempt == MAX_ATTEMPTS:
+                lost += 1
+                continue
+            cw = min(2 * cw + 1, CW_MAX)
+            retry = now + DIFS_US + rng.randint(0, cw) * BACKOFF_SLOT_US
+            heapq.heappush(events, (retry, seq, "tx", sensor, ready, attempt + 1, cw))
+            seq += 1
+
+    latencies.sort()
+
+    def pct(p):
+        return latencies[min(len(latencies) - 1, int(p * len(latencies)))] / 1000 if latencies else 0
+
+    return {
+        "attempts": attempts,
+        "collision_rate": collisions / attempts if attempts else 0,
+        "lost": lost,
+        "p50_ms": pct(0.5),
+        "p99_ms": pct(0.99),
+        "period": period if slotted else None,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--sensors", type=int, default=50)
+    parser.add_argument("--interval-ms", type=int, default=1000, help="reading interval per sensor")
+    parser.add_argument("--payload", type=int, default=48, help="ESP-NOW payload bytes")
+    parser.add_argument("--rate", type=float, default=1.0, help="PHY rate in Mbps")
+    parser.add_argument("--hidden", type=float, default=0.3, help="share of sensor pairs out of each other's range")
+    parser.add_argument("--jitter-us", type=int, default=50000, help="reading time jitter")
+    parser.add_argument("--frame-ms", type=int, default=1000, help="MIST_SLOT_FRAME_MS")
+    parser.add_argument("--slot-us", type=int, default=4000, help="MIST_SLOT_WIDTH_US")
+    parser.add_argument("--clock-error-us", type=int, default=500, help="sensor clock error after SyncTime")
+    parser.add_argument("--duration-s", type=int, default=60)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print(f"{args.sensors} sensors, one {args.payload} byte frame every {args.interval_ms} ms, "
+          f"{airtime_us(args.payload, args.rate):.0f} us airtime")
+    runs = (("contention", False, False), ("slotted", True, False), ("aligned", True, True))
+    for name, slotted, aligned in runs:
+        r = simulate(args, slotted, aligned)
+        extra = f"  period {r['period']}" if slotted else ""
+        print(f"{name:>10}: {r['attempts']:6d} attempts  collisions {100 * r['collision_rate']:5.2f}%  "
+              f"lost {r['lost']:4d}  latency p50 {r['p50_ms']:6.2f} ms  p99 {r['p99_ms']:6.2f} ms{extra}")
+
+
+if __name__ == "__main__":
+    main()
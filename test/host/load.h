@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The work of the pipeline, commands and batch tasks, for test_load. Each is
+// reached through a file of its own that includes the module's .c file, as
+// one file cannot include more than one of them.
+
+// One pass of the pipeline decode task, then of the publisher task
+void load_decode(void);
+void load_publish(void);
+
+// One pass of the commands task. Returns whether it sent or published, after
+// which the task waits CONFIG_MIST_COMMAND_SPACING_MS.
+bool load_commands(int64_t now_us);
+
+// Flushes the batch if batch_add() woke the flush task, or window says the
+// batch window is over. Returns whether it flushed.
+bool load_flush(bool window);
+
+// Bytes of static buffers of each module
+size_t load_pipeline_bytes(void);
+size_t load_commands_bytes(void);
+size_t load_batch_bytes(void);
@@ -0,0 +1,17 @@
+#include "load.h"
+#include "batch.c"
+
+bool load_flush(bool window) {
+    host_task_switch(s_flush_task);
+    bool full = ulTaskNotifyTake(pdTRUE, 0) > 0;
+    host_task_switch(NULL);
+    if (!full && !window) {
+        return false;
+    }
+    flush();
+    return true;
+}
+
+size_t load_batch_bytes(void) {
+    return sizeof(s_batches) + sizeof(s_encode_buf);
+}
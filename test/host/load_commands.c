@@ -0,0 +1,11 @@
+#include "load.h"
+#include "commands.c"
+
+bool load_commands(int64_t now_us) {
+    int64_t next_us;
+    return service(now_us, &next_us);
+}
+
+size_t load_commands_bytes(void) {
+    return sizeof(s_commands) + sizeof(s_tx_buf) + sizeof(s_status_buf);
+}
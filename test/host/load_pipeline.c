@@ -0,0 +1,14 @@
+#include "load.h"
+#include "pipeline.c"
+
+void load_decode(void) {
+    decode_frames();
+}
+
+void load_publish(void) {
+    publish_readings();
+}
+
+size_t load_pipeline_bytes(void) {
+    return sizeof(s_frame_slots) + sizeof(s_reading_slots);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_now.h"
+
+// Stand-in for the mist_comm component's interface. Tests define the functions
+// the module under test calls.
+
+typedef struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    uint8_t *buffer;
+    int buffer_size;
+} CommTask_t;
+
+typedef esp_err_t (*comm_recv_msg_cb_t)(const CommTask_t *task);
+
+extern const uint8_t COMM_BROADCAST_MAC_ADDR[ESP_NOW_ETH_ALEN];
+#define COMM_IS_BROADCAST_ADDR(addr) (memcmp((addr), COMM_BROADCAST_MAC_ADDR, ESP_NOW_ETH_ALEN) == 0)
+
+esp_err_t comm_init(void);
+esp_err_t comm_add_peer(const uint8_t *mac_addr, bool encrypt);
+esp_err_t comm_send(const void *data, size_t len, const uint8_t *mac_addr);
+esp_err_t comm_broadcast(const void *data, size_t len);
+void comm_register_recv_msg_cb(comm_recv_msg_cb_t cb);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <inttypes.h>
+
+// Host stand-in for ESP-IDF's esp_log.h. Logging is compiled in, so format
+// strings are still checked, but prints nothing.
+
+__attribute__((format(printf, 2, 3)))
+static inline void esp_log_host(const char *tag, const char *format, ...) {
+    (void)tag;
+    (void)format;
+}
+
+#define ESP_LOGE(tag, format, ...) esp_log_host(tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) esp_log_host(tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) esp_log_host(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) esp_log_host(tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) esp_log_host(tag, format, ##__VA_ARGS__)
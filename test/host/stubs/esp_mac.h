@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include "esp_err.h"
+
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+
+typedef enum {
+    ESP_MAC_WIFI_STA,
+} esp_mac_type_t;
+
+// Defined by the tests that need it
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_DATA_LEN 250
+#define ESP_NOW_MAX_TOTAL_PEER_NUM 20
+
+typedef int wifi_phy_mode_t;
+typedef int wifi_phy_rate_t;
+
+typedef struct {
+    wifi_phy_mode_t phymode;
+    wifi_phy_rate_t rate;
+    bool ersu;
+    bool dcm;
+} esp_now_rate_config_t;
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr);
+esp_err_t esp_now_set_peer_rate_config(const uint8_t *peer_addr, esp_now_rate_config_t *config);
@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+#include "esp_partition.h"
+
+#define SECTOR_SIZE 4096
+
+static esp_partition_t s_part;
+static FILE *s_file;
+static size_t s_write_budget = SIZE_MAX;
+static uint32_t s_overwrites;
+
+esp_err_t host_partition_open(const char *label, const char *path, uint32_t size) {
+    host_partition_close();
+
+    s_file = fopen(path, "r+b");
+    if (s_file == NULL) {
+        s_file = fopen(path, "w+b");
+        if (s_file == NULL) return ESP_FAIL;
+        uint8_t erased[SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        for (uint32_t off = 0; off < size; off += SECTOR_SIZE) {
+            fwrite(erased, 1, SECTOR_SIZE, s_file);
+        }
+        fflush(s_file);
+    }
+
+    s_part = (esp_partition_t){
+        .type = ESP_PARTITION_TYPE_DATA,
+        .subtype = ESP_PARTITION_SUBTYPE_ANY,
+        .size = size,
+        .erase_size = SECTOR_SIZE,
+    };
+    snprintf(s_part.label, sizeof(s_part.label), "%s", label);
+    s_write_budget = SIZE_MAX;
+    return ESP_OK;
+}
+
+void host_partition_close(void) {
+    if (s_file != NULL) {
+        fclose(s_file);
+        s_file = NULL;
+    }
+}
+
+void host_partition_fail_after(size_t bytes) {
+    s_write_budget = bytes;
+}
+
+uint32_t host_partition_overwrites(void) {
+    return s_overwrites;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+    if (s_file == NULL || type != s_part.type || strcmp(label, s_part.label) != 0) return NULL;
+    return &s_part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size) {
+    if (offset + size > part->size) return ESP_ERR_INVALID_SIZE;
+    if (fseek(s_file, offset, SEEK_SET) != 0 || fread(dst, 1, size, s_file) != size) return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size) {
+    if (offset + size > part->size) return ESP_ERR_INVALID_SIZE;
+
+    size_t n = size < s_write_budget ? size : s_write_budget;
+    s_write_budget -= n;
+
+    uint8_t buf[256];
+    const uint8_t *bytes = src;
+    for (size_t done = 0; done < n;) {
+        size_t chunk = n - done < sizeof(buf) ? n - done : sizeof(buf);
+        esp_err_t err = esp_partition_read(part, offset + done, buf, chunk);
+        if (err != ESP_OK) return err;
+        for (size_t i = 0; i < chunk; i++) {
+            if (buf[i] != 0xFF && (buf[i] & bytes[done + i]) != buf[i]) {
+                s_overwrites++;
+            }
+            buf[i] &= bytes[done + i];
+        }
+        if (fseek(s_file, offset + done, SEEK_SET) != 0 || fwrite(buf, 1, chunk, s_file) != chunk) return ESP_FAIL;
+        done += chunk;
+    }
+    fflush(s_file);
+    return n == size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size) {
+    if (offset % SECTOR_SIZE != 0 || size % SECTOR_SIZE != 0 || offset + size > part->size) return ESP_ERR_INVALID_ARG;
+    if (s_write_budget == 0) return ESP_FAIL;
+
+    uint8_t erased[SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    for (size_t off = offset; off < offset + size; off += SECTOR_SIZE) {
+        if (fseek(s_file, off, SEEK_SET) != 0 || fwrite(erased, 1, SECTOR_SIZE, s_file) != SECTOR_SIZE) return ESP_FAIL;
+    }
+    fflush(s_file);
+    return ESP_OK;
+}
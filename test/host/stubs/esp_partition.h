@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+// Flash partitions backed by files on the host, see esp_partition.c. Writes
+// behave like NOR flash: they can only clear bits, and only an erase of whole
+// sectors sets them again.
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef int esp_partition_subtype_t;
+
+#define ESP_PARTITION_SUBTYPE_ANY 0xff
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    uint32_t erase_size;
+    char label[17];
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size);
+
+// Backs the partition label with size bytes of the file at path, which is
+// created erased if it does not exist. Only one partition can be open.
+esp_err_t host_partition_open(const char *label, const char *path, uint32_t size);
+void host_partition_close(void);
+
+// Cuts the power after bytes more bytes were written: the write in progress
+// stops half way and every later write or erase fails, until the next open
+void host_partition_fail_after(size_t bytes);
+
+// Bytes written over programmed flash without an erase in between, which would
+// have mixed old and new data on a device
+uint32_t host_partition_overwrites(void);
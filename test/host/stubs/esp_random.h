@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host stand-in for ESP-IDF's esp_random.h, deterministic so every run is the same
+uint32_t esp_random(void);
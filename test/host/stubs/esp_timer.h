@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// Host clock in microseconds, which only moves when a test advances it
+int64_t esp_timer_get_time(void);
+void host_clock_advance_us(int64_t us);
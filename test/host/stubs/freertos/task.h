@@ -0,0 +1,22 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+// Tasks are never run. Tests call the work a task would do themselves, after
+// switching to its handle to receive its notifications. NULL switches back.
+typedef struct host_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *task);
+void vTaskDelete(TaskHandle_t task);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void host_task_switch(TaskHandle_t task);
+
+// Advance the host clock
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+
+// Notifications are counted. Taking never blocks and returns the count. Taking
+// none advances the host clock by wait, as the wait would have timed out.
+void xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+
+#define MAX_NAMESPACES 8
+#define MAX_ENTRIES 32
+#define MAX_NAME_LEN 16
+
+typedef struct {
+    nvs_handle_t ns;
+    char key[MAX_NAME_LEN];
+    void *value;
+    size_t length;
+} entry_t;
+
+static char s_namespaces[MAX_NAMESPACES][MAX_NAME_LEN];
+static entry_t s_entries[MAX_ENTRIES];
+
+// Handles are namespace index + 1
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle) {
+    for (int i = 0; i < MAX_NAMESPACES; i++) {
+        if (strncmp(s_namespaces[i], name, MAX_NAME_LEN) == 0) {
+            *handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    // Opening a namespace read-only does not create it
+    if (mode == NVS_READONLY) return ESP_ERR_NVS_NOT_FOUND;
+    for (int i = 0; i < MAX_NAMESPACES; i++) {
+        if (s_namespaces[i][0] == '\0') {
+            strncpy(s_namespaces[i], name, MAX_NAME_LEN - 1);
+            *handle = i + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    return ESP_OK;
+}
+
+static entry_t *find(nvs_handle_t handle, const char *key) {
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (s_entries[i].ns == handle && strncmp(s_entries[i].key, key, MAX_NAME_LEN) == 0) {
+            return &s_entries[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length) {
+    entry_t *entry = find(handle, key);
+    if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+    if (value == NULL) {
+        *length = entry->length;
+        return ESP_OK;
+    }
+    if (*length < entry->length) return ESP_ERR_NVS_INVALID_LENGTH;
+    memcpy(value, entry->value, entry->length);
+    *length = entry->length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    entry_t *entry = find(handle, key);
+    if (entry == NULL) {
+        entry = find(0, "");
+        if (entry == NULL) return ESP_ERR_NO_MEM;
+        entry->ns = handle;
+        strncpy(entry->key, key, MAX_NAME_LEN - 1);
+    }
+    void *copy = malloc(length > 0 ? length : 1);
+    if (copy == NULL) return ESP_ERR_NO_MEM;
+    memcpy(copy, value, length);
+    free(entry->value);
+    entry->value = copy;
+    entry->length = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    entry_t *entry = find(handle, key);
+    if (entry == NULL) return ESP_ERR_NVS_NOT_FOUND;
+    free(entry->value);
+    memset(entry, 0, sizeof(*entry));
+    return ESP_OK;
+}
+
+void host_nvs_erase(void) {
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        free(s_entries[i].value);
+    }
+    memset(s_entries, 0, sizeof(s_entries));
+    memset(s_namespaces, 0, sizeof(s_namespaces));
+}
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+// Host implementations of the stand-ins in freertos/, esp_timer.h, esp_cpu.h and
+// esp_random.h
+
+static int64_t s_now_us;
+
+int64_t esp_timer_get_time(void) {
+    return s_now_us;
+}
+
+void host_clock_advance_us(int64_t us) {
+    s_now_us += us;
+}
+
+esp_cpu_cycle_count_t esp_cpu_get_cycle_count(void) {
+    // 160 MHz, the ESP32-C6 clock
+    return (esp_cpu_cycle_count_t)(s_now_us * 160);
+}
+
+uint32_t esp_random(void) {
+    static uint32_t state = 1;
+    state = state * 1103515245u + 12345u;
+    return state;
+}
+
+struct host_task {
+    uint32_t notifications;
+};
+
+// The task tests run as
+static struct host_task s_main_task;
+static TaskHandle_t s_current = &s_main_task;
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t prio, TaskHandle_t *task) {
+    TaskHandle_t handle = calloc(1, sizeof(*handle));
+    if (handle == NULL) return pdFAIL;
+    if (task != NULL) *task = handle;
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == s_current) {
+        // A task deleting itself would not return
+        abort();
+    }
+    free(task);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    return s_current;
+}
+
+void host_task_switch(TaskHandle_t task) {
+    s_current = task != NULL ? task : &s_main_task;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    s_now_us += (int64_t)ticks * 1000;
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(s_now_us / 1000);
+}
+
+void xTaskNotifyGive(TaskHandle_t task) {
+    task->notifications++;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) {
+    uint32_t count = s_current->notifications;
+    if (count == 0 && wait != portMAX_DELAY) {
+        // Nothing else runs that could notify, so the wait times out
+        vTaskDelay(wait);
+    }
+    if (clear) {
+        s_current->notifications = 0;
+    } else if (count > 0) {
+        s_current->notifications--;
+    }
+    return count;
+}
+
+struct host_semaphore {
+    bool taken;
+    bool binary;
+};
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return calloc(1, sizeof(struct host_semaphore));
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    SemaphoreHandle_t sem = calloc(1, sizeof(*sem));
+    if (sem != NULL) {
+        sem->binary = true;
+        sem->taken = true;
+    }
+    return sem;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t wait) {
+    // A mutex taken twice would deadlock on the device
+    if (sem->taken) return pdFALSE;
+    sem->taken = true;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    if (!sem->taken) return pdFALSE;
+    sem->taken = false;
+    return pdTRUE;
+}
+
+struct host_queue {
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    QueueHandle_t queue = calloc(1, sizeof(*queue) + (size_t)length * item_size);
+    if (queue != NULL) {
+        queue->length = length;
+        queue->item_size = item_size;
+    }
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait) {
+    if (queue->count == queue->length) return pdFALSE;
+    UBaseType_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + (size_t)tail * queue->item_size, item, queue->item_size);
+    queue->count++;
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+    if (queue->count == 0) return pdFALSE;
+    memcpy(item, queue->items + (size_t)queue->head * queue->item_size, queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    return queue->count;
+}
+
+struct host_event_group {
+    EventBits_t bits;
+};
+
+EventGroupHandle_t xEventGroupCreate(void) {
+    return calloc(1, sizeof(struct host_event_group));
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t group, EventBits_t bits) {
+    group->bits |= bits;
+    return group->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t group, EventBits_t bits) {
+    EventBits_t prev = group->bits;
+    group->bits &= ~bits;
+    return prev;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t group) {
+    return group->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t wait) {
+    EventBits_t current = group->bits;
+    bool met = all ? (current & bits) == bits : (current & bits) != 0;
+    if (met && clear) group->bits &= ~bits;
+    return current;
+}
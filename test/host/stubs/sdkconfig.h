@@ -0,0 +1,65 @@
+#pragma once
+
+// Configuration the host tests build the modules under test with. Values
+// follow the defaults in main/Kconfig.projbuild.
+
+#define CONFIG_MIST_PUB_POOL_COUNT 4
+#define CONFIG_MIST_PUB_BUF_SIZE 128
+
+#define CONFIG_MIST_SENSOR_BATCHING 1
+#define CONFIG_MIST_BATCH_MAX_READINGS 32
+#define CONFIG_MIST_BATCH_WINDOW_MS 5000
+#define CONFIG_MIST_BATCH_BUF_SIZE 2048
+#define CONFIG_MIST_BATCH_ENCODING_READINGS 1
+
+#define CONFIG_MIST_BACKLOG 1
+#define CONFIG_MIST_BACKLOG_REPLAY_RATE 5
+
+#define CONFIG_MIST_PEER_CAPACITY 256
+
+#define CONFIG_MIST_PIPELINE_FRAME_DEPTH 32
+#define CONFIG_MIST_PIPELINE_READING_DEPTH 16
+#define CONFIG_MIST_PIPELINE_BACKPRESSURE_MS 100
+
+#define CONFIG_MIST_COMMANDS_MAX_ACTIVE 2
+#define CONFIG_MIST_COMMAND_SPACING_MS 5
+#define CONFIG_MIST_COMMAND_RETRY_MS 250
+#define CONFIG_MIST_COMMAND_MAX_ATTEMPTS 5
+
+#define CONFIG_MIST_MQTT_OUTBOX 1
+#define CONFIG_MIST_OUTBOX_CONTROL_BYTES 4096
+#define CONFIG_MIST_OUTBOX_TELEMETRY_BYTES 16384
+#define CONFIG_MIST_OUTBOX_BACKLOG_BYTES 8192
+#define CONFIG_MIST_OUTBOX_MAX_ITEMS 32
+
+#define CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS 2
+#define CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE 4096
+
+#define CONFIG_MIST_RLINK 1
+#define CONFIG_MIST_RLINK_ACK_DELAY_MS 20
+#define CONFIG_MIST_RLINK_RETRY_MS 100
+#define CONFIG_MIST_RLINK_MAX_ATTEMPTS 5
+#define CONFIG_MIST_RLINK_MAX_MESSAGE 2048
+#define CONFIG_MIST_RLINK_REASSEMBLY_BUFFERS 2
+#define CONFIG_MIST_RLINK_TX_FRAMES 16
+
+#define CONFIG_MIST_SLOTS 1
+#define CONFIG_MIST_SLOT_FRAME_MS 1000
+#define CONFIG_MIST_SLOT_WIDTH_US 4000
+#define CONFIG_MIST_SLOT_IDLE_S 300
+#define CONFIG_MIST_SLOT_REBALANCE_MS 5000
+
+#define CONFIG_MIST_AGGREGATION 1
+#define CONFIG_MIST_AGG_SUMMARY_INTERVAL_S 900
+#define CONFIG_MIST_AGG_DEADBAND_TEMPERATURE 20
+#define CONFIG_MIST_AGG_DEADBAND_HUMIDITY 100
+#define CONFIG_MIST_AGG_DEADBAND_VOC_INDEX 10
+#define CONFIG_MIST_AGG_DEADBAND_MOISTURE 100
+
+#define CONFIG_MIST_HISTORY 1
+#define CONFIG_MIST_HISTORY_SENSORS 100
+#define CONFIG_MIST_HISTORY_BUDGET_KB 64
+#define CONFIG_MIST_HISTORY_TIER1_S 300
+#define CONFIG_MIST_HISTORY_TIER2_S 3600
+#define CONFIG_MIST_HISTORY_MAX_POINTS 128
+#define CONFIG_MIST_HISTORY_RESPONSE_BYTES 8192
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Minimal assertions for the host tests. A failed check ends the test program,
+// which ctest reports as a failure.
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    long long actual_ = (long long)(actual); \
+    long long expected_ = (long long)(expected); \
+    if (actual_ != expected_) { \
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actual_, expected_); \
+        exit(1); \
+    } \
+} while (0)
+
+static inline int64_t test_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Cycle counter of the host, where there is one cheap to read
+#if defined(__x86_64__) || defined(__i386__)
+#define TEST_HAVE_CYCLES 1
+static inline uint64_t test_cycles(void) { return __builtin_ia32_rdtsc(); }
+#else
+#define TEST_HAVE_CYCLES 0
+static inline uint64_t test_cycles(void) { return 0; }
+#endif
+
+// Deterministic pseudo random numbers, so every run sees the same traces
+static inline uint32_t test_rand(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+// Uniform in [0, 1)
+static inline double test_uniform(uint32_t *state) {
+    return (test_rand(state) & 0xFFFFFF) / (double)0x1000000;
+}
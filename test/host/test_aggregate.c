@@ -0,0 +1,156 @@
+#include <math.h>
+#include <string.h>
+#include "test.h"
+
+// Deadband forwarding on a day of readings every minute from air and soil
+// sensors, shaped like what they report indoors: temperature and humidity
+// following the day with sensor noise, a VOC index that jumps when the room is
+// used, and soil drying out between waterings. Prints the share of readings
+// forwarded and the summary messages published instead.
+
+#include "aggregate.c"
+
+#define SENSORS 16
+#define INTERVAL_S 60
+#define DAY_S 86400
+
+// Fakes of the registry and the uplink
+static peer_t s_peers[SENSORS];
+static uint32_t s_summary_publishes;
+static size_t s_summary_bytes;
+
+peer_t *peers_find(const uint8_t *mac_addr) {
+    for (int i = 0; i < SENSORS; i++) {
+        if (memcmp(s_peers[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) return &s_peers[i];
+    }
+    return NULL;
+}
+int peers_index(const peer_t *peer) { return (int)(peer - s_peers) * 3 % CONFIG_MIST_PEER_CAPACITY; }
+const char *mqtt_topic(mqtt_topic_t topic) { return "summaries"; }
+bool mqtt_is_connected(void) { return true; }
+esp_err_t mqtt_publish(const char *topic, const char *data, size_t len) {
+    // Never called with the aggregation lock held
+    CHECK(xSemaphoreTake(s_lock, 0) == pdTRUE);
+    xSemaphoreGive(s_lock);
+    s_summary_publishes++;
+    s_summary_bytes += len;
+    return ESP_OK;
+}
+esp_err_t backlog_append(mqtt_topic_t topic, const uint8_t *data, size_t len) { return ESP_FAIL; }
+
+static double noise(uint32_t *seed, double amplitude) {
+    return (test_uniform(seed) * 2 - 1) * amplitude;
+}
+
+static float hundredths(double value) {
+    return roundf((float)value * 100) / 100;
+}
+
+static pipeline_reading_t reading_at(int sensor, int t, uint32_t *seed) {
+    pipeline_reading_t reading = { 0 };
+    memcpy(reading.mac_addr, s_peers[sensor].mac_addr, ESP_NOW_ETH_ALEN);
+    double day = sin(2 * M_PI * (t - 6 * 3600) / DAY_S);
+    if (sensor % 2 == 0) {
+        AirSensor *air = &reading.data.body.air_sensor;
+        reading.data.sensor_type = SensorType_AIR_SENSOR;
+        reading.data.which_body = SensorData_air_sensor_tag;
+        air->timestamp = 1760000000 + t;
+        air->temperature = hundredths(21 + sensor * 0.1 + 2.5 * day + noise(seed, 0.05));
+        air->humidity = hundredths(45 - 8 * day + noise(seed, 0.4));
+        // The room is used in the evening
+        bool used = t % DAY_S > 18 * 3600 && t % DAY_S < 22 * 3600;
+        air->voc_index = (int32_t)(100 + (used ? 80 : 0) + noise(seed, 3));
+    } else {
+        SoilSensor *soil = &reading.data.body.soil_sensor;
+        reading.data.sensor_type = SensorType_SOIL_SENSOR;
+        reading.data.which_body = SensorData_soil_sensor_tag;
+        soil->timestamp = 1760000000 + t;
+        // Watered twice a day, then drying out
+        double since_watering = (t + sensor * 1800) % (DAY_S / 2);
+        soil->moisture = hundredths(42 - 10 * since_watering / (DAY_S / 2) + noise(seed, 0.2));
+    }
+    return reading;
+}
+
+static void test_deadband(void) {
+    uint8_t mac[ESP_NOW_ETH_ALEN] = { 0x24, 0x6f, 0x28, 0xee, 0, 1 };
+    memcpy(s_peers[0].mac_addr, mac, ESP_NOW_ETH_ALEN);
+
+    pipeline_reading_t reading = { 0 };
+    memcpy(reading.mac_addr, mac, ESP_NOW_ETH_ALEN);
+    reading.data.sensor_type = SensorType_SOIL_SENSOR;
+    reading.data.which_body = SensorData_soil_sensor_tag;
+
+    // The first reading is always forwarded
+    reading.data.body.soil_sensor.moisture = 40.0f;
+    CHECK(aggregate_reading(&reading));
+    reading.data.body.soil_sensor.moisture = 40.0f + (CONFIG_MIST_AGG_DEADBAND_MOISTURE - 1) / 100.0f;
+    CHECK(!aggregate_reading(&reading));
+    // Moving by exactly the deadband is enough
+    reading.data.body.soil_sensor.moisture = 40.0f - CONFIG_MIST_AGG_DEADBAND_MOISTURE / 100.0f;
+    CHECK(aggregate_reading(&reading));
+    // Relative to the last forwarded reading, not the previous one
+    reading.data.body.soil_sensor.moisture = 40.0f;
+    CHECK(aggregate_reading(&reading));
+
+    int index = peers_index(&s_peers[0]);
+    CHECK_EQ(s_table.count[AGG_METRIC_MOISTURE][index], 4);
+    CHECK_EQ(s_table.min[AGG_METRIC_MOISTURE][index], 4000 - CONFIG_MIST_AGG_DEADBAND_MOISTURE);
+    CHECK_EQ(s_table.max[AGG_METRIC_MOISTURE][index], 4000 + CONFIG_MIST_AGG_DEADBAND_MOISTURE - 1);
+
+    // Unpaired sensors and other sensor types are forwarded as is
+    reading.mac_addr[5] = 0x99;
+    CHECK(aggregate_reading(&reading));
+    memcpy(reading.mac_addr, mac, ESP_NOW_ETH_ALEN);
+    reading.data.sensor_type = SensorType_LIGHT_SENSOR;
+    CHECK(aggregate_reading(&reading));
+
+    summarize();
+    CHECK_EQ(s_summary_publishes, 1);
+    CHECK_EQ(s_table.count[AGG_METRIC_MOISTURE][index], 0);
+}
+
+static void test_trace(void) {
+    for (int i = 0; i < SENSORS; i++) {
+        memcpy(s_peers[i].mac_addr, (uint8_t[]){ 0x24, 0x6f, 0x28, 0x10, 0x20, (uint8_t)i }, ESP_NOW_ETH_ALEN);
+    }
+    s_forwarded = 0;
+    s_suppressed = 0;
+    s_summary_publishes = 0;
+    s_summary_bytes = 0;
+
+    uint32_t seed = 11;
+    uint32_t readings = 0;
+    uint32_t forwarded = 0;
+    uint32_t rounds = 0;
+    for (int t = 0; t < DAY_S; t += INTERVAL_S) {
+        for (int i = 0; i < SENSORS; i++) {
+            pipeline_reading_t reading = reading_at(i, t, &seed);
+            forwarded += aggregate_reading(&reading);
+            readings++;
+        }
+        host_clock_advance_us(INTERVAL_S * 1000000LL);
+        if ((t + INTERVAL_S) % CONFIG_MIST_AGG_SUMMARY_INTERVAL_S == 0) {
+            summarize();
+            rounds++;
+        }
+    }
+
+    printf("%u sensors, a reading every %d s for a day: %u readings\n", SENSORS, INTERVAL_S, readings);
+    printf("forwarded %u (%.1f%%), %.1f publishes per hour instead of %.1f\n", forwarded,
+           100.0 * forwarded / readings, forwarded / 24.0, readings / 24.0);
+    printf("summaries: %u publishes in %u rounds, %zu bytes\n", s_summary_publishes, rounds, s_summary_bytes);
+
+    CHECK_EQ(s_forwarded + s_suppressed, readings);
+    CHECK_EQ(s_forwarded, forwarded);
+    // Every sensor has a summary in every round, which takes several messages
+    CHECK(s_summary_publishes > rounds);
+    CHECK(forwarded * 4 < readings);
+}
+
+int main(void) {
+    CHECK_EQ(aggregate_init(), ESP_OK);
+    test_deadband();
+    test_trace();
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+
+// The backlog ring log on a file-backed flash partition: records filling their
+// sector exactly, wrapping around the partition, power cuts in the middle of an
+// append, and replay that only consumes acknowledged records.
+
+#include "backlog.c"
+
+#define SECTORS 4
+#define FLASH_FILE "test_backlog.bin"
+
+// Fakes of the MQTT client the replay task publishes through
+static bool s_fake_connected;
+static bool s_fake_ack;         // Acknowledge publishes before they return, as the MQTT task may
+static int s_fake_msg_id;
+static uint32_t s_fake_publishes;
+static uint32_t s_fake_last_value;
+static mqtt_published_handler_t s_fake_published_handler;
+
+bool mqtt_is_connected(void) { return s_fake_connected; }
+const char *mqtt_topic(mqtt_topic_t topic) { return "sensors"; }
+esp_err_t mqtt_register_connection_handler(mqtt_connection_handler_t handler) { return ESP_OK; }
+
+esp_err_t mqtt_register_published_handler(mqtt_published_handler_t handler) {
+    s_fake_published_handler = handler;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_class(const char *topic, const char *data, size_t len, int qos, mist_outbox_class_t cls, int *msg_id) {
+    CHECK_EQ(qos, 1);
+    CHECK_EQ(cls, MIST_OUTBOX_BACKLOG);
+    memcpy(&s_fake_last_value, data, sizeof(s_fake_last_value));
+    s_fake_publishes++;
+    *msg_id = ++s_fake_msg_id;
+    if (s_fake_ack) {
+        s_fake_published_handler(*msg_id);
+    }
+    return ESP_OK;
+}
+
+// Restarts the device: the log is recovered from flash alone
+static void reboot(void) {
+    s_part = NULL;
+    s_write_off = s_read_off = s_next_seq = 0;
+    s_write_erased = false;
+    memset(&s_stats, 0, sizeof(s_stats));
+    memset((void *)s_acked, 0, sizeof(s_acked));
+    CHECK_EQ(host_partition_open(BACKLOG_PARTITION_LABEL, FLASH_FILE, SECTORS * SECTOR_SIZE), ESP_OK);
+    CHECK_EQ(backlog_init(), ESP_OK);
+}
+
+static esp_err_t append(uint32_t value, size_t len) {
+    uint8_t data[MAX_PAYLOAD];
+    memset(data, (uint8_t)value, len);
+    memcpy(data, &value, sizeof(value));
+    return backlog_append(MQTT_TOPIC_SENSORS, data, len);
+}
+
+// Replays everything, checking records come back in order from first on
+static uint32_t replay_all(uint32_t first) {
+    uint32_t count = 0;
+    s_fake_connected = true;
+    s_fake_ack = true;
+    while (replay_one()) {
+        CHECK_EQ(s_fake_last_value, first + count);
+        count++;
+    }
+    CHECK_EQ(s_stats.pending, 0);
+    return count;
+}
+
+// Payload of a record taking a quarter of a sector
+#define QUARTER (SECTOR_SIZE / 4 - sizeof(record_hdr_t))
+
+static void test_full_sectors(void) {
+    reboot();
+    // Records end exactly at sector ends, wrapping around the partition twice
+    for (uint32_t i = 0; i < 8 * SECTORS; i++) {
+        CHECK_EQ(append(i, QUARTER), ESP_OK);
+        if (i % 4 == 3) {
+            // The next sector was erased as soon as this one filled up
+            CHECK_EQ(s_write_off, sector_start(i / 4 + 1));
+            CHECK(s_write_erased);
+        }
+    }
+    CHECK_EQ(host_partition_overwrites(), 0);
+    // The sector being written was erased, the three before it hold the newest records
+    CHECK_EQ(s_stats.pending, 3 * 4);
+    CHECK_EQ(s_stats.dropped, 8 * SECTORS - 3 * 4);
+
+    reboot();
+    CHECK_EQ(s_stats.pending, 3 * 4);
+    CHECK_EQ(s_write_off, 0);
+    CHECK_EQ(replay_all(8 * SECTORS - 3 * 4), 3 * 4);
+
+    // Sector 0 is used next, not skipped
+    CHECK_EQ(append(100, 10), ESP_OK);
+    CHECK_EQ(s_write_off, ALIGN4(sizeof(record_hdr_t) + 10));
+    CHECK_EQ(replay_all(100), 1);
+    CHECK_EQ(host_partition_overwrites(), 0);
+}
+
+static void test_torn_appends(void) {
+    // Power cuts at every stage of an append: header, payload, committed flag
+    // and the erase of the next sector
+    const size_t cuts[] = { 0, 7, sizeof(record_hdr_t), sizeof(record_hdr_t) + 100, sizeof(record_hdr_t) + QUARTER };
+    uint32_t value = 1000;
+    for (size_t c = 0; c < sizeof(cuts) / sizeof(cuts[0]); c++) {
+        for (int filled = 0; filled < 4; filled++) {
+            unlink(FLASH_FILE);
+            reboot();
+            for (int i = 0; i < filled; i++) {
+                CHECK_EQ(append(value + i, QUARTER), ESP_OK);
+            }
+            host_partition_fail_after(cuts[c]);
+            CHECK(append(value + filled, QUARTER) != ESP_OK);
+
+            reboot();
+            CHECK_EQ(s_stats.pending, filled);
+            for (int i = 0; i < 5; i++) {
+                CHECK_EQ(append(value + 100 + i, QUARTER), ESP_OK);
+            }
+            CHECK_EQ(host_partition_overwrites(), 0);
+
+            s_fake_connected = true;
+            s_fake_ack = true;
+            for (int i = 0; i < filled; i++) {
+                CHECK(replay_one());
+                CHECK_EQ(s_fake_last_value, value + i);
+            }
+            CHECK_EQ(replay_all(value + 100), 5);
+            value += 1000;
+        }
+    }
+}
+
+static void test_replay_acks(void) {
+    unlink(FLASH_FILE);
+    reboot();
+    for (uint32_t i = 0; i < 3; i++) {
+        CHECK_EQ(append(i, 100), ESP_OK);
+    }
+
+    // Without a PUBACK the record stays pending and is published again
+    s_fake_connected = true;
+    s_fake_ack = false;
+    uint32_t publishes = s_fake_publishes;
+    CHECK(replay_one());
+    CHECK(replay_one());
+    CHECK_EQ(s_fake_publishes, publishes + 2);
+    CHECK_EQ(s_fake_last_value, 0);
+    CHECK_EQ(s_stats.pending, 3);
+    CHECK_EQ(s_stats.replayed, 0);
+
+    // A PUBACK for another message does not consume it
+    s_fake_published_handler(s_fake_msg_id + 100);
+    CHECK(replay_one());
+    CHECK_EQ(s_stats.pending, 3);
+
+    // Nor does one that arrives after the disconnect ended the wait
+    s_fake_connected = false;
+    CHECK(!replay_one());
+    CHECK_EQ(s_stats.pending, 3);
+
+    // Acknowledged, it is consumed and survives a reboot as such
+    s_fake_connected = true;
+    s_fake_ack = true;
+    CHECK(replay_one());
+    CHECK_EQ(s_fake_last_value, 0);
+    CHECK_EQ(s_stats.pending, 2);
+    CHECK_EQ(s_stats.replayed, 1);
+    reboot();
+    CHECK_EQ(s_stats.pending, 2);
+    CHECK_EQ(replay_all(1), 2);
+}
+
+int main(void) {
+    unlink(FLASH_FILE);
+    test_full_sectors();
+    test_torn_appends();
+    test_replay_acks();
+    host_partition_close();
+    unlink(FLASH_FILE);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+
+// Bytes on the wire per reading: every reading published as "%.2f" strings,
+// one QoS 0 publish per value on /esp32/air/* and /esp32/soil/*, the way
+// handle_sensor_data did before batching, against the batches batch.c builds.
+// Counts MQTT PUBLISH packets, and with the 29 bytes a TLS 1.2 AES-GCM record
+// adds to every publish.
+
+#include "batch.c"
+
+#define TLS_RECORD_OVERHEAD 29
+
+// Fakes of the modules batch.c publishes through
+static const char *s_sensors_topic = "/0a1b2c3d-4e5f-6071-8293-a4b5c6d7e8f9/master/aa:bb:cc:dd:ee:ff/sensors";
+static uint32_t s_publishes;
+static size_t s_payload_bytes;
+static size_t s_last_len;
+
+const char *mqtt_topic(mqtt_topic_t topic) { return s_sensors_topic; }
+bool mqtt_is_connected(void) { return true; }
+esp_err_t mqtt_publish(const char *topic, const char *data, size_t len) {
+    s_publishes++;
+    s_payload_bytes += len;
+    s_last_len = len;
+    return ESP_OK;
+}
+esp_err_t backlog_append(mqtt_topic_t topic, const uint8_t *data, size_t len) { return ESP_FAIL; }
+void boot_mark(boot_phase_t phase) { }
+void metrics_record(metrics_stage_t stage, uint32_t start) { }
+
+// Fixed header, topic and payload of a QoS 0 PUBLISH
+static size_t publish_bytes(size_t topic_len, size_t payload_len) {
+    size_t remaining = 2 + topic_len + payload_len;
+    size_t length_bytes = remaining < 128 ? 1 : remaining < 16384 ? 2 : 3;
+    return 1 + length_bytes + remaining;
+}
+
+static size_t legacy_bytes(const char *topic, float value, uint32_t *publishes) {
+    char str[30];
+    int len = snprintf(str, sizeof(str), "%.2f", value);
+    (*publishes)++;
+    return publish_bytes(strlen(topic), len);
+}
+
+// What handle_sensor_data sent for one reading
+static size_t legacy_reading(const SensorData *data, uint32_t *publishes) {
+    switch (data->which_body) {
+    case SensorData_air_sensor_tag:
+        return legacy_bytes("/esp32/air/temperature", data->body.air_sensor.temperature, publishes) +
+               legacy_bytes("/esp32/air/humidity", data->body.air_sensor.humidity, publishes) +
+               legacy_bytes("/esp32/air/voc_index", (float)data->body.air_sensor.voc_index, publishes);
+    case SensorData_soil_sensor_tag:
+        return legacy_bytes("/esp32/soil/moisture", data->body.soil_sensor.moisture, publishes);
+    default:
+        return 0;
+    }
+}
+
+#define SENSORS 8
+#define READINGS 3200
+
+int main(void) {
+    CHECK_EQ(batch_init(), ESP_OK);
+    host_task_switch(s_flush_task);
+
+    // Half air and half soil sensors reporting every 10 s
+    uint8_t macs[SENSORS][ESP_NOW_ETH_ALEN];
+    for (int i = 0; i < SENSORS; i++) {
+        memcpy(macs[i], (uint8_t[]){ 0x24, 0x6f, 0x28, 0x10, 0x20, (uint8_t)i }, ESP_NOW_ETH_ALEN);
+    }
+
+    uint32_t seed = 3;
+    uint32_t legacy_publishes = 0;
+    size_t legacy_total = 0;
+    size_t batch_total = 0;
+    uint32_t air = 0;
+    for (int i = 0; i < READINGS; i++) {
+        int sensor = i % SENSORS;
+        int64_t timestamp = 1760000000 + (i / SENSORS) * 10;
+        SensorData data = { .message_type = MessageType_SENSOR_DATA };
+        if (sensor % 2 == 0) {
+            data.sensor_type = SensorType_AIR_SENSOR;
+            data.which_body = SensorData_air_sensor_tag;
+            data.body.air_sensor.timestamp = timestamp;
+            data.body.air_sensor.temperature = roundf((float)(18.0 + test_uniform(&seed) * 10.0) * 100) / 100;
+            data.body.air_sensor.humidity = roundf((float)(30.0 + test_uniform(&seed) * 40.0) * 100) / 100;
+            data.body.air_sensor.voc_index = 50 + test_rand(&seed) % 200;
+            air++;
+        } else {
+            data.sensor_type = SensorType_SOIL_SENSOR;
+            data.which_body = SensorData_soil_sensor_tag;
+            data.body.soil_sensor.timestamp = timestamp;
+            data.body.soil_sensor.moisture = roundf((float)(test_uniform(&seed) * 100.0) * 100) / 100;
+        }
+        legacy_total += legacy_reading(&data, &legacy_publishes);
+
+        CHECK_EQ(batch_add(&data, macs[sensor]), ESP_OK);
+        // batch_add() wakes the flush task when the batch is full
+        if (ulTaskNotifyTake(pdTRUE, 0) > 0) {
+            uint32_t publishes = s_publishes;
+            flush();
+            CHECK_EQ(s_publishes, publishes + 1);
+            batch_total += publish_bytes(strlen(s_sensors_topic), s_last_len);
+        }
+    }
+    CHECK_EQ(s_publishes, READINGS / BATCH_MAX_READINGS);
+
+    batch_stats_t stats;
+    batch_get_stats(&stats);
+    CHECK_EQ(stats.readings, READINGS);
+    CHECK_EQ(stats.bytes, s_payload_bytes);
+    CHECK_EQ(stats.dropped, 0);
+
+    double legacy_per_reading = (double)legacy_total / READINGS;
+    double batch_per_reading = (double)batch_total / READINGS;
+    double legacy_tls = (double)(legacy_total + legacy_publishes * TLS_RECORD_OVERHEAD) / READINGS;
+    double batch_tls = (double)(batch_total + s_publishes * TLS_RECORD_OVERHEAD) / READINGS;
+    printf("%d readings, %u air and %u soil, %d per batch\n", READINGS, air, READINGS - air, BATCH_MAX_READINGS);
+    printf("per value publishes: %5.1f bytes per reading, %5.1f with TLS, %.2f publishes per reading\n",
+           legacy_per_reading, legacy_tls, (double)legacy_publishes / READINGS);
+    printf("batched:             %5.1f bytes per reading, %5.1f with TLS, %.3f publishes per reading\n",
+           batch_per_reading, batch_tls, (double)s_publishes / READINGS);
+
+    // An order of magnitude fewer publishes, and fewer bytes despite the
+    // longer topic and the timestamps the old values went without
+    CHECK(legacy_publishes >= 10 * s_publishes);
+    CHECK(batch_tls < legacy_tls);
+    return 0;
+}
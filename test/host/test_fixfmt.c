@@ -0,0 +1,188 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "fixfmt.h"
+#include "pub_pool.h"
+
+// fixfmt against printf, and the cost of encoding one AIR_SENSOR reading the
+// way telemetry.c does compared with the formatting it replaced: one malloc,
+// snprintf("%.2f") and free per value.
+
+#if TEST_WRAP_HEAP
+static uint32_t s_heap_calls;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) { s_heap_calls++; return __real_malloc(size); }
+void *__wrap_calloc(size_t count, size_t size) { s_heap_calls++; return __real_calloc(count, size); }
+void *__wrap_realloc(void *ptr, size_t size) { s_heap_calls++; return __real_realloc(ptr, size); }
+void __wrap_free(void *ptr) { s_heap_calls++; __real_free(ptr); }
+#else
+static uint32_t s_heap_calls;
+#endif
+
+typedef struct {
+    int64_t timestamp;
+    float temperature;
+    float humidity;
+    int32_t voc_index;
+} air_reading_t;
+
+static void check_2dp(float value) {
+    char out[FIXFMT_2DP_MAX_LEN + 1];
+    char expected[64];
+    size_t n = fixfmt_2dp(out, value);
+    out[n] = '\0';
+    snprintf(expected, sizeof(expected), "%.2f", value);
+    if (strcmp(out, expected) != 0) {
+        fprintf(stderr, "fixfmt_2dp(%.9g) is %s, printf gives %s\n", value, out, expected);
+        exit(1);
+    }
+}
+
+static void check_i64(int64_t value) {
+    char out[FIXFMT_I64_MAX_LEN + 1];
+    char expected[32];
+    size_t n = fixfmt_i64(out, value);
+    out[n] = '\0';
+    snprintf(expected, sizeof(expected), "%" PRId64, value);
+    CHECK(strcmp(out, expected) == 0);
+}
+
+static void test_formats(void) {
+    check_i64(0);
+    check_i64(-1);
+    check_i64(1700000000);
+    check_i64(INT64_MAX);
+    check_i64(INT64_MIN);
+
+    // Sensors report two decimals, which must come out exactly as printf writes them
+    for (int centi = -10000; centi <= 10000; centi++) {
+        check_2dp(centi / 100.0f);
+    }
+    check_2dp(0.004f);
+    check_2dp(123456.78f);
+
+    // Arbitrary values may only differ from printf on ties, by one hundredth
+    uint32_t seed = 1;
+    for (int i = 0; i < 100000; i++) {
+        float value = (float)(test_uniform(&seed) * 200.0 - 100.0);
+        char out[FIXFMT_2DP_MAX_LEN + 1];
+        size_t n = fixfmt_2dp(out, value);
+        out[n] = '\0';
+        CHECK(fabs(strtod(out, NULL) - value) <= 0.0051);
+    }
+
+    char out[FIXFMT_2DP_MAX_LEN];
+    CHECK_EQ(fixfmt_2dp(out, -0.004f), 4);
+    CHECK(memcmp(out, "0.00", 4) == 0);
+    CHECK_EQ(fixfmt_2dp(out, NAN), 4);
+    CHECK(memcmp(out, "null", 4) == 0);
+}
+
+// Same sequence of calls as publish_json() in telemetry.c
+static size_t encode_air(pub_buf_t *buf, const air_reading_t *air) {
+#define PUT_LITERAL(lit) (memcpy(buf->data + buf->len, lit, sizeof(lit) - 1), buf->len += sizeof(lit) - 1)
+    PUT_LITERAL("{\"timestamp\":");
+    buf->len += fixfmt_i64(buf->data + buf->len, air->timestamp);
+    PUT_LITERAL(",\"temperature\":");
+    buf->len += fixfmt_2dp(buf->data + buf->len, air->temperature);
+    PUT_LITERAL(",\"humidity\":");
+    buf->len += fixfmt_2dp(buf->data + buf->len, air->humidity);
+    PUT_LITERAL(",\"voc_index\":");
+    buf->len += fixfmt_i64(buf->data + buf->len, air->voc_index);
+    PUT_LITERAL("}");
+#undef PUT_LITERAL
+    return buf->len;
+}
+
+// What handle_sensor_data did per value before the publish pool
+static size_t encode_air_legacy(const air_reading_t *air) {
+    size_t len = 0;
+    const float values[] = { air->temperature, air->humidity, (float)air->voc_index };
+    for (int i = 0; i < 3; i++) {
+        char *str = malloc(30);
+        len += snprintf(str, 30, "%.2f", values[i]);
+        free(str);
+    }
+    return len;
+}
+
+#define READINGS 200000
+
+static air_reading_t s_readings[1024];
+
+static void bench(void) {
+    uint32_t seed = 7;
+    for (int i = 0; i < 1024; i++) {
+        s_readings[i] = (air_reading_t){
+            .timestamp = 1760000000 + i * 10,
+            .temperature = roundf((float)(18.0 + test_uniform(&seed) * 10.0) * 100) / 100,
+            .humidity = roundf((float)(30.0 + test_uniform(&seed) * 40.0) * 100) / 100,
+            .voc_index = 50 + test_rand(&seed) % 200,
+        };
+    }
+
+    size_t total = 0;
+    s_heap_calls = 0;
+    int64_t start_ns = test_now_ns();
+    uint64_t start_cycles = test_cycles();
+    for (int i = 0; i < READINGS; i++) {
+        pub_buf_t *buf = pub_pool_acquire();
+        CHECK(buf != NULL);
+        total += encode_air(buf, &s_readings[i & 1023]);
+        pub_pool_release(buf);
+    }
+    double ns = (double)(test_now_ns() - start_ns) / READINGS;
+    double cyc = (double)(test_cycles() - start_cycles) / READINGS;
+    uint32_t heap_calls = s_heap_calls;
+
+    s_heap_calls = 0;
+    int64_t legacy_start_ns = test_now_ns();
+    uint64_t legacy_start_cycles = test_cycles();
+    for (int i = 0; i < READINGS; i++) {
+        total += encode_air_legacy(&s_readings[i & 1023]);
+    }
+    double legacy_ns = (double)(test_now_ns() - legacy_start_ns) / READINGS;
+    double legacy_cyc = (double)(test_cycles() - legacy_start_cycles) / READINGS;
+    uint32_t legacy_heap_calls = s_heap_calls;
+
+    printf("publish pool + fixfmt: %6.1f ns", ns);
+    if (TEST_HAVE_CYCLES) printf(", %6.0f cycles", cyc);
+    printf(" per reading, %u heap calls\n", heap_calls);
+    printf("malloc + snprintf:     %6.1f ns", legacy_ns);
+    if (TEST_HAVE_CYCLES) printf(", %6.0f cycles", legacy_cyc);
+    printf(" per reading, %.1f heap calls\n", (double)legacy_heap_calls / READINGS);
+    printf("(%zu bytes encoded)\n", total);
+
+    CHECK_EQ(heap_calls, 0);
+    CHECK_EQ(pub_pool_exhausted_count(), 0);
+}
+
+static void test_pool(void) {
+    pub_buf_t *bufs[CONFIG_MIST_PUB_POOL_COUNT];
+    for (int i = 0; i < CONFIG_MIST_PUB_POOL_COUNT; i++) {
+        bufs[i] = pub_pool_acquire();
+        CHECK(bufs[i] != NULL);
+        CHECK_EQ(bufs[i]->len, 0);
+    }
+    CHECK(pub_pool_acquire() == NULL);
+    CHECK_EQ(pub_pool_exhausted_count(), 1);
+    pub_pool_release(bufs[1]);
+    CHECK(pub_pool_acquire() == bufs[1]);
+    for (int i = 0; i < CONFIG_MIST_PUB_POOL_COUNT; i++) {
+        pub_pool_release(bufs[i]);
+    }
+}
+
+int main(void) {
+    test_formats();
+    bench();
+    test_pool();
+    return 0;
+}
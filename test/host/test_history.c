@@ -0,0 +1,254 @@
+#include <string.h>
+#include "test.h"
+
+// Memory footprint and query cost of the history at 100 sensors, sized the way
+// history.c sizes it from the configuration: a day of air sensor readings every
+// 10 s from each sensor goes in through history_add(), then queries are
+// answered with HistoryResponse messages as the query task publishes them.
+// Prints what each tier covers, the cost of an add and of each query.
+
+#include "history.c"
+
+#define SENSORS CONFIG_MIST_HISTORY_SENSORS
+#define READING_S 10
+#define DAY_S (24 * 3600)
+#define START_S 1760000000u
+#define REPEATS 200
+
+// TimeSeriesBlock fields, see master.proto
+#define BLOCK_MAC_TAG 1
+#define BLOCK_COUNT_TAG 3
+
+// Fake of the module history.c publishes through
+const char *mqtt_topic(mqtt_topic_t topic) { return "history"; }
+esp_err_t mqtt_publish_qos(const char *topic, const char *data, size_t len, int qos) { return ESP_OK; }
+
+typedef struct {
+    int64_t id;
+    int blocks;
+    uint32_t points;
+    bool truncated;
+    uint32_t next;
+    uint8_t mac_addr[SENSORS][ESP_NOW_ETH_ALEN];
+} response_t;
+
+static void mac_of(int sensor, uint8_t mac_addr[ESP_NOW_ETH_ALEN]) {
+    const uint8_t mac[ESP_NOW_ETH_ALEN] = { 0x24, 0x0a, 0xc4, 0x10, sensor >> 8, sensor };
+    memcpy(mac_addr, mac, ESP_NOW_ETH_ALEN);
+}
+
+static double temperature_at(int sensor, uint32_t time_s) {
+    return 21 + sensor % 5 + 2 * sin((time_s - START_S) * 2 * M_PI / DAY_S);
+}
+
+static int64_t fill(void) {
+    static pipeline_reading_t reading;
+    int64_t adds = 0;
+    for (uint32_t t = START_S; t < START_S + DAY_S; t += READING_S) {
+        for (int i = 0; i < SENSORS; i++) {
+            memset(&reading, 0, sizeof(reading));
+            mac_of(i, reading.mac_addr);
+            reading.data.sensor_type = SensorType_AIR_SENSOR;
+            reading.data.which_body = SensorData_air_sensor_tag;
+            AirSensor *air = &reading.data.body.air_sensor;
+            // Sensors do not read in step
+            air->timestamp = t + i % READING_S;
+            air->temperature = temperature_at(i, air->timestamp);
+            air->humidity = 45.5f;
+            air->voc_index = 100 + i;
+            history_add(&reading);
+            adds++;
+        }
+    }
+    return adds;
+}
+
+static void parse_response(const uint8_t *data, size_t len, response_t *response) {
+    pb_istream_t stream = pb_istream_from_buffer(data, len);
+    pb_wire_type_t type;
+    uint32_t field;
+    bool eof;
+
+    memset(response, 0, sizeof(*response));
+    while (pb_decode_tag(&stream, &type, &field, &eof)) {
+        if (field == RESPONSE_ID_TAG) {
+            CHECK(pb_decode_svarint(&stream, &response->id));
+        } else if (field == RESPONSE_TRUNCATED_TAG) {
+            uint32_t truncated;
+            CHECK(pb_decode_varint32(&stream, &truncated));
+            response->truncated = truncated != 0;
+        } else if (field == RESPONSE_NEXT_TAG) {
+            CHECK(pb_decode_varint32(&stream, &response->next));
+        } else {
+            CHECK_EQ(field, RESPONSE_BLOCKS_TAG);
+            CHECK(response->blocks < SENSORS);
+            pb_istream_t block;
+            CHECK(pb_make_string_substream(&stream, &block));
+            while (pb_decode_tag(&block, &type, &field, &eof)) {
+                if (field == BLOCK_MAC_TAG) {
+                    uint32_t size;
+                    CHECK(pb_decode_varint32(&block, &size));
+                    CHECK_EQ(size, ESP_NOW_ETH_ALEN);
+                    CHECK(pb_read(&block, response->mac_addr[response->blocks], size));
+                } else if (field == BLOCK_COUNT_TAG) {
+                    uint32_t count;
+                    CHECK(pb_decode_varint32(&block, &count));
+                    response->points += count;
+                } else {
+                    CHECK(pb_skip_field(&block, type));
+                }
+            }
+            CHECK(eof);
+            CHECK(pb_close_string_substream(&stream, &block));
+            response->blocks++;
+        }
+    }
+    CHECK(eof);
+}
+
+// Encodes the response to a query the way the query task does, returning its
+// length and the average time taken
+static size_t answer(const uint8_t *query_data, size_t query_len, response_t *response, double *us) {
+    history_query_t query;
+    CHECK(decode_query(query_data, query_len, &query));
+
+    size_t len = 0;
+    int64_t start_ns = test_now_ns();
+    for (int r = 0; r < REPEATS; r++) {
+        len = encode_response(&query);
+    }
+    *us = (double)(test_now_ns() - start_ns) / REPEATS / 1000;
+    CHECK(len > 0);
+    parse_response(s_response, len, response);
+    return len;
+}
+
+static size_t encode_query(uint8_t *buf, size_t size, int64_t id, int sensor, uint32_t from_s, uint32_t start) {
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, size);
+    CHECK(pbw_sint(&stream, QUERY_ID_TAG, id));
+    if (sensor >= 0) {
+        uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+        mac_of(sensor, mac_addr);
+        CHECK(pbw_bytes(&stream, QUERY_MAC_TAG, mac_addr, ESP_NOW_ETH_ALEN));
+    }
+    if (from_s != 0) CHECK(pbw_uint(&stream, QUERY_FROM_TAG, from_s));
+    if (start != 0) CHECK(pbw_uint(&stream, QUERY_START_TAG, start));
+    return stream.bytes_written;
+}
+
+// Every series holds the most recent readings raw and older ones as means,
+// oldest first, without gaps between the tiers
+static void check_series(int sensor) {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    mac_of(sensor, mac_addr);
+    int index = history_store_find(&s_store, mac_addr);
+    CHECK(index >= 0);
+
+    bool truncated;
+    size_t count = history_store_query(&s_store, index, 0, UINT32_MAX, s_samples, MAX_POINTS, &truncated);
+    CHECK(!truncated);
+    CHECK(count >= RAW_SLOTS && count <= SLOTS_PER_SERIES + HISTORY_TIERS - 1);
+    for (size_t k = 1; k < count; k++) {
+        CHECK(s_samples[k].time_s > s_samples[k - 1].time_s);
+        CHECK(s_samples[k].time_s - s_samples[k - 1].time_s <= CONFIG_MIST_HISTORY_TIER2_S);
+        CHECK_EQ(s_samples[k].values[2], 100 + sensor);
+    }
+
+    // The newest samples are the last readings, unchanged but for the fixed point
+    for (size_t k = count - RAW_SLOTS + 1; k < count; k++) {
+        CHECK_EQ(s_samples[k].time_s - s_samples[k - 1].time_s, READING_S);
+    }
+    const history_sample_t *last = &s_samples[count - 1];
+    uint32_t last_s = START_S + DAY_S - READING_S + sensor % READING_S;
+    CHECK_EQ(last->time_s, last_s);
+    CHECK_EQ(last->values[0], lround(temperature_at(sensor, last_s) * 100));
+    CHECK_EQ(last->values[1], 4550);
+
+    // The oldest are means of whole hours, as far back as the coarsest ring reaches
+    CHECK_EQ(s_samples[0].time_s % CONFIG_MIST_HISTORY_TIER2_S, 0);
+    CHECK(s_samples[0].time_s <= last_s - (TIER2_SLOTS - 1) * CONFIG_MIST_HISTORY_TIER2_S);
+}
+
+int main(void) {
+    CHECK_EQ(history_init(), ESP_OK);
+
+    size_t memory = sizeof(s_series) + sizeof(s_times) + sizeof(s_values);
+    CHECK(memory <= CONFIG_MIST_HISTORY_BUDGET_KB * 1024);
+    printf("%d sensors in %zu of %d bytes, %zu per sensor: %d raw readings, %d %d s means, %d %d s means\n",
+           SENSORS, memory, CONFIG_MIST_HISTORY_BUDGET_KB * 1024, memory / SENSORS,
+           (int)RAW_SLOTS, (int)TIER1_SLOTS, CONFIG_MIST_HISTORY_TIER1_S, (int)TIER2_SLOTS, CONFIG_MIST_HISTORY_TIER2_S);
+    printf("at one reading every %d s, raw readings cover %d s, means %d min and %d h\n", READING_S,
+           (int)RAW_SLOTS * READING_S, (int)TIER1_SLOTS * CONFIG_MIST_HISTORY_TIER1_S / 60,
+           (int)TIER2_SLOTS * CONFIG_MIST_HISTORY_TIER2_S / 3600);
+
+    int64_t start_ns = test_now_ns();
+    int64_t adds = fill();
+    printf("history_add: %.0f ns\n", (double)(test_now_ns() - start_ns) / adds);
+
+    for (int i = 0; i < SENSORS; i++) {
+        check_series(i);
+    }
+
+    static const struct {
+        const char *name;
+        int sensor;             // -1 for every sensor
+        uint32_t from_s;
+    } QUERIES[] = {
+        { "1 sensor, last hour", 7, START_S + DAY_S - 3600 },
+        { "1 sensor, everything", 7, 0 },
+        { "all sensors, last 5 min", -1, START_S + DAY_S - 300 },
+        { "all sensors, last hour", -1, START_S + DAY_S - 3600 },
+        { "all sensors, everything", -1, 0 },
+    };
+    uint8_t query[64];
+    response_t response;
+
+    printf("query                     responses  largest B  blocks  points  truncated  encode us\n");
+    for (size_t q = 0; q < sizeof(QUERIES) / sizeof(QUERIES[0]); q++) {
+        // Followed up until every sensor was answered for
+        int responses = 0;
+        int blocks = 0;
+        uint32_t points = 0;
+        bool truncated = false;
+        size_t largest = 0;
+        double total_us = 0;
+        uint32_t start = 0;
+        do {
+            size_t query_len = encode_query(query, sizeof(query), q + 1, QUERIES[q].sensor, QUERIES[q].from_s, start);
+            double us;
+            size_t len = answer(query, query_len, &response, &us);
+            CHECK_EQ(response.id, q + 1);
+            CHECK(len <= CONFIG_MIST_HISTORY_RESPONSE_BYTES);
+            CHECK(response.blocks > 0);
+            CHECK(response.next == 0 || response.next > start);
+
+            // Sensors come in order and none is left out between responses
+            for (int b = 0; b < response.blocks; b++) {
+                uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+                mac_of(QUERIES[q].sensor >= 0 ? QUERIES[q].sensor : blocks + b, mac_addr);
+                CHECK(memcmp(response.mac_addr[b], mac_addr, ESP_NOW_ETH_ALEN) == 0);
+            }
+            responses++;
+            blocks += response.blocks;
+            points += response.points;
+            truncated |= response.truncated;
+            largest = len > largest ? len : largest;
+            total_us += us;
+            start = response.next;
+        } while (start != 0);
+
+        printf("%-24s  %9d  %9zu  %6d  %6" PRIu32 "  %9d  %9.1f\n", QUERIES[q].name, responses, largest, blocks,
+               points, truncated, total_us);
+        CHECK_EQ(blocks, QUERIES[q].sensor >= 0 ? 1 : SENSORS);
+        CHECK(!truncated);
+    }
+
+    // The last minute of every sensor fits one response
+    size_t query_len = encode_query(query, sizeof(query), 1, -1, START_S + DAY_S - 60, 0);
+    double us;
+    answer(query, query_len, &response, &us);
+    CHECK_EQ(response.blocks, SENSORS);
+    CHECK(!response.truncated);
+    CHECK_EQ(response.next, 0);
+    return 0;
+}
@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "load.h"
+#include "pb_encode.h"
+#include "pb_decode.h"
+#include "router.h"
+#include "pipeline.h"
+#include "commands.h"
+#include "batch.h"
+#include "peers.h"
+#include "mqtt.h"
+#include "backlog.h"
+#include "boot.h"
+#include "metrics.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+// Load generator on the host: fake sensors send readings over ESP-NOW through
+// the pipeline and router into batches, while SensorCommands arrive over MQTT,
+// fan out through commands.c and are acknowledged by the sensors. The tasks are
+// run by hand in their priority order, the host clock following the real one.
+// Prints messages handled per second, the p50/p99 of the time from a reading
+// arriving until its batch is published and from a command arriving until its
+// CommandStatus is published, both measured with the real clock, and the peak
+// heap use.
+
+#define SENSORS 64
+// Readings are offered as fast as they are handled for DURATION_MS, up to MAX_READINGS
+#define DURATION_MS 1000
+#define MAX_READINGS (1 << 20)
+// Frames arriving between two runs of the tasks, at most the readings ring depth
+// so the publisher keeps up as it would at its higher priority on the device
+#define BURST 8
+#define COMMAND_INTERVAL_US 10000
+#define MAX_COMMANDS 4096
+#define ACKS 16
+
+// CommandStatus fields, see master.proto
+#define STATUS_ID_TAG 1
+#define STATUS_ACKED_TAG 3
+
+const uint8_t COMM_BROADCAST_MAC_ADDR[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static uint8_t s_macs[SENSORS][ESP_NOW_ETH_ALEN];
+
+// Arrival of each reading and each command, replaced by its latency once published
+static int64_t s_reading_ns[MAX_READINGS];
+static int64_t s_command_ns[MAX_COMMANDS];
+
+// Readings in the batch being filled, by sequence number
+static uint32_t s_batched[CONFIG_MIST_BATCH_MAX_READINGS];
+static uint32_t s_batched_count;
+static uint32_t s_readings_published;
+
+static uint32_t s_commands;
+static uint32_t s_statuses;
+static uint32_t s_acked;
+
+// Acks the sensors send once a command reaches them
+static struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int64_t id;
+} s_acks[ACKS];
+static uint32_t s_ack_count;
+
+static int64_t s_flushed_us;
+
+#if TEST_WRAP_HEAP
+#include <malloc.h>
+
+static size_t s_heap_bytes;
+static size_t s_heap_peak;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static void *counted(void *ptr) {
+    if (ptr != NULL) {
+        s_heap_bytes += malloc_usable_size(ptr);
+        if (s_heap_bytes > s_heap_peak) s_heap_peak = s_heap_bytes;
+    }
+    return ptr;
+}
+
+static void uncount(void *ptr) {
+    if (ptr != NULL) s_heap_bytes -= malloc_usable_size(ptr);
+}
+
+void *__wrap_malloc(size_t size) { return counted(__real_malloc(size)); }
+void *__wrap_calloc(size_t count, size_t size) { return counted(__real_calloc(count, size)); }
+void *__wrap_realloc(void *ptr, size_t size) { uncount(ptr); return counted(__real_realloc(ptr, size)); }
+void __wrap_free(void *ptr) { uncount(ptr); __real_free(ptr); }
+#endif
+
+// Fakes of the modules the pipeline, commands, batch and peers call into
+void metrics_record(metrics_stage_t stage, uint32_t start) { }
+void metrics_peer_frame(const uint8_t *mac_addr, bool ok) { }
+esp_err_t backlog_append(mqtt_topic_t topic, const uint8_t *data, size_t len) { return ESP_FAIL; }
+void boot_mark(boot_phase_t phase) { }
+esp_err_t comm_add_peer(const uint8_t *mac_addr, bool encrypt) { return ESP_OK; }
+esp_err_t comm_send(const void *data, size_t len, const uint8_t *mac_addr) { return ESP_OK; }
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr) { return ESP_OK; }
+esp_err_t esp_now_set_peer_rate_config(const uint8_t *peer_addr, esp_now_rate_config_t *config) { return ESP_OK; }
+
+const char *mqtt_topic(mqtt_topic_t topic) {
+    return topic == MQTT_TOPIC_SENSORS ? "sensors" : "commands/status";
+}
+
+bool mqtt_is_connected(void) { return true; }
+
+// The batch goes out with the readings added since the last one
+esp_err_t mqtt_publish(const char *topic, const char *data, size_t len) {
+    int64_t now_ns = test_now_ns();
+    CHECK(strcmp(topic, "sensors") == 0);
+    for (uint32_t i = 0; i < s_batched_count; i++) {
+        s_reading_ns[s_batched[i]] = now_ns - s_reading_ns[s_batched[i]];
+    }
+    s_readings_published += s_batched_count;
+    s_batched_count = 0;
+    return ESP_OK;
+}
+
+esp_err_t mqtt_publish_qos(const char *topic, const char *data, size_t len, int qos) {
+    int64_t now_ns = test_now_ns();
+    CHECK(strcmp(topic, "commands/status") == 0);
+
+    pb_istream_t stream = pb_istream_from_buffer((const uint8_t *)data, len);
+    pb_wire_type_t type;
+    uint32_t field;
+    bool eof;
+    int64_t id = -1;
+    while (pb_decode_tag(&stream, &type, &field, &eof)) {
+        if (field == STATUS_ID_TAG) {
+            CHECK(pb_decode_svarint(&stream, &id));
+        } else if (field == STATUS_ACKED_TAG) {
+            uint32_t acked;
+            CHECK(pb_decode_varint32(&stream, &acked));
+            s_acked += acked;
+        } else {
+            CHECK(pb_skip_field(&stream, type));
+        }
+    }
+    CHECK(id > 0 && id <= (int64_t)s_commands);
+    s_command_ns[id] = now_ns - s_command_ns[id];
+    s_statuses++;
+    return ESP_OK;
+}
+
+// The sensor a command is sent to acknowledges it right away
+esp_err_t rlink_send(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
+    SensorCommand cmd = SensorCommand_init_zero;
+    pb_istream_t stream = pb_istream_from_buffer(data, len);
+    CHECK(pb_decode(&stream, SensorCommand_fields, &cmd));
+    CHECK(memcmp(cmd.sensor_mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0);
+    CHECK(s_ack_count < ACKS);
+    memcpy(s_acks[s_ack_count].mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    s_acks[s_ack_count++].id = cmd.id;
+    return ESP_OK;
+}
+
+// Handlers as main.c registers them, with batching
+static esp_err_t on_sensor_data(const router_msg_t *msg, const void *decoded) {
+    peers_touch(msg->mac_addr, msg->rx_time_us);
+    return pipeline_submit_reading(decoded, msg->mac_addr, msg->rx_time_us);
+}
+
+static esp_err_t on_sensor_command(const router_msg_t *msg, const void *decoded) {
+    return commands_submit(decoded);
+}
+
+static esp_err_t on_sensor_command_ack(const router_msg_t *msg, const void *decoded) {
+    commands_ack(msg->mac_addr, ((const SensorCommand *)decoded)->id);
+    return ESP_OK;
+}
+
+static esp_err_t on_frame(const pipeline_frame_t *frame) {
+    router_msg_t msg = {
+        .transport = ROUTER_TRANSPORT_ESPNOW,
+        .mac_addr = frame->mac_addr,
+        .raw = frame->data,
+        .raw_len = frame->len,
+        .rx_time_us = frame->rx_time_us,
+    };
+    return router_dispatch(&msg);
+}
+
+// The flush task is above the publisher, so a full batch goes out before the
+// next reading is added
+static void on_reading(const pipeline_reading_t *reading) {
+    if (batch_add(&reading->data, reading->mac_addr) == ESP_OK) {
+        s_batched[s_batched_count++] = reading->data.body.air_sensor.timestamp;
+    }
+    if (load_flush(false)) {
+        s_flushed_us = esp_timer_get_time();
+    }
+}
+
+static void submit_frame(const uint8_t *mac_addr, const uint8_t *data, size_t len) {
+    CommTask_t task = { .buffer = (uint8_t *)data, .buffer_size = len };
+    memcpy(task.mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    CHECK_EQ(pipeline_submit_frame(&task), ESP_OK);
+}
+
+static void send_reading(uint32_t seq) {
+    SensorData data = SensorData_init_default;
+    data.message_type = MessageType_SENSOR_DATA;
+    data.sensor_type = SensorType_AIR_SENSOR;
+    data.which_body = SensorData_air_sensor_tag;
+    // Carries the sequence number to find the reading in its batch
+    data.body.air_sensor.timestamp = seq;
+    data.body.air_sensor.temperature = 18.0f + (seq % 100) / 10.0f;
+    data.body.air_sensor.humidity = 40.0f + (seq % 300) / 10.0f;
+    data.body.air_sensor.voc_index = 100 + seq % 50;
+
+    uint8_t buf[ESP_NOW_MAX_DATA_LEN];
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
+    CHECK(pb_encode(&stream, SensorData_fields, &data));
+    s_reading_ns[seq] = test_now_ns();
+    submit_frame(s_macs[seq % SENSORS], buf, stream.bytes_written);
+}
+
+static size_t encode_command(uint8_t *buf, size_t size, int64_t id, const uint8_t *mac_addr) {
+    SensorCommand cmd = SensorCommand_init_default;
+    cmd.message_type = MessageType_SENSOR_COMMAND;
+    cmd.id = id;
+    memcpy(cmd.sensor_mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    cmd.which_body = SensorCommand_sample_rate_tag;
+    cmd.body.sample_rate.rate = 60;
+
+    pb_ostream_t stream = pb_ostream_from_buffer(buf, size);
+    CHECK(pb_encode(&stream, SensorCommand_fields, &cmd));
+    return stream.bytes_written;
+}
+
+static void send_acks(void) {
+    uint8_t buf[ESP_NOW_MAX_DATA_LEN];
+    for (uint32_t i = 0; i < s_ack_count; i++) {
+        submit_frame(s_acks[i].mac_addr, buf, encode_command(buf, sizeof(buf), s_acks[i].id, s_acks[i].mac_addr));
+    }
+    s_ack_count = 0;
+}
+
+// A command for one sensor arrives over MQTT. Ids of consumers are positive.
+static void send_command(void) {
+    CHECK(s_commands + 1 < MAX_COMMANDS);
+    uint8_t buf[ESP_NOW_MAX_DATA_LEN];
+    int64_t id = ++s_commands;
+    router_msg_t msg = {
+        .transport = ROUTER_TRANSPORT_MQTT,
+        .raw = buf,
+        .raw_len = encode_command(buf, sizeof(buf), id, s_macs[id % SENSORS]),
+        .rx_time_us = esp_timer_get_time(),
+    };
+    s_command_ns[id] = test_now_ns();
+    CHECK_EQ(router_dispatch(&msg), ESP_OK);
+}
+
+// The host clock follows the real one, so the batch window and command spacing
+// pass as they would on the device
+static int64_t sync_clock(int64_t start_ns) {
+    int64_t real_us = (test_now_ns() - start_ns) / 1000;
+    if (real_us > esp_timer_get_time()) {
+        host_clock_advance_us(real_us - esp_timer_get_time());
+    }
+    return esp_timer_get_time();
+}
+
+// Runs every task once, highest priority first
+static void run_tasks(int64_t now_us, int64_t *commands_ready_us) {
+    load_decode();
+    if (load_flush(now_us - s_flushed_us >= CONFIG_MIST_BATCH_WINDOW_MS * 1000LL)) {
+        s_flushed_us = now_us;
+    }
+    load_publish();
+    if (now_us >= *commands_ready_us && load_commands(now_us)) {
+        *commands_ready_us = now_us + CONFIG_MIST_COMMAND_SPACING_MS * 1000LL;
+    }
+}
+
+static int compare_ns(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_latency(const char *name, int64_t *ns, uint32_t count) {
+    qsort(ns, count, sizeof(ns[0]), compare_ns);
+    printf("%-8s p50 %8.1f us  p99 %8.1f us  max %8.1f us  %" PRIu32 " samples\n", name,
+           ns[count / 2] / 1e3, ns[(uint64_t)count * 99 / 100] / 1e3, ns[count - 1] / 1e3, count);
+}
+
+int main(void) {
+    printf("%d sensors for %d ms, readings in bursts of %d, a command every %d ms\n", SENSORS, DURATION_MS, BURST,
+           COMMAND_INTERVAL_US / 1000);
+#if TEST_WRAP_HEAP
+    // From here on, past the buffers stdio allocates
+    size_t heap_base = s_heap_bytes;
+    s_heap_peak = heap_base;
+#endif
+
+    CHECK_EQ(peers_init(), ESP_OK);
+    for (int i = 0; i < SENSORS; i++) {
+        memcpy(s_macs[i], (uint8_t[]){ 0x02, 'L', 'G', 0, 0, (uint8_t)i }, ESP_NOW_ETH_ALEN);
+        CHECK(peers_add(s_macs[i]) != NULL);
+    }
+    CHECK_EQ(router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SENSOR_DATA, on_sensor_data), ESP_OK);
+    CHECK_EQ(router_register(ROUTER_TRANSPORT_ESPNOW, MessageType_SENSOR_COMMAND, on_sensor_command_ack), ESP_OK);
+    CHECK_EQ(router_register(ROUTER_TRANSPORT_MQTT, MessageType_SENSOR_COMMAND, on_sensor_command), ESP_OK);
+    CHECK_EQ(pipeline_init(on_frame, on_reading), ESP_OK);
+    CHECK_EQ(commands_init(), ESP_OK);
+    CHECK_EQ(batch_init(), ESP_OK);
+
+    int64_t start_ns = test_now_ns();
+    int64_t command_us = 0;
+    int64_t commands_ready_us = 0;
+    uint32_t seq = 0;
+    int64_t now_us = 0;
+    while (now_us < DURATION_MS * 1000LL && seq + BURST <= MAX_READINGS) {
+        now_us = sync_clock(start_ns);
+        for (int i = 0; i < BURST; i++) {
+            send_reading(seq++);
+        }
+        send_acks();
+        if (now_us >= command_us) {
+            send_command();
+            command_us = now_us + COMMAND_INTERVAL_US;
+        }
+        run_tasks(now_us, &commands_ready_us);
+    }
+
+    // Until the last command is reported, then the last batch goes out
+    while (s_statuses < s_commands) {
+        send_acks();
+        run_tasks(sync_clock(start_ns), &commands_ready_us);
+    }
+    load_decode();
+    load_publish();
+    load_flush(true);
+    double seconds = (test_now_ns() - start_ns) / 1e9;
+
+    pipeline_stats_t pipeline;
+    batch_stats_t batch;
+    pipeline_get_stats(&pipeline);
+    batch_get_stats(&batch);
+    printf("%.3f s: %.0f msgs/s, %" PRIu32 " frames, %" PRIu32 " commands, %" PRIu32 " batches\n", seconds,
+           (pipeline.frames_received + s_commands) / seconds, pipeline.frames_received, s_commands, batch.batches);
+    print_latency("reading", s_reading_ns, seq);
+    print_latency("command", s_command_ns + 1, s_commands);
+#if TEST_WRAP_HEAP
+    printf("peak heap %zu bytes, ", s_heap_peak - heap_base);
+#endif
+    printf("static buffers: pipeline %zu, commands %zu, batch %zu bytes\n", load_pipeline_bytes(),
+           load_commands_bytes(), load_batch_bytes());
+
+    // Nothing dropped or failed on the way, every command acknowledged
+    CHECK_EQ(pipeline.frames_received, seq + s_commands);
+    CHECK_EQ(pipeline.frames_dropped + pipeline.frames_invalid + pipeline.frames_failed, 0);
+    CHECK_EQ(pipeline.readings_dropped, 0);
+    CHECK_EQ(pipeline.readings_published, seq);
+    CHECK_EQ(batch.readings, seq);
+    CHECK_EQ(batch.dropped, 0);
+    CHECK_EQ(s_readings_published, seq);
+    CHECK_EQ(s_statuses, s_commands);
+    CHECK_EQ(s_acked, s_commands);
+    return 0;
+}
@@ -0,0 +1,325 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "test.h"
+#include "mqtt_outbox.h"
+#include "mist_outbox.h"
+
+// Drives the outbox the way the client does: every packet enqueued as encoded,
+// then dequeued, sent and deleted. Publishes are MQTT 5 PUBLISH packets as the
+// client encodes them, with an empty property list.
+
+#define PACKET_PUBLISH 3
+#define PACKET_SUBSCRIBE 8
+
+static const char *CONTENT_TYPE = "application/x-protobuf";
+
+static uint8_t s_packet[20000];
+
+static uint32_t put_varint(uint8_t *p, uint32_t value) {
+    uint32_t n = 0;
+    do {
+        p[n] = value & 0x7f;
+        value >>= 7;
+        if (value > 0) {
+            p[n] |= 0x80;
+        }
+        n++;
+    } while (value > 0);
+    return n;
+}
+
+static uint32_t get_varint(const uint8_t *p, uint32_t *value) {
+    uint32_t n = 0;
+    *value = 0;
+    do {
+        *value |= (uint32_t)(p[n] & 0x7f) << (7 * n);
+    } while (p[n++] & 0x80);
+    return n;
+}
+
+// Encodes a PUBLISH into s_packet, the payload filled with its msg_id
+static int encode_publish(const char *topic, int msg_id, int qos, bool mqtt5, int payload_len) {
+    int topic_len = strlen(topic);
+    uint32_t remaining = 2 + topic_len + (qos > 0 ? 2 : 0) + (mqtt5 ? 1 : 0) + payload_len;
+    uint8_t *p = s_packet;
+    *p++ = PACKET_PUBLISH << 4 | qos << 1;
+    p += put_varint(p, remaining);
+    *p++ = topic_len >> 8;
+    *p++ = topic_len;
+    memcpy(p, topic, topic_len);
+    p += topic_len;
+    if (qos > 0) {
+        *p++ = msg_id >> 8;
+        *p++ = msg_id;
+    }
+    if (mqtt5) {
+        *p++ = 0;
+    }
+    memset(p, msg_id, payload_len);
+    return p + payload_len - s_packet;
+}
+
+static outbox_item_handle_t enqueue(outbox_handle_t outbox, int msg_type, int msg_id, int qos, int len, int split) {
+    outbox_message_t message = {
+        .data = s_packet,
+        .len = split > 0 ? split : len,
+        .msg_id = msg_id,
+        .msg_qos = qos,
+        .msg_type = msg_type,
+        .remaining_data = split > 0 ? s_packet + split : NULL,
+        .remaining_len = split > 0 ? len - split : 0,
+    };
+    return outbox_enqueue(outbox, &message, 0);
+}
+
+static outbox_item_handle_t publish(outbox_handle_t outbox, const mist_outbox_publish_t *description,
+                                    const char *topic, int msg_id, int qos, bool mqtt5, int payload_len) {
+    int len = encode_publish(topic, msg_id, qos, mqtt5, payload_len);
+    mist_outbox_set_next_publish(description);
+    return enqueue(outbox, PACKET_PUBLISH, msg_id, qos, len, 0);
+}
+
+// Dequeues the next message as the client sends it, which deletes QoS 0
+// messages once written and keeps the others until acknowledged
+static const uint8_t *send_next(outbox_handle_t outbox, size_t *len, uint16_t *msg_id) {
+    static uint8_t sent[sizeof(s_packet)];
+    outbox_item_handle_t item = outbox_dequeue(outbox, QUEUED, NULL);
+    if (item == NULL) {
+        return NULL;
+    }
+    int msg_type, qos;
+    const uint8_t *data = outbox_item_get_data(item, len, msg_id, &msg_type, &qos);
+    CHECK(data != NULL);
+    memcpy(sent, data, *len);
+    if (qos == 0) {
+        CHECK_EQ(outbox_delete_item(outbox, item), ESP_OK);
+    } else {
+        CHECK_EQ(outbox_set_pending(outbox, *msg_id, TRANSMITTED), ESP_OK);
+    }
+    return sent;
+}
+
+typedef struct {
+    uint32_t remaining;
+    uint32_t topic_len;
+    const uint8_t *topic;
+    uint32_t props_len;
+    const uint8_t *props;
+    uint32_t payload_len;
+    const uint8_t *payload;
+} parsed_t;
+
+// Parses an MQTT 5 PUBLISH, checking its remaining length against len
+static parsed_t parse(const uint8_t *p, size_t len) {
+    parsed_t parsed;
+    CHECK_EQ(p[0] >> 4, PACKET_PUBLISH);
+    uint32_t pos = 1 + get_varint(p + 1, &parsed.remaining);
+    CHECK_EQ(pos + parsed.remaining, len);
+    parsed.topic_len = p[pos] << 8 | p[pos + 1];
+    parsed.topic = p + pos + 2;
+    pos += 2 + parsed.topic_len + ((p[0] >> 1 & 3) > 0 ? 2 : 0);
+    pos += get_varint(p + pos, &parsed.props_len);
+    parsed.props = p + pos;
+    pos += parsed.props_len;
+    CHECK(pos <= len);
+    parsed.payload = p + pos;
+    parsed.payload_len = len - pos;
+    return parsed;
+}
+
+static bool has_content_type(const parsed_t *parsed) {
+    uint32_t len = strlen(CONTENT_TYPE);
+    for (uint32_t i = 0; i + 3 + len <= parsed->props_len; i++) {
+        const uint8_t *p = parsed->props + i;
+        if (p[0] == 0x03 && (uint32_t)(p[1] << 8 | p[2]) == len && memcmp(p + 3, CONTENT_TYPE, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int topic_alias(const parsed_t *parsed) {
+    for (uint32_t i = 0; i + 3 <= parsed->props_len; i++) {
+        if (parsed->props[i] == 0x23) {
+            return parsed->props[i + 1] << 8 | parsed->props[i + 2];
+        }
+    }
+    return 0;
+}
+
+static bool payload_is(const parsed_t *parsed, int msg_id, uint32_t len) {
+    if (parsed->payload_len != len) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        if (parsed->payload[i] != (uint8_t)msg_id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_classes(void) {
+    outbox_handle_t outbox = outbox_init();
+    mist_outbox_set_protocol(false);
+    mist_outbox_new_connection(0);
+    mist_outbox_publish_t telemetry = { .cls = MIST_OUTBOX_TELEMETRY };
+    mist_outbox_stats_t stats;
+
+    // Telemetry running out of budget drops its own oldest messages
+    int per_message = encode_publish("t", 1, 1, false, 5000);
+    for (int i = 1; i <= 5; i++) {
+        CHECK(publish(outbox, &telemetry, "t", i, 1, false, 5000) != NULL);
+    }
+    mist_outbox_get_stats(MIST_OUTBOX_TELEMETRY, &stats);
+    CHECK_EQ(stats.items, CONFIG_MIST_OUTBOX_TELEMETRY_BYTES / per_message);
+    CHECK_EQ(stats.evicted, 5 - stats.items);
+
+    // Larger than the whole budget
+    CHECK(publish(outbox, &telemetry, "t", 6, 1, false, CONFIG_MIST_OUTBOX_TELEMETRY_BYTES) == NULL);
+    mist_outbox_get_stats(MIST_OUTBOX_TELEMETRY, &stats);
+    CHECK_EQ(stats.rejected, 1);
+
+    // A publish without a description and the client's own packets are
+    // control, which goes out first
+    CHECK(publish(outbox, NULL, "c", 7, 1, false, 10) != NULL);
+    s_packet[0] = PACKET_SUBSCRIBE << 4 | 2;
+    CHECK(enqueue(outbox, PACKET_SUBSCRIBE, 8, 1, 20, 0) != NULL);
+    mist_outbox_get_stats(MIST_OUTBOX_CONTROL, &stats);
+    CHECK_EQ(stats.items, 2);
+
+    size_t len;
+    uint16_t msg_id;
+    CHECK(send_next(outbox, &len, &msg_id) != NULL);
+    CHECK_EQ(msg_id, 7);
+    CHECK(send_next(outbox, &len, &msg_id) != NULL);
+    CHECK_EQ(msg_id, 8);
+    CHECK(send_next(outbox, &len, &msg_id) != NULL);
+    CHECK_EQ(msg_id, 5 - CONFIG_MIST_OUTBOX_TELEMETRY_BYTES / per_message + 1);
+
+    outbox_delete_all_items(outbox);
+    CHECK_EQ(outbox_get_size(outbox), 0);
+}
+
+static void test_properties(void) {
+    outbox_handle_t outbox = outbox_init();
+    mist_outbox_set_protocol(true);
+    mist_outbox_new_connection(2);
+    mist_outbox_publish_t readings = { .cls = MIST_OUTBOX_TELEMETRY, .content_type = CONTENT_TYPE, .topic_alias = 1 };
+    const char *topic = "/u1/master/aabbccddeeff/sensors";
+    size_t len;
+    uint16_t msg_id;
+
+    // The first publish teaches the broker the alias
+    CHECK(publish(outbox, &readings, topic, 0, 0, true, 40) != NULL);
+    const uint8_t *sent = send_next(outbox, &len, &msg_id);
+    CHECK(sent != NULL);
+    parsed_t parsed = parse(sent, len);
+    CHECK(parsed.topic_len == strlen(topic) && memcmp(parsed.topic, topic, parsed.topic_len) == 0);
+    CHECK(has_content_type(&parsed));
+    CHECK_EQ(topic_alias(&parsed), 1);
+    CHECK(payload_is(&parsed, 0, 40));
+
+    // Later ones leave the topic out
+    CHECK(publish(outbox, &readings, topic, 0, 0, true, 40) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    parsed = parse(sent, len);
+    CHECK_EQ(parsed.topic_len, 0);
+    CHECK(has_content_type(&parsed));
+    CHECK_EQ(topic_alias(&parsed), 1);
+    CHECK(payload_is(&parsed, 0, 40));
+
+    // QoS 1 keeps its topic and packet identifier and gets no alias
+    CHECK(publish(outbox, &readings, topic, 9, 1, true, 40) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    parsed = parse(sent, len);
+    CHECK_EQ(msg_id, 9);
+    CHECK_EQ(parsed.topic_len, strlen(topic));
+    CHECK_EQ(parsed.topic[parsed.topic_len] << 8 | parsed.topic[parsed.topic_len + 1], 9);
+    CHECK(has_content_type(&parsed));
+    CHECK_EQ(topic_alias(&parsed), 0);
+    CHECK(payload_is(&parsed, 9, 40));
+    CHECK_EQ(outbox_delete(outbox, 9, PACKET_PUBLISH), ESP_OK);
+
+    // The properties push the remaining length past a byte, and the payload
+    // is split between the two parts of the message
+    int payload = 127 - (2 + strlen(topic) + 1) - 5;
+    int packet_len = encode_publish(topic, 10, 1, true, payload);
+    mist_outbox_set_next_publish(&readings);
+    CHECK(enqueue(outbox, PACKET_PUBLISH, 10, 1, packet_len, packet_len - 20) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    parsed = parse(sent, len);
+    CHECK(parsed.remaining > 127);
+    CHECK(has_content_type(&parsed));
+    CHECK(payload_is(&parsed, 10, payload));
+    CHECK_EQ(outbox_delete(outbox, 10, PACKET_PUBLISH), ESP_OK);
+
+    // The description only applies to the next publish
+    CHECK(publish(outbox, NULL, topic, 0, 0, true, 40) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    parsed = parse(sent, len);
+    CHECK_EQ(parsed.props_len, 0);
+    mist_outbox_stats_t stats;
+    mist_outbox_get_stats(MIST_OUTBOX_CONTROL, &stats);
+    CHECK_EQ(stats.high_water, len);
+
+    // An alias above what the broker accepts is not added
+    mist_outbox_publish_t summaries = { .cls = MIST_OUTBOX_TELEMETRY, .content_type = CONTENT_TYPE, .topic_alias = 3 };
+    CHECK(publish(outbox, &summaries, topic, 0, 0, true, 40) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    parsed = parse(sent, len);
+    CHECK(has_content_type(&parsed));
+    CHECK_EQ(topic_alias(&parsed), 0);
+
+    // Nor over MQTT 3.1.1, which has no properties
+    mist_outbox_set_protocol(false);
+    CHECK(publish(outbox, &readings, topic, 0, 0, false, 40) != NULL);
+    sent = send_next(outbox, &len, &msg_id);
+    CHECK_EQ(len, encode_publish(topic, 0, 0, false, 40));
+    CHECK(memcmp(sent, s_packet, len) == 0);
+}
+
+static void test_new_connection(void) {
+    outbox_handle_t outbox = outbox_init();
+    mist_outbox_set_protocol(true);
+    mist_outbox_new_connection(2);
+    mist_outbox_publish_t readings = { .cls = MIST_OUTBOX_TELEMETRY, .content_type = CONTENT_TYPE, .topic_alias = 1 };
+    const char *topic = "/u1/master/aabbccddeeff/sensors";
+    size_t len;
+    uint16_t msg_id;
+
+    CHECK(publish(outbox, &readings, topic, 0, 0, true, 40) != NULL);
+    CHECK(send_next(outbox, &len, &msg_id) != NULL);
+
+    // Handed out without its topic, but the connection drops before it is
+    // written. It is dropped, as is one carrying an alias the next broker
+    // does not accept.
+    CHECK(publish(outbox, &readings, topic, 0, 0, true, 40) != NULL);
+    CHECK(outbox_dequeue(outbox, QUEUED, NULL) != NULL);
+    CHECK(publish(outbox, &readings, topic, 0, 0, true, 40) != NULL);
+    CHECK(publish(outbox, &readings, topic, 11, 1, true, 40) != NULL);
+    mist_outbox_new_connection(0);
+    mist_outbox_stats_t stats;
+    mist_outbox_get_stats(MIST_OUTBOX_TELEMETRY, &stats);
+    CHECK_EQ(stats.items, 1);
+
+    const uint8_t *sent = send_next(outbox, &len, &msg_id);
+    CHECK_EQ(msg_id, 11);
+    parsed_t parsed = parse(sent, len);
+    CHECK_EQ(parsed.topic_len, strlen(topic));
+
+    // Everything not sent yet, e.g. on falling back to MQTT 3.1.1
+    CHECK(publish(outbox, &readings, topic, 12, 1, true, 40) != NULL);
+    mist_outbox_drop_unsent();
+    mist_outbox_get_stats(MIST_OUTBOX_TELEMETRY, &stats);
+    CHECK_EQ(stats.items, 1);
+    CHECK(outbox_get(outbox, 11) != NULL);
+    CHECK(outbox_get(outbox, 12) == NULL);
+}
+
+int main(void) {
+    test_classes();
+    test_properties();
+    test_new_connection();
+    return 0;
+}
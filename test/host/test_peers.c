@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+
+// The peer registry at and beyond 256 sensors: lookups, removals against a
+// reference set, restoring from NVS after a restart, lookup cost, and sending
+// to every sensor through the few ESP-NOW peer entries.
+
+#include "peers.c"
+
+static const uint8_t BROADCAST[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+// Fake of the ESP-NOW peer list, which refuses entries beyond its limit and
+// frames to addresses without one
+static struct {
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    int rate;                   // -1 until set
+} s_table[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static int s_table_count;
+static uint32_t s_comm_peers;   // Entries ever added
+static uint32_t s_sent;
+static int s_sent_rate;         // Rate of the entry the last frame was sent with
+
+static int table_find(const uint8_t *mac_addr) {
+    for (int i = 0; i < s_table_count; i++) {
+        if (memcmp(s_table[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) return i;
+    }
+    return -1;
+}
+
+esp_err_t comm_add_peer(const uint8_t *mac_addr, bool encrypt) {
+    CHECK(table_find(mac_addr) < 0);
+    if (s_table_count == ESP_NOW_MAX_TOTAL_PEER_NUM) return ESP_ERR_NO_MEM;
+    memcpy(s_table[s_table_count].mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
+    s_table[s_table_count++].rate = -1;
+    s_comm_peers++;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr) {
+    int i = table_find(peer_addr);
+    if (i < 0) return ESP_ERR_NOT_FOUND;
+    s_table[i] = s_table[--s_table_count];
+    return ESP_OK;
+}
+
+esp_err_t esp_now_set_peer_rate_config(const uint8_t *peer_addr, esp_now_rate_config_t *config) {
+    int i = table_find(peer_addr);
+    if (i < 0) return ESP_ERR_NOT_FOUND;
+    s_table[i].rate = config->rate;
+    return ESP_OK;
+}
+
+esp_err_t comm_send(const void *data, size_t len, const uint8_t *mac_addr) {
+    int i = table_find(mac_addr);
+    if (i < 0) return ESP_ERR_NOT_FOUND;
+    s_sent++;
+    s_sent_rate = s_table[i].rate;
+    return ESP_OK;
+}
+
+// Sensors share the vendor prefix and differ in the last bytes
+static void sensor_mac(uint32_t id, uint8_t *mac) {
+    const uint8_t mac_addr[ESP_NOW_ETH_ALEN] = { 0x40, 0x4c, 0xca, (uint8_t)(id >> 16), (uint8_t)(id >> 8), (uint8_t)id };
+    memcpy(mac, mac_addr, ESP_NOW_ETH_ALEN);
+}
+
+// Restarts the registry, which then only has what it persisted
+static void restart(void) {
+    memset(s_peers, 0, sizeof(s_peers));
+    memset(s_espnow, 0, sizeof(s_espnow));
+    memset(s_rates, 0, sizeof(s_rates));
+    s_count = 0;
+    s_table_count = 0;
+    s_comm_peers = 0;
+    s_sent = 0;
+    // main.c adds the broadcast address at boot
+    CHECK_EQ(comm_add_peer(BROADCAST, false), ESP_OK);
+    CHECK_EQ(peers_init(), ESP_OK);
+}
+
+static uint32_t longest_probe(void) {
+    uint32_t longest = 0;
+    for (uint32_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+        if (s_buckets[bucket] == BUCKET_EMPTY) continue;
+        uint32_t home = home_bucket(s_peers[s_buckets[bucket]].mac_addr);
+        uint32_t distance = (bucket - home) & (BUCKET_COUNT - 1);
+        if (distance + 1 > longest) longest = distance + 1;
+    }
+    return longest;
+}
+
+static void test_full_registry(void) {
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    restart();
+
+    for (uint32_t i = 0; i < PEER_CAPACITY; i++) {
+        sensor_mac(i * 7, mac);
+        peer_t *peer = peers_add(mac);
+        CHECK(peer != NULL);
+        CHECK_EQ(peers_index(peer), i);
+        // Adding again returns the same entry
+        CHECK(peers_add(mac) == peer);
+    }
+    CHECK_EQ(peers_count(), PEER_CAPACITY);
+    // ESP-NOW entries wait for the first send
+    CHECK_EQ(s_comm_peers, 1);
+
+    sensor_mac(99999, mac);
+    CHECK(peers_add(mac) == NULL);
+    CHECK(peers_find(mac) == NULL);
+
+    for (uint32_t i = 0; i < PEER_CAPACITY; i++) {
+        sensor_mac(i * 7, mac);
+        peer_t *peer = peers_find(mac);
+        CHECK(peer != NULL);
+        CHECK(memcmp(peer->mac_addr, mac, ESP_NOW_ETH_ALEN) == 0);
+        CHECK(peers_at(peers_index(peer)) == peer);
+    }
+
+    sensor_mac(7, mac);
+    CHECK(peers_touch(mac, 1000) == peers_find(mac));
+    CHECK_EQ(peers_find(mac)->state, PEER_STATE_ACTIVE);
+    CHECK_EQ(peers_find(mac)->rx_count, 1);
+    sensor_mac(8, mac);
+    CHECK(peers_touch(mac, 1000) == NULL);
+
+    printf("%d peers: longest probe %" PRIu32 " buckets\n", PEER_CAPACITY, longest_probe());
+    CHECK(longest_probe() <= 16);
+}
+
+// Random adds and removals against a plain array of who should be there
+static void test_churn(void) {
+    enum { IDS = 1024 };
+    static bool present[IDS];
+    memset(present, 0, sizeof(present));
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    uint32_t seed = 11;
+    uint32_t count = 0;
+
+    host_nvs_erase();
+    restart();
+    for (int round = 0; round < 20000; round++) {
+        uint32_t id = test_rand(&seed) % IDS;
+        sensor_mac(id, mac);
+        if (present[id]) {
+            CHECK_EQ(peers_remove(mac), ESP_OK);
+            present[id] = false;
+            count--;
+        } else if (count < PEER_CAPACITY) {
+            CHECK(peers_add(mac) != NULL);
+            present[id] = true;
+            count++;
+        } else {
+            CHECK(peers_add(mac) == NULL);
+        }
+
+        if (round % 1000 == 999) {
+            CHECK_EQ(peers_count(), count);
+            for (uint32_t i = 0; i < IDS; i++) {
+                sensor_mac(i, mac);
+                CHECK_EQ(peers_find(mac) != NULL, present[i]);
+            }
+        }
+    }
+    sensor_mac(IDS, mac);
+    CHECK_EQ(peers_remove(mac), ESP_ERR_NOT_FOUND);
+
+    // Everything paired comes back after a restart, without a handshake
+    restart();
+    CHECK_EQ(peers_count(), count);
+    CHECK_EQ(s_comm_peers, 1);
+    for (uint32_t i = 0; i < IDS; i++) {
+        sensor_mac(i, mac);
+        CHECK_EQ(peers_find(mac) != NULL, present[i]);
+    }
+}
+
+// Every paired sensor can be sent to, not only as many as ESP-NOW has entries for
+static void test_send(void) {
+    uint8_t mac[ESP_NOW_ETH_ALEN];
+    const uint8_t frame[] = { 1, 2, 3 };
+    host_nvs_erase();
+    restart();
+    for (uint32_t i = 0; i < PEER_CAPACITY; i++) {
+        sensor_mac(i, mac);
+        CHECK(peers_add(mac) != NULL);
+    }
+
+    for (int round = 0; round < 3; round++) {
+        for (uint32_t i = 0; i < PEER_CAPACITY; i++) {
+            sensor_mac(i, mac);
+            CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+        }
+    }
+    CHECK_EQ(s_sent, 3 * PEER_CAPACITY);
+    CHECK_EQ(s_table_count, ESP_NOW_MAX_TOTAL_PEER_NUM);
+    CHECK(table_find(BROADCAST) >= 0);
+
+    // Sensors sent to often keep their entry, the least recently used one goes
+    s_comm_peers = 0;
+    for (uint32_t i = 0; i < 100; i++) {
+        sensor_mac(0, mac);
+        CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+        sensor_mac(i % 4 + 1, mac);
+        CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    }
+    CHECK_EQ(s_comm_peers, 5);
+    sensor_mac(PEER_CAPACITY - 1, mac);
+    CHECK(table_find(mac) >= 0);
+    sensor_mac(PEER_CAPACITY - ESPNOW_ENTRIES + 4, mac);
+    CHECK(table_find(mac) < 0);
+    sensor_mac(PEER_CAPACITY - ESPNOW_ENTRIES + 5, mac);
+    CHECK(table_find(mac) >= 0);
+
+    // A rate set without an entry is applied once the sensor gets one, and again after eviction
+    sensor_mac(200, mac);
+    CHECK(table_find(mac) < 0);
+    esp_now_rate_config_t config = { .rate = 11 };
+    CHECK_EQ(peers_set_rate(mac, &config), ESP_OK);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    CHECK_EQ(s_sent_rate, 11);
+    for (uint32_t i = 0; i < PEER_CAPACITY; i++) {
+        uint8_t other[ESP_NOW_ETH_ALEN];
+        sensor_mac(i == 200 ? 0 : i, other);
+        CHECK_EQ(peers_send(frame, sizeof(frame), other), ESP_OK);
+    }
+    CHECK(table_find(mac) < 0);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    CHECK_EQ(s_sent_rate, 11);
+    sensor_mac(201, mac);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    CHECK_EQ(s_sent_rate, -1);
+
+    // Unpaired addresses can be sent to, removed peers lose their entry and rate
+    sensor_mac(PEER_CAPACITY + 1, mac);
+    CHECK(peers_set_rate(mac, &config) == ESP_ERR_NOT_FOUND);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    sensor_mac(200, mac);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    CHECK_EQ(peers_remove(mac), ESP_OK);
+    CHECK(table_find(mac) < 0);
+    CHECK_EQ(s_table_count, ESP_NOW_MAX_TOTAL_PEER_NUM - 1);
+    CHECK(peers_add(mac) != NULL);
+    CHECK_EQ(peers_send(frame, sizeof(frame), mac), ESP_OK);
+    CHECK_EQ(s_sent_rate, -1);
+}
+
+#define LOOKUPS 2000000
+
+static void bench_lookups(void) {
+    uint8_t macs[PEER_CAPACITY * 2][ESP_NOW_ETH_ALEN];
+    host_nvs_erase();
+    restart();
+    for (uint32_t i = 0; i < PEER_CAPACITY * 2; i++) {
+        sensor_mac(i * 13, macs[i]);
+        if (i < PEER_CAPACITY) CHECK(peers_add(macs[i]) != NULL);
+    }
+
+    // Half the lookups are for unknown senders
+    uint32_t found = 0;
+    int64_t start = test_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        found += peers_find(macs[(i * 2654435761u) >> 7 & (PEER_CAPACITY * 2 - 1)]) != NULL;
+    }
+    double ns = (double)(test_now_ns() - start) / LOOKUPS;
+    printf("%d peers: %.1f ns per lookup, %u of %d found\n", PEER_CAPACITY, ns, found, LOOKUPS);
+    CHECK(found > 0 && found < LOOKUPS);
+}
+
+int main(void) {
+    test_full_registry();
+    test_churn();
+    test_send();
+    bench_lookups();
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <math.h>
+#include <string.h>
+#include "test.h"
+#include "rate_adapt.h"
+
+// rate_adapt against simulated link traces: an RSSI over time, the delivery
+// ratio each rate gets at that RSSI, and interference hitting the OFDM rates.
+// Every interval the peer is heard with a noisy RSSI, smoothed as linkq does,
+// and sends a few frames at its current rate. Prints the goodput reached
+// against the best rate in hindsight per interval and the best fixed rate.
+
+// The rates and configuration linkq uses without long range
+static const rate_adapt_rate_t RATES[] = {
+    { .kbps = 1000, .overhead_us = 500, .min_rssi = -98 },
+    { .kbps = 6000, .overhead_us = 60, .min_rssi = -93 },
+    { .kbps = 12000, .overhead_us = 60, .min_rssi = -90 },
+    { .kbps = 24000, .overhead_us = 60, .min_rssi = -85 },
+    { .kbps = 52000, .overhead_us = 90, .min_rssi = -77 },
+    { .kbps = 65000, .overhead_us = 90, .min_rssi = -72 },
+};
+
+#define RATE_COUNT (int)(sizeof(RATES) / sizeof(RATES[0]))
+#define FIRST_OFDM 3
+#define FRAMES 4
+#define SILENT -999
+
+static const rate_adapt_config_t CONFIG = {
+    .rates = RATES,
+    .count = RATE_COUNT,
+    .frame_bytes = 250,
+    .margin_db = 6,
+    .min_attempts = 2,
+    .hysteresis_pct = 10,
+    .stale_ticks = 60,
+};
+
+typedef struct {
+    const char *name;
+    double (*rssi)(int t);          // SILENT while the peer is not heard
+    double (*interference)(int t);  // Share of OFDM frames lost on top, NULL for none
+    bool has_rssi;
+    int ticks;
+} scenario_t;
+
+typedef struct {
+    double goodput;                 // Mbps, averaged over the intervals
+    double oracle;                  // Best rate of each interval
+    double best_fixed;              // Best single rate for the whole trace
+    int changes;
+    uint8_t rates[1200];
+    rate_adapt_peer_t peer;
+} result_t;
+
+// Actual delivery ratio of rate at rssi, a smooth step around the sensitivity
+static double delivery(int rate, double rssi, double interference) {
+    double p = 1 / (1 + exp(-(rssi - RATES[rate].min_rssi - 2) / 1.5));
+    return rate >= FIRST_OFDM ? p * (1 - interference) : p;
+}
+
+// Mbps at rate when every frame gets through
+static double airtime_mbps(int rate) {
+    double bits = CONFIG.frame_bytes * 8;
+    return bits / (RATES[rate].overhead_us + bits * 1000 / RATES[rate].kbps);
+}
+
+static void run(const scenario_t *sc, uint32_t seed, result_t *result) {
+    double fixed[RATE_COUNT] = { 0 };
+    double ewma = 0;
+    bool has_ewma = false;
+
+    memset(result, 0, sizeof(*result));
+    rate_adapt_init_peer(&result->peer);
+    for (int t = 0; t < sc->ticks; t++) {
+        double rssi = sc->rssi(t);
+        double interference = sc->interference != NULL ? sc->interference(t) : 0;
+        rate_adapt_signals_t signals = { .heard = rssi != SILENT };
+
+        if (signals.heard) {
+            double sample = rssi + (test_uniform(&seed) - 0.5) * 6;
+            ewma = has_ewma ? ewma + (sample - ewma) / 8 : sample;
+            has_ewma = true;
+            int rate = result->peer.rate;
+            for (int f = 0; f < FRAMES; f++) {
+                signals.attempts++;
+                signals.delivered += test_uniform(&seed) < delivery(rate, rssi, interference);
+            }
+
+            double best = 0;
+            for (int r = 0; r < RATE_COUNT; r++) {
+                double mbps = delivery(r, rssi, interference) * airtime_mbps(r);
+                fixed[r] += mbps;
+                best = mbps > best ? mbps : best;
+            }
+            result->goodput += delivery(rate, rssi, interference) * airtime_mbps(rate);
+            result->oracle += best;
+        }
+        signals.has_rssi = sc->has_rssi && has_ewma;
+        signals.rssi_dbm = lround(ewma);
+
+        result->changes += rate_adapt_step(&CONFIG, &result->peer, &signals);
+        result->rates[t] = result->peer.rate;
+    }
+
+    for (int r = 0; r < RATE_COUNT; r++) {
+        result->best_fixed = fixed[r] > result->best_fixed ? fixed[r] : result->best_fixed;
+    }
+    result->goodput /= sc->ticks;
+    result->oracle /= sc->ticks;
+    result->best_fixed /= sc->ticks;
+}
+
+static double near(int t) { return -60; }
+static double far(int t) { return -91; }
+// Walking away to the edge of range and back, twice
+static double walk(int t) {
+    int c = t % 400;
+    return c < 200 ? -60 - 35.0 * c / 200 : -95 + 35.0 * (c - 200) / 200;
+}
+// Bursts of interference, e.g. a neighbouring network busy half the time
+static double bursts(int t) { return (t / 50) % 2 ? 0.7 : 0; }
+static double away(int t) { return t < 100 || t >= 250 ? -70 : SILENT; }
+
+static void test_traces(void) {
+    static const scenario_t scenarios[] = {
+        { "near", near, NULL, true, 500 },
+        { "far", far, NULL, true, 500 },
+        { "walk", walk, NULL, true, 1200 },
+        { "interference", near, bursts, true, 1000 },
+    };
+    static const double MIN_SHARE[] = { 0.95, 0.9, 0.85, 0.75 };
+    static result_t r;
+
+    printf("trace         goodput Mbps  oracle Mbps  best fixed Mbps  changes\n");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const scenario_t *sc = &scenarios[i];
+        run(sc, 1 + i, &r);
+        printf("%-12s  %12.1f  %11.1f  %15.1f  %7d\n", sc->name, r.goodput, r.oracle, r.best_fixed, r.changes);
+
+        CHECK(r.goodput >= r.oracle * MIN_SHARE[i]);
+        CHECK(!r.peer.stale);
+        // Moving between rates, not flapping every interval
+        CHECK(r.changes <= sc->ticks / 8);
+    }
+
+    // Steady links settle on the rate that suits them for good
+    run(&scenarios[0], 1, &r);
+    CHECK_EQ(r.peer.rate, RATE_COUNT - 1);
+    CHECK_EQ(r.changes, 1);
+    run(&scenarios[1], 2, &r);
+    CHECK_EQ(r.peer.rate, 1);
+    CHECK_EQ(r.changes, 1);
+
+    // A moving sensor beats any one rate
+    run(&scenarios[2], 3, &r);
+    CHECK(r.goodput > r.best_fixed);
+}
+
+static void test_stale(void) {
+    static const scenario_t sc = { "away", away, NULL, true, 400 };
+    static result_t r;
+    run(&sc, 7, &r);
+
+    for (int t = 100; t < 100 + (int)CONFIG.stale_ticks - 1; t++) {
+        CHECK(r.rates[t] > 0);
+    }
+    // Most robust once stale, back to a fast rate as soon as it is heard again
+    for (int t = 100 + CONFIG.stale_ticks - 1; t < 250; t++) {
+        CHECK_EQ(r.rates[t], 0);
+    }
+    CHECK(r.rates[250] > 0);
+    CHECK(!r.peer.stale);
+}
+
+// Without an RSSI only the most robust rate is expected to work, and frames
+// delivered there give no reason to try another
+static void test_no_rssi(void) {
+    static const scenario_t sc = { "no rssi", near, NULL, false, 500 };
+    static result_t r;
+    run(&sc, 9, &r);
+    CHECK_EQ(r.changes, 0);
+    CHECK_EQ(r.peer.rate, 0);
+}
+
+static void test_deterministic(void) {
+    static const scenario_t sc = { "interference", near, bursts, true, 1000 };
+    static result_t first, second;
+    run(&sc, 5, &first);
+    run(&sc, 5, &second);
+    CHECK(memcmp(first.rates, second.rates, sizeof(first.rates)) == 0);
+}
+
+int main(void) {
+    test_traces();
+    test_stale();
+    test_no_rssi();
+    test_deterministic();
+    return 0;
+}
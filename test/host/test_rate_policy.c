@@ -0,0 +1,248 @@
+#include <string.h>
+#include "test.h"
+#include "rate_policy.h"
+
+// rate_policy against simulated congestion traces. Sensors send a fixed number
+// of frames per interval unless throttled, the uplink forwards up to its
+// capacity per interval, and the rest queues up to a limit beyond which it is
+// dropped. Latency is the time the queue takes to drain at the current capacity.
+
+#define SENSORS 20
+#define INTERVALS 400
+#define QUEUE_LIMIT 400
+
+static const rate_policy_config_t CONFIG = {
+    .interval_ms = 5000,
+    .queue_high_permille = 700,
+    .queue_low_permille = 300,
+    .latency_high_ms = 2000,
+    .latency_low_ms = 500,
+    .decrease_pct = 25,
+    .restore_pct = 10,
+    .cooldown_ticks = 2,
+    .recover_ticks = 6,
+    .max_slowdown = 16,
+};
+
+typedef struct {
+    rate_action_t actions[INTERVALS];
+    uint32_t queue_permille[INTERVALS];
+    uint32_t dropped;
+    int decreases;
+    int restores;
+    int reversals;              // Restores after decreases and the other way round
+} trace_result_t;
+
+static rate_sensor_t s_sensors[SENSORS];
+static rate_policy_t s_policy;
+
+// Unthrottled frames per interval of sensor i, the last one is the noisiest
+static double base_frames(int i) {
+    return 1 + i;
+}
+
+// Starts over with the base interval of every sensor set by an operator
+static void init_policy(void) {
+    rate_policy_init(&s_policy, &CONFIG, s_sensors, SENSORS);
+    for (int i = 0; i < SENSORS; i++) {
+        rate_policy_reset_sensor(&s_sensors[i], CONFIG.interval_ms / base_frames(i));
+    }
+}
+
+// Frames per interval the sensors send at their current intervals
+static double offered(void) {
+    double total = 0;
+    for (int i = 0; i < SENSORS; i++) {
+        rate_sensor_t *sensor = &s_sensors[i];
+        double frames = base_frames(i);
+        if (sensor->interval_ms != 0) {
+            frames = frames * sensor->base_ms / sensor->interval_ms;
+        }
+        sensor->frames = (uint32_t)(frames + 0.5);
+        total += frames;
+    }
+    return total;
+}
+
+// Capacity of the uplink in frames per interval, from start to end reduced to low
+static void run_trace(int start, int end, double low, trace_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    init_policy();
+    double queue = 0;
+    rate_action_t last = RATE_POLICY_HOLD;
+
+    for (int t = 0; t < INTERVALS; t++) {
+        double capacity = t >= start && t < end ? low : 300;
+        queue += offered() - capacity;
+        if (queue < 0) {
+            queue = 0;
+        }
+        uint32_t dropped = 0;
+        if (queue > QUEUE_LIMIT) {
+            dropped = queue - QUEUE_LIMIT;
+            queue = QUEUE_LIMIT;
+        }
+
+        rate_signals_t signals = {
+            .queue_permille = queue * 1000 / QUEUE_LIMIT,
+            .latency_ms = queue / capacity * CONFIG.interval_ms,
+            .dropped = dropped,
+        };
+        rate_action_t action = rate_policy_step(&s_policy, &signals);
+
+        result->actions[t] = action;
+        result->queue_permille[t] = signals.queue_permille;
+        result->dropped += dropped;
+        result->decreases += action == RATE_POLICY_DECREASE;
+        result->restores += action == RATE_POLICY_RESTORE;
+        if (action != RATE_POLICY_HOLD) {
+            result->reversals += last != RATE_POLICY_HOLD && action != last;
+            last = action;
+        }
+
+        for (int i = 0; i < SENSORS; i++) {
+            const rate_sensor_t *sensor = &s_sensors[i];
+            CHECK(sensor->interval_ms == 0 || sensor->interval_ms > sensor->base_ms);
+            CHECK((uint64_t)sensor->interval_ms <= (uint64_t)sensor->base_ms * CONFIG.max_slowdown);
+        }
+    }
+}
+
+static int throttled(void) {
+    int count = 0;
+    for (int i = 0; i < SENSORS; i++) {
+        count += s_sensors[i].interval_ms != 0;
+    }
+    return count;
+}
+
+static void test_steady(void) {
+    trace_result_t result;
+    run_trace(0, 0, 300, &result);
+    CHECK_EQ(result.decreases, 0);
+    CHECK_EQ(result.restores, 0);
+    CHECK_EQ(throttled(), 0);
+}
+
+// The uplink drops to 80 frames per interval against 210 offered
+static void test_congestion(void) {
+    trace_result_t result;
+    run_trace(50, 150, 80, &result);
+
+    // The noisiest sensor goes first, on the first congested interval
+    CHECK_EQ(result.actions[49], RATE_POLICY_HOLD);
+    CHECK_EQ(result.actions[50], RATE_POLICY_DECREASE);
+
+    // The queue never overflows and drains well before the uplink recovers
+    CHECK_EQ(result.dropped, 0);
+    int drained = -1;
+    for (int t = 50; t < 150 && drained < 0; t++) {
+        if (result.queue_permille[t] <= CONFIG.queue_low_permille / 2) {
+            drained = t;
+        }
+    }
+    CHECK(drained >= 0 && drained < 75);
+    for (int t = drained; t < 150; t++) {
+        CHECK(result.queue_permille[t] < CONFIG.queue_high_permille);
+    }
+
+    // Restores only follow recover_ticks clear intervals
+    int clear = 0;
+    for (int t = 0; t < INTERVALS; t++) {
+        if (result.actions[t] == RATE_POLICY_RESTORE) {
+            CHECK(clear >= (int)CONFIG.recover_ticks - 1);
+        }
+        clear = result.queue_permille[t] <= CONFIG.queue_low_permille ? clear + 1 : 0;
+    }
+
+    // Probing for capacity while congested reverses direction a few times, not
+    // every interval, and every sensor is back at its rate in the end
+    CHECK(result.reversals <= 8);
+    CHECK_EQ(throttled(), 0);
+    printf("congestion: %d decreases, %d restores, %d reversals, drained after %d intervals\n",
+           result.decreases, result.restores, result.reversals, drained - 50);
+}
+
+// Capacity barely below what is offered, the queue grows slowly
+static void test_mild_congestion(void) {
+    trace_result_t result;
+    run_trace(50, 300, 200, &result);
+    CHECK(result.decreases > 0);
+    CHECK_EQ(result.dropped, 0);
+    CHECK_EQ(throttled(), 0);
+}
+
+// Past the queue limit the drops alone count as congestion
+static void test_drops(void) {
+    init_policy();
+    offered();
+    rate_signals_t signals = { .dropped = 5 };
+    CHECK_EQ(rate_policy_step(&s_policy, &signals), RATE_POLICY_DECREASE);
+    // Not again within the cooldown
+    CHECK_EQ(rate_policy_step(&s_policy, &signals), RATE_POLICY_HOLD);
+    CHECK_EQ(rate_policy_step(&s_policy, &signals), RATE_POLICY_DECREASE);
+}
+
+// Between the low and the high marks nothing changes in either direction
+static void test_hysteresis(void) {
+    init_policy();
+    offered();
+    rate_signals_t high = { .queue_permille = CONFIG.queue_high_permille };
+    CHECK_EQ(rate_policy_step(&s_policy, &high), RATE_POLICY_DECREASE);
+    int count = throttled();
+
+    rate_signals_t between = { .queue_permille = (CONFIG.queue_low_permille + CONFIG.queue_high_permille) / 2,
+                               .latency_ms = CONFIG.latency_low_ms + 1 };
+    for (int t = 0; t < 100; t++) {
+        CHECK_EQ(rate_policy_step(&s_policy, &between), RATE_POLICY_HOLD);
+    }
+    CHECK_EQ(throttled(), count);
+
+    rate_signals_t low = { .queue_permille = CONFIG.queue_low_permille, .latency_ms = CONFIG.latency_low_ms };
+    for (uint32_t t = 1; t < CONFIG.recover_ticks; t++) {
+        CHECK_EQ(rate_policy_step(&s_policy, &low), RATE_POLICY_HOLD);
+    }
+    CHECK_EQ(rate_policy_step(&s_policy, &low), RATE_POLICY_RESTORE);
+}
+
+// An operator's interval is the base. Sensors without one are never throttled,
+// they could not be restored to their rate.
+static void test_base(void) {
+    init_policy();
+    rate_policy_reset_sensor(&s_sensors[SENSORS - 1], 60000);
+    rate_policy_reset_sensor(&s_sensors[SENSORS - 2], 0);
+    offered();
+    rate_signals_t high = { .dropped = 1 };
+    CHECK_EQ(rate_policy_step(&s_policy, &high), RATE_POLICY_DECREASE);
+
+    const rate_sensor_t *set = &s_sensors[SENSORS - 1];
+    CHECK_EQ(set->interval_ms, 120000);
+    const rate_sensor_t *unknown = &s_sensors[SENSORS - 2];
+    CHECK_EQ(unknown->interval_ms, 0);
+    CHECK(s_sensors[SENSORS - 3].interval_ms != 0);
+
+    // Not even when nothing else is left to throttle
+    for (int t = 0; t < 100; t++) {
+        rate_policy_step(&s_policy, &high);
+        CHECK_EQ(unknown->interval_ms, 0);
+        CHECK_EQ(unknown->base_ms, 0);
+    }
+}
+
+static void test_deterministic(void) {
+    static trace_result_t first, second;
+    run_trace(50, 150, 80, &first);
+    run_trace(50, 150, 80, &second);
+    CHECK(memcmp(first.actions, second.actions, sizeof(first.actions)) == 0);
+}
+
+int main(void) {
+    test_steady();
+    test_congestion();
+    test_mild_congestion();
+    test_drops();
+    test_hysteresis();
+    test_base();
+    test_deterministic();
+    return 0;
+}
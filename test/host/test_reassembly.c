@@ -0,0 +1,90 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "test.h"
+#include "reassembly.h"
+
+// Synthetic MQTT_EVENT_DATA sequences as the client delivers them: the topic
+// only with the first fragment, current_data_offset and total_data_len on every
+// fragment.
+
+#define FRAGMENT 1024
+
+static char s_payload[CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE + 1];
+
+// Feeds len bytes of s_payload in FRAGMENT sized events, returns the number of
+// complete messages delivered
+static int feed(int msg_id, const char *topic, int len, reassembly_msg_t *msg) {
+    int delivered = 0;
+    for (int offset = 0; offset < len; offset += FRAGMENT) {
+        int n = len - offset < FRAGMENT ? len - offset : FRAGMENT;
+        bool first = offset == 0;
+        delivered += reassembly_feed(msg_id, first ? topic : NULL, first ? (int)strlen(topic) : 0,
+                                     s_payload + offset, n, offset, len, msg);
+    }
+    return delivered;
+}
+
+static void test_unfragmented(void) {
+    reassembly_msg_t msg;
+    CHECK(reassembly_feed(1, "a/b", 3, s_payload, 100, 0, 100, &msg));
+    // Passed through without a copy
+    CHECK(msg.data == (const uint8_t *)s_payload);
+    CHECK(msg.topic_len == 3 && memcmp(msg.topic, "a/b", 3) == 0);
+    CHECK_EQ(msg.len, 100);
+    reassembly_release(&msg);
+}
+
+static void test_fragmented(void) {
+    reassembly_msg_t msg;
+    CHECK_EQ(feed(2, "/u1/master/aa/commands", 3000, &msg), 1);
+    CHECK_EQ(msg.len, 3000);
+    CHECK(memcmp(msg.data, s_payload, 3000) == 0);
+    CHECK(msg.topic_len == strlen("/u1/master/aa/commands"));
+    CHECK(memcmp(msg.topic, "/u1/master/aa/commands", msg.topic_len) == 0);
+    reassembly_release(&msg);
+
+    // The largest message that fits a buffer
+    CHECK_EQ(feed(3, "t", CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE, &msg), 1);
+    CHECK(memcmp(msg.data, s_payload, CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE) == 0);
+    reassembly_release(&msg);
+    CHECK_EQ(reassembly_dropped_count(), 0);
+}
+
+static void test_dropped(void) {
+    reassembly_msg_t msg;
+    uint32_t dropped = reassembly_dropped_count();
+
+    CHECK_EQ(feed(4, "t", CONFIG_MIST_MQTT_REASSEMBLY_BUF_SIZE + 1, &msg), 0);
+    CHECK_EQ(reassembly_dropped_count(), dropped + 1);
+
+    // A missing fragment drops the message, later fragments are ignored
+    CHECK(!reassembly_feed(5, "t", 1, s_payload, 100, 0, 300, &msg));
+    CHECK(!reassembly_feed(5, NULL, 0, s_payload + 200, 100, 200, 300, &msg));
+    CHECK(!reassembly_feed(5, NULL, 0, s_payload + 100, 100, 100, 300, &msg));
+    CHECK_EQ(reassembly_dropped_count(), dropped + 2);
+
+    // Every buffer held by an incomplete message
+    for (int i = 0; i < CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS; i++) {
+        CHECK(!reassembly_feed(10 + i, "t", 1, s_payload, 100, 0, 300, &msg));
+    }
+    CHECK(!reassembly_feed(20, "t", 1, s_payload, 100, 0, 300, &msg));
+    CHECK_EQ(reassembly_dropped_count(), dropped + 3);
+    // Unfragmented messages still get through
+    CHECK(reassembly_feed(21, "t", 1, s_payload, 10, 0, 10, &msg));
+
+    // A lost connection frees them
+    reassembly_reset();
+    CHECK_EQ(reassembly_dropped_count(), dropped + 3 + CONFIG_MIST_MQTT_REASSEMBLY_BUFFERS);
+    CHECK_EQ(feed(22, "t", 3000, &msg), 1);
+    reassembly_release(&msg);
+}
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(s_payload); i++) {
+        s_payload[i] = (char)(i * 7 + i / 251);
+    }
+    test_unfragmented();
+    test_fragmented();
+    test_dropped();
+    return 0;
+}
@@ -0,0 +1,451 @@
+#include <string.h>
+#include "test.h"
+
+// rlink between the master and a simulated sensor over a link that loses,
+// duplicates and reorders frames. The sensor end is a minimal rlink peer written
+// from the frame format in rlink.h. Every message carries its id and a pattern
+// derived from it, so a message delivered twice or corrupted in reassembly is
+// caught at either end.
+
+#include "rlink.c"
+
+#define STEP_US 1000
+#define MAX_IN_FLIGHT 4096
+#define MESSAGES 300
+#define SENSOR_TX_FRAMES 128
+
+static const uint8_t SENSOR[ESP_NOW_ETH_ALEN] = { 0x24, 0x6f, 0x28, 0x01, 0x02, 0x03 };
+static peer_t s_peer;
+
+peer_t *peers_find(const uint8_t *mac_addr) {
+    return memcmp(mac_addr, SENSOR, ESP_NOW_ETH_ALEN) == 0 ? &s_peer : NULL;
+}
+
+int peers_index(const peer_t *peer) { return 7; }
+
+// The link: every frame is lost, duplicated, and delayed independently, which
+// reorders frames sent close together
+typedef struct {
+    double loss;
+    double duplicate;
+    int64_t max_delay_us;
+} link_model_t;
+
+typedef struct {
+    bool to_master;
+    int64_t at_us;
+    uint8_t len;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} in_flight_t;
+
+static link_model_t s_model;
+static in_flight_t s_in_flight[MAX_IN_FLIGHT];
+static int s_in_flight_count;
+static uint32_t s_rand = 7;
+static uint32_t s_plain_frames;
+
+static void transmit(bool to_master, const void *data, size_t len) {
+    CHECK(len <= ESP_NOW_MAX_DATA_LEN);
+    if (test_uniform(&s_rand) < s_model.loss) {
+        return;
+    }
+    int copies = test_uniform(&s_rand) < s_model.duplicate ? 2 : 1;
+    for (int i = 0; i < copies; i++) {
+        CHECK(s_in_flight_count < MAX_IN_FLIGHT);
+        in_flight_t *frame = &s_in_flight[s_in_flight_count++];
+        frame->to_master = to_master;
+        frame->at_us = esp_timer_get_time() + STEP_US + test_rand(&s_rand) % s_model.max_delay_us;
+        frame->len = len;
+        memcpy(frame->data, data, len);
+    }
+}
+
+esp_err_t peers_send(const void *data, size_t len, const uint8_t *mac_addr) {
+    CHECK(memcmp(mac_addr, SENSOR, ESP_NOW_ETH_ALEN) == 0);
+    if (!rlink_is_frame(data, len)) {
+        s_plain_frames++;
+    }
+    transmit(false, data, len);
+    return ESP_OK;
+}
+
+// Message id in the first two bytes, the rest a pattern of the id
+static void make_message(uint8_t *data, int id, size_t len) {
+    data[0] = id;
+    data[1] = id >> 8;
+    for (size_t i = 2; i < len; i++) {
+        data[i] = id + i;
+    }
+}
+
+static int check_message(const uint8_t *data, size_t len) {
+    CHECK(len >= 2);
+    int id = data[0] | data[1] << 8;
+    CHECK(id < MESSAGES);
+    for (size_t i = 2; i < len; i++) {
+        CHECK_EQ(data[i], (uint8_t)(id + i));
+    }
+    return id;
+}
+
+static uint8_t s_master_got[MESSAGES];
+static uint8_t s_sensor_got[MESSAGES];
+
+// The sensor end
+typedef struct {
+    bool used;
+    uint16_t seq;
+    uint8_t attempts;
+    uint8_t len;
+    int64_t sent_us;
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+} sensor_tx_t;
+
+static struct {
+    uint16_t tx_next;
+    bool synced;
+    sensor_tx_t tx[SENSOR_TX_FRAMES];
+    uint32_t given_up;
+
+    bool rx_valid;
+    bool ack_pending;
+    uint16_t rx_top;
+    uint64_t rx_received;
+    uint16_t first_seq;
+    uint32_t fragments;
+    int64_t started_us;
+    size_t len;
+    uint8_t buf[MAX_MESSAGE];
+} s_sensor;
+
+static void sensor_restart(uint16_t tx_next) {
+    memset(&s_sensor, 0, sizeof(s_sensor));
+    s_sensor.tx_next = tx_next;
+}
+
+static void sensor_send(const uint8_t *data, size_t len) {
+    int count = (len + RLINK_FRAGMENT_LEN - 1) / RLINK_FRAGMENT_LEN;
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        while (s_sensor.tx[next].used) {
+            next++;
+            CHECK(next < SENSOR_TX_FRAMES);
+        }
+        sensor_tx_t *tx = &s_sensor.tx[next];
+        size_t offset = (size_t)i * RLINK_FRAGMENT_LEN;
+        size_t payload_len = len - offset < RLINK_FRAGMENT_LEN ? len - offset : RLINK_FRAGMENT_LEN;
+
+        *tx = (sensor_tx_t){ .used = true, .seq = s_sensor.tx_next++, .attempts = 1,
+                             .len = RLINK_DATA_HEADER_LEN + payload_len, .sent_us = esp_timer_get_time() };
+        tx->frame[0] = RLINK_MAGIC;
+        tx->frame[1] = RLINK_TYPE_DATA | (s_sensor.synced ? 0 : RLINK_FLAG_SYN);
+        put_u16(tx->frame + 2, tx->seq);
+        tx->frame[4] = i;
+        tx->frame[5] = count;
+        memcpy(tx->frame + RLINK_DATA_HEADER_LEN, data + offset, payload_len);
+        transmit(true, tx->frame, tx->len);
+    }
+}
+
+static void sensor_receive(const uint8_t *data, size_t len) {
+    if ((data[1] & RLINK_TYPE_MASK) == RLINK_TYPE_ACK) {
+        CHECK_EQ(len, RLINK_ACK_LEN);
+        uint16_t top = get_u16(data + 2);
+        uint64_t received = 0;
+        for (int i = 0; i < 8; i++) {
+            received |= (uint64_t)data[4 + i] << (8 * i);
+        }
+        s_sensor.synced = true;
+        for (int i = 0; i < SENSOR_TX_FRAMES; i++) {
+            int16_t age = (int16_t)(uint16_t)(top - s_sensor.tx[i].seq);
+            if (s_sensor.tx[i].used && age >= 0 && age < WINDOW && (received >> age & 1)) {
+                s_sensor.tx[i].used = false;
+            }
+        }
+        return;
+    }
+
+    CHECK_EQ(data[1] & RLINK_TYPE_MASK, RLINK_TYPE_DATA);
+    uint16_t seq = get_u16(data + 2);
+    uint8_t index = data[4];
+    uint8_t count = data[5];
+    uint16_t first_seq = seq - index;
+    int64_t now_us = esp_timer_get_time();
+
+    // One reassembly buffer. Fragments of another message wait for it, they
+    // stay unacknowledged and are retransmitted.
+    if (s_sensor.fragments != 0 && now_us - s_sensor.started_us > REASSEMBLY_TIMEOUT_US) {
+        s_sensor.fragments = 0;
+    }
+    if (count > 1 && s_sensor.fragments != 0 && s_sensor.first_seq != first_seq) {
+        return;
+    }
+
+    int16_t diff = (int16_t)(uint16_t)(seq - s_sensor.rx_top);
+    s_sensor.ack_pending = true;
+    if (!s_sensor.rx_valid || diff >= WINDOW) {
+        s_sensor.rx_valid = true;
+        s_sensor.rx_top = seq;
+        s_sensor.rx_received = 1;
+    } else if (diff > 0) {
+        s_sensor.rx_received = s_sensor.rx_received << diff | 1;
+        s_sensor.rx_top = seq;
+    } else if (-diff >= WINDOW || (s_sensor.rx_received >> -diff & 1)) {
+        return;
+    } else {
+        s_sensor.rx_received |= 1ULL << -diff;
+    }
+
+    if (s_sensor.fragments == 0) {
+        s_sensor.first_seq = first_seq;
+        s_sensor.started_us = now_us;
+    }
+    size_t offset = (size_t)index * RLINK_FRAGMENT_LEN;
+    memcpy(s_sensor.buf + offset, data + RLINK_DATA_HEADER_LEN, len - RLINK_DATA_HEADER_LEN);
+    s_sensor.fragments |= 1u << index;
+    if (index == count - 1) {
+        s_sensor.len = offset + len - RLINK_DATA_HEADER_LEN;
+    }
+    if (s_sensor.fragments == (1u << count) - 1) {
+        s_sensor_got[check_message(s_sensor.buf, s_sensor.len)]++;
+        s_sensor.fragments = 0;
+    }
+}
+
+static void sensor_service(int64_t now_us) {
+    if (s_sensor.ack_pending) {
+        uint8_t ack[RLINK_ACK_LEN] = { RLINK_MAGIC, RLINK_TYPE_ACK };
+        put_u16(ack + 2, s_sensor.rx_top);
+        for (int i = 0; i < 8; i++) {
+            ack[4 + i] = s_sensor.rx_received >> (8 * i);
+        }
+        transmit(true, ack, sizeof(ack));
+        s_sensor.ack_pending = false;
+    }
+    for (int i = 0; i < SENSOR_TX_FRAMES; i++) {
+        sensor_tx_t *tx = &s_sensor.tx[i];
+        if (!tx->used || now_us - tx->sent_us < RETRY_US << (tx->attempts - 1)) continue;
+        if (tx->attempts >= MAX_ATTEMPTS) {
+            tx->used = false;
+            s_sensor.given_up++;
+            continue;
+        }
+        tx->attempts++;
+        tx->sent_us = now_us;
+        transmit(true, tx->frame, tx->len);
+    }
+}
+
+static void master_receive(const uint8_t *data, size_t len) {
+    CHECK(rlink_is_frame(data, len));
+    rlink_msg_t msg;
+    esp_err_t err = rlink_receive(SENSOR, data, len, &msg);
+    if (err == ESP_OK) {
+        s_master_got[check_message(msg.data, msg.len)]++;
+    } else {
+        // Fragments that found no reassembly buffer are retransmitted
+        CHECK(err == ESP_ERR_NOT_FINISHED || err == ESP_ERR_NO_MEM);
+    }
+}
+
+// Runs both ends for us microseconds, each servicing its links every ack delay
+static void run(int64_t us) {
+    for (int64_t end_us = esp_timer_get_time() + us; esp_timer_get_time() < end_us;) {
+        host_clock_advance_us(STEP_US);
+        int64_t now_us = esp_timer_get_time();
+
+        for (int i = 0; i < s_in_flight_count;) {
+            if (s_in_flight[i].at_us > now_us) {
+                i++;
+                continue;
+            }
+            in_flight_t frame = s_in_flight[i];
+            s_in_flight[i] = s_in_flight[--s_in_flight_count];
+            if (frame.to_master) {
+                master_receive(frame.data, frame.len);
+            } else {
+                sensor_receive(frame.data, frame.len);
+            }
+        }
+
+        if (now_us % (CONFIG_MIST_RLINK_ACK_DELAY_MS * 1000) == 0) {
+            service(now_us);
+            sensor_service(now_us);
+        }
+    }
+}
+
+// The master forgets the link, as after a reboot of its own
+static void master_restart(void) {
+    memset(&s_links[peers_index(&s_peer)], 0, sizeof(link_t));
+    memset(s_tx, 0, sizeof(s_tx));
+}
+
+// Hands the master every frame the sensor sent, without the time passing
+static void deliver_to_master(void) {
+    for (int i = 0; i < s_in_flight_count; i++) {
+        if (s_in_flight[i].to_master) {
+            master_receive(s_in_flight[i].data, s_in_flight[i].len);
+        }
+    }
+    s_in_flight_count = 0;
+}
+
+static int awaiting_ack(void) {
+    int count = 0;
+    for (int i = 0; i < TX_FRAMES; i++) {
+        count += s_tx[i].used;
+    }
+    return count;
+}
+
+static void reset_counts(void) {
+    memset(s_master_got, 0, sizeof(s_master_got));
+    memset(s_sensor_got, 0, sizeof(s_sensor_got));
+}
+
+static void test_plain_fallback(void) {
+    s_model = (link_model_t){ .max_delay_us = 1000 };
+    uint8_t data[ESP_NOW_MAX_DATA_LEN + 1];
+    make_message(data, 0, sizeof(data));
+
+    // The sensor never sent an rlink frame, so it gets plain ones
+    CHECK_EQ(rlink_send(SENSOR, data, ESP_NOW_MAX_DATA_LEN), ESP_OK);
+    CHECK_EQ(s_plain_frames, 1);
+    CHECK_EQ(rlink_send(SENSOR, data, sizeof(data)), ESP_ERR_INVALID_SIZE);
+    s_in_flight_count = 0;
+}
+
+// The sensor sends a message every 500 ms and the master answers every other
+// one. Sequence numbers of the sensor wrap around on the way.
+static void exchange(const char *name, link_model_t model, int *master_missing, int *sensor_missing) {
+    s_model = model;
+    reset_counts();
+    master_restart();
+    sensor_restart(65400);
+    rlink_stats_t before;
+    rlink_get_stats(&before);
+
+    uint8_t data[MAX_MESSAGE];
+    int answers = 0;
+    for (int id = 0; id < MESSAGES; id++) {
+        size_t len = 2 + test_rand(&s_rand) % 1500;
+        make_message(data, id, len);
+        sensor_send(data, len);
+        run(500000);
+
+        if (id % 2 == 0) {
+            len = 2 + test_rand(&s_rand) % 1500;
+            make_message(data, id, len);
+            esp_err_t err;
+            // Waits for frames awaiting an ack to make room
+            while ((err = rlink_send(SENSOR, data, len)) == ESP_ERR_NO_MEM) {
+                run(CONFIG_MIST_RLINK_ACK_DELAY_MS * 1000);
+            }
+            CHECK_EQ(err, ESP_OK);
+            answers++;
+        }
+    }
+    // Every retransmission runs out
+    run(RETRY_US << MAX_ATTEMPTS);
+
+    *master_missing = *sensor_missing = 0;
+    for (int id = 0; id < MESSAGES; id++) {
+        CHECK(s_master_got[id] <= 1);
+        CHECK(s_sensor_got[id] <= 1);
+        *master_missing += s_master_got[id] == 0;
+        *sensor_missing += id % 2 == 0 && s_sensor_got[id] == 0;
+    }
+
+    rlink_stats_t stats;
+    rlink_get_stats(&stats);
+    printf("%-30s to master: %3d of %d lost | to sensor: %3d of %d lost | duplicates %4" PRIu32
+           ", retransmits %4" PRIu32 ", reassembled %3" PRIu32 ", dropped %3" PRIu32 "\n",
+           name, *master_missing, MESSAGES, *sensor_missing, answers,
+           stats.duplicates - before.duplicates, stats.retransmits - before.retransmits,
+           stats.reassembled - before.reassembled, stats.dropped - before.dropped);
+    // A message only goes missing when a fragment was given up on
+    if (*master_missing > 0) {
+        CHECK(s_sensor.given_up > 0 || stats.dropped > before.dropped);
+    }
+    if (*sensor_missing > 0) {
+        CHECK(stats.dropped > before.dropped);
+    }
+}
+
+static void test_exchange(void) {
+    int master_missing, sensor_missing;
+
+    exchange("reordering", (link_model_t){ .max_delay_us = 30000 }, &master_missing, &sensor_missing);
+    CHECK_EQ(master_missing, 0);
+    CHECK_EQ(sensor_missing, 0);
+
+    exchange("10% loss, 10% duplicates", (link_model_t){ .loss = 0.1, .duplicate = 0.1, .max_delay_us = 30000 },
+             &master_missing, &sensor_missing);
+    CHECK(master_missing <= MESSAGES / 100);
+    CHECK(sensor_missing <= MESSAGES / 100);
+
+    exchange("30% loss, 20% duplicates", (link_model_t){ .loss = 0.3, .duplicate = 0.2, .max_delay_us = 30000 },
+             &master_missing, &sensor_missing);
+    CHECK(master_missing <= MESSAGES / 20);
+    CHECK(sensor_missing <= MESSAGES / 20);
+}
+
+// A sensor that reboots starts from another sequence number and flags its
+// frames until acknowledged, so the master starts a new window for it
+static void test_sensor_restart(void) {
+    s_model = (link_model_t){ .max_delay_us = 30000 };
+    uint8_t data[600];
+    for (int restart = 0; restart < 2; restart++) {
+        reset_counts();
+        // Far from where it was, then behind the window the master keeps
+        sensor_restart(restart == 0 ? 30000 : 30000 - 2 * WINDOW);
+        for (int id = 0; id < 20; id++) {
+            make_message(data, id, sizeof(data));
+            sensor_send(data, sizeof(data));
+            run(50000);
+        }
+        run(RETRY_US << MAX_ATTEMPTS);
+        for (int id = 0; id < 20; id++) {
+            CHECK_EQ(s_master_got[id], 1);
+        }
+    }
+}
+
+// Frames waiting for the ack of a sensor that started over are given up on at
+// once and counted as dropped, those to a sensor carrying on are not
+static void test_restart_drops(void) {
+    s_model = (link_model_t){ .max_delay_us = 1000 };
+    uint8_t data[600];
+    make_message(data, 0, sizeof(data));
+
+    // The master's message is lost on the way
+    CHECK_EQ(rlink_send(SENSOR, data, sizeof(data)), ESP_OK);
+    s_in_flight_count = 0;
+    int waiting = awaiting_ack();
+    CHECK(waiting > 0);
+    rlink_stats_t before;
+    rlink_get_stats(&before);
+
+    s_sensor.synced = false;
+    sensor_send(data, sizeof(data));
+    deliver_to_master();
+    CHECK_EQ(awaiting_ack(), waiting);
+
+    sensor_restart(s_sensor.tx_next + 1000);
+    sensor_send(data, sizeof(data));
+    deliver_to_master();
+    CHECK_EQ(awaiting_ack(), 0);
+    rlink_stats_t after;
+    rlink_get_stats(&after);
+    CHECK_EQ(after.dropped - before.dropped, waiting);
+}
+
+int main(void) {
+    CHECK_EQ(rlink_init(), ESP_OK);
+    test_plain_fallback();
+    test_exchange();
+    test_sensor_restart();
+    test_restart_drops();
+    return 0;
+}
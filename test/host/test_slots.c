@@ -0,0 +1,261 @@
+#include <string.h>
+#include "test.h"
+
+// Slot assignments as sensors join, go quiet and push the period up and back
+// down again. The commands module is faked: announcements are delivered,
+// acknowledged or failed by the test, so it can check that a sensor counts as
+// knowing its slot only once it acknowledged the command carrying it.
+
+#include "slots.c"
+#include "pb_decode.h"
+
+const uint8_t COMM_BROADCAST_MAC_ADDR[ESP_NOW_ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+// Fake of the registry, sensor i is entry i
+static peer_t s_registry[CAPACITY];
+static bool s_paired[CAPACITY];
+
+bool peers_get(int index, peer_t *copy) {
+    if (!s_paired[index]) return false;
+    *copy = s_registry[index];
+    return true;
+}
+
+peer_t *peers_find(const uint8_t *mac_addr) {
+    for (int i = 0; i < CAPACITY; i++) {
+        if (s_paired[i] && memcmp(s_registry[i].mac_addr, mac_addr, ESP_NOW_ETH_ALEN) == 0) {
+            return &s_registry[i];
+        }
+    }
+    return NULL;
+}
+
+int peers_index(const peer_t *peer) { return peer - s_registry; }
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type) {
+    memcpy(mac, (uint8_t[]){ 0x24, 0x0a, 0xc4, 0, 0, 1 }, ESP_NOW_ETH_ALEN);
+    return ESP_OK;
+}
+
+// Fake of the commands module, holding the last command submitted
+static struct {
+    uint8_t sensor_mac_addr[ESP_NOW_ETH_ALEN];
+    int64_t id;
+    commands_extend_fn extend;
+    commands_done_fn done;
+} s_command;
+static int s_submits;
+static int s_accepted;
+static esp_err_t s_submit_result = ESP_OK;
+
+esp_err_t commands_submit_local(SensorCommand *cmd, commands_extend_fn extend, commands_done_fn done) {
+    s_submits++;
+    if (s_submit_result != ESP_OK) {
+        return s_submit_result;
+    }
+    cmd->id = -++s_accepted;
+    memcpy(s_command.sensor_mac_addr, cmd->sensor_mac_addr, ESP_NOW_ETH_ALEN);
+    s_command.id = cmd->id;
+    s_command.extend = extend;
+    s_command.done = done;
+    return ESP_OK;
+}
+
+typedef struct {
+    uint32_t frame_us;
+    uint32_t offset_us;
+    uint32_t width_us;
+    uint32_t period;
+    uint32_t phase;
+} assignment_t;
+
+static void pair(int sensor) {
+    memcpy(s_registry[sensor].mac_addr, (uint8_t[]){ 0x02, 'S', 'L', 0, 0, (uint8_t)sensor }, ESP_NOW_ETH_ALEN);
+    s_registry[sensor].state = PEER_STATE_PAIRED;
+    s_paired[sensor] = true;
+    slots_hello(s_registry[sensor].mac_addr);
+}
+
+// The sensor sent data just now
+static void touch(int sensor) {
+    s_registry[sensor].state = PEER_STATE_ACTIVE;
+    s_registry[sensor].last_seen_us = esp_timer_get_time();
+}
+
+// One round of the slots task, returns whether it submitted a command
+static bool step(void) {
+    int submits = s_submits;
+    announce(esp_timer_get_time());
+    return s_submits > submits;
+}
+
+static bool addressed(int sensor) {
+    return COMM_IS_BROADCAST_ADDR(s_command.sensor_mac_addr) ||
+           memcmp(s_command.sensor_mac_addr, s_registry[sensor].mac_addr, ESP_NOW_ETH_ALEN) == 0;
+}
+
+static assignment_t encode(int sensor) {
+    uint8_t buf[64];
+    size_t len = encode_assignment(s_registry[sensor].mac_addr, buf, sizeof(buf));
+    CHECK(len > 0);
+
+    assignment_t assignment = { 0 };
+    pb_istream_t stream = pb_istream_from_buffer(buf, len);
+    while (stream.bytes_left > 0) {
+        pb_wire_type_t type;
+        uint32_t tag;
+        bool eof;
+        uint32_t value;
+        CHECK(pb_decode_tag(&stream, &type, &tag, &eof));
+        CHECK(pb_decode_varint32(&stream, &value));
+        switch (tag) {
+        case FIELD_FRAME_US: assignment.frame_us = value; break;
+        case FIELD_OFFSET_US: assignment.offset_us = value; break;
+        case FIELD_WIDTH_US: assignment.width_us = value; break;
+        case FIELD_PERIOD: assignment.period = value; break;
+        case FIELD_PHASE: assignment.phase = value; break;
+        default: CHECK(false);
+        }
+    }
+    return assignment;
+}
+
+// The commands task sending the last command to sensor, which acknowledges it or not
+static assignment_t deliver(int sensor, bool acked) {
+    CHECK(addressed(sensor));
+    assignment_t assignment = encode(sensor);
+    s_command.done(s_registry[sensor].mac_addr, s_command.id, acked);
+    return assignment;
+}
+
+// Checks that every live sensor among the first count has a slot of its own
+// within the period. Returns by how many sensors the two phases of period 2 differ.
+static uint32_t check_slots(int count, uint32_t period) {
+    static bool taken[SLOTS + 1][2];
+    memset(taken, 0, sizeof(taken));
+    uint32_t phases[2] = { 0 };
+
+    for (int i = 0; i < count; i++) {
+        if (!s_paired[i] || !s_peers[i].live) continue;
+        assignment_t assignment = encode(i);
+        CHECK_EQ(assignment.frame_us, FRAME_US);
+        CHECK_EQ(assignment.width_us, WIDTH_US);
+        CHECK_EQ(assignment.period, period);
+        CHECK(assignment.phase < period);
+        uint32_t slot = assignment.offset_us / WIDTH_US;
+        CHECK_EQ(slot * WIDTH_US, assignment.offset_us);
+        CHECK(slot >= 1 && slot <= SLOTS);
+        CHECK(!taken[slot][assignment.phase]);
+        taken[slot][assignment.phase] = true;
+        phases[assignment.phase]++;
+    }
+    // Sensors are spread evenly over the phases
+    return period == 2 ? (phases[0] > phases[1] ? phases[0] - phases[1] : phases[1] - phases[0]) : 0;
+}
+
+static void test_join(void) {
+    for (int i = 0; i < 3; i++) {
+        pair(i);
+    }
+    CHECK(step());
+    CHECK(COMM_IS_BROADCAST_ADDR(s_command.sensor_mac_addr));
+    // Nothing goes out again while the command is under way
+    CHECK(!step());
+
+    deliver(0, true);
+    deliver(1, true);
+    deliver(2, false);
+    check_slots(3, 1);
+
+    // Only the sensor that did not acknowledge is sent its slot again
+    CHECK(step());
+    CHECK(!COMM_IS_BROADCAST_ADDR(s_command.sensor_mac_addr) && addressed(2) && !addressed(1));
+    deliver(2, true);
+    CHECK(!step());
+
+    // A command that cannot be submitted is tried again next round
+    pair(3);
+    s_submit_result = ESP_ERR_NO_MEM;
+    CHECK(step());
+    s_submit_result = ESP_OK;
+    CHECK(step());
+    CHECK(addressed(3) && !addressed(0));
+
+    // A handshake after the command went out may mean the sensor rebooted
+    // since, its ack does not count
+    encode(3);
+    slots_hello(s_registry[3].mac_addr);
+    s_command.done(s_registry[3].mac_addr, s_command.id, true);
+    CHECK(step());
+    CHECK(addressed(3));
+    deliver(3, true);
+    CHECK(!step());
+}
+
+static void test_leave(void) {
+    uint32_t slot = encode(1).offset_us / WIDTH_US;
+
+    // Sensor 2 goes quiet, sensor 1 is removed
+    host_clock_advance_us(IDLE_US);
+    touch(0);
+    touch(3);
+    s_paired[1] = false;
+    CHECK(!step());
+    CHECK(!s_peers[1].live && !s_peers[2].live);
+    CHECK_EQ(encode(2).width_us, 0);
+    CHECK_EQ(encode(1).width_us, 0);
+    check_slots(4, 1);
+
+    // A new sensor takes the lowest free slot, the others keep theirs
+    pair(4);
+    CHECK(step());
+    CHECK(addressed(4) && !addressed(0));
+    CHECK_EQ(deliver(4, true).offset_us / WIDTH_US, slot);
+    CHECK(!step());
+    check_slots(5, 1);
+}
+
+static void test_period(void) {
+    // Every entry of the registry live, more sensors than slots
+    for (int i = 0; i < CAPACITY; i++) {
+        if (s_paired[i]) {
+            touch(i);
+        } else {
+            pair(i);
+        }
+    }
+    CHECK(step());
+    CHECK(COMM_IS_BROADCAST_ADDR(s_command.sensor_mac_addr));
+    CHECK_EQ(s_period, 2);
+    CHECK(check_slots(CAPACITY, 2) <= 1);
+    for (int i = 0; i < CAPACITY; i++) {
+        deliver(i, true);
+    }
+    CHECK(!step());
+
+    // Back within the slots, everyone moves to period 1 and is told
+    host_clock_advance_us(IDLE_US);
+    for (int i = 0; i < SLOTS; i++) {
+        touch(i);
+    }
+    CHECK(step());
+    CHECK_EQ(s_period, 1);
+    CHECK(COMM_IS_BROADCAST_ADDR(s_command.sensor_mac_addr));
+    check_slots(CAPACITY, 1);
+    for (int i = 0; i < SLOTS; i++) {
+        deliver(i, true);
+    }
+    CHECK(!step());
+}
+
+int main(void) {
+    // Nothing counts as heard from at time 0
+    host_clock_advance_us(1000000);
+    CHECK_EQ(slots_init(), ESP_OK);
+    printf("%d slots per frame\n", SLOTS);
+
+    test_join();
+    test_leave();
+    test_period();
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <math.h>
+#include "test.h"
+#include "time_est.h"
+
+// The estimator against simulated sensor clocks: a fixed offset and drift,
+// exchanges every few seconds over a link with jitter and occasional
+// asymmetric delays. Prints the offset and drift errors it converges to.
+
+typedef struct {
+    double offset_us;       // Sensor minus master at master time 0
+    double drift_ppm;
+    int interval_s;         // Between exchanges
+    uint32_t base_delay_us; // One way
+    uint32_t jitter_us;     // Uniform, added to each direction
+    double spike_rate;      // Share of exchanges with one direction delayed
+    uint32_t spike_us;
+} scenario_t;
+
+typedef struct {
+    int64_t max_offset_err_us;      // After the first minute
+    int32_t drift_err_ppb;          // At the end
+    uint32_t rejected;
+} result_t;
+
+static int64_t sensor_time(const scenario_t *sc, double master_us) {
+    return (int64_t)llround(master_us + sc->offset_us + master_us * sc->drift_ppm / 1e6);
+}
+
+static result_t run(const scenario_t *sc, int exchanges, uint32_t seed) {
+    time_est_t est;
+    time_est_reset(&est);
+
+    result_t result = { 0 };
+    int64_t master_us = 1000000;
+    for (int i = 0; i < exchanges; i++) {
+        double up = sc->base_delay_us + test_uniform(&seed) * sc->jitter_us;
+        double down = sc->base_delay_us + test_uniform(&seed) * sc->jitter_us;
+        if (test_uniform(&seed) < sc->spike_rate) {
+            if (test_rand(&seed) & 1) up += sc->spike_us; else down += sc->spike_us;
+        }
+
+        // Sensor sends at t1, the master receives at t2 and replies at t3
+        int64_t t2 = master_us;
+        int64_t t1 = sensor_time(sc, t2 - up);
+        int64_t t3 = t2 + 300;
+        int64_t t4 = sensor_time(sc, t3 + down);
+        time_est_add(&est, t1, t2, t3, t4);
+
+        // Error where the sensor would extrapolate to, halfway to the next exchange
+        int64_t at = t3 + sc->interval_s * 500000LL;
+        int64_t truth = sensor_time(sc, at) - at;
+        int64_t err = llabs(time_est_offset_at(&est, at) - truth);
+        if (master_us >= 60000000 && err > result.max_offset_err_us) {
+            result.max_offset_err_us = err;
+        }
+        master_us += sc->interval_s * 1000000LL;
+    }
+
+    result.drift_err_ppb = abs(time_est_drift_ppb(&est) - (int32_t)lround(sc->drift_ppm * 1000));
+    result.rejected = est.rejected;
+    return result;
+}
+
+static void test_exact(void) {
+    // Symmetric, jitter free exchanges give the offset and drift exactly
+    scenario_t sc = { .offset_us = 123456789, .drift_ppm = 40, .interval_s = 10, .base_delay_us = 1500 };
+    result_t r = run(&sc, 100, 1);
+    CHECK(r.max_offset_err_us <= 2);
+    CHECK(r.drift_err_ppb <= 5);
+    CHECK_EQ(r.rejected, 0);
+}
+
+static void test_reject(void) {
+    time_est_t est;
+    time_est_reset(&est);
+    CHECK(!time_est_has_offset(&est));
+    CHECK(time_est_add(&est, 0, 1000, 1100, 2100));
+    CHECK(time_est_has_offset(&est));
+    // Replies that arrive before the request was sent are impossible
+    CHECK(!time_est_add(&est, 10000, 11000, 11100, 9000));
+    // Far above the minimum delay
+    CHECK(!time_est_add(&est, 20000, 21000, 21100, 42100));
+    CHECK_EQ(est.rejected, 2);
+    CHECK_EQ(est.samples, 1);
+    CHECK(!time_est_has_drift(&est));
+    CHECK_EQ(time_est_drift_ppb(&est), 0);
+
+    CHECK(time_est_add(&est, 1000000, 1001000, 1001100, 1002100));
+    CHECK(time_est_has_drift(&est));
+}
+
+static void test_skew(void) {
+    static const scenario_t scenarios[] = {
+        { .offset_us = -5000000, .drift_ppm = 20, .interval_s = 10, .base_delay_us = 1500, .jitter_us = 500 },
+        { .offset_us = 2500000, .drift_ppm = -50, .interval_s = 10, .base_delay_us = 1500, .jitter_us = 500 },
+        { .offset_us = 1000, .drift_ppm = 100, .interval_s = 30, .base_delay_us = 2000, .jitter_us = 1000 },
+        { .offset_us = 0, .drift_ppm = 20, .interval_s = 10, .base_delay_us = 1500, .jitter_us = 500,
+          .spike_rate = 0.2, .spike_us = 20000 },
+        { .offset_us = 0, .drift_ppm = -80, .interval_s = 10, .base_delay_us = 1500, .jitter_us = 500,
+          .spike_rate = 0.4, .spike_us = 50000 },
+    };
+
+    printf("drift ppm  interval s  jitter us  spikes  max offset err us  drift err ppb  rejected\n");
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const scenario_t *sc = &scenarios[i];
+        result_t r = run(sc, 360, 42 + i);
+        printf("%9.0f  %10d  %9u  %5.0f%%  %17" PRId64 "  %13" PRId32 "  %8u\n", sc->drift_ppm, sc->interval_s,
+               sc->jitter_us, sc->spike_rate * 100, r.max_offset_err_us, r.drift_err_ppb, r.rejected);
+
+        // Within a millisecond of the truth, and the drift within 1 ppm
+        CHECK(r.max_offset_err_us < 1000);
+        CHECK(r.drift_err_ppb < 1000);
+        if (sc->spike_rate > 0) {
+            CHECK(r.rejected > 0);
+        }
+    }
+}
+
+int main(void) {
+    test_exact();
+    test_reject();
+    test_skew();
+    return 0;
+}
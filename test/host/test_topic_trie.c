@@ -0,0 +1,89 @@
+#include <string.h>
+#include "test.h"
+#include "topic_trie.h"
+
+// The filters main.c subscribes to, next to wildcard filters of the forms the
+// MQTT specification gives, matched against topics of the per-master scheme in
+// README.md.
+
+enum {
+    SHARED_COMMANDS,
+    COMMANDS,
+    ANY_MASTER_COMMANDS,
+    USER_ANY,
+    HISTORY_QUERY,
+    SPORT,
+    TWO_LEVELS,
+};
+
+static topic_trie_t s_trie;
+
+static int match(const char *topic) {
+    return topic_trie_match(&s_trie, topic, strlen(topic));
+}
+
+static void test_match(void) {
+    topic_trie_init(&s_trie);
+    CHECK_EQ(topic_trie_add(&s_trie, "/sensor_command", SHARED_COMMANDS), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "/u1/master/aa:bb:cc:dd:ee:ff/commands", COMMANDS), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "/u1/master/+/commands", ANY_MASTER_COMMANDS), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "/u1/#", USER_ANY), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "/u1/master/aa:bb:cc:dd:ee:ff/history/query", HISTORY_QUERY), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "sport/tennis/#", SPORT), ESP_OK);
+    CHECK_EQ(topic_trie_add(&s_trie, "+/+", TWO_LEVELS), ESP_OK);
+
+    CHECK_EQ(match("/sensor_command"), SHARED_COMMANDS);
+    CHECK_EQ(match("/sensor_commands"), TWO_LEVELS);
+
+    // Exact levels win over +, and + over #
+    CHECK_EQ(match("/u1/master/aa:bb:cc:dd:ee:ff/commands"), COMMANDS);
+    CHECK_EQ(match("/u1/master/11:22:33:44:55:66/commands"), ANY_MASTER_COMMANDS);
+    CHECK_EQ(match("/u1/master/aa:bb:cc:dd:ee:ff/history/query"), HISTORY_QUERY);
+    CHECK_EQ(match("/u1/master/aa:bb:cc:dd:ee:ff/sensors"), USER_ANY);
+    CHECK_EQ(match("/u1/master/aa:bb:cc:dd:ee:ff/commands/status"), USER_ANY);
+
+    // # also matches its parent level
+    CHECK_EQ(match("/u1"), USER_ANY);
+    CHECK_EQ(match("sport/tennis"), SPORT);
+    CHECK_EQ(match("sport/tennis/player1/ranking"), SPORT);
+    CHECK_EQ(match("sport"), TOPIC_TRIE_NO_MATCH);
+
+    // + matches exactly one level, empty ones included
+    CHECK_EQ(match("/u2"), TWO_LEVELS);
+    CHECK_EQ(match("a/b"), TWO_LEVELS);
+    CHECK_EQ(match("a/"), TWO_LEVELS);
+    CHECK_EQ(match("a/b/c"), TOPIC_TRIE_NO_MATCH);
+
+    // Wildcards at the first level do not match topics starting with $
+    CHECK_EQ(match("$SYS/broker"), TOPIC_TRIE_NO_MATCH);
+
+    // Topics from the client are not null terminated
+    const char *topic = "/sensor_command/ignored";
+    CHECK_EQ(topic_trie_match(&s_trie, topic, strlen("/sensor_command")), SHARED_COMMANDS);
+}
+
+static void test_capacity(void) {
+    static char filters[TOPIC_TRIE_MAX_NODES][16];
+    topic_trie_init(&s_trie);
+
+    // Every single level filter takes one node next to the root
+    int added = 0;
+    for (int i = 0; i < TOPIC_TRIE_MAX_NODES; i++) {
+        snprintf(filters[i], sizeof(filters[i]), "f%d", i);
+        if (topic_trie_add(&s_trie, filters[i], i % 128) != ESP_OK) {
+            break;
+        }
+        added++;
+    }
+    CHECK_EQ(added, TOPIC_TRIE_MAX_NODES - 1);
+    for (int i = 0; i < added; i++) {
+        CHECK_EQ(match(filters[i]), i);
+    }
+    CHECK_EQ(match(filters[added]), TOPIC_TRIE_NO_MATCH);
+}
+
+int main(void) {
+    test_match();
+    test_capacity();
+    return 0;
+}
@@ -0,0 +1,253 @@
+#include <math.h>
+#include <string.h>
+#include <esp_now.h>
+#include "test.h"
+#include "pb_encode.h"
+#include "tsblock.h"
+
+// Bytes per sample and encode cost of TimeSeriesBlock against the plain
+// SensorData readings of a SensorDataBatch, on SHT4x like air sensor traces:
+// two decimals, mostly unchanged between samples, a reading every 10 s with
+// the odd second of jitter. Every block is decoded again the way
+// scripts/decode_tsblock.py does and compared value by value.
+
+#define SENSORS 4
+#define REPEATS 1000
+
+static SensorData s_trace[SENSORS][TSBLOCK_MAX_READINGS];
+static uint8_t s_out[SENSORS * TSBLOCK_BLOCK_BUF_SIZE];
+static tsblock_buf_t s_buf;
+
+// Decoder, following scripts/decode_tsblock.py
+
+typedef struct {
+    const uint8_t *buf;
+    size_t pos;         // In bits
+} bit_reader_t;
+
+static uint32_t bits_get(bit_reader_t *r, int bits) {
+    uint32_t value = 0;
+    for (int i = 0; i < bits; i++, r->pos++) {
+        value = (value << 1) | ((r->buf[r->pos >> 3] >> (7 - (r->pos & 7))) & 1);
+    }
+    return value;
+}
+
+static uint64_t varint(const uint8_t *buf, size_t *pos) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = buf[(*pos)++];
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+
+static int64_t zigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void decode_timestamps(const uint8_t *buf, size_t count, int64_t *out) {
+    size_t pos = 0;
+    int64_t prev = 0;
+    int64_t delta = 0;
+    for (size_t i = 0; i < count; i++) {
+        int64_t value = zigzag(varint(buf, &pos));
+        if (i == 0) {
+            prev = value;
+        } else {
+            delta = i == 1 ? value : delta + value;
+            prev += delta;
+        }
+        out[i] = prev;
+    }
+}
+
+static void decode_floats(const uint8_t *buf, size_t count, float *out) {
+    bit_reader_t r = { .buf = buf };
+    uint32_t bits = bits_get(&r, 32);
+    int lead = 0;
+    int trail = 0;
+    memcpy(&out[0], &bits, sizeof(bits));
+    for (size_t i = 1; i < count; i++) {
+        if (bits_get(&r, 1)) {
+            if (bits_get(&r, 1)) {
+                lead = bits_get(&r, 5);
+                trail = 32 - lead - (bits_get(&r, 5) + 1);
+            }
+            bits ^= bits_get(&r, 32 - lead - trail) << trail;
+        }
+        memcpy(&out[i], &bits, sizeof(bits));
+    }
+}
+
+static void decode_packed(const uint8_t *buf, size_t count, int32_t *out) {
+    size_t pos = 0;
+    int32_t min = (int32_t)zigzag(varint(buf, &pos));
+    int width = buf[pos];
+    bit_reader_t r = { .buf = buf + pos + 1 };
+    for (size_t i = 0; i < count; i++) {
+        out[i] = min + (int32_t)bits_get(&r, width);
+    }
+}
+
+// Decodes the air sensor block at buf and compares it with readings
+static void check_block(const uint8_t *buf, size_t len, const uint8_t *mac_addr, const SensorData *readings, size_t count) {
+    static int64_t timestamps[TSBLOCK_MAX_READINGS];
+    static float values[2][TSBLOCK_MAX_READINGS];
+    static int32_t voc_index[TSBLOCK_MAX_READINGS];
+    int columns = 0;
+    bool has_timestamps = false;
+    bool has_voc_index = false;
+
+    size_t pos = 0;
+    while (pos < len) {
+        uint64_t key = varint(buf, &pos);
+        uint32_t field = key >> 3;
+        if ((key & 7) == 0) {
+            uint64_t value = varint(buf, &pos);
+            if (field == 2) CHECK_EQ(value, SensorType_AIR_SENSOR);
+            if (field == 3) CHECK_EQ(value, count);
+            continue;
+        }
+        CHECK_EQ(key & 7, PB_WT_STRING);
+        size_t field_len = varint(buf, &pos);
+        const uint8_t *value = buf + pos;
+        pos += field_len;
+        switch (field) {
+            case 1:
+                CHECK(field_len == ESP_NOW_ETH_ALEN && memcmp(value, mac_addr, ESP_NOW_ETH_ALEN) == 0);
+                break;
+            case 4:
+                decode_timestamps(value, count, timestamps);
+                has_timestamps = true;
+                break;
+            case 5:
+                CHECK(columns < 2);
+                decode_floats(value, count, values[columns++]);
+                break;
+            case 6:
+                decode_packed(value, count, voc_index);
+                has_voc_index = true;
+                break;
+        }
+    }
+    CHECK_EQ(pos, len);
+    CHECK(has_timestamps && has_voc_index);
+    CHECK_EQ(columns, 2);
+
+    for (size_t i = 0; i < count; i++) {
+        const AirSensor *air = &readings[i].body.air_sensor;
+        CHECK_EQ(timestamps[i], air->timestamp);
+        CHECK(memcmp(&values[0][i], &air->humidity, sizeof(float)) == 0);
+        CHECK(memcmp(&values[1][i], &air->temperature, sizeof(float)) == 0);
+        CHECK_EQ(voc_index[i], air->voc_index);
+    }
+}
+
+static void make_trace(void) {
+    uint32_t seed = 1;
+    for (int k = 0; k < SENSORS; k++) {
+        float temperature = 21.5f + k;
+        float humidity = 45.0f;
+        int32_t voc_index = 100;
+        int64_t timestamp = 1760000000 + k;
+        for (int i = 0; i < TSBLOCK_MAX_READINGS; i++) {
+            if (test_rand(&seed) % 4 == 0) temperature += (int)(test_rand(&seed) % 3 - 1) * 0.01f;
+            if (test_rand(&seed) % 3 == 0) humidity += (int)(test_rand(&seed) % 5 - 2) * 0.01f;
+            voc_index += (int)(test_rand(&seed) % 3) - 1;
+            timestamp += 10 + (test_rand(&seed) % 10 == 0);
+
+            SensorData *data = &s_trace[k][i];
+            data->sensor_type = SensorType_AIR_SENSOR;
+            data->which_body = SensorData_air_sensor_tag;
+            data->body.air_sensor.timestamp = timestamp;
+            data->body.air_sensor.temperature = roundf(temperature * 100) / 100;
+            data->body.air_sensor.humidity = roundf(humidity * 100) / 100;
+            data->body.air_sensor.voc_index = voc_index;
+        }
+    }
+}
+
+static void mac_of(int sensor, uint8_t *mac_addr) {
+    memcpy(mac_addr, (uint8_t[]){ 0x24, 0x6f, 0x28, 0x10, 0x20, (uint8_t)sensor }, ESP_NOW_ETH_ALEN);
+}
+
+// The readings as SensorDataBatch.readings, the way batch.c encodes them without blocks
+static size_t plain_bytes(size_t count) {
+    pb_ostream_t sizing = PB_OSTREAM_SIZING;
+    for (int k = 0; k < SENSORS; k++) {
+        for (size_t i = 0; i < count; i++) {
+            CHECK(pb_encode_tag(&sizing, PB_WT_STRING, 1));
+            CHECK(pb_encode_submessage(&sizing, SensorData_fields, &s_trace[k][i]));
+        }
+    }
+    return sizing.bytes_written;
+}
+
+static size_t encode_blocks(size_t count) {
+    const SensorData *series[TSBLOCK_MAX_READINGS];
+    pb_ostream_t stream = pb_ostream_from_buffer(s_out, sizeof(s_out));
+    for (int k = 0; k < SENSORS; k++) {
+        uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+        mac_of(k, mac_addr);
+        for (size_t i = 0; i < count; i++) {
+            series[i] = &s_trace[k][i];
+        }
+        CHECK(tsblock_encode(&s_buf, &stream, 2, mac_addr, series, count));
+    }
+    return stream.bytes_written;
+}
+
+static void check_blocks(size_t len, size_t count) {
+    size_t pos = 0;
+    for (int k = 0; k < SENSORS; k++) {
+        CHECK_EQ(varint(s_out, &pos), (2 << 3) | PB_WT_STRING);
+        size_t block_len = varint(s_out, &pos);
+        uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+        mac_of(k, mac_addr);
+        check_block(s_out + pos, block_len, mac_addr, s_trace[k], count);
+        pos += block_len;
+    }
+    CHECK_EQ(pos, len);
+}
+
+int main(void) {
+    make_trace();
+
+    static const size_t COUNTS[] = { 8, 32, 256 };
+    printf("readings per sensor  plain B/sample  block B/sample  ratio  encode ns/sample");
+    printf(TEST_HAVE_CYCLES ? "  cycles/sample\n" : "\n");
+    for (size_t c = 0; c < sizeof(COUNTS) / sizeof(COUNTS[0]); c++) {
+        size_t count = COUNTS[c];
+        size_t samples = count * SENSORS;
+        size_t plain = plain_bytes(count);
+        size_t len = encode_blocks(count);
+        check_blocks(len, count);
+
+        int64_t start_ns = test_now_ns();
+        uint64_t start_cycles = test_cycles();
+        for (int r = 0; r < REPEATS; r++) {
+            encode_blocks(count);
+        }
+        double ns = (double)(test_now_ns() - start_ns) / REPEATS / samples;
+        double cycles = (double)(test_cycles() - start_cycles) / REPEATS / samples;
+
+        printf("%19zu  %14.1f  %14.1f  %4.1fx  %16.1f", count, (double)plain / samples, (double)len / samples,
+               (double)plain / len, ns);
+        if (TEST_HAVE_CYCLES) printf("  %13.0f", cycles);
+        printf("\n");
+
+        CHECK(len < plain);
+        if (count >= 32) {
+            CHECK(len * 5 <= plain);
+        }
+    }
+
+    // More readings than a block holds
+    const SensorData *series[TSBLOCK_MAX_READINGS + 1] = { 0 };
+    pb_ostream_t stream = pb_ostream_from_buffer(s_out, sizeof(s_out));
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN] = { 0 };
+    CHECK(!tsblock_encode(&s_buf, &stream, 2, mac_addr, series, TSBLOCK_MAX_READINGS + 1));
+    CHECK(!tsblock_encode(&s_buf, &stream, 2, mac_addr, series, 0));
+    return 0;
+}